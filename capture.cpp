@@ -0,0 +1,409 @@
+#include "capture.h"
+#include "debug.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+
+using Clock = std::chrono::steady_clock;
+
+static double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+bool FrameCapture::supports(VkFormat format) {
+    switch (format) {
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void FrameCapture::init(
+    DeviceAllocator &allocator, VkDevice device, VkFormat format,
+    const std::string &directory, CaptureFormat fileFormat,
+    uint32_t bufferCount, uint32_t threadCount, bool dropWhenBehind
+) {
+    Logger log("FrameCapture::init");
+    if (!supports(format)) die(log << "can't capture format " << format << ", only 8 bit BGRA/RGBA");
+    // Only the last directory in the path gets made. Files sitting in it already get overwritten.
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        die(log << "couldn't make " << directory << ": " << strerror(errno));
+    }
+
+    this->allocator = &allocator;
+    this->device = device;
+    this->format = format;
+    this->directory = directory;
+    this->fileFormat = fileFormat;
+    this->dropWhenBehind = dropWhenBehind;
+    // Buffers get made (and remade, if the swapchain grows) the first time they're needed.
+    buffers.resize(std::max(bufferCount, 1u));
+    nextFrame = 0;
+
+    stopping = false;
+    threadCount = std::max(threadCount, 1u);
+    for (uint32_t i = 0; i < threadCount; ++i) threads.emplace_back(&FrameCapture::encoderLoop, this);
+    log << buffers.size() << " readback buffers, " << threadCount << " encoder threads, "
+        << (fileFormat == CAPTURE_PNG ? "png" : "raw") << " files in " << directory << '\n';
+}
+
+void FrameCapture::destroy() {
+    if (buffers.empty()) return;
+    // The device is idle, so every copy is done.
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t i = 0; i < buffers.size(); ++i) {
+            auto &readback = buffers[i];
+            if (readback.state != COPYING) continue;
+            allocator->invalidate(readback.memory);
+            readback.state = ENCODING;
+            queue.push_back(i);
+        }
+        stopping = true;
+    }
+    wake.notify_all();
+    // The encoders only stop once the queue is empty.
+    for (auto &thread : threads) thread.join();
+    threads.clear();
+
+    for (auto &readback : buffers) {
+        if (readback.buffer == VK_NULL_HANDLE) continue;
+        vkDestroyBuffer(device, readback.buffer, nullptr);
+        allocator->free(readback.memory);
+    }
+    buffers.clear();
+}
+
+uint32_t FrameCapture::freeBuffer() {
+    for (uint32_t i = 0; i < buffers.size(); ++i) {
+        if (buffers[i].state == FREE) return i;
+    }
+    return UINT32_MAX;
+}
+
+bool FrameCapture::record(VkCommandBuffer commandBuffer, VkImage image, VkExtent2D extent, VkFence fence, const std::string &name) {
+    ProfileZone zone("FrameCapture::record");
+    uint64_t frame = nextFrame++;
+
+    uint32_t index;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        index = freeBuffer();
+        if (index == UINT32_MAX && dropWhenBehind && name.empty()) {
+            dropped += 1;
+            return false;
+        }
+        if (index == UINT32_MAX) {
+            // Backpressure: the frame loop goes no faster than the encoders. Mostly that's waiting
+            // for one of them to put a buffer back, but if they're all still being copied into
+            // (too few buffers for the frames in flight), wait for the oldest copy instead, since
+            // nobody's going to poll() it while we're in here.
+            ProfileZone wait("wait for readback buffer");
+            auto start = Clock::now();
+            while ((index = freeBuffer()) == UINT32_MAX) {
+                if (collect()) wake.notify_all();
+                const Readback *oldest = nullptr;
+                bool encoding = false;
+                for (auto &other : buffers) {
+                    encoding |= other.state == ENCODING;
+                    if (other.state == COPYING && (!oldest || other.frame < oldest->frame)) oldest = &other;
+                }
+                if (encoding || !oldest) {
+                    returned.wait(lock);
+                    continue;
+                }
+                VkFence oldestFence = oldest->fence;
+                lock.unlock();
+                vkWaitForFences(device, 1, &oldestFence, VK_TRUE, UINT64_MAX);
+                lock.lock();
+            }
+            waitMs.add(millisecondsSince(start));
+        }
+        buffers[index].state = COPYING;
+    }
+
+    // Nobody else touches a buffer that's COPYING until poll() sees its fence signal.
+    auto &readback = buffers[index];
+    VkDeviceSize size = VkDeviceSize(extent.width) * extent.height * 4;
+    if (readback.size < size) {
+        if (readback.buffer != VK_NULL_HANDLE) {
+            vkDestroyBuffer(device, readback.buffer, nullptr);
+            allocator->free(readback.memory);
+        }
+        // Cached, or every byte the encoders read is an uncached trip over the bus.
+        readback.memory = allocator->createBuffer(
+            size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, readback.buffer,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT
+        );
+        readback.size = size;
+    }
+    readback.fence = fence;
+    readback.frame = frame;
+    readback.extent = extent;
+    readback.name = name;
+
+    // Tightly packed rows (bufferRowLength 0), which is what the encoders expect.
+    VkBufferImageCopy region{};
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent = {extent.width, extent.height, 1};
+    vkCmdCopyImageToBuffer(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readback.buffer, 1, &region);
+
+    // A fence signaling doesn't make anything visible to the host on its own.
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(
+        commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+        1, &barrier, 0, nullptr, 0, nullptr
+    );
+    return true;
+}
+
+void FrameCapture::poll() {
+    if (buffers.empty()) return;
+    bool handedOff;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        handedOff = collect();
+    }
+    if (handedOff) wake.notify_all();
+}
+
+bool FrameCapture::collect() {
+    bool handedOff = false;
+    for (uint32_t i = 0; i < buffers.size(); ++i) {
+        auto &readback = buffers[i];
+        if (readback.state != COPYING) continue;
+        if (vkGetFenceStatus(device, readback.fence) != VK_SUCCESS) continue;
+
+        allocator->invalidate(readback.memory);
+        readback.state = ENCODING;
+        latencyFrames.add(double(nextFrame - readback.frame));
+        queue.push_back(i);
+        handedOff = true;
+    }
+    return handedOff;
+}
+
+void FrameCapture::encoderLoop() {
+    setProfileThreadName("capture encoder");
+    // Reused from frame to frame, so encoding doesn't allocate once they've grown.
+    std::vector<uint8_t> rgb, file;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wake.wait(lock, [this] { return stopping || !queue.empty(); });
+        // Stopping still writes out everything that was read back.
+        if (queue.empty()) return;
+
+        uint32_t index = queue.front();
+        queue.pop_front();
+        lock.unlock();
+
+        auto start = Clock::now();
+        bool written;
+        {
+            ProfileZone zone("encode frame");
+            written = encode(buffers[index], rgb, file);
+        }
+        double ms = millisecondsSince(start);
+
+        lock.lock();
+        buffers[index].state = FREE;
+        encodeMs.add(ms);
+        if (written) {
+            captured += 1;
+            bytesWritten += file.size();
+        }
+        else {
+            failed += 1;
+        }
+        if (!buffers[index].name.empty()) finished.push_back({buffers[index].name, written});
+        returned.notify_all();
+    }
+}
+
+static const uint32_t *crcTable() {
+    static const auto table = [] {
+        std::vector<uint32_t> entries(256);
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            entries[n] = c;
+        }
+        return entries;
+    }();
+    return table.data();
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size) {
+    auto table = crcTable();
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) c = table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static uint32_t adler32(const uint8_t *data, size_t size) {
+    uint32_t a = 1, b = 0;
+    while (size > 0) {
+        // The most bytes that can go by before b has to be reduced, or it overflows.
+        size_t chunk = std::min<size_t>(size, 5552);
+        for (size_t i = 0; i < chunk; ++i) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += chunk;
+        size -= chunk;
+    }
+    return (b << 16) | a;
+}
+
+static void appendBigEndian(std::vector<uint8_t> &out, uint32_t value) {
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+// Length, type, data, CRC of the type and data.
+static void appendChunk(std::vector<uint8_t> &out, const char *type, const uint8_t *data, size_t size) {
+    appendBigEndian(out, size);
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    appendBigEndian(out, crc32(&out[start], out.size() - start));
+}
+
+// `scanlines` is already in PNG's layout: each row is a filter type byte (0, none) and then RGB.
+// It all goes in stored deflate blocks, so this is a memcpy and two checksums. Compressing would
+// make the files a lot smaller and the encoders a lot slower, and it's easy to do afterwards.
+static void encodePng(const std::vector<uint8_t> &scanlines, VkExtent2D extent, std::vector<uint8_t> &out) {
+    static const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    out.assign(signature, signature + sizeof(signature));
+
+    std::vector<uint8_t> header;
+    appendBigEndian(header, extent.width);
+    appendBigEndian(header, extent.height);
+    // 8 bits per channel, color type 2 (RGB), deflate, adaptive filtering, no interlacing.
+    header.insert(header.end(), {8, 2, 0, 0, 0});
+    appendChunk(out, "IHDR", header.data(), header.size());
+
+    // IDAT goes straight into `out`, with its length and CRC filled in after.
+    size_t lengthAt = out.size();
+    appendBigEndian(out, 0);
+    out.insert(out.end(), {'I', 'D', 'A', 'T'});
+    // zlib header: deflate with a 32K window, no preset dictionary, and the check bits.
+    out.insert(out.end(), {0x78, 0x01});
+    const size_t MAX_STORED = 65535;
+    size_t offset = 0;
+    do {
+        size_t size = std::min(scanlines.size() - offset, MAX_STORED);
+        bool last = offset + size == scanlines.size();
+        out.push_back(last ? 1 : 0);
+        out.insert(out.end(), {uint8_t(size), uint8_t(size >> 8), uint8_t(~size), uint8_t(~size >> 8)});
+        out.insert(out.end(), scanlines.begin() + offset, scanlines.begin() + offset + size);
+        offset += size;
+    } while (offset < scanlines.size());
+    appendBigEndian(out, adler32(scanlines.data(), scanlines.size()));
+
+    uint32_t length = out.size() - lengthAt - 8;
+    for (int i = 0; i < 4; ++i) out[lengthAt + i] = length >> (24 - 8 * i);
+    appendBigEndian(out, crc32(&out[lengthAt + 4], out.size() - lengthAt - 4));
+
+    appendChunk(out, "IEND", nullptr, 0);
+}
+
+bool FrameCapture::encode(const Readback &readback, std::vector<uint8_t> &rgb, std::vector<uint8_t> &file) {
+    uint32_t width = readback.extent.width, height = readback.extent.height;
+    bool bgra = format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB;
+    // PNG wants a filter byte in front of every row. (The bytes are sRGB already with an _SRGB
+    // swapchain, which is what both file formats expect.)
+    uint32_t rowPrefix = fileFormat == CAPTURE_PNG ? 1 : 0;
+
+    rgb.resize(size_t(height) * (rowPrefix + width * 3));
+    auto pixels = static_cast<const uint8_t *>(readback.memory.mapped);
+    uint8_t *out = rgb.data();
+    for (uint32_t y = 0; y < height; ++y) {
+        if (rowPrefix) *out++ = 0;
+        const uint8_t *in = pixels + size_t(y) * width * 4;
+        for (uint32_t x = 0; x < width; ++x, in += 4, out += 3) {
+            out[0] = in[bgra ? 2 : 0];
+            out[1] = in[1];
+            out[2] = in[bgra ? 0 : 2];
+        }
+    }
+
+    if (fileFormat == CAPTURE_PNG) {
+        encodePng(rgb, readback.extent, file);
+    }
+    else {
+        char header[64];
+        int length = snprintf(header, sizeof(header), "P6\n%u %u\n255\n", width, height);
+        file.assign(header, header + length);
+        file.insert(file.end(), rgb.begin(), rgb.end());
+    }
+
+    std::string path = directory + '/';
+    if (readback.name.empty()) {
+        char name[32];
+        snprintf(name, sizeof(name), "frame%06llu", (unsigned long long)readback.frame);
+        path += name;
+    }
+    else {
+        path += readback.name;
+    }
+    path += fileFormat == CAPTURE_PNG ? ".png" : ".ppm";
+    // Written next to where it goes and renamed into place, so anyone watching the directory
+    // never sees half an image.
+    std::string tempPath = path + ".tmp";
+    FILE *handle = fopen(tempPath.c_str(), "wb");
+    bool written = handle && fwrite(file.data(), 1, file.size(), handle) == file.size();
+    if (handle && fclose(handle) != 0) written = false;
+    if (written && std::rename(tempPath.c_str(), path.c_str()) != 0) written = false;
+    if (!written) {
+        std::cout << "couldn't write " << path << '\n';
+        std::remove(tempPath.c_str());
+    }
+    return written;
+}
+
+std::vector<FrameCapture::Finished> FrameCapture::takeFinished() {
+    std::vector<Finished> taken;
+    std::lock_guard<std::mutex> lock(mutex);
+    taken.swap(finished);
+    return taken;
+}
+
+void FrameCapture::report(const char *label) {
+    if (buffers.empty()) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    Report log(label);
+    log << captured << " frames written to " << directory << " (" << (bytesWritten >> 20) << " MiB), "
+        << dropped << " dropped, " << failed << " failed\n";
+    if (!encodeMs.empty()) {
+        log << "encoding: avg " << encodeMs.avg() << " ms, p99 " << encodeMs.percentile(99) << " ms on "
+            << threads.size() << " threads, so about " << threads.size() * 1000.0 / encodeMs.avg() << " frames/sec\n";
+    }
+    if (!latencyFrames.empty()) {
+        log << "read back " << latencyFrames.avg() << " frames after recording on average (max "
+            << latencyFrames.max() << "), " << buffers.size() << " buffers\n";
+    }
+    if (!waitMs.empty()) {
+        log << "waited on the encoders " << waitMs.size() << " times: avg " << waitMs.avg() << " ms, max "
+            << waitMs.max() << " ms\n";
+    }
+}
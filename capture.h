@@ -0,0 +1,119 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "memory.h"
+#include "stats.h"
+
+enum CaptureFormat {
+    CAPTURE_PNG, // RGB, in stored (uncompressed) deflate blocks, so there's no zlib to link or wait on
+    CAPTURE_RAW, // binary PPM (what netpbm calls "raw"): a tiny header, then RGB
+};
+
+// Writes rendered frames out as image files without the frame loop waiting on the GPU or the disk.
+//
+// record() copies the frame into one of a pool of persistently mapped readback buffers, in a
+// command buffer that goes in with the frame. poll() finds the copies whose fence has signaled
+// (a frame or a few later, never waiting) and hands them to encoder threads, which convert to RGB,
+// write the file and put the buffer back in the pool.
+//
+// If the encoders fall behind, the pool runs dry. Then record() either waits for a buffer to come
+// back, which slows the frame loop down to what the disk can take and never loses a frame, or
+// skips the frame and counts it as dropped, which keeps the frame rate.
+class FrameCapture {
+public:
+    // Only 4 bytes per pixel BGRA/RGBA formats. Anything else dies.
+    void init(
+        DeviceAllocator &allocator, VkDevice device, VkFormat format,
+        const std::string &directory, CaptureFormat fileFormat,
+        uint32_t bufferCount, uint32_t threadCount, bool dropWhenBehind
+    );
+    // Only once the device is idle. Waits for every frame that's already been read back to be written.
+    void destroy();
+    bool enabled() const { return !buffers.empty(); }
+
+    // Records copying `image` (in TRANSFER_SRC_OPTIMAL, with the frame's writes already made
+    // available to transfer reads) into a free buffer. `fence` is what the command buffer gets
+    // submitted with, and has to be unsignaled from the moment it's submitted until the copy is
+    // done. Returns false if the frame got dropped.
+    //
+    // A frame with a `name` gets written as that (plus .png or .ppm) instead of frameNNNNNN, is
+    // never dropped, and shows up in takeFinished() once it's on disk.
+    bool record(VkCommandBuffer commandBuffer, VkImage image, VkExtent2D extent, VkFence fence, const std::string &name = {});
+    // Hands every copy whose fence has signaled over to the encoders. Never waits. Don't call it
+    // between record() and submitting the command buffer, when the fence can still be signaled
+    // from the last time it was used.
+    void poll();
+
+    struct Finished {
+        std::string name;
+        bool written; // false if writing the file failed
+    };
+    // The named frames the encoders are done with since last time.
+    std::vector<Finished> takeFinished();
+
+    static bool supports(VkFormat format);
+
+    void report(const char *label);
+
+private:
+    enum State { FREE, COPYING, ENCODING };
+
+    struct Readback {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        Allocation memory;
+        VkDeviceSize size = 0;
+
+        State state = FREE;
+        VkFence fence = VK_NULL_HANDLE;
+        uint64_t frame = 0;
+        VkExtent2D extent{};
+        std::string name;
+    };
+
+    DeviceAllocator *allocator = nullptr;
+    VkDevice device = VK_NULL_HANDLE;
+    VkFormat format = VK_FORMAT_UNDEFINED;
+    std::string directory;
+    CaptureFormat fileFormat = CAPTURE_PNG;
+    bool dropWhenBehind = false;
+
+    std::vector<Readback> buffers;
+    // Which frame record() is on, dropped ones included, so file names match frame numbers.
+    uint64_t nextFrame = 0;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    // An encoder put a buffer back.
+    std::condition_variable returned;
+    bool stopping = false;
+    std::deque<uint32_t> queue;
+    std::vector<std::thread> threads;
+
+    // The rest is under `mutex` too, since the encoders add to it.
+    uint64_t captured = 0;
+    uint64_t dropped = 0;
+    uint64_t failed = 0;
+    uint64_t bytesWritten = 0;
+    std::vector<Finished> finished;
+    RollingStats encodeMs;
+    RollingStats waitMs;
+    // How many record()s from a copy being recorded to it reaching an encoder.
+    RollingStats latencyFrames;
+
+    void encoderLoop();
+    bool encode(const Readback &readback, std::vector<uint8_t> &rgb, std::vector<uint8_t> &file);
+    // With `mutex` held. UINT32_MAX if every buffer is busy.
+    uint32_t freeBuffer();
+    // With `mutex` held. Queues every finished copy up for the encoders, and says if there were any.
+    bool collect();
+};
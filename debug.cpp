@@ -1,6 +1,16 @@
 #include "debug.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 const char *physicalDeviceTypeToString(int t) {
     // https://www.khronos.org/registry/vulkan/specs/1.1-extensions/html/vkspec.html#VkPhysicalDeviceType
@@ -14,14 +24,393 @@ const char *physicalDeviceTypeToString(int t) {
     die(std::cout << "Huh? Unknown device type " << t);
 }
 
-size_t Logger::tabs = 0;
+const char *presentModeToString(int mode) {
+    // https://www.khronos.org/registry/vulkan/specs/1.1-extensions/html/vkspec.html#VkPresentModeKHR
+    switch (mode) {
+    case 0: return "IMMEDIATE";
+    case 1: return "MAILBOX";
+    case 2: return "FIFO";
+    case 3: return "FIFO_RELAXED";
+    }
+    return "some extension's present mode";
+}
+
+#ifdef DEBUG
+
+thread_local uint16_t logDepth = 0;
+
+namespace {
+
+enum RecordKind : uint8_t {
+    RECORD_LINE, // a LogLine's packed values
+    RECORD_RAW,  // plain text that went through std::cout
+    RECORD_WRAP, // nothing here, skip to the start of the ring
+};
+
+struct RecordHeader {
+    uint32_t size; // header included, rounded up to 16
+    RecordKind kind;
+    bool truncated;
+    uint16_t depth;
+    uint64_t sequence;
+};
+// Records are 16 byte aligned, so there's always room for a header before the end of the ring.
+static_assert(sizeof(RecordHeader) == 16, "has to match the record alignment");
+
+// Single producer (the thread it belongs to), single consumer (whoever holds consumerMutex).
+// head and tail only ever go up; `% capacity` turns them into offsets.
+struct LogRing {
+    static const size_t capacity = 64 << 10;
+    std::unique_ptr<char[]> data{new char[capacity]};
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+};
+
+std::mutex registryMutex;
+std::vector<std::unique_ptr<LogRing>> rings;
+// Which thread logged first, when the log thread has to pick between rings.
+std::atomic<uint64_t> nextSequence{0};
+// How many times someone had to wait for room in their ring.
+std::atomic<uint64_t> fullRings{0};
+
+std::mutex consumerMutex;
+bool atLineStart = true;
+// Returns whether there was anything to write.
+bool drain();
+
+LogRing &threadRing() {
+    thread_local LogRing *ring = nullptr;
+    if (!ring) {
+        // Once per thread. Rings stick around after their thread exits, so nothing gets lost.
+        std::lock_guard<std::mutex> lock(registryMutex);
+        rings.push_back(std::make_unique<LogRing>());
+        ring = rings.back().get();
+    }
+    return *ring;
+}
+
+// The lock-free part. Only blocks if the log thread has fallen a whole ring behind.
+void push(RecordKind kind, uint16_t depth, bool truncated, const char *payload, size_t length);
+
+class LogThread {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    // How many empty checks in a row before going to sleep until poked (about 100 ms).
+    static const uint32_t IDLE_CHECKS = 50;
+
+public:
+    std::atomic<bool> running{false};
+    // Set while the log thread is blocked waiting for poke(), so a push() knows it has to.
+    std::atomic<bool> sleeping{false};
+
+    void start() {
+        running = true;
+        thread = std::thread([this] {
+            std::unique_lock<std::mutex> lock(mutex);
+            uint32_t idleChecks = 0;
+            while (!stopping) {
+                lock.unlock();
+                bool wrote = drain();
+                lock.lock();
+                idleChecks = wrote ? 0 : idleChecks + 1;
+                if (idleChecks < IDLE_CHECKS) {
+                    // While things are being logged, nobody pokes us (that would cost them a
+                    // syscall a line), so just check every couple of milliseconds.
+                    wake.wait_for(lock, std::chrono::milliseconds(2));
+                    continue;
+                }
+
+                // Nothing for a while, so stop waking up at all until somebody logs something.
+                // push() checks `sleeping` after publishing its record, and we check the rings
+                // after setting it, so one of us always sees the other.
+                sleeping = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                lock.unlock();
+                bool late = drain();
+                lock.lock();
+                if (!late) wake.wait(lock, [this] { return stopping || !sleeping; });
+                sleeping = false;
+                idleChecks = 0;
+            }
+        });
+    }
+    // Wakes the log thread up if it's sleeping. Only costs a syscall when it is.
+    void poke() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sleeping = false;
+        }
+        wake.notify_one();
+    }
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (thread.joinable()) thread.join();
+        running = false;
+    }
+};
+
+// Feeds std::cout into the current thread's ring a line at a time, so stuff printed straight
+// to std::cout can't overtake Logger lines that are still waiting to be written.
+class RingStreambuf : public std::streambuf {
+public:
+    // A plain array, not a std::string: thread_locals are gone before statics, and ~LogBackend
+    // still commits the main thread's. Something trivially destructible is still there to commit.
+    struct Pending {
+        char text[512];
+        size_t length;
+    };
+    static Pending &pending() {
+        thread_local Pending buffer{};
+        return buffer;
+    }
+    static void commit() {
+        auto &buffer = pending();
+        if (buffer.length == 0) return;
+        push(RECORD_RAW, 0, false, buffer.text, buffer.length);
+        buffer.length = 0;
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (c == traits_type::eof()) return traits_type::not_eof(c);
+        auto &buffer = pending();
+        buffer.text[buffer.length++] = traits_type::to_char_type(c);
+        if (c == '\n' || buffer.length == sizeof(buffer.text)) commit();
+        return c;
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        auto &buffer = pending();
+        for (std::streamsize done = 0; done < n;) {
+            size_t chunk = std::min(size_t(n - done), sizeof(buffer.text) - buffer.length);
+            memcpy(buffer.text + buffer.length, s + done, chunk);
+            buffer.length += chunk;
+            done += chunk;
+            if (buffer.length == sizeof(buffer.text)) commit();
+        }
+        if (memchr(s, '\n', n)) commit();
+        return n;
+    }
+    int sync() override {
+        commit();
+        return 0;
+    }
+};
+
+struct LogBackend {
+    LogThread thread;
+    RingStreambuf streambuf;
+    std::streambuf *originalCout = nullptr;
+
+    LogBackend() {
+        originalCout = std::cout.rdbuf(&streambuf);
+        thread.start();
+    }
+    ~LogBackend() {
+        thread.stop();
+        RingStreambuf::commit();
+        drain();
+        std::cout.rdbuf(originalCout);
+        uint64_t waits = fullRings;
+        if (waits > 0) std::cout << "(logging had to wait for room " << waits << " times)\n";
+    }
+} backend;
+
+void push(RecordKind kind, uint16_t depth, bool truncated, const char *payload, size_t length) {
+    LogRing &ring = threadRing();
+    size_t size = (sizeof(RecordHeader) + length + 15) & ~size_t(15);
+    if (size > LogRing::capacity / 2) {
+        length = LogRing::capacity / 2 - sizeof(RecordHeader);
+        size = LogRing::capacity / 2;
+        truncated = true;
+    }
+
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    size_t offset = head % LogRing::capacity;
+    size_t toEnd = LogRing::capacity - offset;
+    // Records never wrap around the end. If this one doesn't fit, the rest of the ring is padding.
+    size_t needed = size + (toEnd < size ? toEnd : 0);
+    bool waited = false;
+    while (LogRing::capacity - (head - ring.tail.load(std::memory_order_acquire)) < needed) {
+        if (!waited) fullRings += 1;
+        waited = true;
+        // Past the end of main() there's no log thread to make room, so do it ourselves.
+        if (!backend.thread.running) drain();
+        else std::this_thread::yield();
+    }
+
+    if (toEnd < size) {
+        RecordHeader wrap{uint32_t(toEnd), RECORD_WRAP, false, 0, 0};
+        memcpy(ring.data.get() + offset, &wrap, sizeof(wrap));
+        head += toEnd;
+        offset = 0;
+    }
+    RecordHeader header{uint32_t(size), kind, truncated, depth, nextSequence.fetch_add(1, std::memory_order_relaxed)};
+    memcpy(ring.data.get() + offset, &header, sizeof(header));
+    memcpy(ring.data.get() + offset + sizeof(header), payload, length);
+    // Zeroes mark the end of the payload (see LOG_END).
+    memset(ring.data.get() + offset + sizeof(header) + length, 0, size - sizeof(header) - length);
+    ring.head.store(head + size, std::memory_order_release);
+
+    if (!backend.thread.running) {
+        drain();
+    }
+    else {
+        // Pairs with the log thread setting `sleeping` and then checking the rings.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (backend.thread.sleeping.load(std::memory_order_relaxed)) backend.thread.poke();
+    }
+}
+
+// Everything from here down only runs with consumerMutex held.
+
+void appendIndented(std::string &out, const char *text, size_t length, uint16_t depth) {
+    for (size_t i = 0; i < length; ++i) {
+        if (atLineStart && text[i] != '\n') {
+            for (uint16_t tab = 0; tab < depth; ++tab) out += "   ";
+        }
+        out += text[i];
+        atLineStart = text[i] == '\n';
+    }
+}
+
+void formatLine(std::string &out, const char *payload, size_t length, uint16_t depth, bool truncated) {
+    std::string text;
+    char number[64];
+    size_t i = 0;
+    auto read = [&](void *value, size_t size) {
+        memcpy(value, payload + i, size);
+        i += size;
+    };
+    while (i < length) {
+        auto type = LogArg(payload[i++]);
+        if (type == LOG_END) break;
+        switch (type) {
+        case LOG_END:
+            break;
+        case LOG_TEXT: {
+            uint32_t size;
+            read(&size, sizeof(size));
+            text.append(payload + i, size);
+            i += size;
+            break;
+        }
+        case LOG_CHAR:
+            text += payload[i++];
+            break;
+        case LOG_INT: {
+            int64_t value;
+            read(&value, sizeof(value));
+            text.append(number, snprintf(number, sizeof(number), "%lld", (long long)value));
+            break;
+        }
+        case LOG_UINT: {
+            uint64_t value;
+            read(&value, sizeof(value));
+            text.append(number, snprintf(number, sizeof(number), "%llu", (unsigned long long)value));
+            break;
+        }
+        case LOG_DOUBLE: {
+            double value;
+            read(&value, sizeof(value));
+            // Same as what std::cout does by default.
+            text.append(number, snprintf(number, sizeof(number), "%g", value));
+            break;
+        }
+        case LOG_POINTER: {
+            const void *value;
+            read(&value, sizeof(value));
+            text.append(number, snprintf(number, sizeof(number), "%p", value));
+            break;
+        }
+        }
+    }
+    if (truncated) text += " [...]\n";
+    appendIndented(out, text.data(), text.size(), depth);
+}
+
+// The next real record in `ring` that's before `end`, skipping padding. Null if there isn't one.
+const RecordHeader *peek(LogRing &ring, uint64_t &tail, uint64_t end) {
+    while (tail < end) {
+        auto header = reinterpret_cast<const RecordHeader *>(ring.data.get() + tail % LogRing::capacity);
+        if (header->kind != RECORD_WRAP) return header;
+        tail += header->size;
+    }
+    return nullptr;
+}
+
+bool drain() {
+    std::lock_guard<std::mutex> lock(consumerMutex);
+    std::vector<LogRing *> snapshot;
+    {
+        std::lock_guard<std::mutex> registryLock(registryMutex);
+        for (auto &ring : rings) snapshot.push_back(ring.get());
+    }
+
+    // Only what's there right now, or a chatty thread could keep us here forever.
+    std::vector<uint64_t> tails, ends;
+    for (auto ring : snapshot) {
+        tails.push_back(ring->tail.load(std::memory_order_relaxed));
+        ends.push_back(ring->head.load(std::memory_order_acquire));
+    }
+
+    std::string out;
+    for (;;) {
+        // Oldest record across all the rings goes next.
+        size_t oldest = snapshot.size();
+        const RecordHeader *next = nullptr;
+        for (size_t r = 0; r < snapshot.size(); ++r) {
+            auto header = peek(*snapshot[r], tails[r], ends[r]);
+            if (header && (!next || header->sequence < next->sequence)) {
+                next = header;
+                oldest = r;
+            }
+        }
+        if (!next) break;
+
+        const char *payload = reinterpret_cast<const char *>(next) + sizeof(RecordHeader);
+        size_t length = next->size - sizeof(RecordHeader);
+        if (next->kind == RECORD_LINE) formatLine(out, payload, length, next->depth, next->truncated);
+        else appendIndented(out, payload, strnlen(payload, length), 0);
+
+        tails[oldest] += next->size;
+        snapshot[oldest]->tail.store(tails[oldest], std::memory_order_release);
+    }
+    // Skipped padding at the very end counts too.
+    for (size_t r = 0; r < snapshot.size(); ++r) snapshot[r]->tail.store(tails[r], std::memory_order_release);
+
+    if (out.empty()) return false;
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+    return true;
+}
+
+}
+
+void logFlush() {
+    RingStreambuf::commit();
+    drain();
+}
+
+LogLine::~LogLine() {
+    // Anything half-printed to std::cout on this thread came first.
+    RingStreambuf::commit();
+    push(RECORD_LINE, depth, truncated, buffer, length);
+}
 
 Logger::Logger(const char *label) : label(label) {
     *this << "== " << label << " ==\n";
-    tabs += 1;
+    logDepth += 1;
 }
 
 Logger::~Logger() {
-    tabs -= 1;
+    logDepth -= 1;
     *this << '\n';
 }
+
+#endif
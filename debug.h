@@ -1,7 +1,21 @@
+#pragma once
+
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+// Makes sure everything logged so far (on any thread) has actually been written out.
+#ifdef DEBUG
+void logFlush();
+#else
+inline void logFlush() { }
+#endif
 
-#define die(print) do { auto &log = std::cout; print << '\n'; exit(2); } while(0)
+#define die(print) do { logFlush(); auto &log = std::cout; print << '\n'; exit(2); } while(0)
 
 #ifdef DEBUG
 #define debug(statement) do { auto &log = std::cout; statement; } while(0)
@@ -10,18 +24,167 @@
 #endif
 
 const char *physicalDeviceTypeToString(int t);
+const char *presentModeToString(int mode);
 
+#ifdef DEBUG
+
+// How a logged value is stored in a LogLine until the log thread gets around to printing it.
+enum LogArg : uint8_t {
+    LOG_END,    // the rest is padding
+    LOG_TEXT,   // uint32_t length, then the bytes
+    LOG_CHAR,
+    LOG_INT,    // int64_t
+    LOG_UINT,   // uint64_t
+    LOG_DOUBLE,
+    LOG_POINTER,
+};
+
+// One `log << a << b << c;` statement. Doesn't format anything: it packs the raw values into
+// a buffer on the stack, and hands the whole thing to this thread's log ring when it dies at
+// the end of the statement. The log thread does the formatting and the write().
+class LogLine {
+    char buffer[1024];
+    size_t length = 0;
+    uint16_t depth;
+    bool truncated = false;
+
+    void put(LogArg type, const void *data, size_t size) {
+        if (length + 1 + size > sizeof(buffer)) {
+            truncated = true;
+            return;
+        }
+        buffer[length++] = type;
+        memcpy(buffer + length, data, size);
+        length += size;
+    }
+    void text(const char *data, size_t size) {
+        uint32_t size32;
+        if (length + 1 + sizeof(size32) > sizeof(buffer)) {
+            truncated = true;
+            return;
+        }
+        // Cut it down to whatever still fits, rather than losing the whole thing.
+        size_t room = sizeof(buffer) - length - 1 - sizeof(size32);
+        if (size > room) {
+            size = room;
+            truncated = true;
+        }
+        size32 = size;
+        buffer[length++] = LOG_TEXT;
+        memcpy(buffer + length, &size32, sizeof(size32));
+        memcpy(buffer + length + sizeof(size32), data, size);
+        length += sizeof(size32) + size;
+    }
+
+public:
+    template<typename T>
+    LogLine(uint16_t depth, const T &first) : depth(depth) { *this << first; }
+    LogLine(const LogLine &) = delete;
+    ~LogLine();
+
+    template<typename T>
+    LogLine &operator<<(const T &value) {
+        using V = std::decay_t<T>;
+        if constexpr (std::is_same_v<V, char>) {
+            put(LOG_CHAR, &value, 1);
+        }
+        else if constexpr (std::is_array_v<T> && std::is_same_v<std::remove_cv_t<std::remove_extent_t<T>>, char>) {
+            // String literals, and char arrays like VkExtensionProperties::extensionName.
+            text(value, strnlen(value, sizeof(T)));
+        }
+        else if constexpr (std::is_same_v<V, const char *> || std::is_same_v<V, char *>) {
+            if (value) text(value, strlen(value));
+            else text("(null)", 6);
+        }
+        else if constexpr (std::is_same_v<V, std::string>) {
+            text(value.data(), value.size());
+        }
+        else if constexpr (std::is_same_v<V, bool>) {
+            char digit = value ? '1' : '0';
+            put(LOG_CHAR, &digit, 1);
+        }
+        else if constexpr (std::is_same_v<V, signed char> || std::is_same_v<V, unsigned char>) {
+            // iostreams print these as characters, so we do too.
+            put(LOG_CHAR, &value, 1);
+        }
+        else if constexpr (std::is_enum_v<V>) {
+            *this << static_cast<std::underlying_type_t<V>>(value);
+        }
+        else if constexpr (std::is_integral_v<V> && std::is_signed_v<V>) {
+            int64_t wide = value;
+            put(LOG_INT, &wide, sizeof(wide));
+        }
+        else if constexpr (std::is_integral_v<V>) {
+            uint64_t wide = value;
+            put(LOG_UINT, &wide, sizeof(wide));
+        }
+        else if constexpr (std::is_floating_point_v<V>) {
+            double wide = value;
+            put(LOG_DOUBLE, &wide, sizeof(wide));
+        }
+        else if constexpr (std::is_pointer_v<V>) {
+            const void *pointer = value;
+            put(LOG_POINTER, &pointer, sizeof(pointer));
+        }
+        else {
+            // Something only iostreams knows how to print. Rare enough to just format it here.
+            std::ostringstream formatted;
+            formatted << value;
+            *this << formatted.str();
+        }
+        return *this;
+    }
+};
+
+// Prints "== label ==" and indents everything logged on this thread until it goes out of scope.
+//
+// Nothing gets written on the calling thread. Each thread has its own lock-free ring of log
+// entries, and a background thread formats them and writes them out in the order they were
+// logged. (std::cout goes through the same rings in debug builds, so the two stay in order.)
 class Logger {
-    static size_t tabs;
     const char *label;
 
 public:
     Logger(const char *label);
     ~Logger();
-    
+
     template<typename T>
-    std::ostream &operator<<(T val) {
-        for (size_t i = 0; i < tabs; ++i) std::cout << "   ";
-        return (std::cout << val);
-    }
+    LogLine operator<<(const T &value);
+};
+
+// Every thread's current Logger nesting.
+extern thread_local uint16_t logDepth;
+
+template<typename T>
+LogLine Logger::operator<<(const T &value) {
+    return LogLine(logDepth, value);
+}
+
+#else
+
+// Release builds: all of the above boils down to nothing.
+struct LogLine {
+    template<typename T>
+    const LogLine &operator<<(const T &) const { return *this; }
+};
+
+class Logger {
+public:
+    Logger(const char *) { }
+
+    template<typename T>
+    LogLine operator<<(const T &) const { return {}; }
+};
+
+#endif
+
+// Logger for results, like the benchmarks and the reports at the end of a run: the same
+// "== label ==" header, but straight to std::cout, so it's still there in release builds.
+class Report {
+public:
+    explicit Report(const char *label) { std::cout << "== " << label << " ==\n"; }
+    ~Report() { std::cout << '\n'; }
+
+    template<typename T>
+    std::ostream &operator<<(const T &value) { return std::cout << value; }
 };
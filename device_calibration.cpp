@@ -0,0 +1,229 @@
+#include "device_calibration.h"
+#include "debug.h"
+#include "memory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+static const uint32_t CALIBRATION_SIZE = 2048;
+// Clear + copy passes per frame, and how many frames. The first frame is mostly the driver
+// waking up, which is why we keep the best one rather than the average.
+static const uint32_t CALIBRATION_PASSES = 8;
+static const uint32_t CALIBRATION_FRAMES = 4;
+
+// Everything the transfer commands below do to the two images, as one big hammer of a barrier.
+static void transferBarrier(VkCommandBuffer commandBuffer) {
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(
+        commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+        1, &barrier, 0, nullptr, 0, nullptr
+    );
+}
+
+std::optional<double> calibrateDevice(VkPhysicalDevice physicalDevice, uint32_t graphicsQueueFamily) {
+    Logger log("calibrateDevice");
+
+    float queuePriority = 1.0f;
+    VkDeviceQueueCreateInfo queueInfo{};
+    queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueInfo.queueFamilyIndex = graphicsQueueFamily;
+    queueInfo.queueCount = 1;
+    queueInfo.pQueuePriorities = &queuePriority;
+
+    VkDeviceCreateInfo deviceInfo{};
+    deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    deviceInfo.queueCreateInfoCount = 1;
+    deviceInfo.pQueueCreateInfos = &queueInfo;
+
+    VkDevice device;
+    auto result = vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device);
+    if (result != VK_SUCCESS) {
+        log << "couldn't create a device to calibrate on " << result << '\n';
+        return std::nullopt;
+    }
+    VkQueue queue;
+    vkGetDeviceQueue(device, graphicsQueueFamily, 0, &queue);
+
+    DeviceAllocator allocator;
+    allocator.init(device, physicalDevice);
+
+    // Two screen-sized-ish images: one we clear, one we copy it into.
+    VkImageCreateInfo imageInfo{};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+    imageInfo.extent = { CALIBRATION_SIZE, CALIBRATION_SIZE, 1 };
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    VkImage images[2];
+    Allocation memory[2];
+    for (int i = 0; i < 2; ++i) memory[i] = allocator.createImage(imageInfo, images[i], VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = graphicsQueueFamily;
+    VkCommandPool pool;
+    vkCreateCommandPool(device, &poolInfo, nullptr, &pool);
+
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = pool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+    VkCommandBuffer commandBuffer;
+    vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+
+    // One "frame". GENERAL layout the whole way through, so the passes only need memory barriers.
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+        VkImageMemoryBarrier toGeneral[2] = {};
+        for (int i = 0; i < 2; ++i) {
+            toGeneral[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            toGeneral[i].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+            toGeneral[i].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            toGeneral[i].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+            toGeneral[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            toGeneral[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            toGeneral[i].image = images[i];
+            toGeneral[i].subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        }
+        vkCmdPipelineBarrier(
+            commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+            0, nullptr, 0, nullptr, 2, toGeneral
+        );
+
+        VkImageSubresourceRange range = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        VkImageCopy copy{};
+        copy.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        copy.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        copy.extent = imageInfo.extent;
+        for (uint32_t pass = 0; pass < CALIBRATION_PASSES; ++pass) {
+            VkClearColorValue color = {{ pass / float(CALIBRATION_PASSES), 0.5f, 0.25f, 1.0f }};
+            vkCmdClearColorImage(commandBuffer, images[0], VK_IMAGE_LAYOUT_GENERAL, &color, 1, &range);
+            transferBarrier(commandBuffer);
+            vkCmdCopyImage(commandBuffer, images[0], VK_IMAGE_LAYOUT_GENERAL, images[1], VK_IMAGE_LAYOUT_GENERAL, 1, &copy);
+            transferBarrier(commandBuffer);
+        }
+
+    vkEndCommandBuffer(commandBuffer);
+
+    VkFenceCreateInfo fenceInfo{};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VkFence fence;
+    vkCreateFence(device, &fenceInfo, nullptr, &fence);
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+
+    std::optional<double> best;
+    for (uint32_t frame = 0; frame < CALIBRATION_FRAMES; ++frame) {
+        auto start = std::chrono::steady_clock::now();
+        result = vkQueueSubmit(queue, 1, &submitInfo, fence);
+        if (result == VK_SUCCESS) result = vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+        if (result != VK_SUCCESS) {
+            log << "calibration frame " << frame << " failed " << result << '\n';
+            best.reset();
+            break;
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        best = std::min(best.value_or(ms), ms);
+        vkResetFences(device, 1, &fence);
+    }
+
+    vkDeviceWaitIdle(device);
+    vkDestroyFence(device, fence, nullptr);
+    vkDestroyCommandPool(device, pool, nullptr);
+    for (int i = 0; i < 2; ++i) {
+        vkDestroyImage(device, images[i], nullptr);
+        allocator.free(memory[i]);
+    }
+    allocator.destroy();
+    vkDestroyDevice(device, nullptr);
+    return best;
+}
+
+// Same GPU, same driver: same answer. A driver update could change things, so it's in the key.
+static std::string cacheKey(const VkPhysicalDeviceProperties &props) {
+    char key[128];
+    int length = snprintf(key, sizeof(key), "%x:%x:%x:", props.vendorID, props.deviceID, props.driverVersion);
+    for (uint32_t i = 0; i < VK_UUID_SIZE; ++i) {
+        length += snprintf(key + length, sizeof(key) - length, "%02x", props.pipelineCacheUUID[i]);
+    }
+    return key;
+}
+
+void DeviceCalibrationCache::load(const std::string &path) {
+    Logger log("DeviceCalibrationCache::load");
+    this->path = path;
+    results.clear();
+    changed = false;
+
+    std::ifstream file(path);
+    if (!file) {
+        log << "no calibrations at " << path << " yet\n";
+        return;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        Entry entry;
+        if (!(fields >> key >> entry.ms) || entry.ms <= 0) continue;
+        std::getline(fields >> std::ws, entry.name);
+        results[key] = entry;
+    }
+    log << results.size() << " calibrated devices in " << path << '\n';
+}
+
+void DeviceCalibrationCache::save() {
+    Logger log("DeviceCalibrationCache::save");
+    if (!changed || path.empty()) return;
+
+    // Same temp file + rename dance as PipelineCache::save().
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::trunc);
+        if (!file) {
+            log << "couldn't open " << tempPath << " for writing\n";
+            return;
+        }
+        for (auto &[key, entry] : results) file << key << ' ' << entry.ms << ' ' << entry.name << '\n';
+        if (!file) {
+            log << "failed writing " << tempPath << '\n';
+            return;
+        }
+    }
+    if (std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        log << "couldn't move " << tempPath << " to " << path << '\n';
+        return;
+    }
+    changed = false;
+    log << "wrote " << results.size() << " calibrations to " << path << '\n';
+}
+
+std::optional<double> DeviceCalibrationCache::lookup(const VkPhysicalDeviceProperties &props) const {
+    auto entry = results.find(cacheKey(props));
+    if (entry == results.end()) return std::nullopt;
+    return entry->second.ms;
+}
+
+void DeviceCalibrationCache::store(const VkPhysicalDeviceProperties &props, double ms) {
+    results[cacheKey(props)] = {ms, props.deviceName};
+    changed = true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <map>
+#include <optional>
+#include <string>
+
+// How fast does this device actually push pixels? Renders a few frames of nothing but big clears
+// and image-to-image copies (which is about what a fill-rate bound 2D renderer like us does) and
+// times each one with a fence. Makes its own throwaway logical device, so it can run before
+// we've picked one. Returns the quickest frame in ms, or nothing if the device couldn't do it.
+std::optional<double> calibrateDevice(VkPhysicalDevice physicalDevice, uint32_t graphicsQueueFamily);
+
+// calibrateDevice() results from earlier launches, so we only ever calibrate a device once per
+// driver version. Plain text, one device per line: "vendor:device:driver:cacheUUID ms name".
+class DeviceCalibrationCache {
+    struct Entry {
+        double ms;
+        std::string name; // just so the file makes sense to people
+    };
+
+    std::string path;
+    std::map<std::string, Entry> results;
+    bool changed = false;
+
+public:
+    void load(const std::string &path);
+    // Only writes anything if store() added something new.
+    void save();
+
+    std::optional<double> lookup(const VkPhysicalDeviceProperties &props) const;
+    void store(const VkPhysicalDeviceProperties &props, double ms);
+};
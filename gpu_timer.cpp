@@ -0,0 +1,178 @@
+#include "gpu_timer.h"
+#include "debug.h"
+
+#include <cstring>
+
+bool GpuTimer::init(
+    VkDevice device, VkPhysicalDevice physicalDevice, uint32_t queueFamily,
+    uint32_t slotCount, uint32_t maxZonesPerSlot, size_t window, bool countFragments
+) {
+    Logger log("GpuTimer::init");
+    this->device = device;
+    this->window = window;
+    fragmentStats = RollingStats(window);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+    uint32_t validBits = queueFamilies[queueFamily].timestampValidBits;
+    if (validBits == 0 || properties.limits.timestampPeriod == 0) {
+        log << "queue family " << queueFamily << " can't do timestamps. no GPU times for you\n";
+        return false;
+    }
+    validMask = validBits >= 64 ? ~0ULL : (1ULL << validBits) - 1;
+    nanosecondsPerTick = properties.limits.timestampPeriod;
+    maxZones = maxZonesPerSlot;
+    slots.assign(slotCount, Slot{});
+
+    VkQueryPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = slotCount * maxZones * 2;
+
+    auto result = vkCreateQueryPool(device, &poolInfo, nullptr, &pool);
+    if (result != VK_SUCCESS) {
+        log << "couldn't create timestamp query pool " << result << '\n';
+        pool = VK_NULL_HANDLE;
+        return false;
+    }
+    log << "created timestamp pool: " << slotCount << " slots x " << maxZones << " zones\n";
+
+    if (countFragments) {
+        VkQueryPoolCreateInfo statisticsInfo{};
+        statisticsInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        statisticsInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+        statisticsInfo.queryCount = slotCount;
+        statisticsInfo.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+        result = vkCreateQueryPool(device, &statisticsInfo, nullptr, &statisticsPool);
+        if (result != VK_SUCCESS) {
+            log << "couldn't create pipeline statistics pool " << result << ". no overdraw numbers\n";
+            statisticsPool = VK_NULL_HANDLE;
+        }
+    }
+    return true;
+}
+
+void GpuTimer::destroy() {
+    if (pool != VK_NULL_HANDLE) vkDestroyQueryPool(device, pool, nullptr);
+    if (statisticsPool != VK_NULL_HANDLE) vkDestroyQueryPool(device, statisticsPool, nullptr);
+    pool = VK_NULL_HANDLE;
+    statisticsPool = VK_NULL_HANDLE;
+    slots.clear();
+}
+
+void GpuTimer::beginSlot(VkCommandBuffer commandBuffer, uint32_t slot) {
+    if (!enabled()) return;
+    slots[slot].zoneNames.clear();
+    slots[slot].counting = false;
+    slots[slot].pending = false;
+    vkCmdResetQueryPool(commandBuffer, pool, slot * maxZones * 2, maxZones * 2);
+    if (countingFragments()) vkCmdResetQueryPool(commandBuffer, statisticsPool, slot, 1);
+}
+
+uint32_t GpuTimer::begin(VkCommandBuffer commandBuffer, uint32_t slot, const char *name) {
+    if (!enabled()) return 0;
+    auto &zones = slots[slot].zoneNames;
+    if (zones.size() >= maxZones) die(log << "GpuTimer: too many zones in one slot (" << name << ")");
+
+    uint32_t zone = zones.size();
+    zones.push_back(name);
+    uint32_t query = (slot * maxZones + zone) * 2;
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pool, query);
+    return zone;
+}
+
+void GpuTimer::end(VkCommandBuffer commandBuffer, uint32_t slot, uint32_t zone) {
+    if (!enabled()) return;
+    uint32_t query = (slot * maxZones + zone) * 2 + 1;
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, pool, query);
+}
+
+void GpuTimer::beginFragments(VkCommandBuffer commandBuffer, uint32_t slot) {
+    if (!countingFragments()) return;
+    slots[slot].counting = true;
+    vkCmdBeginQuery(commandBuffer, statisticsPool, slot, 0);
+}
+
+void GpuTimer::endFragments(VkCommandBuffer commandBuffer, uint32_t slot) {
+    if (!countingFragments()) return;
+    vkCmdEndQuery(commandBuffer, statisticsPool, slot);
+}
+
+void GpuTimer::submitted(uint32_t slot) {
+    if (!enabled()) return;
+    slots[slot].pending = true;
+}
+
+void GpuTimer::collect(uint32_t slot) {
+    if (!enabled() || !slots[slot].pending) return;
+
+    // No WAIT_BIT: if the results somehow aren't there yet we'd rather drop a sample than stall.
+    if (slots[slot].counting) {
+        uint64_t invocations = 0;
+        auto result = vkGetQueryPoolResults(
+            device, statisticsPool, slot, 1, sizeof(invocations), &invocations, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT
+        );
+        if (result == VK_SUCCESS) {
+            fragmentStats.add(invocations);
+            slots[slot].counting = false;
+        }
+    }
+    auto &zones = slots[slot].zoneNames;
+    if (zones.empty()) return;
+
+    std::vector<uint64_t> ticks(zones.size() * 2);
+    auto result = vkGetQueryPoolResults(
+        device, pool, slot * maxZones * 2, ticks.size(),
+        ticks.size() * sizeof(uint64_t), ticks.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT
+    );
+    if (result != VK_SUCCESS) return;
+    slots[slot].pending = false;
+
+    for (size_t zone = 0; zone < zones.size(); ++zone) {
+        uint64_t elapsed = (ticks[zone * 2 + 1] - ticks[zone * 2]) & validMask;
+        statsFor(zones[zone]).add(elapsed * nanosecondsPerTick / 1e6);
+    }
+}
+
+RollingStats &GpuTimer::statsFor(const char *name) {
+    for (auto &entry : zoneStats) {
+        if (entry.first == name) return entry.second;
+    }
+    zoneStats.emplace_back(name, RollingStats(window));
+    return zoneStats.back().second;
+}
+
+const RollingStats *GpuTimer::stats(const char *name) const {
+    for (auto &entry : zoneStats) {
+        if (entry.first == name) return &entry.second;
+    }
+    return nullptr;
+}
+
+const RollingStats *GpuTimer::fragments() const {
+    return fragmentStats.empty() ? nullptr : &fragmentStats;
+}
+
+void GpuTimer::clearStats() {
+    for (auto &entry : zoneStats) entry.second.clear();
+    fragmentStats.clear();
+}
+
+void GpuTimer::report(const char *label) {
+    Report log(label);
+    if (!enabled()) {
+        log << "(no timestamp support)\n";
+        return;
+    }
+    for (auto &[name, stats] : zoneStats) {
+        if (stats.empty()) continue;
+        log << name << ": min " << stats.min() << " ms, avg " << stats.avg()
+            << " ms, p99 " << stats.percentile(99) << " ms (" << stats.size() << " frames)\n";
+    }
+}
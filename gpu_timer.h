@@ -0,0 +1,72 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "stats.h"
+
+// Timestamp queries around chunks of GPU work ("zones").
+//
+// Queries are split into slots, one per command buffer we might have in flight. Zones get
+// recorded into a slot's command buffer with begin()/end(), and once the fence for that
+// submission has signaled, collect() pulls the results without waiting on anything. So the
+// numbers always show up a frame (or a few) late, but we never stall to get them.
+//
+// Each slot can also count fragment shader invocations with a pipeline statistics query, which
+// over the pixel count is how much overdraw there was (after early depth testing threw out what
+// it could).
+class GpuTimer {
+    struct Slot {
+        std::vector<const char*> zoneNames;
+        bool counting = false;
+        bool pending = false;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkQueryPool pool = VK_NULL_HANDLE;
+    VkQueryPool statisticsPool = VK_NULL_HANDLE;
+    double nanosecondsPerTick = 0;
+    uint64_t validMask = 0;
+    uint32_t maxZones = 0;
+    size_t window = 512;
+    std::vector<Slot> slots;
+    // In the order the zones were first seen, so reports come out in recording order.
+    std::vector<std::pair<std::string, RollingStats>> zoneStats;
+    RollingStats fragmentStats;
+
+    RollingStats &statsFor(const char *name);
+
+public:
+    // Returns false (and leaves the timer disabled) if the queue family can't do timestamps.
+    // `countFragments` needs the pipelineStatisticsQuery feature enabled on the device.
+    bool init(
+        VkDevice device, VkPhysicalDevice physicalDevice, uint32_t queueFamily,
+        uint32_t slotCount, uint32_t maxZonesPerSlot, size_t window = 512, bool countFragments = false
+    );
+    void destroy();
+    bool enabled() const { return pool != VK_NULL_HANDLE; }
+    bool countingFragments() const { return statisticsPool != VK_NULL_HANDLE; }
+
+    // Recording. beginSlot() resets the slot's queries, so it has to go outside any render pass.
+    void beginSlot(VkCommandBuffer commandBuffer, uint32_t slot);
+    uint32_t begin(VkCommandBuffer commandBuffer, uint32_t slot, const char *name);
+    void end(VkCommandBuffer commandBuffer, uint32_t slot, uint32_t zone);
+    // Counts fragment shader invocations in between. At most once per slot, and outside any
+    // render pass (secondaries executed in between have to inherit the query).
+    void beginFragments(VkCommandBuffer commandBuffer, uint32_t slot);
+    void endFragments(VkCommandBuffer commandBuffer, uint32_t slot);
+
+    // Call after the slot's command buffer is submitted, and collect() once its fence signaled.
+    void submitted(uint32_t slot);
+    void collect(uint32_t slot);
+
+    const RollingStats *stats(const char *name) const;
+    // Fragment shader invocations per frame. Null if nothing got counted.
+    const RollingStats *fragments() const;
+    void clearStats();
+    void report(const char *label);
+};
@@ -0,0 +1,12 @@
+#include "handles.h"
+
+void DeletionQueue::collect(uint64_t frame) {
+    // Deferred in order, so the tags only ever go up.
+    while (!deletions.empty() && deletions.front().frame <= frame) {
+        auto &deletion = deletions.front();
+        if (deletion.destroy) deletion.destroy(deletion.device, deletion.handle);
+        if (deletion.allocation) allocator->free(deletion.allocation);
+        deletions.pop_front();
+        destroyedCount += 1;
+    }
+}
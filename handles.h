@@ -0,0 +1,120 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <cstdint>
+#include <deque>
+#include <utility>
+
+#include "memory.h"
+
+// Owns one Vulkan object and destroys it with `Destroy` (vkDestroyBuffer, vkDestroyFramebuffer...)
+// when it goes out of scope. Move-only, and just the handle plus the device it came from: no
+// std::function, nothing on the heap, and the destroy call is a plain direct call.
+//
+// Only for objects that get destroyed with vkDestroyWhatever(device, handle, allocator).
+template<typename T, auto Destroy>
+class DeviceHandle {
+    VkDevice device = VK_NULL_HANDLE;
+    T handle = VK_NULL_HANDLE;
+
+public:
+    DeviceHandle() = default;
+    DeviceHandle(VkDevice device, T handle) : device(device), handle(handle) { }
+    ~DeviceHandle() { reset(); }
+
+    DeviceHandle(const DeviceHandle &) = delete;
+    DeviceHandle &operator=(const DeviceHandle &) = delete;
+    DeviceHandle(DeviceHandle &&other) noexcept : device(other.device), handle(other.release()) { }
+    DeviceHandle &operator=(DeviceHandle &&other) noexcept {
+        if (this != &other) {
+            reset();
+            device = other.device;
+            handle = other.release();
+        }
+        return *this;
+    }
+
+    // Destroys whatever this holds and returns somewhere for a vkCreate* call to put the new one.
+    T *replace(VkDevice device) {
+        reset();
+        this->device = device;
+        return &handle;
+    }
+    void reset() {
+        if (handle != VK_NULL_HANDLE) Destroy(device, handle, nullptr);
+        handle = VK_NULL_HANDLE;
+    }
+    // Stop owning it, and hand it back.
+    T release() { return std::exchange(handle, VK_NULL_HANDLE); }
+
+    T get() const { return handle; }
+    VkDevice owner() const { return device; }
+    operator T() const { return handle; }
+    explicit operator bool() const { return handle != VK_NULL_HANDLE; }
+};
+static_assert(sizeof(DeviceHandle<VkBuffer, vkDestroyBuffer>) == sizeof(VkDevice) + sizeof(VkBuffer), "no hidden baggage");
+
+using Buffer = DeviceHandle<VkBuffer, vkDestroyBuffer>;
+using ImageView = DeviceHandle<VkImageView, vkDestroyImageView>;
+using Framebuffer = DeviceHandle<VkFramebuffer, vkDestroyFramebuffer>;
+using ShaderModule = DeviceHandle<VkShaderModule, vkDestroyShaderModule>;
+using RenderPass = DeviceHandle<VkRenderPass, vkDestroyRenderPass>;
+using DescriptorPool = DeviceHandle<VkDescriptorPool, vkDestroyDescriptorPool>;
+using Swapchain = DeviceHandle<VkSwapchainKHR, vkDestroySwapchainKHR>;
+
+// Things the GPU might still be using, waiting to be destroyed until it's definitely done.
+//
+// Every defer() gets tagged with how many frames had been submitted at that point. Once the
+// fence of the newest of those frames has signaled, so have all the earlier ones (fence signals
+// cover everything submitted before them on the queue), and nothing can be using the object
+// anymore. So swapping out a buffer or a framebuffer mid-run never needs vkDeviceWaitIdle.
+class DeletionQueue {
+    struct Deletion {
+        uint64_t frame;
+        VkDevice device;
+        uint64_t handle;
+        void (*destroy)(VkDevice device, uint64_t handle);
+        Allocation allocation;
+    };
+
+    DeviceAllocator *allocator = nullptr;
+    std::deque<Deletion> deletions;
+    uint64_t submittedFrames = 0;
+    uint64_t destroyedCount = 0;
+
+    template<typename T, auto Destroy>
+    static void destroyThunk(VkDevice device, uint64_t handle) { Destroy(device, (T)handle, nullptr); }
+
+public:
+    void init(DeviceAllocator &allocator) { this->allocator = &allocator; }
+
+    template<typename T, auto Destroy>
+    void defer(DeviceHandle<T, Destroy> &&handle, Allocation allocation = {}) {
+        VkDevice device = handle.owner();
+        defer<Destroy>(device, handle.release(), allocation);
+    }
+    // For handles that aren't wrapped in a DeviceHandle (yet).
+    template<auto Destroy, typename T>
+    void defer(VkDevice device, T handle, Allocation allocation = {}) {
+        if (handle == VK_NULL_HANDLE && !allocation) return;
+        deletions.push_back({submittedFrames, device, (uint64_t)handle, destroyThunk<T, Destroy>, allocation});
+    }
+    void defer(Allocation allocation) {
+        if (allocation) deletions.push_back({submittedFrames, VK_NULL_HANDLE, 0, nullptr, allocation});
+    }
+
+    // Call right after submitting a frame with a fence. Returns the frame's number, to hand to
+    // collect() once that fence has signaled.
+    uint64_t submitted() { return ++submittedFrames; }
+    // The number the frame being recorded right now is going to get from submitted().
+    uint64_t recording() const { return submittedFrames + 1; }
+    // Call once frame `frame` is done. Destroys everything that no later frame could have used.
+    void collect(uint64_t frame);
+    // Destroys everything. Only once the device is idle.
+    void flush() { collect(UINT64_MAX); }
+
+    size_t pending() const { return deletions.size(); }
+    uint64_t destroyed() const { return destroyedCount; }
+};
@@ -0,0 +1,83 @@
+#include "job_spool.h"
+#include "debug.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <iostream>
+#include <sys/stat.h>
+#include <time.h>
+
+static const char SCENE_EXTENSION[] = ".shapes";
+static const char STOP_FILE[] = "stop";
+
+void JobSpool::open(const std::string &directory) {
+    Logger log("JobSpool::open");
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        die(log << "couldn't make " << directory << ": " << strerror(errno));
+    }
+    this->directory = directory;
+    taken.clear();
+    log << "waiting for *" << SCENE_EXTENSION << " jobs in " << directory << " (touch " << directory << '/'
+        << STOP_FILE << " to stop)\n";
+}
+
+std::vector<SpoolJob> JobSpool::poll() {
+    // No Logger: this runs every few milliseconds while the server waits for work.
+    DIR *handle = opendir(directory.c_str());
+    if (!handle) die(log << "couldn't read " << directory << ": " << strerror(errno));
+
+    struct Found {
+        timespec written;
+        std::string name;
+    };
+    std::vector<Found> found;
+    size_t extension = strlen(SCENE_EXTENSION);
+    while (dirent *entry = readdir(handle)) {
+        std::string file = entry->d_name;
+        if (file.size() <= extension || file.compare(file.size() - extension, extension, SCENE_EXTENSION) != 0) continue;
+        std::string name = file.substr(0, file.size() - extension);
+        if (taken.count(name)) continue;
+
+        // It can be gone again already, if some other server on the same directory got it.
+        struct stat info;
+        if (stat((directory + '/' + file).c_str(), &info) != 0 || !S_ISREG(info.st_mode)) continue;
+        found.push_back({info.st_mtim, name});
+    }
+    closedir(handle);
+
+    // Oldest first, and in name order when they landed together (a batch copied in at once).
+    std::sort(found.begin(), found.end(), [](const Found &a, const Found &b) {
+        if (a.written.tv_sec != b.written.tv_sec) return a.written.tv_sec < b.written.tv_sec;
+        if (a.written.tv_nsec != b.written.tv_nsec) return a.written.tv_nsec < b.written.tv_nsec;
+        return a.name < b.name;
+    });
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    std::vector<SpoolJob> jobs;
+    for (auto &job : found) {
+        double queuedMs = (now.tv_sec - job.written.tv_sec) * 1000.0 + (now.tv_nsec - job.written.tv_nsec) / 1e6;
+        jobs.push_back({job.name, directory + '/' + job.name + SCENE_EXTENSION, std::max(queuedMs, 0.0)});
+        taken.insert(job.name);
+    }
+    return jobs;
+}
+
+void JobSpool::finish(const SpoolJob &job, bool succeeded) {
+    if (succeeded) {
+        std::remove(job.scenePath.c_str());
+    }
+    else {
+        std::string failedPath = job.scenePath + ".failed";
+        if (std::rename(job.scenePath.c_str(), failedPath.c_str()) != 0) std::remove(job.scenePath.c_str());
+    }
+    taken.erase(job.name);
+}
+
+bool JobSpool::takeStop() {
+    std::string path = directory + '/' + STOP_FILE;
+    return std::remove(path.c_str()) == 0;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+
+// One render job: a scene file somebody dropped in the spool directory.
+struct SpoolJob {
+    // The file name without .shapes. The image gets called this too.
+    std::string name;
+    std::string scenePath;
+    // How long it sat in the directory before poll() saw it, going by when it was last written.
+    double queuedMs = 0;
+};
+
+// --serve's job queue: a directory that .shapes files (see scene_file.h) get dropped into, one per
+// job. It gets polled instead of watched (inotify and friends), since a readdir every few
+// milliseconds costs nothing next to a frame and works the same everywhere.
+//
+// Jobs have to show up whole: write them under another name (like writeSceneFile()'s .tmp) and
+// rename them in. A file called "stop" tells the server to finish what it has and exit.
+class JobSpool {
+public:
+    // Makes the directory if it isn't there. Dies if it can't.
+    void open(const std::string &directory);
+    const std::string &path() const { return directory; }
+
+    // Jobs that showed up since last time, oldest first. Each one comes back once.
+    std::vector<SpoolJob> poll();
+    // The job's scene file goes. Or if it failed, gets renamed to .failed, so it's still there to
+    // look at but never gets picked up again.
+    void finish(const SpoolJob &job, bool succeeded);
+
+    // Whether there's a stop file. Takes it away, so the next server on this directory doesn't
+    // stop right away.
+    bool takeStop();
+
+private:
+    std::string directory;
+    // Names poll() has handed out that haven't been finish()ed yet.
+    std::set<std::string> taken;
+};
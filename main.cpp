@@ -10,40 +10,56 @@
 #include <map>
 #include <array>
 #include <algorithm>
-#include <functional>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <random>
+#include <sstream>
+#include <thread>
 
 #include "debug.h"
+#include "options.h"
+#include "pipeline_cache.h"
+#include "device_calibration.h"
+#include "gpu_timer.h"
+#include "stats.h"
+#include "scene.h"
+#include "memory.h"
+#include "staging.h"
+#include "workers.h"
+#include "pipelines.h"
+#include "profiler.h"
+#include "handles.h"
+#include "mesh_cache.h"
+#include "render_graph.h"
+#include "capture.h"
+#include "scene_file.h"
+#include "job_spool.h"
 
 using std::unique_ptr;
 using std::optional;
 using std::clamp;
-using std::function;
+using Clock = std::chrono::steady_clock;
 
-#define SECTION(message) std::cout << '\n' << message << '\n'
-
-// This all uses https://vulkan-tutorial.com/en as a reference.
-
-template<typename VkHandle>
-struct HandleWrapper {
-    VkHandle handle;
-    function<void(VkHandle &)> destructor;
+static double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
 
-    HandleWrapper(
-        VkHandle value,
-        function<void(VkHandle &)> cleanup
-    ) : handle(value), destructor(cleanup) { }
+// How long a frame gets at `fps` frames per second. 0 fps means no limit.
+static Clock::duration frameInterval(uint32_t fps) {
+    if (fps == 0) return Clock::duration::zero();
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / fps));
+}
 
-    HandleWrapper(HandleWrapper<VkHandle> &copy) : handle(copy.handle),
-                                                   destructor(copy.destructor)
-    { copy.handle = nullptr; }
+#define SECTION(message) std::cout << '\n' << message << '\n'
 
-    ~HandleWrapper() {
-        if (handle == nullptr) return;
-        destructor(handle);
-    }
+// Everything that reads the instance buffers: vertex input, and cull.comp with --gpu-cull.
+static const VkPipelineStageFlags INSTANCE_READ_STAGES = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+static const VkAccessFlags INSTANCE_READ_ACCESS = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
 
-    operator VkHandle() { return handle; }
-};
+// This all uses https://vulkan-tutorial.com/en as a reference.
 
 struct SwapchainSupport {
     VkSurfaceCapabilitiesKHR capabilities;
@@ -51,7 +67,7 @@ struct SwapchainSupport {
     std::vector<VkPresentModeKHR> presentModes;
 
     SwapchainSupport(VkPhysicalDevice device, VkSurfaceKHR surface) {
-        vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface, &capabilities);
+        refreshCapabilities(device, surface);
 
         // Get formats
         uint32_t formatCount;
@@ -70,6 +86,12 @@ struct SwapchainSupport {
         }
     }
 
+    // The current size (and a couple other things) go stale whenever the window changes. The
+    // formats and present modes don't, so those only ever get asked for once.
+    void refreshCapabilities(VkPhysicalDevice device, VkSurfaceKHR surface) {
+        vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface, &capabilities);
+    }
+
     // The GPU might support many color formats, this picks the best one.
     VkSurfaceFormatKHR bestSurfaceFormat() {
         for (const auto& format : formats) {
@@ -86,14 +108,43 @@ struct SwapchainSupport {
         return formats[0];
     }
 
+    bool supports(VkPresentModeKHR mode) {
+        return std::find(presentModes.begin(), presentModes.end(), mode) != presentModes.end();
+    }
+
     // The "present mode" is like, how many framebuffers do we have and what's the algorithm for
-    // showing them on the screen vs filling them.
-    VkPresentModeKHR bestPresentMode() {
-        // Hmmm... We could check for VK_PRESENT_MODE_MAILBOX_KHR. That would let us go wild
-        // but I don't really see the point in rendering multiple times per display refresh...
+    // showing them on the screen vs filling them. Goes down the list for `pacing` and takes the
+    // first one the surface has. FIFO is always there, so everything ends up there worst case.
+    VkPresentModeKHR bestPresentMode(PresentPacing pacing) {
+        std::vector<VkPresentModeKHR> wanted;
+        switch (pacing) {
+        // MAILBOX: render as fast as we like, the display takes the newest finished frame at
+        // vblank. IMMEDIATE is even quicker to the screen but tears.
+        case PACING_LOW_LATENCY: wanted = {VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR}; break;
+        // Like FIFO, but a late frame goes out right away (with a tear) instead of waiting a whole
+        // extra refresh. With the frame cap we're usually late on purpose anyway.
+        case PACING_POWER_SAVER: wanted = {VK_PRESENT_MODE_FIFO_RELAXED_KHR}; break;
+        case PACING_THROUGHPUT:
+        case PACING_BALANCED: break;
+        }
+        for (auto mode : wanted) if (supports(mode)) return mode;
         return VK_PRESENT_MODE_FIFO_KHR;
     }
 
+    uint32_t imageCount(PresentPacing pacing) {
+        uint32_t min = capabilities.minImageCount;
+        switch (pacing) {
+        // Fewer images queued up = less time between drawing a frame and seeing it.
+        case PACING_LOW_LATENCY: return clampImageCount(min);
+        // 2 spare images is enough to keep the GPU busy through a hiccup. More than that in FIFO
+        // just queues more frames (more latency, more per-image buffers) without going any faster.
+        case PACING_THROUGHPUT: return clampImageCount(min + 2);
+        case PACING_POWER_SAVER:
+        case PACING_BALANCED: break;
+        }
+        return clampImageCount(min + 1);
+    }
+
     // The "swap extent" is the size of our framebuffers in pixels.
     VkExtent2D swapExtent(GLFWwindow *window) {
         if (capabilities.currentExtent.width != UINT32_MAX) {
@@ -131,32 +182,338 @@ class RenderState {
     VkDevice device;
     VkQueue presentQueue;
     VkQueue graphicsQueue;
-
-    VkSurfaceKHR surface;
-    VkSwapchainKHR swapchain;
+    VkQueue transferQueue;
+
+    // Headless means no window, no surface and no swapchain. We render into plain offscreen
+    // images instead (they still live in swapchainImages so everything downstream is the same).
+    bool headless;
+    GLFWwindow *window = nullptr;
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
+    VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+    // Set by the GLFW framebuffer size callback. drawFrame() recreates the swapchain when it sees it.
+    bool framebufferResized = false;
+
+    // --present and --max-fps.
+    PresentPacing presentPacing;
+    VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+    Clock::duration minFrameInterval;
+    Clock::time_point nextFrameStart;
+
+    // Input-to-present latency: when the oldest input nobody has drawn yet came in, and how long
+    // it took from there until the frame that saw it got handed to vkQueuePresentKHR.
+    optional<Clock::time_point> pendingInput;
+    RollingStats inputToPresentMs;
     VkExtent2D swapchainExtent;
     VkSurfaceFormatKHR swapchainSurfaceFormat;
     std::vector<VkImage> swapchainImages;
-    std::vector<VkImageView> swapchainImageViews;
-    std::vector<VkFramebuffer> swapchainFramebuffers;
+    std::vector<Allocation> offscreenImageMemory;
+    std::vector<ImageView> swapchainImageViews;
     std::vector<VkCommandBuffer> commandBuffers;
 
-    VkRenderPass renderPass;
+    // The depth buffer itself belongs to frameGraph. depthFormat stays VK_FORMAT_UNDEFINED with --no-depth.
+    bool useDepth;
+    VkFormat depthFormat = VK_FORMAT_UNDEFINED;
+
+    // What a frame does, as passes (see buildFrameGraph()). It owns the render pass, the
+    // framebuffers and the depth buffer, so it gets rebuilt with the swapchain, and whenever
+    // culling comes or goes.
+    RenderGraph frameGraph;
+    RenderGraph::Pass shapesPass = 0;
+    bool frameGraphCulls = false;
+    bool dumpGraph;
+
+    // --capture. The graph leaves the image ready to be copied, and then each frame slot's capture
+    // command buffer copies it into whichever readback buffer is free (and puts it back in
+    // PRESENT_SRC, with a window). It's recorded again every frame, since it's a different buffer
+    // every time, and that's cheaper than recording the whole frame again.
+    std::string capturePath;
+    CaptureFormat captureFormat;
+    uint32_t captureBuffers;
+    uint32_t captureThreads;
+    bool captureDrop;
+    FrameCapture capture;
+    std::vector<VkCommandBuffer> captureCommandBuffers;
+    // What the next captured frame's file gets called. Empty = frameNNNNNN like the rest.
+    std::string nextCaptureName;
+    // --serve only wants the job frames, not the ones drawn while a scene is still streaming in.
+    bool captureNamedOnly = false;
+
     VkPipelineLayout pipelineLayout;
-    VkPipeline graphicsPipeline;
+    // Owns the generic pipelines, along with all the specialized variants.
+    PipelineLibrary pipelines;
+    uint32_t pipelineThreads;
+    bool precompilePipelines;
+    BlendMode blendMode;
+    ShapeRendering shapeRendering;
+    // The ShapeType every shape in the scene has, or SHAPE_ANY if it's a mix. Picks the variant.
+    uint32_t sceneShape = SHAPE_ANY;
+    // Some command buffer got recorded with the generic pipeline while its variant compiled.
+    bool waitingOnPipeline = false;
+    uint64_t pipelinesSeen = 0;
+    size_t fallbackPipelineRecords = 0;
     VkCommandPool commandPool;
 
-    VkSemaphore imageAvailableSemaphore;
-    VkSemaphore renderFinishedSemaphore;
+    // Every shape in the scene, as per-instance vertex data. Drawn with one instanced vkCmdDraw.
+    // Each swapchain image gets its own copy, so we can stream changes into one while the
+    // others are still being read by frames in flight.
+    std::vector<VkBuffer> instanceBuffers;
+    std::vector<Allocation> instanceBufferMemory;
+    uint32_t instanceCount = 0;
+    // How many shapes the instance buffers have room for. setShapes() can grow or shrink the
+    // scene up to this without making new buffers (and waiting for the GPU to let go of the old ones).
+    uint32_t instanceCapacity = 0;
+    // sceneShapes (and so the instance buffers) are in sortForDrawing() order: the first
+    // opaqueCount shapes are opaque, front to back, and the rest translucent, back to front.
+    // Without a depth buffer nothing gets sorted, and it all counts as opaque.
+    uint32_t opaqueCount = 0;
+
+    // --polygons: tessellated paths, drawn with the RENDER_MESHES pipeline right after the opaque
+    // shapes (so without a depth buffer, on top of them).
+    // Every mesh lives in the same vertex + index buffer, shared by all the images since they only
+    // change when loadPolygons() waits for the GPU anyway.
+    bool drawPolygons;
+    MeshCache meshes;
+    VkBuffer meshVertexBuffer = VK_NULL_HANDLE;
+    VkBuffer meshIndexBuffer = VK_NULL_HANDLE;
+    Allocation meshVertexMemory;
+    Allocation meshIndexMemory;
+    size_t meshVertexCapacity = 0;
+    size_t meshIndexCapacity = 0;
+    // One ShapeInstance per polygon, sorted by mesh, so each mesh is one instanced draw.
+    struct MeshDraw {
+        uint32_t mesh;
+        uint32_t firstInstance;
+        uint32_t instanceCount;
+    };
+    std::vector<MeshDraw> meshDraws;
+    VkBuffer polygonInstanceBuffer = VK_NULL_HANDLE;
+    Allocation polygonInstanceMemory;
+
+    // --gpu-cull: cull.comp packs the visible shapes from instanceBuffers[i] into visibleBuffers[i]
+    // and counts them into indirectBuffers[i], which the render pass draws with vkCmdDrawIndirect.
+    // So the CPU never touches individual shapes per frame.
+    bool gpuCull;
+    float cullMinPixels;
+    VkDescriptorSetLayout cullSetLayout = VK_NULL_HANDLE;
+    // A fresh one per scene, since the old sets can still be in use by frames in flight.
+    DescriptorPool cullDescriptorPool;
+    VkPipelineLayout cullPipelineLayout = VK_NULL_HANDLE;
+    VkPipeline cullPipeline = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> cullDescriptorSets;
+    std::vector<VkBuffer> visibleBuffers;
+    std::vector<Allocation> visibleBufferMemory;
+    std::vector<VkBuffer> indirectBuffers;
+    std::vector<Allocation> indirectBufferMemory; // host visible, so we can peek at the visible count
+    uint32_t visibleShapes = 0;
+
+    // CPU-side copy of the scene, and how many changes have been streamed into it.
+    std::vector<ShapeInstance> sceneShapes;
+    // Unless it came from loadSceneFile(): then it stays in the mapped file instead, until
+    // something wants to change it (see materializeScene()). sceneData() is whichever it is.
+    SceneFile sceneFile;
+    uint64_t sceneVersion = 0;
+    // Which sceneVersion each image's instance buffer is up to. 0 is a new buffer with nothing in
+    // it yet (see growInstanceBuffers()).
+    std::vector<uint64_t> imageSceneVersions;
+
+    // Same idea for the command buffers: bump commandsVersion when anything they bake in changes
+    // (the shape count, mostly), and drawFrame() re-records each image's the next time it comes
+    // around. No waiting for the whole device, and images that never come around cost nothing.
+    uint64_t commandsVersion = 0;
+    std::vector<uint64_t> imageCommandsVersions;
+    size_t lazyRecords = 0;
+
+    // What the last drawFrame() showed, so the main loop can tell when there's no point drawing.
+    uint64_t drawnSceneVersion = UINT64_MAX;
+    uint64_t drawnCommandsVersion = UINT64_MAX;
+    bool redrawRequested = true;
+
+    // Changes waiting in the staging ring for some image to copy them.
+    struct PendingUpload {
+        StagingRing::Region *region;
+        VkDeviceSize destinationOffset;
+        uint64_t version;
+    };
+    std::deque<PendingUpload> pendingUploads;
+    StagingRing stagingRing;
+    VkDeviceSize stagingRingSize;
+    size_t stagingOverflows = 0;
+    // Changed shapes that didn't fit in the ring yet, [backlogFirst, backlogEnd) of the scene.
+    // drawFrame() stages what it can of them each frame, as frames finish and free up room.
+    uint32_t backlogFirst = 0;
+    uint32_t backlogEnd = 0;
+    // --animate: how many shapes to spin per frame, and where the rolling window is at.
+    uint32_t animateCount;
+    uint32_t animateCursor = 0;
+    std::vector<ShapeInstance> animateScratch;
+
+    // Command buffers + semaphores for streaming into one image's instance buffer. With a dedicated
+    // transfer queue that's a three step dance (see recordUploads), otherwise only `transfer` is used,
+    // on the graphics queue.
+    struct ImageUpload {
+        VkCommandBuffer release = VK_NULL_HANDLE;
+        VkCommandBuffer transfer = VK_NULL_HANDLE;
+        VkCommandBuffer acquire = VK_NULL_HANDLE;
+        VkSemaphore released = VK_NULL_HANDLE;
+        VkSemaphore transferred = VK_NULL_HANDLE;
+    };
+    std::vector<ImageUpload> imageUploads;
+    VkCommandPool uploadCommandPool = VK_NULL_HANDLE;
+    VkCommandPool transferCommandPool = VK_NULL_HANDLE;
+
+    // Every buffer and image gets its memory from here instead of its own vkAllocateMemory.
+    DeviceAllocator allocator;
+    // Objects frames in flight might still be using. Collected as their fences signal.
+    DeletionQueue deletions;
+
+    std::string pipelineCachePath;
+    PipelineCache pipelineCache;
+
+    // --device, --calibrate-devices and --device-cache. See deviceByName() and fastestDevice().
+    std::string deviceOverride;
+    bool calibrateDevices;
+    std::string deviceCachePath;
+
+    // "Frames in flight" - the CPU is allowed to get this many frames ahead of the GPU before
+    // drawFrame() blocks. Each frame slot gets its own semaphores and fence.
+    uint32_t framesInFlight;
+    size_t currentFrame = 0;
+    std::vector<VkSemaphore> imageAvailableSemaphores;
+    std::vector<VkSemaphore> renderFinishedSemaphores;
+    std::vector<VkFence> inFlightFences;
+    // Which frame's fence is currently using each swapchain image (VK_NULL_HANDLE if none).
+    // There can be more swapchain images than frames in flight, or they can come back out of order.
+    std::vector<VkFence> imagesInFlight;
+    // The DeletionQueue frame number each slot last submitted.
+    uint64_t slotFrames[MAX_FRAMES_IN_FLIGHT] = {};
+
+    // One timer slot per swapchain image, since that's what the command buffers are recorded per.
+    GpuTimer gpuTimer;
+    // Device features for counting fragments (see GpuTimer), if it has them. Without
+    // inheritedQueries, frames recorded into secondaries just don't get counted.
+    bool pipelineStatistics = false;
+    bool inheritedQueries = false;
+    // How many frames the rolling min/avg/p99 numbers cover.
+    size_t statsWindow;
+    RollingStats cpuFrameMs;
+
+    // --record-threads: 0 records each frame's draws inline into its primary command buffer.
+    // Otherwise the draws get split into batches of `drawBatchSize` shapes, and `recordWorkers`
+    // record those into secondary command buffers in parallel.
+    uint32_t recordThreads;
+    uint32_t drawBatchSize;
+    WorkerPool recordWorkers;
+    // Each worker gets its own command pool per swapchain image (command pools aren't thread
+    // safe, and per-image lets us reset one image's secondaries without touching the others).
+    struct RecordContext {
+        VkCommandPool pool = VK_NULL_HANDLE;
+        std::vector<VkCommandBuffer> buffers;
+        size_t used = 0;
+    };
+    std::vector<RecordContext> recordContexts; // [worker * swapchainImages.size() + image]
+    std::vector<std::vector<VkCommandBuffer>> secondaryBuffers; // [image][batch]
+    RollingStats recordMs;
+    RollingStats recreateMs;
+
+    // --profile: ProfileZones from every thread, gathered up at the start of each frame.
+    Profiler profiler;
+    // --trace: where cleanup() writes them all as a Chrome trace. Empty = nowhere.
+    std::string tracePath;
 
     optional<uint32_t> graphicsQueueFamily;
     optional<uint32_t> presentQueueFamily;
+    // A transfer-only family (DMA engine) if there is one, otherwise the graphics family.
+    optional<uint32_t> transferQueueFamily;
+    // What the surface can do on the device we picked, from when we scored it. Only the
+    // capabilities ever get re-queried (by createSwapchain()).
+    optional<SwapchainSupport> surfaceSupport;
 
-    std::array<const char*, 1> requiredExtensions = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+    bool dedicatedTransferQueue() { return transferQueueFamily != graphicsQueueFamily; }
 
-    size_t howGoodIsThisDevice(VkPhysicalDevice device) {
-        VkPhysicalDeviceProperties deviceProperties;
-        vkGetPhysicalDeviceProperties(device, &deviceProperties);
+    // local_size_x in cull.comp.
+    static const uint32_t CULL_GROUP_SIZE = 256;
+
+    std::array<const char*, 1> swapchainExtensions = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+
+    // We don't need any device extensions at all if we're not presenting.
+    std::vector<const char*> requiredExtensions() {
+        if (headless) return {};
+        return std::vector<const char*>(swapchainExtensions.begin(), swapchainExtensions.end());
+    }
+
+    // What howGoodIsThisDevice() found out about one device. Every device gets scored on its own
+    // thread, so whatever it has to say goes in `report` instead of straight to out.
+    struct DeviceScore {
+        size_t score = 0;
+        VkPhysicalDeviceProperties properties;
+        optional<uint32_t> graphicsQueueFamily;
+        optional<SwapchainSupport> surfaceSupport;
+        std::string report;
+    };
+
+    // --device: a number from the "device N/M" list, or a piece of the name ("nvidia", "llvmpipe").
+    // Has to be usable, because there's nothing to fall back to when somebody asked for it.
+    size_t deviceByName(const std::string &wanted, const std::vector<DeviceScore> &scores) {
+        char *end;
+        unsigned long number = strtoul(wanted.c_str(), &end, 10);
+        bool isNumber = !wanted.empty() && *end == '\0';
+
+        auto lower = [](std::string text) {
+            for (auto &c : text) c = tolower(static_cast<unsigned char>(c));
+            return text;
+        };
+        for (size_t i = 0; i < scores.size(); ++i) {
+            bool matches = isNumber ? number == i + 1
+                         : lower(scores[i].properties.deviceName).find(lower(wanted)) != std::string::npos;
+            if (!matches) continue;
+            if (scores[i].score == 0) die(log << "--device " << wanted << " is " << scores[i].properties.deviceName << ", which can't run this");
+            return i;
+        }
+        die(log << "--device " << wanted << " doesn't match any of the " << scores.size() << " devices");
+    }
+
+    // --calibrate-devices: whichever usable device gets through calibrateDevice()'s frames the
+    // quickest. Devices we've measured before (same driver) come out of the calibration cache.
+    size_t fastestDevice(const VkPhysicalDevice *devices, const std::vector<DeviceScore> &scores, const std::vector<size_t> &ranking) {
+        DeviceCalibrationCache cache;
+        if (!deviceCachePath.empty()) cache.load(deviceCachePath);
+
+        size_t fastest = ranking[0];
+        optional<double> fastestMs;
+        for (size_t i : ranking) {
+            auto &props = scores[i].properties;
+            auto ms = cache.lookup(props);
+            bool cached = ms.has_value();
+            if (!cached) {
+                ms = calibrateDevice(devices[i], scores[i].graphicsQueueFamily.value());
+                if (ms) cache.store(props, *ms);
+            }
+
+            std::cout << "device " << i+1 << " (" << props.deviceName << "): ";
+            if (!ms) {
+                std::cout << "calibration failed\n";
+                continue;
+            }
+            std::cout << *ms << " ms per calibration frame" << (cached ? " (cached)" : "") << '\n';
+            if (!fastestMs || *ms < *fastestMs) {
+                fastest = i;
+                fastestMs = ms;
+            }
+        }
+        cache.save();
+        return fastest;
+    }
+
+    DeviceScore howGoodIsThisDevice(VkPhysicalDevice device) {
+        DeviceScore result;
+        std::ostringstream out;
+        auto done = [&](size_t score) {
+            result.score = score;
+            result.report = out.str();
+            return result;
+        };
+        vkGetPhysicalDeviceProperties(device, &result.properties);
+        auto &deviceProperties = result.properties;
 
         // Make sure the device has the extensions we need
         uint32_t extensionCount;
@@ -164,55 +521,133 @@ class RenderState {
         unique_ptr<VkExtensionProperties[]> extensions(new VkExtensionProperties[extensionCount]);
         vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, extensions.get());
 
-        std::set<std::string> remainingExtensions(requiredExtensions.begin(), requiredExtensions.end());
+        auto required = requiredExtensions();
+        std::set<std::string> remainingExtensions(required.begin(), required.end());
         for (size_t i = 0; i < extensionCount; ++i) {
             auto erased = remainingExtensions.erase(extensions[i].extensionName);
             if (erased > 0)
-                std::cout << "\tsupports " << extensions[i].extensionName << "!\n";
+                out << "\tsupports " << extensions[i].extensionName << "!\n";
         }
         if (remainingExtensions.size() > 0) {
-            std::cout << "\tdoesn't support: ";
-            for (auto &ext : remainingExtensions) std::cout << ext << ' ';
-            std::cout << "- forget it.\n";
-            return 0;
+            out << "\tdoesn't support: ";
+            for (auto &ext : remainingExtensions) out << ext << ' ';
+            out << "- forget it.\n";
+            return done(0);
         }
-        std::cout << "\thas all the extensions we need. not bad\n";
+        out << "\thas all the extensions we need. not bad\n";
 
         // Make sure the swapchain is actually functional
-        SwapchainSupport swapchainSupport(device, surface);
-        if (swapchainSupport.formats.empty()) {
-            std::cout << "\tswap chain has no formats. forget it!\n";
-            return 0;
+        if (!headless) {
+            auto &swapchainSupport = result.surfaceSupport.emplace(device, surface);
+            if (swapchainSupport.formats.empty()) {
+                out << "\tswap chain has no formats. forget it!\n";
+                return done(0);
+            }
+            if (swapchainSupport.presentModes.empty()) {
+                out << "\tswap chain has no present modes. forget it!\n";
+                return done(0);
+            }
+            out << "\tswap chain looks good.\n";
         }
-        if (swapchainSupport.presentModes.empty()) {
-            std::cout << "\tswap chain has no present modes. forget it!\n";
-            return 0;
+
+        // No graphics queue, or nothing that can present to our window, and we can't use it at all.
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, queueFamilies.data());
+        bool canPresent = headless, transferQueue = false, computeQueue = false;
+        for (uint32_t i = 0; i < queueFamilyCount; ++i) {
+            auto flags = queueFamilies[i].queueFlags;
+            if ((flags & VK_QUEUE_GRAPHICS_BIT) && !result.graphicsQueueFamily) result.graphicsQueueFamily = i;
+            if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) transferQueue = true;
+            if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT)) computeQueue = true;
+            if (!canPresent) {
+                VkBool32 presentSupport;
+                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+                canPresent = presentSupport;
+            }
+        }
+        if (!result.graphicsQueueFamily) {
+            out << "\tno graphics queue. forget it!\n";
+            return done(0);
+        }
+        if (!canPresent) {
+            out << "\tcan't present to our window. forget it!\n";
+            return done(0);
         }
-        std::cout << "\tswap chain looks good.\n";
 
-        // From here on, we will try to estimate how powerful the card is.
+        // From here on, we will try to estimate how powerful the card is, going by what the
+        // driver says about it. (--calibrate-devices actually measures it instead.)
         // We'll start at 1 here 'cause 0 means unusable.
         size_t score = 1;
 
-        if (deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
+        switch (deviceProperties.deviceType) {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
             score += 1000;
-            std::cout << "\tdiscrete card. awesome";
+            out << "\tdiscrete card. awesome\n";
+            break;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+            score += 500;
+            out << "\tintegrated. shares memory with the CPU, but it's a real GPU\n";
+            break;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+            score += 250;
+            out << "\tvirtual GPU. somebody else's card, probably\n";
+            break;
+        case VK_PHYSICAL_DEVICE_TYPE_CPU:
+            // lavapipe, SwiftShader... They work, they're just a last resort.
+            out << "\trunning on the CPU. only if there's nothing else\n";
+            break;
+        default:
+            break;
+        }
+
+        // Memory: the biggest DEVICE_LOCAL heap, 10 points per 256 MiB, up to 8 GiB. (Software
+        // rasterizers call system RAM device local, but they're way behind after the type anyway.)
+        VkPhysicalDeviceMemoryProperties memoryProperties;
+        vkGetPhysicalDeviceMemoryProperties(device, &memoryProperties);
+        VkDeviceSize deviceLocal = 0;
+        for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; ++i) {
+            auto &heap = memoryProperties.memoryHeaps[i];
+            if (heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) deviceLocal = std::max(deviceLocal, heap.size);
+        }
+        score += std::min<VkDeviceSize>(deviceLocal >> 28, 32) * 10;
+        out << "\t" << (deviceLocal >> 20) << " MiB of device local memory\n";
+
+        // Limits: how big we can render, and whether GpuTimer will work at all.
+        auto &limits = deviceProperties.limits;
+        if (limits.maxImageDimension2D >= 16384) score += 50;
+        else if (limits.maxImageDimension2D >= 8192) score += 20;
+        if (limits.timestampComputeAndGraphics) score += 20;
+        out << "\tup to " << limits.maxImageDimension2D << " pixels across, "
+            << (limits.timestampComputeAndGraphics ? "has" : "no") << " timestamps\n";
+
+        // Extra queues that let uploads and compute run alongside drawing.
+        if (transferQueue) {
+            score += 50;
+            out << "\thas a transfer-only queue\n";
+        }
+        if (computeQueue) {
+            score += 20;
+            out << "\thas an async compute queue\n";
         }
 
-        return score;
+        return done(score);
     }
 
     void createSwapchain(GLFWwindow *window) {
         Logger log("createSwapchain");
-        SwapchainSupport support(physicalDevice, surface);
+        ProfileZone zone("createSwapchain");
+        // Formats and present modes are still whatever they were when we picked the device.
+        surfaceSupport->refreshCapabilities(physicalDevice, surface);
+        auto &support = *surfaceSupport;
 
         swapchainExtent = support.swapExtent(window);
-        swapchainSurfaceFormat = support.bestSurfaceFormat();
 
         VkSwapchainCreateInfoKHR createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
         createInfo.surface = surface;
-        createInfo.minImageCount = support.clampImageCount(support.capabilities.minImageCount + 1);
+        createInfo.minImageCount = support.imageCount(presentPacing);
         log << "minImageCount: " << createInfo.minImageCount << '\n';
 
         createInfo.imageFormat = swapchainSurfaceFormat.format;
@@ -220,6 +655,13 @@ class RenderState {
         createInfo.imageExtent = swapchainExtent;
         createInfo.imageArrayLayers = 1;
         createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+        if (!capturePath.empty()) {
+            // Nothing has to support copying out of swapchain images, but pretty much everything does.
+            if (!(support.capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT)) {
+                die(log << "can't --capture: this surface's images can't be copied from");
+            }
+            createInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        }
 
         if (graphicsQueueFamily != presentQueueFamily) {
             die(log << "2 separate queue families! not supported yet. see "
@@ -229,14 +671,20 @@ class RenderState {
 
         createInfo.preTransform = support.capabilities.currentTransform;
         createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-        createInfo.presentMode = support.bestPresentMode();
+        createInfo.presentMode = support.bestPresentMode(presentPacing);
+        presentMode = createInfo.presentMode;
+        log << "present mode: " << presentModeToString(presentMode) << '\n';
         createInfo.clipped = VK_TRUE;
 
-        // Oh boy!!!
-        createInfo.oldSwapchain = VK_NULL_HANDLE;
+        // Oh boy!!! Handing over the old one (if any) lets the driver reuse its stuff, and lets
+        // whatever it's still presenting finish up instead of getting yanked.
+        VkSwapchainKHR oldSwapchain = swapchain;
+        createInfo.oldSwapchain = oldSwapchain;
 
         auto result = vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapchain);
         if (result != VK_SUCCESS) die(log << "omg, failed to create swapchain. " << result);
+        // Frames in flight can still be rendering into its images.
+        deletions.defer<vkDestroySwapchainKHR>(device, oldSwapchain);
 
         // Swapchain is made! Last step: grab its images for later.
         log << "Swapchain created! Now fetching images:\n";
@@ -247,9 +695,527 @@ class RenderState {
         log << "Fetched " << imageCount << " swapchain images\n";
     }
 
+    // Blocking copy on the graphics queue. Fine for loading, not for every frame.
+    void copyBuffer(VkBuffer source, VkBuffer destination, VkDeviceSize size, VkDeviceSize destinationOffset = 0) {
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandPool = commandPool;
+        allocInfo.commandBufferCount = 1;
+
+        VkCommandBuffer commandBuffer;
+        vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+        VkBufferCopy region{};
+        region.dstOffset = destinationOffset;
+        region.size = size;
+        vkCmdCopyBuffer(commandBuffer, source, destination, 1, &region);
+        vkEndCommandBuffer(commandBuffer);
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commandBuffer;
+        vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+        vkQueueWaitIdle(graphicsQueue);
+
+        vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+    }
+
+    // Frames in flight can still be reading these, so they only get destroyed once those are done.
+    void destroyInstanceBuffers() {
+        for (size_t i = 0; i < instanceBuffers.size(); ++i) {
+            deletions.defer<vkDestroyBuffer>(device, instanceBuffers[i], instanceBufferMemory[i]);
+        }
+        instanceBuffers.clear();
+        instanceBufferMemory.clear();
+
+        for (size_t i = 0; i < visibleBuffers.size(); ++i) {
+            deletions.defer<vkDestroyBuffer>(device, visibleBuffers[i], visibleBufferMemory[i]);
+            deletions.defer<vkDestroyBuffer>(device, indirectBuffers[i], indirectBufferMemory[i]);
+        }
+        visibleBuffers.clear();
+        visibleBufferMemory.clear();
+        indirectBuffers.clear();
+        indirectBufferMemory.clear();
+        cullDescriptorSets.clear();
+    }
+
+    // Makes the compacted instance + indirect draw buffers cull.comp writes to, one set per image
+    // to go with instanceBuffers.
+    void createCullBuffers() {
+        Logger log("createCullBuffers");
+        size_t imageCount = instanceBuffers.size();
+        VkDeviceSize size = sizeof(ShapeInstance) * instanceCapacity;
+
+        visibleBuffers.resize(imageCount);
+        visibleBufferMemory.resize(imageCount);
+        indirectBuffers.resize(imageCount);
+        indirectBufferMemory.resize(imageCount);
+        for (size_t i = 0; i < imageCount; ++i) {
+            visibleBufferMemory[i] = allocator.createBuffer(
+                size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, visibleBuffers[i],
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+            );
+            indirectBufferMemory[i] = allocator.createBuffer(
+                sizeof(VkDrawIndirectCommand),
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                indirectBuffers[i],
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+            );
+        }
+
+        // Sets from last scene are pointing at buffers that are on their way out, but frames in
+        // flight might still be using them, so they get a pool of their own to die with.
+        // One set per image, 3 buffers each.
+        deletions.defer(std::move(cullDescriptorPool));
+        VkDescriptorPoolSize poolSize{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3 * (uint32_t)imageCount};
+        VkDescriptorPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.maxSets = imageCount;
+        poolInfo.poolSizeCount = 1;
+        poolInfo.pPoolSizes = &poolSize;
+        auto result = vkCreateDescriptorPool(device, &poolInfo, nullptr, cullDescriptorPool.replace(device));
+        if (result != VK_SUCCESS) die(log << "Failed to create culling descriptor pool " << result);
+
+        std::vector<VkDescriptorSetLayout> layouts(imageCount, cullSetLayout);
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = cullDescriptorPool;
+        allocInfo.descriptorSetCount = imageCount;
+        allocInfo.pSetLayouts = layouts.data();
+        cullDescriptorSets.resize(imageCount);
+        result = vkAllocateDescriptorSets(device, &allocInfo, cullDescriptorSets.data());
+        if (result != VK_SUCCESS) die(log << "Failed to allocate culling descriptor sets " << result);
+
+        for (size_t i = 0; i < imageCount; ++i) {
+            VkDescriptorBufferInfo buffers[3] = {
+                {instanceBuffers[i], 0, VK_WHOLE_SIZE},
+                {visibleBuffers[i], 0, VK_WHOLE_SIZE},
+                {indirectBuffers[i], 0, VK_WHOLE_SIZE},
+            };
+            VkWriteDescriptorSet writes[3]{};
+            for (uint32_t binding = 0; binding < 3; ++binding) {
+                writes[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                writes[binding].dstSet = cullDescriptorSets[i];
+                writes[binding].dstBinding = binding;
+                writes[binding].descriptorCount = 1;
+                writes[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                writes[binding].pBufferInfo = &buffers[binding];
+            }
+            vkUpdateDescriptorSets(device, 3, writes, 0, nullptr);
+        }
+    }
+
+    // Blocking upload of `size` bytes to `offset` in `destination`, through a throwaway staging buffer.
+    void uploadToBuffer(VkBuffer destination, VkDeviceSize offset, const void *data, VkDeviceSize size) {
+        VkBuffer stagingBuffer;
+        Allocation stagingMemory = allocator.createBuffer(
+            size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBuffer,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+        );
+        memcpy(stagingMemory.mapped, data, size);
+        allocator.flush(stagingMemory);
+
+        copyBuffer(stagingBuffer, destination, size, offset);
+
+        vkDestroyBuffer(device, stagingBuffer, nullptr);
+        allocator.free(stagingMemory);
+    }
+
+    // Gets whatever the mesh cache added since last time up to the GPU. Only the new meshes get
+    // copied, unless the buffers have to grow, and then everything goes into new ones.
+    void uploadMeshes() {
+        Logger log("uploadMeshes");
+        auto &vertices = meshes.vertices();
+        auto &indices = meshes.indices();
+        if (indices.empty()) return;
+
+        if (vertices.size() > meshVertexCapacity || indices.size() > meshIndexCapacity) {
+            deletions.defer<vkDestroyBuffer>(device, meshVertexBuffer, meshVertexMemory);
+            deletions.defer<vkDestroyBuffer>(device, meshIndexBuffer, meshIndexMemory);
+            // Double, so a few more meshes next time don't land us back here.
+            meshVertexCapacity = std::max(vertices.size(), 2 * meshVertexCapacity);
+            meshIndexCapacity = std::max(indices.size(), 2 * meshIndexCapacity);
+            meshVertexMemory = allocator.createBuffer(
+                sizeof(Point) * meshVertexCapacity, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                meshVertexBuffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+            );
+            meshIndexMemory = allocator.createBuffer(
+                sizeof(uint32_t) * meshIndexCapacity, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                meshIndexBuffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+            );
+            meshes.uploadedVertices = 0;
+            meshes.uploadedIndices = 0;
+        }
+
+        size_t newVertices = vertices.size() - meshes.uploadedVertices;
+        size_t newIndices = indices.size() - meshes.uploadedIndices;
+        if (newVertices > 0) {
+            uploadToBuffer(
+                meshVertexBuffer, sizeof(Point) * meshes.uploadedVertices,
+                &vertices[meshes.uploadedVertices], sizeof(Point) * newVertices
+            );
+        }
+        if (newIndices > 0) {
+            uploadToBuffer(
+                meshIndexBuffer, sizeof(uint32_t) * meshes.uploadedIndices,
+                &indices[meshes.uploadedIndices], sizeof(uint32_t) * newIndices
+            );
+        }
+        meshes.markUploaded();
+        log << "uploaded " << newVertices << " vertices and " << newIndices << " indices\n";
+    }
+
+    void destroyPolygonBuffers() {
+        deletions.defer<vkDestroyBuffer>(device, polygonInstanceBuffer, polygonInstanceMemory);
+        deletions.defer<vkDestroyBuffer>(device, meshVertexBuffer, meshVertexMemory);
+        deletions.defer<vkDestroyBuffer>(device, meshIndexBuffer, meshIndexMemory);
+        polygonInstanceBuffer = meshVertexBuffer = meshIndexBuffer = VK_NULL_HANDLE;
+        meshVertexCapacity = meshIndexCapacity = 0;
+        meshes.uploadedVertices = meshes.uploadedIndices = 0;
+    }
+
+    // Blocking upload of the whole CPU-side scene into every image's instance buffer.
+    void uploadWholeScene() {
+        Logger log("uploadWholeScene");
+        VkDeviceSize size = sizeof(ShapeInstance) * sceneSize();
+        if (size == 0) return;
+
+        VkBuffer stagingBuffer;
+        Allocation stagingMemory = allocator.createBuffer(
+            size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBuffer,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+        );
+        // For a scene file, this is the only time the CPU touches the shapes: straight from the
+        // page cache into staging memory.
+        {
+            ProfileZone copy("copy scene to staging");
+            memcpy(stagingMemory.mapped, sceneData(), size);
+        }
+        allocator.flush(stagingMemory);
+
+        for (auto buffer : instanceBuffers) copyBuffer(stagingBuffer, buffer, size);
+
+        vkDestroyBuffer(device, stagingBuffer, nullptr);
+        allocator.free(stagingMemory);
+
+        // Nothing in the ring matters anymore.
+        dropPendingUploads();
+        backlogFirst = backlogEnd = 0;
+        imageSceneVersions.assign(swapchainImages.size(), sceneVersion);
+        log << "uploaded " << sceneSize() << " shapes (" << size / 1024 << " KiB) x "
+            << instanceBuffers.size() << " images\n";
+    }
+
+    // Lets every region in the ring go as soon as the frames that did copy out of it are done.
+    void dropPendingUploads() {
+        for (auto &pending : pendingUploads) pending.region->users = 0;
+        pendingUploads.clear();
+    }
+
+    // Copies shapes [first, first + count) of sceneShapes into the staging ring, for each image to
+    // pick up as `version` the next time it comes around. Goes in pieces of at most a quarter of
+    // the ring, so one big change can't take all of it, or need more room than is free in one
+    // go. What doesn't fit goes on the backlog. Returns how many shapes made it.
+    uint32_t stageShapes(uint32_t first, uint32_t count, uint64_t version) {
+        uint32_t pieceShapes = std::max<VkDeviceSize>(stagingRing.capacity() / 4 / sizeof(ShapeInstance), 1);
+        uint32_t staged = 0;
+        while (staged < count) {
+            uint32_t pieceCount = std::min(pieceShapes, count - staged);
+            VkDeviceSize size = sizeof(ShapeInstance) * pieceCount;
+            auto region = stagingRing.allocate(size, sizeof(ShapeInstance), instanceBuffers.size());
+            if (!region) break;
+            memcpy(region->mapped, &sceneShapes[first + staged], size);
+            stagingRing.flush(*region);
+            pendingUploads.push_back({region, sizeof(ShapeInstance) * (first + staged), version});
+            staged += pieceCount;
+        }
+        if (staged < count) {
+            // One range for the whole backlog. Whatever's in between gets staged again, which
+            // costs a bit of room but is never wrong, since it all comes from sceneShapes.
+            uint32_t end = first + count;
+            first += staged;
+            if (backlogFirst != backlogEnd) {
+                first = std::min(first, backlogFirst);
+                end = std::max(end, backlogEnd);
+            }
+            backlogFirst = first;
+            backlogEnd = end;
+        }
+        return staged;
+    }
+
+    // Stages as much of the backlog as there's room for now. It goes in as a new scene version,
+    // so images that already caught up without it pick it up too.
+    void stageBacklog() {
+        if (backlogFirst == backlogEnd) return;
+        // The scene can have gotten smaller since (see setShapes()).
+        uint32_t first = backlogFirst;
+        uint32_t end = std::min<size_t>(backlogEnd, sceneShapes.size());
+        backlogFirst = backlogEnd = 0;
+        if (first < end && stageShapes(first, end - first, sceneVersion + 1) > 0) sceneVersion += 1;
+    }
+
+    void createUploadResources() {
+        Logger log("createUploadResources");
+        ProfileZone zone("createUploadResources");
+
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        poolInfo.queueFamilyIndex = graphicsQueueFamily.value();
+        auto result = vkCreateCommandPool(device, &poolInfo, nullptr, &uploadCommandPool);
+        if (result != VK_SUCCESS) die(log << "no upload command pool? " << result);
+
+        transferCommandPool = uploadCommandPool;
+        if (dedicatedTransferQueue()) {
+            poolInfo.queueFamilyIndex = transferQueueFamily.value();
+            result = vkCreateCommandPool(device, &poolInfo, nullptr, &transferCommandPool);
+            if (result != VK_SUCCESS) die(log << "no transfer command pool? " << result);
+        }
+
+        auto allocate = [&](VkCommandPool pool) {
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = pool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = 1;
+            VkCommandBuffer commandBuffer;
+            auto result = vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+            if (result != VK_SUCCESS) die(log << "Failed to allocate upload command buffer " << result);
+            return commandBuffer;
+        };
+
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+        imageUploads.resize(swapchainImages.size());
+        for (auto &upload : imageUploads) {
+            upload.transfer = allocate(transferCommandPool);
+            if (!dedicatedTransferQueue()) continue;
+
+            upload.release = allocate(uploadCommandPool);
+            upload.acquire = allocate(uploadCommandPool);
+            vkCreateSemaphore(device, &semaphoreInfo, nullptr, &upload.released);
+            vkCreateSemaphore(device, &semaphoreInfo, nullptr, &upload.transferred);
+        }
+
+        stagingRing.init(allocator, device, stagingRingSize);
+        log << "uploads go through " << (dedicatedTransferQueue() ? "the dedicated transfer queue" : "the graphics queue") << '\n';
+    }
+
+    void destroyUploadResources() {
+        for (auto &upload : imageUploads) {
+            if (upload.released != VK_NULL_HANDLE) vkDestroySemaphore(device, upload.released, nullptr);
+            if (upload.transferred != VK_NULL_HANDLE) vkDestroySemaphore(device, upload.transferred, nullptr);
+        }
+        imageUploads.clear();
+        if (transferCommandPool != uploadCommandPool) vkDestroyCommandPool(device, transferCommandPool, nullptr);
+        vkDestroyCommandPool(device, uploadCommandPool, nullptr);
+        stagingRing.destroy();
+        pendingUploads.clear();
+    }
+
+    void beginOneTimeCommands(VkCommandBuffer commandBuffer) {
+        vkResetCommandBuffer(commandBuffer, 0);
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    }
+
+    void bufferBarrier(
+        VkCommandBuffer commandBuffer, VkBuffer buffer,
+        VkPipelineStageFlags srcStage, VkAccessFlags srcAccess, uint32_t srcFamily,
+        VkPipelineStageFlags dstStage, VkAccessFlags dstAccess, uint32_t dstFamily
+    ) {
+        VkBufferMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = srcAccess;
+        barrier.dstAccessMask = dstAccess;
+        barrier.srcQueueFamilyIndex = srcFamily;
+        barrier.dstQueueFamilyIndex = dstFamily;
+        barrier.buffer = buffer;
+        barrier.offset = 0;
+        barrier.size = VK_WHOLE_SIZE;
+        vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+    }
+
+    // Copies whatever changes this image's instance buffer is missing out of the staging ring.
+    // Only call this once the image's last frame is done (so nothing is reading the buffer).
+    //
+    // Returns true if the frame has to wait for it: then with a dedicated transfer queue, the
+    // frame must wait on imageUploads[imageIndex].transferred and run .acquire first. Otherwise it
+    // just has to run .transfer first.
+    bool recordUploads(uint32_t imageIndex) {
+        ProfileZone zone("recordUploads");
+        if (imageSceneVersions[imageIndex] == sceneVersion || instanceBuffers.empty()) return false;
+
+        bool empty = imageSceneVersions[imageIndex] == 0;
+        auto &upload = imageUploads[imageIndex];
+        VkBuffer buffer = instanceBuffers[imageIndex];
+        uint32_t graphicsFamily = graphicsQueueFamily.value();
+        uint32_t transferFamily = transferQueueFamily.value();
+        bool dedicated = dedicatedTransferQueue();
+
+        // Newest first, and only the bytes nothing newer has already covered. Two changes to the
+        // same shapes can't both go in one vkCmdCopyBuffer (its regions mustn't overlap), and the
+        // newest one is what the buffer has to end up with anyway.
+        std::vector<VkBufferCopy> copies;
+        std::map<VkDeviceSize, VkDeviceSize> covered; // start -> end, none of them overlapping
+        for (auto pending = pendingUploads.rbegin(); pending != pendingUploads.rend(); ++pending) {
+            if (pending->version <= imageSceneVersions[imageIndex]) continue;
+
+            VkDeviceSize start = pending->destinationOffset;
+            VkDeviceSize end = start + pending->region->size;
+            auto copyPiece = [&](VkDeviceSize from, VkDeviceSize to) {
+                VkBufferCopy copy{};
+                copy.srcOffset = pending->region->offset + (from - start);
+                copy.dstOffset = from;
+                copy.size = to - from;
+                copies.push_back(copy);
+            };
+            // Copy the gaps between what's covered already, and merge this range in with it.
+            auto next = covered.upper_bound(start);
+            if (next != covered.begin() && std::prev(next)->second >= start) --next;
+            VkDeviceSize cursor = start, mergedStart = start, mergedEnd = end;
+            while (next != covered.end() && next->first <= end) {
+                if (next->first > cursor) copyPiece(cursor, next->first);
+                cursor = std::max(cursor, next->second);
+                mergedStart = std::min(mergedStart, next->first);
+                mergedEnd = std::max(mergedEnd, next->second);
+                next = covered.erase(next);
+            }
+            if (cursor < end) copyPiece(cursor, end);
+            covered[mergedStart] = mergedEnd;
+
+            // The ring region can go once every image has copied it and this frame is done.
+            pending->region->users -= 1;
+            pending->region->frame = deletions.recording();
+        }
+        imageSceneVersions[imageIndex] = sceneVersion;
+        while (!pendingUploads.empty() && pendingUploads.front().region->users == 0) pendingUploads.pop_front();
+
+        if (dedicated) {
+            // 1. graphics queue gives the buffer to the transfer queue family...
+            beginOneTimeCommands(upload.release);
+            bufferBarrier(
+                upload.release, buffer,
+                INSTANCE_READ_STAGES, INSTANCE_READ_ACCESS, graphicsFamily,
+                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, transferFamily
+            );
+            vkEndCommandBuffer(upload.release);
+
+            VkSubmitInfo releaseSubmit{};
+            releaseSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            releaseSubmit.commandBufferCount = 1;
+            releaseSubmit.pCommandBuffers = &upload.release;
+            releaseSubmit.signalSemaphoreCount = 1;
+            releaseSubmit.pSignalSemaphores = &upload.released;
+            vkQueueSubmit(graphicsQueue, 1, &releaseSubmit, VK_NULL_HANDLE);
+        }
+
+        // 2. ...which acquires it, copies, and gives it back...
+        beginOneTimeCommands(upload.transfer);
+        if (dedicated) {
+            bufferBarrier(
+                upload.transfer, buffer,
+                VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, graphicsFamily,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, transferFamily
+            );
+        }
+        if (empty) {
+            // Whatever part of the scene hasn't made it through the ring yet draws as nothing
+            // (zero width and height) instead of whatever the memory had in it.
+            vkCmdFillBuffer(upload.transfer, buffer, 0, VK_WHOLE_SIZE, 0);
+            bufferBarrier(
+                upload.transfer, buffer,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_QUEUE_FAMILY_IGNORED,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_QUEUE_FAMILY_IGNORED
+            );
+        }
+        if (!copies.empty()) vkCmdCopyBuffer(upload.transfer, stagingRing.buffer, buffer, copies.size(), copies.data());
+        if (dedicated) {
+            bufferBarrier(
+                upload.transfer, buffer,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, transferFamily,
+                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, graphicsFamily
+            );
+        }
+        else {
+            bufferBarrier(
+                upload.transfer, buffer,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_QUEUE_FAMILY_IGNORED,
+                INSTANCE_READ_STAGES, INSTANCE_READ_ACCESS, VK_QUEUE_FAMILY_IGNORED
+            );
+        }
+        vkEndCommandBuffer(upload.transfer);
+        if (!dedicated) return true;
+
+        VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        VkSubmitInfo transferSubmit{};
+        transferSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        transferSubmit.waitSemaphoreCount = 1;
+        transferSubmit.pWaitSemaphores = &upload.released;
+        transferSubmit.pWaitDstStageMask = &waitStage;
+        transferSubmit.commandBufferCount = 1;
+        transferSubmit.pCommandBuffers = &upload.transfer;
+        transferSubmit.signalSemaphoreCount = 1;
+        transferSubmit.pSignalSemaphores = &upload.transferred;
+        auto result = vkQueueSubmit(transferQueue, 1, &transferSubmit, VK_NULL_HANDLE);
+        if (result != VK_SUCCESS) die(log << "Failed to submit uploads to the transfer queue " << result);
+
+        // 3. ...and the graphics queue takes it back right before the frame reads it.
+        beginOneTimeCommands(upload.acquire);
+        bufferBarrier(
+            upload.acquire, buffer,
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, transferFamily,
+            INSTANCE_READ_STAGES, INSTANCE_READ_ACCESS, graphicsFamily
+        );
+        vkEndCommandBuffer(upload.acquire);
+        return true;
+    }
+
+    // The headless version of createSwapchain(). One image per frame in flight, so frame slot N
+    // always renders into image N and the frame fences are all the synchronization we need.
+    void createOffscreenTargets(VkExtent2D extent) {
+        Logger log("createOffscreenTargets");
+        ProfileZone zone("createOffscreenTargets");
+
+        swapchainExtent = extent;
+        swapchainImages.resize(framesInFlight);
+        offscreenImageMemory.resize(framesInFlight);
+
+        for (size_t i = 0; i < swapchainImages.size(); ++i) {
+            VkImageCreateInfo imageInfo{};
+            imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+            imageInfo.imageType = VK_IMAGE_TYPE_2D;
+            imageInfo.format = swapchainSurfaceFormat.format;
+            imageInfo.extent = { extent.width, extent.height, 1 };
+            imageInfo.mipLevels = 1;
+            imageInfo.arrayLayers = 1;
+            imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+            imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+            // TRANSFER_SRC so --capture can read frames back out
+            imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+            imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+            offscreenImageMemory[i] = allocator.createImage(imageInfo, swapchainImages[i], VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        }
+        log << "created " << swapchainImages.size() << " offscreen images, "
+            << extent.width << 'x' << extent.height << '\n';
+    }
+
     void createImageViews() {
         Logger log("createImageViews");
-        SwapchainSupport support(physicalDevice, surface);
+        ProfileZone zone("createImageViews");
         swapchainImageViews.resize(swapchainImages.size());
 
         log << "creating " << swapchainImages.size() << " imageViews\n";
@@ -258,7 +1224,7 @@ class RenderState {
             createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
             createInfo.image = swapchainImages[i];
             createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-            createInfo.format = support.bestSurfaceFormat().format;
+            createInfo.format = swapchainSurfaceFormat.format;
             createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
             createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
             createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
@@ -269,13 +1235,24 @@ class RenderState {
             createInfo.subresourceRange.baseArrayLayer = 0;
             createInfo.subresourceRange.layerCount = 1;
 
-            auto result = vkCreateImageView(device, &createInfo, nullptr, &swapchainImageViews[i]);
+            auto result = vkCreateImageView(device, &createInfo, nullptr, swapchainImageViews[i].replace(device));
             if (result != VK_SUCCESS) {
                 die(log << "Failed to create image view!!?? " << i << '/' << swapchainImages.size());
             }
         }
     }
 
+    // The first of these we can render depth into. D16 always works, but 32 bits keeps a million
+    // shapes at a million different depths apart.
+    VkFormat findDepthFormat() {
+        for (auto format : {VK_FORMAT_D32_SFLOAT, VK_FORMAT_X8_D24_UNORM_PACK32, VK_FORMAT_D16_UNORM}) {
+            VkFormatProperties properties;
+            vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &properties);
+            if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) return format;
+        }
+        return VK_FORMAT_D16_UNORM;
+    }
+
     VkShaderModule createShaderModule(const unsigned char *spirvCode, unsigned int len) {
         VkShaderModuleCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
@@ -289,227 +1266,331 @@ class RenderState {
         return shaderModule;
     }
 
-    void createRenderPass() {
-        Logger log("createRenderPass");
-
-        log << "creating color attachment\n";
-        // I guess this routes the output of the fragment shader?
-        VkAttachmentDescription colorAttachment{};
-        colorAttachment.format = swapchainSurfaceFormat.format;
-        colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-        colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-        colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-        colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-
-        VkAttachmentReference colorAttachmentRef{};
-        colorAttachmentRef.attachment = 0;
-        colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-
-        VkSubpassDescription subpass{};
-        subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-        subpass.colorAttachmentCount = 1;
-        subpass.pColorAttachments = &colorAttachmentRef;
-
-        log << "setting up subpass dependency\n";
-        VkSubpassDependency dependency{};
-        dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-        dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        dependency.srcAccessMask = 0;
-        dependency.dstSubpass = 0;
-        dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-
-        log << "creating render pass\n";
-        VkRenderPassCreateInfo renderPassInfo{};
-        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-        renderPassInfo.attachmentCount = 1;
-        renderPassInfo.pAttachments = &colorAttachment;
-        renderPassInfo.subpassCount = 1;
-        renderPassInfo.pSubpasses = &subpass;
-        renderPassInfo.dependencyCount = 1;
-        renderPassInfo.pDependencies = &dependency;
-
-        auto result = vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass);
-        if (result != VK_SUCCESS) die(log << "Failed to create render pass!!" << result);
-    }
-
-    void createGraphicsPipeline() {
-        Logger log("createGraphicsPipeline");
-#include "triangle.vert.h"
-#include "triangle.frag.h"
-
-        log << "creating basic triangle vertex shader module\n";
-        HandleWrapper<VkShaderModule> vertModule(
-            createShaderModule(triangle_vert_spv, triangle_vert_spv_len),
-            [this](VkShaderModule mod) { vkDestroyShaderModule(device, mod, nullptr); }
-        );
-        log << "creating basic triangle fragment shader module\n";
-        HandleWrapper<VkShaderModule> fragModule(
-            createShaderModule(triangle_frag_spv, triangle_frag_spv_len),
-            [this](VkShaderModule mod) { vkDestroyShaderModule(device, mod, nullptr); }
+    // Everything a frame does: with --gpu-cull, reset the indirect draw and run cull.comp over the
+    // opaque shapes, then draw them all in the "shapes" render pass. The graph works out the
+    // render pass, the barriers in between and the depth buffer from that.
+    //
+    // Culling only happens when there are opaque shapes to cull. Without them the shapes pass
+    // doesn't read what the cull passes write, and the graph drops them. Either way every command
+    // buffer has to be recorded again, against the new render pass.
+    void buildFrameGraph() {
+        Logger log("buildFrameGraph");
+        ProfileZone zone("buildFrameGraph");
+        // Frames in flight keep the old render pass, framebuffers and depth buffer until they're done.
+        frameGraph.clear(deletions);
+        frameGraphCulls = gpuCull && opaqueCount > 0;
+
+        std::vector<VkImageView> views(swapchainImageViews.begin(), swapchainImageViews.end());
+        bool capturing = !capturePath.empty();
+        auto target = frameGraph.importImage(
+            "swapchain image", swapchainSurfaceFormat.format, VK_IMAGE_ASPECT_COLOR_BIT, swapchainImages, views,
+            // Nobody presents offscreen images, so leave them ready to be copied out instead. Same
+            // for --capture, whose command buffer gets them ready to present after it's copied.
+            headless || capturing ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+            // Where drawFrame() waits for the image to be acquired.
+            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
         );
+        if (capturing) frameGraph.output(target, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+        else frameGraph.output(target);
+
+        RenderGraph::Resource indirect = RenderGraph::NONE;
+        RenderGraph::Resource visible = RenderGraph::NONE;
+        if (gpuCull) {
+            indirect = frameGraph.importBuffer("indirect draw");
+            visible = frameGraph.importBuffer("visible shapes");
+
+            auto reset = frameGraph.addPass("cull reset", RenderGraph::PASS_TRANSFER, [this](VkCommandBuffer commandBuffer, uint32_t image) {
+                VkDrawIndirectCommand draw{VERTICES_PER_SHAPE, 0, 0, 0};
+                vkCmdUpdateBuffer(commandBuffer, indirectBuffers[image], 0, sizeof(draw), &draw);
+            });
+            frameGraph.use(reset, indirect, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+            auto cull = frameGraph.addPass("cull", RenderGraph::PASS_COMPUTE, [this](VkCommandBuffer commandBuffer, uint32_t image) {
+                recordCull(commandBuffer, image);
+            });
+            frameGraph.use(cull, indirect, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+            frameGraph.use(cull, visible, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+            // The CPU reads the visible count back for the stats.
+            if (frameGraphCulls) frameGraph.output(indirect, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+        }
 
-        VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
-        vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-        vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-        vertShaderStageInfo.module = vertModule;
-        vertShaderStageInfo.pName = "main";
-        // TODO: for the future, there is a pSpecializationInfo field for passing constants.
-
-        VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
-        fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-        fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-        fragShaderStageInfo.module = fragModule;
-        fragShaderStageInfo.pName = "main";
-
-        log << "setting up vertex input\n";
-        VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
-        vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-        vertexInputInfo.vertexBindingDescriptionCount = 0;
-        vertexInputInfo.pVertexBindingDescriptions = nullptr; // Optional
-        vertexInputInfo.vertexAttributeDescriptionCount = 0;
-        vertexInputInfo.pVertexAttributeDescriptions = nullptr; // Optional
-
-        log << "setting up \"input assembly\"\n";
-        VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
-        inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-        inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-        inputAssembly.primitiveRestartEnable = VK_FALSE;
-
-        log << "setting up viewport and scissor\n";
-        VkViewport viewport{};
-        viewport.x = 0.0f;
-        viewport.y = 0.0f;
-        viewport.width = (float)swapchainExtent.width;
-        viewport.height = (float)swapchainExtent.height;
-        viewport.minDepth = 0.0f;
-        viewport.maxDepth = 1.0f;
+        shapesPass = frameGraph.addPass("shapes", RenderGraph::PASS_GRAPHICS, [this](VkCommandBuffer commandBuffer, uint32_t image) {
+            recordShapesPass(commandBuffer, image);
+        });
+        frameGraph.colorAttachment(shapesPass, target, VK_ATTACHMENT_LOAD_OP_CLEAR, {{0.0f, 0.0f, 0.0f, 1.0f}});
+        if (depthFormat != VK_FORMAT_UNDEFINED) {
+            // Cleared at the start and never stored, so the graph makes it a TRANSIENT attachment in
+            // lazily allocated memory where there is any: a tiler keeps it on chip and never backs
+            // it with real memory. Every image shares it.
+            auto depth = frameGraph.createImage("depth", depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
+            frameGraph.depthAttachment(shapesPass, depth, VK_ATTACHMENT_LOAD_OP_CLEAR);
+        }
+        if (frameGraphCulls) {
+            frameGraph.use(shapesPass, indirect, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+            frameGraph.use(shapesPass, visible, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+        }
 
-        VkRect2D scissor{};
-        scissor.offset = {0, 0};
-        scissor.extent = swapchainExtent;
+        frameGraph.compile(device, allocator, swapchainExtent, swapchainImages.size());
+        if (dumpGraph) frameGraph.dump("Render graph");
+        commandsVersion += 1;
+    }
 
-        VkPipelineViewportStateCreateInfo viewportState{};
-        viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-        viewportState.viewportCount = 1;
-        viewportState.pViewports = &viewport;
-        viewportState.scissorCount = 1;
-        viewportState.pScissors = &scissor;
-
-        log << "setting up rasterizer\n";
-        VkPipelineRasterizationStateCreateInfo rasterizer{};
-        rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-        rasterizer.depthClampEnable = VK_FALSE;
-        rasterizer.rasterizerDiscardEnable = VK_FALSE;
-        rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
-        rasterizer.lineWidth = 1.0f;
-        rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-        rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
-        rasterizer.depthBiasEnable = VK_FALSE;
-        rasterizer.depthBiasConstantFactor = 0.0f; // Optional
-        rasterizer.depthBiasClamp = 0.0f; // Optional
-        rasterizer.depthBiasSlopeFactor = 0.0f; // Optional
-
-        log << "setting up multisample (useless for this)\n";
-        VkPipelineMultisampleStateCreateInfo multisampling{};
-        multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-        multisampling.sampleShadingEnable = VK_FALSE;
-        multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-        multisampling.minSampleShading = 1.0f; // Optional
-        multisampling.pSampleMask = nullptr; // Optional
-        multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
-        multisampling.alphaToOneEnable = VK_FALSE; // Optional
-
-        log << "setting up color blending\n";
-        VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-        colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-        colorBlendAttachment.blendEnable = VK_FALSE; // TODO: false! maybe we want alpha blending at some point though
-        colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-        colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
-        colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD; // Optional
-        colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-        colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
-        colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD; // Optional
-
-        VkPipelineColorBlendStateCreateInfo colorBlending{};
-        colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-        colorBlending.logicOpEnable = VK_FALSE;
-        colorBlending.logicOp = VK_LOGIC_OP_COPY; // Optional
-        colorBlending.attachmentCount = 1;
-        colorBlending.pAttachments = &colorBlendAttachment;
-        colorBlending.blendConstants[0] = 0.0f; // Optional
-        colorBlending.blendConstants[1] = 0.0f; // Optional
-        colorBlending.blendConstants[2] = 0.0f; // Optional
-        colorBlending.blendConstants[3] = 0.0f; // Optional
+    // Gets the pipeline layout and the PipelineLibrary going, and queues up the generic pipeline
+    // (and every variant, with precompilePipelines). Only needs the device and the surface format,
+    // so initVulkan() calls it before the swapchain exists, and the compile threads build the
+    // pipelines while the main thread does everything else. finishGraphicsPipeline() collects it.
+    void startGraphicsPipeline() {
+        Logger log("startGraphicsPipeline");
+        ProfileZone zone("startGraphicsPipeline");
+#include "triangle.vert.h"
+#include "triangle.frag.h"
+#include "mesh.vert.h"
+
+        // No descriptors, everything comes in as instance attributes. Just the framebuffer size
+        // as a push constant, for SDF shapes to work in pixels.
+        VkPushConstantRange pushConstants{};
+        pushConstants.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+        pushConstants.size = sizeof(float) * 2;
 
         VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
         pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-        pipelineLayoutInfo.setLayoutCount = 0; // Optional
-        pipelineLayoutInfo.pSetLayouts = nullptr; // Optional
-        pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-        pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstants;
 
         auto result = vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout);
         if (result != VK_SUCCESS) die(log << "Couldn't create pipeline wtf! " << result);
 
-        VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo, fragShaderStageInfo};
-
-        log << "building the actual pipeline\n";
-        VkGraphicsPipelineCreateInfo pipelineInfo{};
-        pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-        pipelineInfo.stageCount = 2;
-        pipelineInfo.pStages = shaderStages;
-        pipelineInfo.pVertexInputState = &vertexInputInfo;
-        pipelineInfo.pInputAssemblyState = &inputAssembly;
-        pipelineInfo.pViewportState = &viewportState;
-        pipelineInfo.pRasterizationState = &rasterizer;
-        pipelineInfo.pMultisampleState = &multisampling;
-        pipelineInfo.pDepthStencilState = nullptr; // Optional
-        pipelineInfo.pColorBlendState = &colorBlending;
-        pipelineInfo.pDynamicState = nullptr; // Optional
-        pipelineInfo.layout = pipelineLayout;
-        pipelineInfo.renderPass = renderPass;
-        pipelineInfo.subpass = 0; // <- index of the subpass that uses this pipeline
-        // Optional - the following 2 attribuges are for copying from another pipeline
-        pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
-        pipelineInfo.basePipelineIndex = -1; // Optional
-
-        result = vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline);
-        if (result != VK_SUCCESS) die(log << "Failed to create graphics pipeline!! " << result);
-    }
-
-    void createFramebuffers() {
-        Logger log("createFramebuffers");
-        swapchainFramebuffers.resize(swapchainImageViews.size());
-
-        for (size_t i = 0; i < swapchainImageViews.size(); i++) {
-            log << "framebuffer " << i+1 << '/' << swapchainImageViews.size() << '\n';
-            VkImageView attachments[] = { swapchainImageViews[i] };
-
-            VkFramebufferCreateInfo framebufferInfo{};
-            framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-            framebufferInfo.renderPass = renderPass;
-            framebufferInfo.attachmentCount = 1;
-            framebufferInfo.pAttachments = attachments;
-            framebufferInfo.width = swapchainExtent.width;
-            framebufferInfo.height = swapchainExtent.height;
-            framebufferInfo.layers = 1;
-
-            auto result = vkCreateFramebuffer(device, &framebufferInfo, nullptr, &swapchainFramebuffers[i]);
-            if (result != VK_SUCCESS) die(log << "Auuughghghghghgh " << result);
+        // The fixed-function setup for every variant lives in pipelines.cpp.
+        // Wake the main loop up if it's idling in glfwWaitEvents(), so it can swap the variant in.
+        if (!headless) pipelines.onReady = [] { glfwPostEmptyEvent(); };
+        pipelines.init(
+            device, pipelineCache, pipelineLayout, depthFormat,
+            triangle_vert_spv, triangle_vert_spv_len, triangle_frag_spv, triangle_frag_spv_len,
+            mesh_vert_spv, mesh_vert_spv_len,
+            pipelineThreads
+        );
+
+        // The generic ones go in first: the compile threads take them in order. Meshes have no
+        // fallback, so theirs is next.
+        if (mayHaveOpaque()) pipelines.request(genericVariant(opaqueBlend()));
+        if (mayHaveTranslucent()) pipelines.request(genericVariant(translucentBlend()));
+        if (drawPolygons) pipelines.request(meshVariant());
+        if (precompilePipelines) requestAllVariants();
+    }
+
+    // The generic ones can draw anything, so they're what we fall back on while the specialized
+    // variants compile. That makes them the only ones worth waiting for. Returns how long we waited.
+    double finishGraphicsPipeline() {
+        ProfileZone zone("finishGraphicsPipeline");
+        auto start = Clock::now();
+        if (mayHaveOpaque()) pipelines.getBlocking(genericVariant(opaqueBlend()));
+        if (mayHaveTranslucent()) pipelines.getBlocking(genericVariant(translucentBlend()));
+        return millisecondsSince(start);
+    }
+
+    // Which shapes sortForDrawing() puts in the translucent part of the scene: the ones that
+    // need blending with what's behind them.
+    Translucency translucency() const {
+        if (shapeRendering == RENDER_SDF) return TRANSLUCENT_ALL;
+        return blendMode == BLEND_ALPHA ? TRANSLUCENT_BY_ALPHA : TRANSLUCENT_NONE;
+    }
+    bool mayHaveOpaque() const { return !useDepth || translucency() != TRANSLUCENT_ALL; }
+    bool mayHaveTranslucent() const { return useDepth && translucency() != TRANSLUCENT_NONE; }
+
+    // Opaque shapes don't need to blend, and writing depth is the whole point of them. Without a
+    // depth buffer everything is "opaque", and gets drawn the way the blend mode says.
+    BlendMode opaqueBlend() const { return useDepth ? BLEND_OPAQUE : blendMode; }
+    // SDF shapes blend either way. Whether alpha means anything to them is up to the blend mode.
+    BlendMode translucentBlend() const { return shapeRendering == RENDER_SDF ? blendMode : BLEND_ALPHA; }
+
+    // Draws any shape with `blend`. The ones we use are always ready after finishGraphicsPipeline().
+    PipelineVariant genericVariant(BlendMode blend) {
+        return {SHAPE_ANY, blend, swapchainSurfaceFormat.format, shapeRendering};
+    }
+
+    // The best fit for what's on screen right now.
+    PipelineVariant sceneVariant(BlendMode blend) {
+        return {variantShape(sceneShape), blend, swapchainSurfaceFormat.format, shapeRendering};
+    }
+
+    // Whether shapePipeline() would come back with the real thing for each part of the scene.
+    bool scenePipelinesReady() {
+        if (opaqueCount > 0 && pipelines.get(sceneVariant(opaqueBlend())) == VK_NULL_HANDLE) return false;
+        if (instanceCount > opaqueCount && pipelines.get(sceneVariant(translucentBlend())) == VK_NULL_HANDLE) return false;
+        return true;
+    }
+
+    // Kicks off every variant we could want for the current color format, so they're (probably)
+    // done by the time the scene asks for one.
+    void requestAllVariants() {
+        for (auto blend : {BLEND_OPAQUE, BLEND_ALPHA}) {
+            pipelines.request({SHAPE_ANY, blend, swapchainSurfaceFormat.format, shapeRendering});
+            for (uint32_t shape = 0; shape < SHAPE_TYPE_COUNT; ++shape) {
+                // Circles and friends would only compile to the rectangle pipeline again.
+                if (variantShape(shape) != shape) continue;
+                pipelines.request({shape, blend, swapchainSurfaceFormat.format, shapeRendering});
+            }
+        }
+    }
+
+    // Which specialized pipeline draws `shape`. Without SDFs, the shapes that only exist with
+    // them are rectangles, so they share its pipeline instead of getting an identical one.
+    uint32_t variantShape(uint32_t shape) const {
+        if (!analyticShapes() && shape >= SHAPE_CIRCLE && shape < SHAPE_TYPE_COUNT) return SHAPE_RECTANGLE;
+        return shape;
+    }
+
+    // The pipeline to record the shapes with. Falls back to the generic one (and notes that it
+    // did, so drawFrame() re-records once the real one is ready) if the variant isn't compiled yet.
+    VkPipeline shapePipeline(BlendMode blend) {
+        // No threads to compile it in the background, so there's nothing to wait for but us.
+        if (pipelineThreads == 0) return pipelines.getBlocking(sceneVariant(blend));
+        VkPipeline pipeline = pipelines.get(sceneVariant(blend));
+        if (pipeline != VK_NULL_HANDLE) return pipeline;
+        fallbackPipelineRecords += 1;
+        waitingOnPipeline = true;
+        return pipelines.getBlocking(genericVariant(blend));
+    }
+
+    // The polygons are all opaque, so with a depth buffer they're drawn like opaque shapes.
+    PipelineVariant meshVariant() {
+        return {SHAPE_ANY, opaqueBlend(), swapchainSurfaceFormat.format, RENDER_MESHES};
+    }
+
+    // shapePipeline() for the polygons. There's nothing to fall back on for these, so until it's
+    // compiled they just don't get drawn (and drawFrame() re-records once it's there).
+    VkPipeline meshPipeline() {
+        if (meshDraws.empty() || meshIndexBuffer == VK_NULL_HANDLE) return VK_NULL_HANDLE;
+        if (pipelineThreads == 0) return pipelines.getBlocking(meshVariant());
+        VkPipeline pipeline = pipelines.get(meshVariant());
+        if (pipeline == VK_NULL_HANDLE) waitingOnPipeline = true;
+        return pipeline;
+    }
+
+    // Every polygon, one instanced draw per mesh. Expects the viewport and push constants to be
+    // set already: they carry over, since it's the same layout.
+    void recordMeshDraws(VkCommandBuffer commandBuffer, VkPipeline pipeline) {
+        if (pipeline == VK_NULL_HANDLE) return;
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        VkBuffer buffers[] = {polygonInstanceBuffer, meshVertexBuffer};
+        VkDeviceSize offsets[] = {0, 0};
+        vkCmdBindVertexBuffers(commandBuffer, 0, 2, buffers, offsets);
+        vkCmdBindIndexBuffer(commandBuffer, meshIndexBuffer, 0, VK_INDEX_TYPE_UINT32);
+        for (auto &draw : meshDraws) {
+            auto &mesh = meshes.mesh(draw.mesh);
+            vkCmdDrawIndexed(commandBuffer, mesh.indexCount, draw.instanceCount, mesh.firstIndex, 0, draw.firstInstance);
         }
     }
 
+    // What sceneShape should be for `shapes`: their ShapeType if they all have the same one.
+    // Types we don't know draw as rectangles, so they count as one.
+    static uint32_t uniformShape(const ShapeInstance *shapes, size_t count) {
+        auto typeOf = [](const ShapeInstance &instance) {
+            uint32_t type = instance.shape & 0xFF;
+            return type < SHAPE_TYPE_COUNT ? type : uint32_t(SHAPE_RECTANGLE);
+        };
+        if (count == 0) return SHAPE_ANY;
+        uint32_t shape = typeOf(shapes[0]);
+        for (size_t i = 1; i < count; ++i) {
+            if (typeOf(shapes[i]) != shape) return SHAPE_ANY;
+        }
+        return shape;
+    }
+
+    void setSceneShape(uint32_t shape) {
+        if (shape == sceneShape) return;
+        sceneShape = shape;
+        // The variant bakes the shape in, so every command buffer has to switch pipelines.
+        commandsVersion += 1;
+    }
+
+    void createCullPipeline() {
+        Logger log("createCullPipeline");
+        ProfileZone zone("createCullPipeline");
+#include "cull.comp.h"
+
+        VkDescriptorSetLayoutBinding bindings[3]{};
+        for (uint32_t i = 0; i < 3; ++i) {
+            bindings[i].binding = i;
+            bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            bindings[i].descriptorCount = 1;
+            bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        }
+        VkDescriptorSetLayoutCreateInfo layoutInfo{};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = 3;
+        layoutInfo.pBindings = bindings;
+        auto result = vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &cullSetLayout);
+        if (result != VK_SUCCESS) die(log << "Failed to create culling descriptor set layout " << result);
+
+        VkPushConstantRange pushConstants{};
+        pushConstants.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        pushConstants.size = sizeof(CullPushConstants);
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &cullSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstants;
+        result = vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &cullPipelineLayout);
+        if (result != VK_SUCCESS) die(log << "Failed to create culling pipeline layout " << result);
+
+        log << "creating culling compute shader module\n";
+        ShaderModule cullModule(device, createShaderModule(cull_comp_spv, cull_comp_spv_len));
+
+        VkComputePipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipelineInfo.stage.module = cullModule;
+        pipelineInfo.stage.pName = "main";
+        pipelineInfo.layout = cullPipelineLayout;
+
+        result = vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &cullPipeline);
+        if (result != VK_SUCCESS) die(log << "Failed to create culling pipeline!! " << result);
+    }
+
+    void destroyCullPipeline() {
+        if (cullPipeline == VK_NULL_HANDLE) return;
+        vkDestroyPipeline(device, cullPipeline, nullptr);
+        vkDestroyPipelineLayout(device, cullPipelineLayout, nullptr);
+        cullDescriptorPool.reset();
+        vkDestroyDescriptorSetLayout(device, cullSetLayout, nullptr);
+        cullPipeline = VK_NULL_HANDLE;
+    }
+
+    // Has to match the push_constant block in cull.comp.
+    struct CullPushConstants {
+        uint32_t shapeCount;
+        float minPixels;
+        float halfExtent[2];
+    };
+
+    // The "cull" pass: runs cull.comp over every opaque shape. The translucent ones are left
+    // alone, since the packing would lose their back to front order. The graph puts the barriers
+    // around it (after "cull reset", before the indirect draw and the CPU reading the count).
+    void recordCull(VkCommandBuffer commandBuffer, size_t image) {
+        CullPushConstants push{
+            opaqueCount, cullMinPixels, {swapchainExtent.width / 2.0f, swapchainExtent.height / 2.0f}
+        };
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+        vkCmdBindDescriptorSets(
+            commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1, &cullDescriptorSets[image], 0, nullptr
+        );
+        vkCmdPushConstants(commandBuffer, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push), &push);
+        vkCmdDispatch(commandBuffer, (opaqueCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+    }
+
     void createCommandPool() {
         Logger log("createCommandPool");
+        ProfileZone zone("createCommandPool");
 
         VkCommandPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
         poolInfo.queueFamilyIndex = graphicsQueueFamily.value();
-        poolInfo.flags = 0; // Optional
+        // So recordCommandBuffers() can just re-record them in place.
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 
         auto result = vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool);
         if (result != VK_SUCCESS) die(log << "wheres my command pool? " << result);
@@ -517,10 +1598,163 @@ class RenderState {
         log << "created command pool\n";
     }
 
+    void createRecordContexts() {
+        Logger log("createRecordContexts");
+        ProfileZone zone("createRecordContexts");
+        if (recordThreads == 0) return;
+
+        recordWorkers.start(recordThreads);
+        recordContexts.resize(recordThreads * swapchainImages.size());
+
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.queueFamilyIndex = graphicsQueueFamily.value();
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+        for (auto &context : recordContexts) {
+            auto result = vkCreateCommandPool(device, &poolInfo, nullptr, &context.pool);
+            if (result != VK_SUCCESS) die(log << "no command pool for a recording thread? " << result);
+        }
+        log << recordThreads << " recording threads, " << drawBatchSize << " shapes per secondary command buffer\n";
+    }
+
+    void destroyRecordContexts() {
+        for (auto &context : recordContexts) vkDestroyCommandPool(device, context.pool, nullptr);
+        recordContexts.clear();
+        secondaryBuffers.clear();
+        recordWorkers.stop();
+    }
+
+    // What the scene gets drawn with, picked once per recording. Null for anything there's
+    // nothing of (or, for the polygons, that isn't compiled yet).
+    struct DrawPipelines {
+        VkPipeline opaque = VK_NULL_HANDLE;
+        VkPipeline translucent = VK_NULL_HANDLE;
+        VkPipeline polygons = VK_NULL_HANDLE;
+    };
+
+    DrawPipelines drawPipelines() {
+        DrawPipelines draw;
+        if (opaqueCount > 0) draw.opaque = shapePipeline(opaqueBlend());
+        if (instanceCount > opaqueCount) draw.translucent = shapePipeline(translucentBlend());
+        draw.polygons = meshPipeline();
+        return draw;
+    }
+    // The ones for the command buffer being recorded right now, for recordShapesPass().
+    DrawPipelines drawnWith;
+
+    // Draws shapes [first, end) of the scene: whichever of them are opaque, then the polygons if
+    // this is where the opaque ones end, then whichever are translucent. Expects the viewport and
+    // push constants to be set already. `primary` is for when this is the whole scene, inline in
+    // the image's own command buffer: that's where the GPU timer zones go, and where the opaque
+    // shapes come out of cull.comp with --gpu-cull.
+    void recordShapeDraws(VkCommandBuffer commandBuffer, size_t image, uint32_t first, uint32_t end, const DrawPipelines &draw, bool primary) {
+        auto beginZone = [&](const char *name) { return primary ? gpuTimer.begin(commandBuffer, image, name) : 0; };
+        auto endZone = [&](uint32_t zone) {
+            if (primary) gpuTimer.end(commandBuffer, image, zone);
+        };
+        VkDeviceSize offset = 0;
+        uint32_t split = std::clamp(opaqueCount, first, end);
+
+        if (first < split) {
+            auto zone = beginZone("draw: opaque");
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, draw.opaque);
+            if (primary && gpuCull) {
+                // However many shapes cull.comp kept, in one go.
+                vkCmdBindVertexBuffers(commandBuffer, 0, 1, &visibleBuffers[image], &offset);
+                vkCmdDrawIndirect(commandBuffer, indirectBuffers[image], 0, 1, sizeof(VkDrawIndirectCommand));
+            }
+            else {
+                vkCmdBindVertexBuffers(commandBuffer, 0, 1, &instanceBuffers[image], &offset);
+                vkCmdDraw(commandBuffer, VERTICES_PER_SHAPE, split - first, 0, first);
+            }
+            endZone(zone);
+        }
+        // Exactly one range has the end of the opaque shapes in it, even if that's the very end.
+        if (draw.polygons != VK_NULL_HANDLE && first <= opaqueCount && (opaqueCount < end || end == instanceCount)) {
+            auto zone = beginZone("draw: polygons");
+            recordMeshDraws(commandBuffer, draw.polygons);
+            endZone(zone);
+        }
+        if (split < end) {
+            // Last, so they blend over everything that's behind them. Never culled: cull.comp
+            // would scramble the back to front order they need.
+            auto zone = beginZone("draw: translucent");
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, draw.translucent);
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1, &instanceBuffers[image], &offset);
+            vkCmdDraw(commandBuffer, VERTICES_PER_SHAPE, end - split, 0, split);
+            endZone(zone);
+        }
+    }
+
+    // Records the draws for one image into secondary command buffers, one per batch, spread across
+    // recordWorkers. Only call this when that image's command buffer isn't in flight.
+    // Whichever batch has the end of the opaque shapes in it draws the polygons too.
+    void recordSecondaryCommandBuffers(size_t image, const DrawPipelines &draw, bool countFragments) {
+        size_t imageCount = swapchainImages.size();
+        size_t batchCount = (instanceCount + drawBatchSize - 1) / drawBatchSize;
+
+        // Throw out last time's secondaries for this image. Resetting the pool keeps the buffers
+        // allocated, so we can hand them right back out.
+        for (uint32_t worker = 0; worker < recordWorkers.size(); ++worker) {
+            auto &context = recordContexts[worker * imageCount + image];
+            if (context.used == 0) continue;
+            vkResetCommandPool(device, context.pool, 0);
+            context.used = 0;
+        }
+        secondaryBuffers.resize(imageCount);
+        secondaryBuffers[image].assign(batchCount, VK_NULL_HANDLE);
+
+        recordWorkers.run(batchCount, [&](size_t batch, uint32_t worker) {
+            ProfileZone zone("record draw batch");
+            auto &context = recordContexts[worker * imageCount + image];
+            if (context.used == context.buffers.size()) {
+                VkCommandBufferAllocateInfo allocInfo{};
+                allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+                allocInfo.commandPool = context.pool;
+                allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+                allocInfo.commandBufferCount = 1;
+
+                VkCommandBuffer commandBuffer;
+                auto result = vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+                if (result != VK_SUCCESS) die(log << "Failed to allocate secondary command buffer " << result);
+                context.buffers.push_back(commandBuffer);
+            }
+            VkCommandBuffer commandBuffer = context.buffers[context.used++];
+
+            // Secondaries inside a render pass have to say which one they'll be executed in.
+            VkCommandBufferInheritanceInfo inheritance{};
+            inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+            inheritance.renderPass = frameGraph.renderPass(shapesPass);
+            inheritance.subpass = frameGraph.subpass(shapesPass);
+            inheritance.framebuffer = frameGraph.framebuffer(shapesPass, image);
+            // And which queries they'll be executed inside of.
+            if (countFragments) inheritance.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+
+            VkCommandBufferBeginInfo beginInfo{};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+            beginInfo.pInheritanceInfo = &inheritance;
+            vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+                // Nothing is inherited from the primary, so every batch binds its own state.
+                setViewportAndScissor(commandBuffer);
+                pushFrameConstants(commandBuffer);
+
+                uint32_t first = batch * drawBatchSize;
+                uint32_t end = std::min(first + drawBatchSize, instanceCount);
+                recordShapeDraws(commandBuffer, image, first, end, draw, false);
+
+            if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) die(log << "Failed to record draw batch " << batch);
+            secondaryBuffers[image][batch] = commandBuffer;
+        });
+    }
+
     void createCommandBuffers() {
         Logger log("createCommandbuffers");
+        ProfileZone zone("createCommandBuffers");
 
-        commandBuffers.resize(swapchainFramebuffers.size());
+        commandBuffers.resize(swapchainImages.size());
 
         VkCommandBufferAllocateInfo allocInfo{};
         allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -532,63 +1766,238 @@ class RenderState {
         if (result != VK_SUCCESS) die(log << "Failed to allocate command buffer :((((( " << result);
         log << "allocated buffers\n";
 
-        for (size_t i = 0; i < commandBuffers.size(); ++i) {
-            VkCommandBufferBeginInfo beginInfo{};
-            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        auto start = Clock::now();
+        imageCommandsVersions.assign(commandBuffers.size(), commandsVersion);
+        recordCommandBuffers();
+        log << "recorded " << commandBuffers.size() << " command buffers in " << millisecondsSince(start) << " ms\n";
+    }
 
-            result = vkBeginCommandBuffer(commandBuffers[i], &beginInfo);
-            if (result != VK_SUCCESS) {
-                die(log << "Failed to start recording buffer " << i+1 << '/' << commandBuffers.size() << ' ' << result);
-            }
+    // --capture: the readback buffers and encoder threads, and a command buffer per frame slot to
+    // copy into them with.
+    void createCapture() {
+        Logger log("createCapture");
+        ProfileZone zone("createCapture");
+
+        // framesInFlight of them can be waiting on the GPU, and each encoder needs one to work on.
+        // One more means there's always a frame queued up for whichever encoder is done first.
+        uint32_t bufferCount = captureBuffers > 0 ? captureBuffers : framesInFlight + captureThreads + 1;
+        capture.init(allocator, device, swapchainSurfaceFormat.format, capturePath, captureFormat, bufferCount, captureThreads, captureDrop);
 
-            VkRenderPassBeginInfo renderPassInfo{};
-            renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-            renderPassInfo.renderPass = renderPass;
-            renderPassInfo.framebuffer = swapchainFramebuffers[i];
-            renderPassInfo.renderArea.offset = {0, 0};
-            renderPassInfo.renderArea.extent = swapchainExtent;
+        captureCommandBuffers.resize(framesInFlight);
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = captureCommandBuffers.size();
+        auto result = vkAllocateCommandBuffers(device, &allocInfo, captureCommandBuffers.data());
+        if (result != VK_SUCCESS) die(log << "Failed to allocate capture command buffers " << result);
+    }
 
-            VkClearValue clearColor = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
-            renderPassInfo.clearValueCount = 1;
-            renderPassInfo.pClearValues = &clearColor;
+    // Copies this frame's image out (unless FrameCapture drops it), then gets it ready to present.
+    // Goes in the same submit as the frame, right after it, so the frame slot's fence covers it.
+    VkCommandBuffer recordCapture(uint32_t imageIndex) {
+        ProfileZone zone("recordCapture");
+        VkCommandBuffer commandBuffer = captureCommandBuffers[currentFrame];
+        vkResetCommandBuffer(commandBuffer, 0);
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+        // The graph already made the frame's color writes visible to transfer reads.
+        capture.record(commandBuffer, swapchainImages[imageIndex], swapchainExtent, inFlightFences[currentFrame], nextCaptureName);
+        nextCaptureName.clear();
+
+        if (!headless) {
+            // Only has to wait for the copy, and present doesn't need anything made visible.
+            VkImageMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.image = swapchainImages[imageIndex];
+            barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            barrier.subresourceRange.levelCount = 1;
+            barrier.subresourceRange.layerCount = 1;
+            vkCmdPipelineBarrier(
+                commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+                0, nullptr, 0, nullptr, 1, &barrier
+            );
+        }
 
-            log << "recording render pass " << i+1 << '/' << commandBuffers.size() << '\n';
-            vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        vkEndCommandBuffer(commandBuffer);
+        return commandBuffer;
+    }
 
-                vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+    // Covers the whole swapchain image. The pipeline leaves these dynamic, so every command
+    // buffer (secondaries too, they don't inherit it) has to set them.
+    void setViewportAndScissor(VkCommandBuffer commandBuffer) {
+        VkViewport viewport{};
+        viewport.x = 0.0f;
+        viewport.y = 0.0f;
+        viewport.width = (float)swapchainExtent.width;
+        viewport.height = (float)swapchainExtent.height;
+        viewport.minDepth = 0.0f;
+        viewport.maxDepth = 1.0f;
 
-                uint32_t vertexCount = 3, instanceCount = 1, firstVertex = 0, firstInstance = 0;
-                vkCmdDraw(commandBuffers[i], vertexCount, instanceCount, firstVertex, firstInstance);
+        VkRect2D scissor{};
+        scissor.offset = {0, 0};
+        scissor.extent = swapchainExtent;
 
-            vkCmdEndRenderPass(commandBuffers[i]);
+        vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+    }
 
-            if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-                die(log << "Failed to start recording buffer " << i+1 << '/' << commandBuffers.size());
-            }
+    // The Frame push constant in triangle.vert. Same deal as the viewport: every command buffer
+    // that draws shapes needs it.
+    void pushFrameConstants(VkCommandBuffer commandBuffer) {
+        float halfExtent[2] = { swapchainExtent.width / 2.0f, swapchainExtent.height / 2.0f };
+        vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(halfExtent), halfExtent);
+    }
+
+    // (Re-)records every image's command buffer. Only call this when none of them are in flight.
+    void recordCommandBuffers() {
+        waitingOnPipeline = false;
+        for (size_t i = 0; i < commandBuffers.size(); ++i) recordCommandBuffer(i);
+    }
+
+    // The "shapes" pass: every draw, inline or from the secondaries recordCommandBuffer() just
+    // recorded. drawnWith is whatever pipelines it picked for them.
+    void recordShapesPass(VkCommandBuffer commandBuffer, uint32_t image) {
+        if (frameGraph.contents(shapesPass) == VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS) {
+            // Nothing but vkCmdExecuteCommands allowed in here, so no timestamps either: the
+            // graph's "shapes" zone covers the draws.
+            vkCmdExecuteCommands(commandBuffer, secondaryBuffers[image].size(), secondaryBuffers[image].data());
+            return;
         }
+        setViewportAndScissor(commandBuffer);
+        pushFrameConstants(commandBuffer);
+        recordShapeDraws(commandBuffer, image, 0, instanceCount, drawnWith, true);
     }
 
-    void createSemaphores() {
-        Logger log("createSemaphores");
+    // Everything drawFrame() submits for image i. Stamps it with commandsVersion, so drawFrame()
+    // can tell when it's gone stale.
+    void recordCommandBuffer(size_t i) {
+        ProfileZone zone("recordCommandBuffer");
+        auto start = Clock::now();
+        // Culling on the GPU leaves a single indirect draw, so there's nothing to split across threads.
+        bool culling = gpuCull && opaqueCount > 0;
+        if (culling != frameGraphCulls) buildFrameGraph();
+        bool secondaries = recordThreads > 0 && instanceCount > 0 && !gpuCull;
+        // Fragments in secondaries only count if they can inherit the query.
+        bool countFragments = gpuTimer.countingFragments() && (!secondaries || inheritedQueries);
+        drawnWith = drawPipelines();
+        frameGraph.setContents(shapesPass, secondaries ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
+        if (secondaries) recordSecondaryCommandBuffers(i, drawnWith, countFragments);
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+        auto result = vkBeginCommandBuffer(commandBuffers[i], &beginInfo);
+        if (result != VK_SUCCESS) {
+            die(log << "Failed to start recording buffer " << i+1 << '/' << commandBuffers.size() << ' ' << result);
+        }
+
+        gpuTimer.beginSlot(commandBuffers[i], i);
+        // Around the whole graph, since the query can't start inside a render pass that executes
+        // secondaries. Only the shapes pass runs fragment shaders anyway.
+        if (countFragments) gpuTimer.beginFragments(commandBuffers[i], i);
+        frameGraph.execute(commandBuffers[i], i, gpuTimer);
+        if (countFragments) gpuTimer.endFragments(commandBuffers[i], i);
+
+        if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
+            die(log << "Failed to start recording buffer " << i+1 << '/' << commandBuffers.size());
+        }
+
+        imageCommandsVersions[i] = commandsVersion;
+        recordMs.add(millisecondsSince(start));
+    }
+
+    void createSyncObjects() {
+        Logger log("createSyncObjects");
+        ProfileZone zone("createSyncObjects");
+
+        imageAvailableSemaphores.resize(framesInFlight);
+        renderFinishedSemaphores.resize(framesInFlight);
+        inFlightFences.resize(framesInFlight);
+        imagesInFlight.resize(swapchainImages.size(), VK_NULL_HANDLE);
 
         VkSemaphoreCreateInfo semaphoreInfo{};
         semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-        auto result1 = vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphore);
-        auto result2 = vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphore);
-        if (result1 != VK_SUCCESS) die(log << "Failed to create imageAvailableSemaphore");
-        log << "created imageAvailableSemaphore\n";
-        if (result2 != VK_SUCCESS) die(log << "Failed to create renderFinishedSemaphore");
-        log << "created renderFinishedSemaphore\n";
+        // Fences start signaled so the very first wait in drawFrame() doesn't hang forever.
+        VkFenceCreateInfo fenceInfo{};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+        for (size_t i = 0; i < framesInFlight; ++i) {
+            auto result1 = vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]);
+            auto result2 = vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]);
+            auto result3 = vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]);
+            if (result1 != VK_SUCCESS) die(log << "Failed to create imageAvailableSemaphore " << i);
+            if (result2 != VK_SUCCESS) die(log << "Failed to create renderFinishedSemaphore " << i);
+            if (result3 != VK_SUCCESS) die(log << "Failed to create inFlightFence " << i);
+        }
+        log << "created sync objects for " << framesInFlight << " frames in flight\n";
     }
 
 public:
-    void initVulkan(GLFWwindow *window) {
+    RenderState(const Options &options) : headless(options.headless),
+                                          presentPacing(options.presentPacing),
+                                          minFrameInterval(frameInterval(options.maxFps)),
+                                          inputToPresentMs(options.headless ? 1 : 512),
+                                          useDepth(options.depth),
+                                          dumpGraph(options.dumpGraph),
+                                          capturePath(options.capturePath),
+                                          captureFormat(options.captureRaw ? CAPTURE_RAW : CAPTURE_PNG),
+                                          captureBuffers(options.captureBuffers),
+                                          captureThreads(options.captureThreads),
+                                          captureDrop(options.captureDrop),
+                                          pipelineThreads(options.pipelineThreads),
+                                          precompilePipelines(options.precompilePipelines),
+                                          blendMode(options.alphaBlend ? BLEND_ALPHA : BLEND_OPAQUE),
+                                          shapeRendering(options.sdf ? RENDER_SDF : RENDER_TRIANGLES),
+                                          drawPolygons(options.polygons > 0),
+                                          gpuCull(options.gpuCull),
+                                          cullMinPixels(options.cullMinPixels),
+                                          stagingRingSize(VkDeviceSize(options.stagingRingMiB) << 20),
+                                          animateCount(options.animate),
+                                          pipelineCachePath(options.pipelineCachePath),
+                                          deviceOverride(options.device),
+                                          calibrateDevices(options.calibrateDevices),
+                                          deviceCachePath(options.deviceCachePath),
+                                          framesInFlight(options.framesInFlight),
+                                          statsWindow(options.headless ? options.frames : 512),
+                                          cpuFrameMs(statsWindow),
+                                          recordThreads(options.recordThreads),
+                                          drawBatchSize(options.drawBatch),
+                                          recordMs(statsWindow),
+                                          recreateMs(statsWindow),
+                                          tracePath(options.tracePath) {
+        profiler.init(statsWindow, !tracePath.empty());
+    }
+
+    // Pass a null window (and construct with Options::headless) to render offscreen at `headlessExtent`.
+    void initVulkan(GLFWwindow *window, VkExtent2D headlessExtent = {800, 600}) {
+        ProfileZone zone("initVulkan");
+        auto initStart = Clock::now();
+        // Where the time went, for the breakdown at the end. Each phase lasts until the next one.
+        std::vector<std::pair<const char *, double>> phases;
+        auto phaseStart = initStart;
+        auto endPhase = [&](const char *name) {
+            phases.emplace_back(name, millisecondsSince(phaseStart));
+            phaseStart = Clock::now();
+        };
+        this->window = window;
+        // GLFW isn't even initialized in headless mode, and we don't need its surface extensions anyway.
         uint32_t glfwExtensionCount = 0;
-        const char **glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        const char **glfwExtensions = headless ? nullptr : glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
 
         SECTION("=== Create Vulkan \"Instance\" ===");
         {
+            ProfileZone step("create instance");
             VkApplicationInfo appInfo{};
             appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
             appInfo.pApplicationName = "Hello Triangle";
@@ -604,38 +2013,29 @@ public:
             createInfo.ppEnabledExtensionNames = glfwExtensions;
             createInfo.enabledLayerCount = 0;
 
+            std::cout << "extensions requested by GLFW:";
+            for (size_t i = 0; i < glfwExtensionCount; ++i) std::cout << ' ' << glfwExtensions[i];
+            std::cout << '\n';
+
             VkResult result = vkCreateInstance(&createInfo, nullptr, &instance);
             if (result != VK_SUCCESS) die(log << "ah fuck " << result);
             std::cout << "easy" << '\n';
         }
-
-        SECTION("=== Dick around with extensions (completely unnecessary) ===");
-        {
-            uint32_t extensionCount = 0;
-            vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr);
-            unique_ptr<VkExtensionProperties[]> extensions(new VkExtensionProperties[extensionCount]);
-            vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, extensions.get());
-
-            std::cout << "extensions requested by GLFW:\n";
-            for (size_t i = 0; i < glfwExtensionCount; ++i) {
-                std::cout << '\t' << glfwExtensions[i] << '\n';
-            }
-            std::cout << "available extensions:\n";
-            for (size_t i = 0; i < extensionCount; ++i) {
-                std::cout << '\t' << extensions[i].extensionName << '\n';
-            }
-        }
+        endPhase("instance");
 
         SECTION("=== Create window surface ===");
-        {
+        if (headless) std::cout << "headless. no surface\n";
+        else {
             auto createResult = glfwCreateWindowSurface(instance, window, nullptr, &surface);
             if (createResult != VK_SUCCESS) die(log << "glfwCreateWindowSurface failed! " << createResult);
 
             std::cout << "done\n";
         }
+        endPhase("surface");
 
         SECTION("=== Pick a physical graphics device ===");
         {
+            ProfileZone step("pick physical device");
             uint32_t deviceCount = 0;
             vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
             unique_ptr<VkPhysicalDevice[]> devices(new VkPhysicalDevice[deviceCount]);
@@ -643,29 +2043,64 @@ public:
 
             if (deviceCount == 0) die(log << "You don't even have a GPU dude!");
 
-            std::map<size_t, size_t> ranking;
+            // Scoring a device is a pile of little driver queries, some of which (the surface ones)
+            // can be surprisingly slow the first time. So every device gets its own thread.
+            std::vector<std::future<DeviceScore>> scoring;
             for (size_t i = 0; i < deviceCount; ++i) {
-                VkPhysicalDeviceProperties deviceProperties;
-                vkGetPhysicalDeviceProperties(devices[i], &deviceProperties);
+                auto policy = deviceCount > 1 ? std::launch::async : std::launch::deferred;
+                scoring.push_back(std::async(policy, [this, device = devices[i]] { return howGoodIsThisDevice(device); }));
+            }
 
-                std::cout << "device " << i+1 << '/' << deviceCount << ": "
-                          << physicalDeviceTypeToString(deviceProperties.deviceType)
-                          << '\n';
+            std::vector<DeviceScore> scores;
+            for (size_t i = 0; i < deviceCount; ++i) {
+                scores.push_back(scoring[i].get());
+                std::cout << "device " << i+1 << '/' << deviceCount << ": " << scores[i].properties.deviceName << ", "
+                          << physicalDeviceTypeToString(scores[i].properties.deviceType)
+                          << '\n' << scores[i].report;
+                std::cout << "\tfinal score: " << scores[i].score << '\n';
+            }
 
-                size_t score = howGoodIsThisDevice(devices[i]);
-                ranking.emplace(score, i);
-                std::cout << "\tfinal score: " << score << '\n';
+            // Best first. Equal scores stay in the order the driver listed them (they used to
+            // knock each other out of a map, so which one we got was anybody's guess).
+            std::vector<size_t> ranking;
+            for (size_t i = 0; i < deviceCount; ++i) {
+                if (scores[i].score > 0) ranking.push_back(i);
             }
+            if (ranking.empty()) die(log << "None of your " << deviceCount << " devices can run this :(");
+            std::stable_sort(ranking.begin(), ranking.end(), [&](size_t a, size_t b) { return scores[a].score > scores[b].score; });
 
-            size_t winnerIndex = ranking.rbegin()->second;
+            size_t winnerIndex = ranking[0];
+            if (!deviceOverride.empty()) {
+                winnerIndex = deviceByName(deviceOverride, scores);
+                std::cout << "--device " << deviceOverride << " says so.\n";
+            }
+            else if (calibrateDevices && ranking.size() > 1) {
+                winnerIndex = fastestDevice(devices.get(), scores, ranking);
+                std::cout << "calibration says so.\n";
+            }
+            else if (ranking.size() > 1 && scores[ranking[1]].score == scores[winnerIndex].score) {
+                std::cout << "tied with " << ranking[1]+1 << '/' << deviceCount << ", going with the first one "
+                          << "(--device to pick, --calibrate-devices to measure)\n";
+            }
             physicalDevice = devices[winnerIndex];
             std::cout << winnerIndex+1 << '/' << deviceCount << " wins.\n";
+
+            // The format gets baked into the render pass and every pipeline, so it's decided once,
+            // here. Which means the pipelines can start compiling before there's a swapchain.
+            if (headless) {
+                swapchainSurfaceFormat = { VK_FORMAT_B8G8R8A8_SRGB, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR };
+            }
+            else {
+                surfaceSupport = std::move(scores[winnerIndex].surfaceSupport);
+                swapchainSurfaceFormat = surfaceSupport->bestSurfaceFormat();
+            }
+            if (useDepth) depthFormat = findDepthFormat();
         }
+        endPhase("pick device");
 
         SECTION("=== Gather queue families ===");
         {
-            // TODO (1): looks like we should actually use this as a way to determine if a physical device is usable.
-            // Like, "must have graphics queue and sexy compute queue!!" or something.
+            // howGoodIsThisDevice() already threw out devices without a graphics (or present) queue.
             uint32_t queueFamilyCount = 0;
             vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
             unique_ptr<VkQueueFamilyProperties[]> queueFamilies(new VkQueueFamilyProperties[queueFamilyCount]);
@@ -679,7 +2114,16 @@ public:
                     graphicsQueueFamily = i;
                 }
 
+                // Transfer-only queue family. That's usually a separate copy engine that can run
+                // alongside rendering, so uploads don't have to get in line behind draws.
+                auto flags = queueFamilies[i].queueFlags;
+                if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+                    std::cout << "going with queue family #" << i << " for transfers.\n";
+                    transferQueueFamily = i;
+                }
+
                 // Present queue family (probably, hopefully, the same as the graphics queue family)
+                if (headless) continue;
                 VkBool32 presentSupport;
                 vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, i, surface, &presentSupport);
                 if (presentSupport) {
@@ -689,18 +2133,26 @@ public:
             }
 
             if (!graphicsQueueFamily.has_value()) die(log << "couldn't find graphics queue :(");
+            if (headless) presentQueueFamily = graphicsQueueFamily;
             if (!presentQueueFamily.has_value()) die(log << "couldn't find present queue :(");
+            if (!transferQueueFamily.has_value()) {
+                std::cout << "no dedicated transfer queue. uploads will share the graphics queue.\n";
+                transferQueueFamily = graphicsQueueFamily;
+            }
         }
 
         SECTION("=== Create logical device ===");
         {
+            ProfileZone step("create logical device");
             float queuePriority = 1.0f;
 
             // TODO: hah actually isn't this already done above? I'm supposed to change it right?
             // TODO: yes. confirmed. this code belongs in the logical device step. these queues are
             // created alongside the logical device.
             std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-            std::set<uint32_t> uniqueQueueFamilies = {graphicsQueueFamily.value(), presentQueueFamily.value()};
+            std::set<uint32_t> uniqueQueueFamilies = {
+                graphicsQueueFamily.value(), presentQueueFamily.value(), transferQueueFamily.value()
+            };
             std::cout << "creating " << uniqueQueueFamilies.size() << " queues.\n";
             for (uint32_t queueFamily : uniqueQueueFamilies) {
                 VkDeviceQueueCreateInfo queueCreateInfo{};
@@ -711,8 +2163,14 @@ public:
                 queueCreateInfos.push_back(queueCreateInfo);
             }
 
-            // TODO: We can populate this with feature we want later
+            // Only the ones for counting fragments, and only if they're there: it's just stats.
+            VkPhysicalDeviceFeatures supportedFeatures;
+            vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+            pipelineStatistics = supportedFeatures.pipelineStatisticsQuery;
+            inheritedQueries = supportedFeatures.inheritedQueries;
             VkPhysicalDeviceFeatures deviceFeatures{};
+            deviceFeatures.pipelineStatisticsQuery = supportedFeatures.pipelineStatisticsQuery;
+            deviceFeatures.inheritedQueries = supportedFeatures.inheritedQueries;
 
             VkDeviceCreateInfo createInfo{};
             createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -720,8 +2178,9 @@ public:
             createInfo.queueCreateInfoCount = queueCreateInfos.size();
             createInfo.pEnabledFeatures = &deviceFeatures;
             createInfo.enabledLayerCount = 0;
-            createInfo.enabledExtensionCount = requiredExtensions.size();
-            createInfo.ppEnabledExtensionNames = requiredExtensions.data();
+            auto extensions = requiredExtensions();
+            createInfo.enabledExtensionCount = extensions.size();
+            createInfo.ppEnabledExtensionNames = extensions.data();
 
             auto createResult = vkCreateDevice(physicalDevice, &createInfo, nullptr, &device);
             if (createResult != VK_SUCCESS) die(log << "vkCreateDevice failed! " << createResult);
@@ -729,47 +2188,204 @@ public:
             std::cout << "logical devices created! now grabbing the queues\n";
             vkGetDeviceQueue(device, presentQueueFamily.value(), 0, &presentQueue);
             vkGetDeviceQueue(device, graphicsQueueFamily.value(), 0, &graphicsQueue);
+            vkGetDeviceQueue(device, transferQueueFamily.value(), 0, &transferQueue);
 
             std::cout << "done\n";
         }
+        endPhase("queue families + logical device");
+
+        SECTION("=== Set up memory allocator ===");
+        allocator.init(device, physicalDevice);
+        deletions.init(allocator);
+
+        SECTION("=== Load pipeline cache ===");
+        {
+            ProfileZone step("load pipeline cache");
+            if (!pipelineCachePath.empty()) pipelineCache.load(device, physicalDevice, pipelineCachePath);
+            else std::cout << "pipeline cache disabled\n";
+        }
+
+        endPhase("allocator + pipeline cache");
+
+        SECTION("=== Pipelines. These compile in the background while we do everything else ===");
+        startGraphicsPipeline();
+        endPhase("start pipeline compiles");
 
         SECTION("=== Swapchain and friends. This is stuff that may happen a lot ===");
-        createSwapchain(window);
+        if (headless) createOffscreenTargets(headlessExtent);
+        else createSwapchain(window);
         createImageViews();
-        createRenderPass();
-        createGraphicsPipeline();
-        createFramebuffers();
+        if (gpuCull) createCullPipeline();
+        buildFrameGraph();
         createCommandPool();
+        createUploadResources();
+        createRecordContexts();
+        gpuTimer.init(device, physicalDevice, graphicsQueueFamily.value(), swapchainImages.size(), 8, statsWindow, pipelineStatistics);
         createCommandBuffers();
-        createSemaphores();
+        createSyncObjects();
+        if (!capturePath.empty()) createCapture();
+        endPhase("swapchain, buffers, command pools");
+
+        double pipelineWaitMs = finishGraphicsPipeline();
+        endPhase("wait for the generic pipeline");
         std::cout << "done!\n";
+
+        SECTION("=== Startup timings ===");
+        double totalMs = millisecondsSince(initStart);
+        const char *cacheState = pipelineCache.handle == VK_NULL_HANDLE ? "disabled"
+                               : pipelineCache.warm ? "warm" : "cold";
+        std::cout << "pipeline cache: " << cacheState << '\n';
+        for (auto &[name, ms] : phases) {
+            std::cout << name << ": " << ms << " ms (" << static_cast<int>(100 * ms / totalMs) << "%)\n";
+        }
+        if (pipelineThreads == 0) std::cout << "(--pipeline-threads 0: the generic pipeline compiled right there, nothing overlapped)\n";
+        else if (pipelineWaitMs < 0.1) std::cout << "the generic pipeline was already done by the time we needed it\n";
+        std::cout << "initVulkan total: " << totalMs << " ms\n";
     }
 
     void drawFrame() {
-        vkQueueWaitIdle(presentQueue);
+        // Everything since the last drawFrame() (events, animate(), loadScene()...) was last frame.
+        profiler.newFrame();
+        ProfileZone zone("drawFrame");
+
+        // --max-fps. Sleeping here instead of letting FIFO block us in vkAcquireNextImageKHR means
+        // the CPU actually gets to idle, and the input we draw with is fresher.
+        if (minFrameInterval > Clock::duration::zero() && !headless) {
+            auto now = Clock::now();
+            if (now < nextFrameStart) std::this_thread::sleep_until(nextFrameStart);
+            // If we're running behind, don't try to catch up with a burst of frames.
+            nextFrameStart = std::max(nextFrameStart, now) + minFrameInterval;
+        }
+
+        // Only block if the GPU is still chewing on the frame we submitted framesInFlight frames ago.
+        {
+            ProfileZone wait("wait for frame slot");
+            vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+        }
+        auto cpuStart = Clock::now();
+
+        // Whatever this slot used last time around is done being read by the GPU.
+        deletions.collect(slotFrames[currentFrame]);
+        stagingRing.collect(slotFrames[currentFrame]);
+        // Which might have made room for changes that didn't fit before.
+        stageBacklog();
+        // Frames that finished reading back go to the encoders. This slot's fence just signaled,
+        // so at least its copy (if it had one) is done.
+        capture.poll();
 
         uint32_t imageIndex;
-        vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
+        if (headless) {
+            // Offscreen image N belongs to frame slot N, whose fence we just waited on.
+            imageIndex = currentFrame;
+        }
+        else {
+            ProfileZone acquire("vkAcquireNextImageKHR");
+            auto result = vkAcquireNextImageKHR(
+                device, swapchain, UINT64_MAX,
+                imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex
+            );
+            // Window changed size out from under us. Nothing got signaled, so just try again next time.
+            if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+                recreateSwapchain();
+                return;
+            }
+            // (VK_SUBOPTIMAL_KHR still gave us an image, so we use it and recreate after presenting.)
+            if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) die(log << "Failed to acquire swapchain image " << result);
+        }
 
-        VkSemaphore semaphoresToSignal[] = {renderFinishedSemaphore};
+        // A previous frame might still be rendering into this exact image.
+        if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) {
+            ProfileZone wait("wait for image");
+            auto waitStart = Clock::now();
+            vkWaitForFences(device, 1, &imagesInFlight[imageIndex], VK_TRUE, UINT64_MAX);
+            cpuStart += Clock::now() - waitStart;
+            gpuTimer.collect(imageIndex);
+            if (gpuCull && !indirectBufferMemory.empty()) {
+                auto draw = static_cast<const VkDrawIndirectCommand *>(indirectBufferMemory[imageIndex].mapped);
+                visibleShapes = draw->instanceCount;
+            }
+        }
+        imagesInFlight[imageIndex] = inFlightFences[currentFrame];
+
+        // Swap the generic pipelines out for the real ones as soon as they're compiled.
+        if (waitingOnPipeline && pipelines.readyCount() != pipelinesSeen) {
+            pipelinesSeen = pipelines.readyCount();
+            if (scenePipelinesReady()) {
+                waitingOnPipeline = false;
+                commandsVersion += 1;
+            }
+        }
+
+        // Nothing's using this image's command buffer anymore, so now's the time to catch it up.
+        if (imageCommandsVersions[imageIndex] != commandsVersion) {
+            recordCommandBuffer(imageIndex);
+            lazyRecords += 1;
+        }
+
+        // Anything that came in before this point is in this frame.
+        auto frameInput = pendingInput;
+        pendingInput.reset();
+
+        VkSemaphore semaphoresToSignal[] = {renderFinishedSemaphores[currentFrame]};
         VkSwapchainKHR swapchainsToPresent[] = {swapchain};
 
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-        VkSemaphore waitSemaphores[] = {imageAvailableSemaphore};
-        VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-        submitInfo.waitSemaphoreCount = 1;
+        // No swapchain means nothing to wait for before rendering and nobody to signal afterwards.
+        VkSemaphore waitSemaphores[2];
+        VkPipelineStageFlags waitStages[2];
+        VkCommandBuffer submitBuffers[3];
+        uint32_t waitCount = 0, bufferCount = 0;
+        if (!headless) {
+            waitSemaphores[waitCount] = imageAvailableSemaphores[currentFrame];
+            waitStages[waitCount++] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        }
+        // Any streamed shape changes go in before the frame reads the instance buffer.
+        if (recordUploads(imageIndex)) {
+            if (dedicatedTransferQueue()) {
+                waitSemaphores[waitCount] = imageUploads[imageIndex].transferred;
+                waitStages[waitCount++] = INSTANCE_READ_STAGES;
+                submitBuffers[bufferCount++] = imageUploads[imageIndex].acquire;
+            }
+            else {
+                submitBuffers[bufferCount++] = imageUploads[imageIndex].transfer;
+            }
+        }
+        submitBuffers[bufferCount++] = commandBuffers[imageIndex];
+        // With every readback buffer busy, this is where --capture waits for the encoders.
+        if (capture.enabled() && (!captureNamedOnly || !nextCaptureName.empty())) {
+            submitBuffers[bufferCount++] = recordCapture(imageIndex);
+        }
+
+        submitInfo.waitSemaphoreCount = waitCount;
         submitInfo.pWaitSemaphores = waitSemaphores;
         submitInfo.pWaitDstStageMask = waitStages;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+        submitInfo.commandBufferCount = bufferCount;
+        submitInfo.pCommandBuffers = submitBuffers;
 
-        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.signalSemaphoreCount = headless ? 0 : 1;
         submitInfo.pSignalSemaphores = semaphoresToSignal;
 
-        auto result = vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+        vkResetFences(device, 1, &inFlightFences[currentFrame]);
+        VkResult result;
+        {
+            ProfileZone submit("vkQueueSubmit");
+            result = vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]);
+        }
         if (result != VK_SUCCESS) die(log << "Failed to submit draw command buffer! " << result);
+        gpuTimer.submitted(imageIndex);
+        slotFrames[currentFrame] = deletions.submitted();
+
+        drawnSceneVersion = sceneVersion;
+        drawnCommandsVersion = commandsVersion;
+        redrawRequested = false;
+
+        if (headless) {
+            cpuFrameMs.add(millisecondsSince(cpuStart));
+            currentFrame = (currentFrame + 1) % framesInFlight;
+            return;
+        }
 
         VkPresentInfoKHR presentInfo{};
         presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -779,28 +2395,651 @@ public:
         presentInfo.pSwapchains = swapchainsToPresent;
         presentInfo.pImageIndices = &imageIndex;
 
-        vkQueuePresentKHR(presentQueue, &presentInfo);
+        {
+            ProfileZone present("vkQueuePresentKHR");
+            result = vkQueuePresentKHR(presentQueue, &presentInfo);
+        }
+        if (frameInput) inputToPresentMs.add(millisecondsSince(*frameInput));
+
+        cpuFrameMs.add(millisecondsSince(cpuStart));
+        currentFrame = (currentFrame + 1) % framesInFlight;
+
+        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized) {
+            recreateSwapchain();
+        }
+        else if (result != VK_SUCCESS) {
+            die(log << "Failed to present " << result);
+        }
+    }
+
+    void windowResized() { framebufferResized = true; }
+
+    // Call from input callbacks. The next frame measures how long it took to get it on screen.
+    void inputArrived() {
+        if (!pendingInput) pendingInput = Clock::now();
+        requestRedraw();
+    }
+
+    // New swapchain for the new window size. Keeps everything that doesn't care about the size:
+    // the pipelines, the per-image buffers. Only the image views, the frame graph (render pass,
+    // framebuffers, depth buffer) and command buffers get rebuilt (unless the image count
+    // changed, see below).
+    //
+    // Doesn't wait for the GPU: the old views, frame graph and swapchain go on the deletion
+    // queue, and each command buffer gets re-recorded once its image's last frame is done.
+    void recreateSwapchain() {
+        Logger log("recreateSwapchain");
+        ProfileZone zone("recreateSwapchain");
+        framebufferResized = false;
+
+        // Minimized. Nothing to draw into until it comes back.
+        int width = 0, height = 0;
+        glfwGetFramebufferSize(window, &width, &height);
+        while ((width == 0 || height == 0) && !glfwWindowShouldClose(window)) {
+            glfwWaitEvents();
+            glfwGetFramebufferSize(window, &width, &height);
+        }
+        if (width == 0 || height == 0) return;
+
+        auto start = Clock::now();
+        for (auto &imageView : swapchainImageViews) deletions.defer(std::move(imageView));
+        swapchainImageViews.clear();
+
+        size_t oldImageCount = swapchainImages.size();
+        auto swapchainStart = Clock::now();
+        createSwapchain(window);
+        double swapchainMs = millisecondsSince(swapchainStart);
+
+        auto viewsStart = Clock::now();
+        createImageViews();
+        buildFrameGraph();
+        double viewsMs = millisecondsSince(viewsStart);
+
+        double idleMs = 0;
+        if (swapchainImages.size() != oldImageCount) {
+            // Everything per-image gets rebuilt, and that does need the GPU to be done with all of it.
+            log << "image count went from " << oldImageCount << " to " << swapchainImages.size() << '\n';
+            auto idleStart = Clock::now();
+            vkDeviceWaitIdle(device);
+            idleMs = millisecondsSince(idleStart);
+            // That recorded every command buffer for the new swapchain already.
+            rebuildPerImageState();
+        }
+        else {
+            // Leave imagesInFlight alone: image i of the new swapchain shares image i's per-image
+            // buffers with the old one, so drawFrame() still has to wait on whoever last used them.
+            // The command buffers are re-recorded there too, right after that wait.
+            commandsVersion += 1;
+        }
+
+        double totalMs = millisecondsSince(start);
+        recreateMs.add(totalMs);
+        log << swapchainExtent.width << 'x' << swapchainExtent.height << " in " << totalMs << " ms (swapchain "
+            << swapchainMs << ", views + frame graph " << viewsMs << ", idle wait " << idleMs << "), "
+            << deletions.pending() << " old objects waiting on the GPU\n";
+        requestRedraw();
+    }
+
+    // Everything we keep one of per swapchain image. Only needed if a new swapchain came back with
+    // a different number of images, which in practice is rare. Device has to be idle.
+    void rebuildPerImageState() {
+        gpuTimer.destroy();
+        gpuTimer.init(device, physicalDevice, graphicsQueueFamily.value(), swapchainImages.size(), 8, statsWindow, pipelineStatistics);
+
+        destroyUploadResources();
+        createUploadResources();
+        destroyRecordContexts();
+        createRecordContexts();
+        if (gpuCull) {
+            destroyCullPipeline();
+            createCullPipeline();
+        }
+        imagesInFlight.assign(swapchainImages.size(), VK_NULL_HANDLE);
+
+        // Instance buffers first, then command buffers (recorded right away) to go with them.
+        vkFreeCommandBuffers(device, commandPool, commandBuffers.size(), commandBuffers.data());
+        commandBuffers.clear();
+        if (sceneFile) {
+            // Nothing about the scene changed, so it doesn't need loading again, just uploading.
+            createInstanceBuffers();
+            uploadWholeScene();
+        }
+        else {
+            auto shapes = sceneShapes;
+            loadScene(shapes, instanceCapacity);
+        }
+        createCommandBuffers();
+    }
+
+    // Sorts `shapes` into the order they get drawn in (see opaqueCount) and returns how many are
+    // opaque.
+    uint32_t sortScene(std::vector<ShapeInstance> &shapes) const {
+        if (!useDepth) return shapes.size();
+        ProfileZone zone("sortScene");
+        return sortForDrawing(shapes, translucency());
+    }
+
+    // Replaces whatever was being drawn with `shapes`. Makes new instance buffers with room for
+    // `capacity` shapes (at least shapes.size()) and uploads the whole scene into them, which
+    // waits on the graphics queue. See setShapes() for the cheap way. Each image's command buffer
+    // gets re-recorded the next time drawFrame() comes around to it.
+    void loadScene(const std::vector<ShapeInstance> &shapes, size_t capacity = 0) {
+        Logger log("loadScene");
+        ProfileZone zone("loadScene");
+
+        sceneFile.close();
+        sceneShapes = shapes;
+        opaqueCount = sortScene(sceneShapes);
+        sceneVersion += 1;
+        commandsVersion += 1;
+        instanceCount = shapes.size();
+        instanceCapacity = std::max(shapes.size(), capacity);
+        sceneShape = uniformShape(shapes.data(), shapes.size());
+        createInstanceBuffers();
+        uploadWholeScene();
+    }
+
+    // loadScene() for a .shapes file (see scene_file.h). The file gets mapped and copied straight
+    // into staging memory, and that's it: no parsing, no copy in between, and no going through the
+    // shapes to sort them or see what they are, since the header already says. Unless the file
+    // was sorted for a different blend mode, which needs a sorted copy like any other scene.
+    void loadSceneFile(const std::string &path) {
+        Logger log("loadSceneFile");
+        ProfileZone zone("loadSceneFile");
+        auto start = Clock::now();
+
+        SceneFile file;
+        if (!file.open(path)) die(log << "couldn't load a scene from " << path);
+        if (file.size() > UINT32_MAX) die(log << path << " has " << file.size() << " shapes, more than we can draw");
+        if (useDepth && !file.sortedFor(translucency())) {
+            log << path << " isn't sorted for how we're drawing, so it's getting copied and sorted\n";
+            loadScene(std::vector<ShapeInstance>(file.shapes(), file.shapes() + file.size()));
+            return;
+        }
+
+        sceneShapes.clear();
+        sceneShapes.shrink_to_fit();
+        sceneFile = std::move(file);
+        // Without a depth buffer nothing gets sorted, so whatever order it's in is fine.
+        opaqueCount = useDepth ? sceneFile.header().opaqueCount : sceneFile.size();
+        sceneVersion += 1;
+        commandsVersion += 1;
+        instanceCount = sceneFile.size();
+        instanceCapacity = instanceCount;
+        uint32_t shape = sceneFile.header().uniformShape;
+        sceneShape = shape < SHAPE_TYPE_COUNT ? shape : SHAPE_ANY;
+        createInstanceBuffers();
+        uploadWholeScene();
+        log << instanceCount << " shapes from " << path << " in " << millisecondsSince(start) << " ms\n";
+    }
+
+    // Writes `shapes` out as a .shapes file that loadSceneFile() can upload as is: sorted the way
+    // we draw, with that and the uniform shape in the header. Doesn't need initVulkan().
+    bool saveScene(std::vector<ShapeInstance> shapes, const std::string &path) const {
+        uint32_t opaque = sortScene(shapes);
+        return writeSceneFile(path, shapes, useDepth, opaque, translucency(), uniformShape(shapes.data(), shapes.size()));
+    }
+
+    // Gives a scene that's still in its mapped file a copy in sceneShapes, so it can be changed.
+    void materializeScene() {
+        if (!sceneFile) return;
+        ProfileZone zone("materializeScene");
+        sceneShapes.assign(sceneFile.shapes(), sceneFile.shapes() + sceneFile.size());
+        sceneFile.close();
+    }
+
+    const ShapeInstance *sceneData() const { return sceneFile ? sceneFile.shapes() : sceneShapes.data(); }
+    size_t sceneSize() const { return sceneFile ? sceneFile.size() : sceneShapes.size(); }
+
+    // New instance buffers with room for instanceCapacity shapes, one per image (and new cull
+    // buffers to go with them). Frames in flight can keep using the old ones. They go once those
+    // are done.
+    void createInstanceBuffers() {
+        Logger log("createInstanceBuffers");
+        destroyInstanceBuffers();
+        if (instanceCapacity > 0) {
+            VkDeviceSize size = sizeof(ShapeInstance) * instanceCapacity;
+            instanceBuffers.resize(swapchainImages.size());
+            instanceBufferMemory.resize(swapchainImages.size());
+            for (size_t i = 0; i < swapchainImages.size(); ++i) {
+                instanceBufferMemory[i] = allocator.createBuffer(
+                    size,
+                    VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                    instanceBuffers[i], VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+                );
+            }
+            if (gpuCull) {
+                // Only one dimension of workgroups, and 65535 of them is all we're guaranteed.
+                if ((instanceCapacity + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE > 65535) {
+                    die(log << "--gpu-cull can only handle " << 65535 * CULL_GROUP_SIZE << " shapes, not " << instanceCapacity);
+                }
+                createCullBuffers();
+            }
+        }
+    }
+
+    // Replaces the polygons with `count` random stars from makeTestPath(), `distinct` different
+    // ones, placed like makeTestScene() places shapes. Every polygon asks the mesh cache for its
+    // path, but only the first of each kind gets tessellated and uploaded. Waits on the GPU.
+    void loadPolygons(size_t count, uint32_t distinct) {
+        Logger log("loadPolygons");
+        ProfileZone zone("loadPolygons");
+        auto start = Clock::now();
+
+        auto placements = makeTestScene(count, 4321);
+        std::vector<std::pair<uint32_t, ShapeInstance>> polygons;
+        polygons.reserve(count);
+        for (size_t i = 0; i < count; ++i) polygons.emplace_back(meshes.get(makeTestPath(i % distinct)), placements[i]);
+        std::stable_sort(polygons.begin(), polygons.end(), [](auto &a, auto &b) { return a.first < b.first; });
+
+        meshDraws.clear();
+        std::vector<ShapeInstance> instances;
+        instances.reserve(count);
+        for (auto &[mesh, instance] : polygons) {
+            if (meshDraws.empty() || meshDraws.back().mesh != mesh) meshDraws.push_back({mesh, (uint32_t)instances.size(), 0});
+            meshDraws.back().instanceCount += 1;
+            instances.push_back(instance);
+        }
+
+        uploadMeshes();
+        deletions.defer<vkDestroyBuffer>(device, polygonInstanceBuffer, polygonInstanceMemory);
+        polygonInstanceBuffer = VK_NULL_HANDLE;
+        if (!instances.empty()) {
+            VkDeviceSize size = sizeof(ShapeInstance) * instances.size();
+            polygonInstanceMemory = allocator.createBuffer(
+                size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                polygonInstanceBuffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+            );
+            uploadToBuffer(polygonInstanceBuffer, 0, instances.data(), size);
+        }
+        commandsVersion += 1;
+        log << count << " polygons, " << meshDraws.size() << " meshes, in " << millisecondsSince(start) << " ms\n";
+    }
+
+    // Changes the scene to `shapes` without stalling. Only the shapes that actually differ get
+    // streamed to the GPU, and the command buffers only get re-recorded if the counts changed.
+    // If the instance buffers are too small, they get replaced with bigger ones that the whole
+    // scene streams into, still without waiting on anything.
+    void setShapes(const std::vector<ShapeInstance> &unsortedShapes) {
+        materializeScene();
+        bool grown = unsortedShapes.size() > instanceCapacity;
+        if (grown) {
+            // Leave some room so adding a few more next time doesn't land us back here.
+            growInstanceBuffers(unsortedShapes.size() + unsortedShapes.size() / 2);
+        }
+        // Compared in drawing order, so a scene that's only a few shapes off from the current
+        // one still mostly lines up with it.
+        auto shapes = unsortedShapes;
+        uint32_t opaque = sortScene(shapes);
+
+        auto same = [&](size_t i) { return memcmp(&sceneShapes[i], &shapes[i], sizeof(ShapeInstance)) == 0; };
+        size_t common = std::min(sceneShapes.size(), shapes.size());
+        size_t first = 0;
+        size_t end = shapes.size();
+        if (!grown) {
+            while (first < common && same(first)) ++first;
+            if (shapes.size() <= sceneShapes.size()) {
+                while (end > first && same(end - 1)) --end;
+            }
+        }
+
+        sceneShapes.resize(shapes.size());
+        if (first < end) streamShapes(first, &shapes[first], end - first);
+        // Dropping the odd one out can make the scene uniform again.
+        setSceneShape(uniformShape(sceneShapes.data(), sceneShapes.size()));
+
+        if (instanceCount != shapes.size() || opaqueCount != opaque) {
+            instanceCount = shapes.size();
+            opaqueCount = opaque;
+            commandsVersion += 1;
+        }
+    }
+
+    // Swaps the instance buffers for new ones with room for `capacity` shapes, without waiting:
+    // the old ones go once the frames using them are done (see createInstanceBuffers()). The new
+    // ones start out empty, so whatever was on its way to the old ones is no use anymore, and
+    // the caller has to stream the whole scene.
+    void growInstanceBuffers(size_t capacity) {
+        Logger log("growInstanceBuffers");
+        log << instanceCapacity << " -> " << capacity << " shapes\n";
+        instanceCapacity = capacity;
+        createInstanceBuffers();
+        dropPendingUploads();
+        backlogFirst = backlogEnd = 0;
+        imageSceneVersions.assign(instanceBuffers.size(), 0);
+        commandsVersion += 1;
+    }
+
+    const std::vector<ShapeInstance> &shapes() {
+        materializeScene();
+        return sceneShapes;
+    }
+    // Whether circles and friends actually look like circles, so they're worth adding.
+    bool analyticShapes() const { return shapeRendering == RENDER_SDF; }
+
+    // True if drawing a frame right now would show something different from the last one.
+    bool dirty() const {
+        return redrawRequested || framebufferResized || drawnSceneVersion != sceneVersion || drawnCommandsVersion != commandsVersion ||
+               (waitingOnPipeline && pipelines.readyCount() != pipelinesSeen) || backlogFirst != backlogEnd;
+    }
+
+    // For when what's on screen got lost without the scene changing (window uncovered, etc).
+    void requestRedraw() { redrawRequested = true; }
+
+    // Switches between inline recording (0) and recording on `threads` threads.
+    void setRecordThreads(uint32_t threads) {
+        vkDeviceWaitIdle(device);
+        destroyRecordContexts();
+        recordThreads = threads;
+        createRecordContexts();
+        commandsVersion += 1;
+        recordCommandBuffers();
+    }
+
+    // Spins the next `animateCount` shapes a bit, wrapping around the scene. Good for seeing what
+    // streaming costs: each frame is a fresh batch of changes.
+    void animate() {
+        ProfileZone zone("animate");
+        if (animateCount == 0 || sceneSize() == 0) return;
+        materializeScene();
+
+        uint32_t count = std::min<size_t>(animateCount, sceneShapes.size());
+        if (animateCursor + count > sceneShapes.size()) animateCursor = 0;
+
+        animateScratch.assign(sceneShapes.begin() + animateCursor, sceneShapes.begin() + animateCursor + count);
+        for (auto &shape : animateScratch) shape.rotation += 0.1f;
+        streamShapes(animateCursor, animateScratch.data(), count);
+        animateCursor += count;
+    }
+
+    // Changes `count` shapes starting at `first`, without stalling: the new data goes into the
+    // staging ring right away, and each image copies it into its instance buffer the next time
+    // it comes around. If the ring doesn't have room for all of it, the rest follows over the
+    // next few frames. Doesn't re-sort anything, so changing a shape's depth or alpha this way
+    // can leave it drawn out of order. setShapes() sorts.
+    void streamShapes(uint32_t first, const ShapeInstance *data, uint32_t count) {
+        if (count == 0) return;
+        materializeScene();
+        if (first + count > sceneShapes.size()) die(log << "streamShapes: " << first << '+' << count << " is past the end");
+        std::copy(data, data + count, sceneShapes.begin() + first);
+        sceneVersion += 1;
+        // A pipeline specialized for one shape would draw anything else as that shape too.
+        if (sceneShape != SHAPE_ANY && uniformShape(data, count) != sceneShape) setSceneShape(SHAPE_ANY);
+
+        // The ring can be full of changes some image hasn't picked up yet, or this one can just
+        // be huge. Then the rest waits on the backlog for frames to finish, instead of us waiting
+        // on the GPU.
+        if (stageShapes(first, count, sceneVersion) < count) stagingOverflows += 1;
+    }
+
+    // Per-frame CPU time plus every GPU timer zone, over the last statsWindow frames.
+    void reportTimings() {
+        {
+            Report log("CPU timings");
+            log << "drawFrame: min " << cpuFrameMs.min() << " ms, avg " << cpuFrameMs.avg()
+                << " ms, p99 " << cpuFrameMs.percentile(99) << " ms (" << cpuFrameMs.size() << " frames)\n";
+            if (gpuCull) log << "GPU culling kept " << visibleShapes << '/' << opaqueCount << " opaque shapes\n";
+            if (!headless) {
+                log << "present mode " << presentModeToString(presentMode) << ", " << swapchainImages.size() << " images";
+                if (minFrameInterval > Clock::duration::zero()) {
+                    log << ", capped at " << 1.0 / std::chrono::duration<double>(minFrameInterval).count() << " fps";
+                }
+                log << '\n';
+            }
+            if (!inputToPresentMs.empty()) {
+                log << "input to present: p50 " << inputToPresentMs.percentile(50) << " ms, p99 "
+                    << inputToPresentMs.percentile(99) << " ms (" << inputToPresentMs.size() << " inputs)\n";
+            }
+            if (!recreateMs.empty()) {
+                log << "swapchain recreate: min " << recreateMs.min() << " ms, avg " << recreateMs.avg() << " ms, max "
+                    << recreateMs.max() << " ms (" << recreateMs.size() << " times)\n";
+            }
+            log << "recording one command buffer: min " << recordMs.min() << " ms, avg " << recordMs.avg() << " ms ("
+                << recordMs.size() << " times, " << lazyRecords << " in drawFrame, " << recordThreads << " threads, "
+                << recordWorkers.steals() << " steals)\n";
+        }
+        gpuTimer.report("GPU timings");
+        if (auto fragments = gpuTimer.fragments()) {
+            Report log("Overdraw");
+            double pixels = double(swapchainExtent.width) * swapchainExtent.height;
+            log << fragments->avg() / pixels << " fragments shaded per pixel (avg " << fragments->avg() << ", max "
+                << fragments->max() << " per frame), " << opaqueCount << " opaque and " << instanceCount - opaqueCount
+                << " translucent shapes, " << (depthFormat != VK_FORMAT_UNDEFINED ? "depth buffer" : "no depth buffer") << '\n';
+        }
+        if (dumpGraph) frameGraph.dump("Render graph", &gpuTimer);
+        capture.report("Capture");
+        if (profilingEnabled) profiler.report("CPU profile");
+        if (!meshDraws.empty()) meshes.report("Meshes");
+        allocator.report("Device memory");
+        pipelines.report("Pipelines");
+        {
+            Report log("Pipelines");
+            log << fallbackPipelineRecords << " command buffers recorded with the generic pipeline while waiting on a variant\n";
+        }
+        {
+            Report log("Deferred destruction");
+            log << deletions.destroyed() << " objects destroyed after their last frame, " << deletions.pending() << " still waiting\n";
+        }
+        {
+            Report log("Streaming");
+            log << (stagingRing.inUse() >> 10) << '/' << (stagingRing.capacity() >> 10) << " KiB of staging ring in use, "
+                << pendingUploads.size() << " pending uploads, " << stagingOverflows << " overflows, "
+                << backlogEnd - backlogFirst << " shapes still waiting for room\n";
+        }
+    }
+
+    struct BenchmarkResult {
+        double framesPerSecond;
+        double cpuMs;
+        double gpuMs;
+    };
+
+    // Renders `frameCount` offscreen frames as fast as possible and reports how it went.
+    BenchmarkResult runBenchmark(uint32_t frameCount) {
+        SECTION("=== Headless benchmark ===");
+        cpuFrameMs.clear();
+        gpuTimer.clearStats();
+        profiler.clearStats();
+
+        auto start = Clock::now();
+        for (uint32_t i = 0; i < frameCount; ++i) {
+            animate();
+            drawFrame();
+        }
+        vkDeviceWaitIdle(device);
+        double totalMs = millisecondsSince(start);
+
+        // The last few frames never got their timestamps collected by drawFrame().
+        for (uint32_t i = 0; i < swapchainImages.size(); ++i) gpuTimer.collect(i);
+
+        BenchmarkResult benchmark{frameCount * 1000.0 / totalMs, cpuFrameMs.avg(), 0};
+
+        std::cout << instanceCount << " shapes, " << frameCount << " frames in " << totalMs << " ms = "
+                  << benchmark.framesPerSecond << " frames/sec\n";
+        if (gpuCull) std::cout << visibleShapes << " shapes left after culling\n";
+        std::cout << "CPU per frame: avg " << cpuFrameMs.avg() << " ms, min " << cpuFrameMs.min()
+                  << " ms, max " << cpuFrameMs.max() << " ms\n";
+        if (auto gpu = gpuTimer.stats("shapes")) {
+            benchmark.gpuMs = gpu->avg();
+            std::cout << "GPU per frame: avg " << gpu->avg() << " ms, min " << gpu->min()
+                      << " ms, max " << gpu->max() << " ms\n";
+        }
+        else {
+            std::cout << "GPU per frame: n/a\n";
+        }
+        reportTimings();
+        return benchmark;
+    }
+
+    // --serve: renders every job that turns up in `spool` into an image, until it says stop.
+    // Everything initVulkan() made (the device, pipelines, caches, and instance buffers once
+    // they're big enough) stays warm from one job to the next. A job is one captured frame, and
+    // its scene goes in with setShapes(), which doesn't wait on the GPU, even when the instance
+    // buffers have to grow. So the next job gets loaded and submitted while the last few are
+    // still rendering and being read back, and the GPU goes straight from one to the next.
+    // Nothing in here waits for more than a frame slot (or a readback buffer, with the encoders
+    // behind).
+    void runServer(JobSpool &spool) {
+        SECTION("=== Render server ===");
+        Report log("Jobs");
+        captureNamedOnly = true;
+        cpuFrameMs.clear();
+        gpuTimer.clearStats();
+        profiler.clearStats();
+
+        struct Running {
+            SpoolJob job;
+            size_t shapes;
+            Clock::time_point start;
+        };
+        std::map<std::string, Running> running;
+        // From picking a job up to its image being on disk, and how long it waited before that.
+        RollingStats latencyMs(1 << 16), queuedMs(1 << 16);
+        uint64_t jobsDone = 0, jobsFailed = 0, shapesDrawn = 0, framesDrawn = 0, streamingFrames = 0;
+        optional<Clock::time_point> firstStart;
+        Clock::time_point lastFinish;
+        std::vector<ShapeInstance> shapes;
+
+        auto finishJobs = [&] {
+            for (auto &finished : capture.takeFinished()) {
+                auto found = running.find(finished.name);
+                if (found == running.end()) continue;
+                auto &job = found->second;
+                double ms = millisecondsSince(job.start);
+                spool.finish(job.job, finished.written);
+                lastFinish = Clock::now();
+                if (finished.written) {
+                    jobsDone += 1;
+                    shapesDrawn += job.shapes;
+                    latencyMs.add(ms);
+                    queuedMs.add(job.job.queuedMs);
+                    log << job.job.name << ": " << job.shapes << " shapes in " << ms << " ms (queued for "
+                        << job.job.queuedMs << " ms)\n";
+                }
+                else {
+                    jobsFailed += 1;
+                }
+                running.erase(found);
+            }
+        };
+
+        for (;;) {
+            auto jobs = spool.poll();
+            for (auto &job : jobs) {
+                auto start = Clock::now();
+                if (!firstStart) firstStart = start;
+
+                SceneFile file;
+                if (!file.open(job.scenePath) || file.size() > UINT32_MAX) {
+                    log << job.name << ": couldn't load " << job.scenePath << '\n';
+                    spool.finish(job, false);
+                    jobsFailed += 1;
+                    continue;
+                }
+                shapes.assign(file.shapes(), file.shapes() + file.size());
+                file.close();
+
+                setShapes(shapes);
+                // More than the staging ring has room for goes in over a few frames. Those don't
+                // get captured, and only wait for their frame slots like any other frame.
+                while (backlogFirst != backlogEnd) {
+                    drawFrame();
+                    framesDrawn += 1;
+                    streamingFrames += 1;
+                }
+                nextCaptureName = job.name;
+                drawFrame();
+                framesDrawn += 1;
+                running[job.name] = {job, shapes.size(), start};
+                // Whatever drawFrame() saw get read back might be written by now.
+                finishJobs();
+            }
+            if (!jobs.empty()) continue;
+
+            // Nothing new, so nothing calls drawFrame() to hand finished copies to the encoders.
+            capture.poll();
+            finishJobs();
+            if (running.empty() && spool.takeStop()) break;
+            // Still waiting on the GPU or the encoders, or on somebody to send a job.
+            std::this_thread::sleep_for(std::chrono::milliseconds(running.empty() ? 10 : 1));
+        }
+
+        double totalMs = firstStart ? std::chrono::duration<double, std::milli>(lastFinish - *firstStart).count() : 0;
+        log << jobsDone << " jobs done, " << jobsFailed << " failed";
+        if (totalMs > 0) {
+            log << ", in " << totalMs << " ms: " << jobsDone * 1000.0 / totalMs << " jobs/sec, "
+                << shapesDrawn * 1000.0 / totalMs << " shapes/sec";
+        }
+        log << '\n';
+        if (!latencyMs.empty()) {
+            log << "latency: p50 " << latencyMs.percentile(50) << " ms, p95 " << latencyMs.percentile(95) << " ms, p99 "
+                << latencyMs.percentile(99) << " ms, max " << latencyMs.max() << " ms\n";
+            log << "queued before that: p50 " << queuedMs.percentile(50) << " ms, p99 " << queuedMs.percentile(99)
+                << " ms\n";
+        }
+        if (streamingFrames > 0) log << streamingFrames << " extra frames for scenes too big for the staging ring in one go\n";
+        // How much of the time the GPU had a job to draw. Only as good as the timer window.
+        for (uint32_t i = 0; i < swapchainImages.size(); ++i) gpuTimer.collect(i);
+        if (auto gpu = gpuTimer.stats("shapes"); gpu && totalMs > 0) {
+            log << "GPU per job: avg " << gpu->avg() << " ms, so busy about "
+                << std::min(100.0, gpu->avg() * framesDrawn / totalMs * 100) << "% of the time\n";
+        }
+        reportTimings();
+    }
+
+    // How long does re-recording every command buffer take with `threads` recording threads?
+    // Returns the average in ms over `repeats` goes.
+    double benchmarkRecording(uint32_t threads, uint32_t repeats) {
+        setRecordThreads(threads);
+        RollingStats allMs(repeats);
+        for (uint32_t i = 0; i < repeats; ++i) {
+            auto start = Clock::now();
+            recordCommandBuffers();
+            allMs.add(millisecondsSince(start));
+        }
+        return allMs.avg();
     }
 
     void cleanupSwapchain() {
-        vkDestroySemaphore(device, renderFinishedSemaphore, nullptr);
-        vkDestroySemaphore(device, imageAvailableSemaphore, nullptr);
-        vkDestroyCommandPool(device, commandPool, nullptr);
-        for (auto framebuffer : swapchainFramebuffers) {
-            vkDestroyFramebuffer(device, framebuffer, nullptr);
+        for (size_t i = 0; i < framesInFlight; ++i) {
+            vkDestroyFence(device, inFlightFences[i], nullptr);
+            vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
+            vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
         }
-        vkDestroyPipeline(device, graphicsPipeline, nullptr);
+        gpuTimer.destroy();
+        destroyRecordContexts();
+        vkDestroyCommandPool(device, commandPool, nullptr);
+        frameGraph.destroy();
+        destroyCullPipeline();
+        pipelines.destroy();
         vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-        vkDestroyRenderPass(device, renderPass, nullptr);
-        for (auto imageView : swapchainImageViews) vkDestroyImageView(device, imageView, nullptr);
-        vkDestroySwapchainKHR(device, swapchain, nullptr);
+        swapchainImageViews.clear();
+        if (headless) {
+            for (auto image : swapchainImages) vkDestroyImage(device, image, nullptr);
+            for (auto &memory : offscreenImageMemory) allocator.free(memory);
+        }
+        else {
+            vkDestroySwapchainKHR(device, swapchain, nullptr);
+        }
     }
 
     void cleanup() {
-        vkQueueWaitIdle(presentQueue);
-
+        // Frames can still be in flight on either queue at this point.
+        vkDeviceWaitIdle(device);
+
+        destroyInstanceBuffers();
+        destroyPolygonBuffers();
+        destroyUploadResources();
+        // Writes out whatever got read back but isn't encoded yet.
+        capture.destroy();
         cleanupSwapchain();
-        vkDestroySurfaceKHR(instance, surface, nullptr);
+        // Nothing's in flight anymore, so everything that was waiting on a frame can go.
+        deletions.flush();
+        pipelineCache.save();
+        pipelineCache.destroy();
+        if (!tracePath.empty()) profiler.writeTrace(tracePath);
+        allocator.destroy();
+        if (surface != VK_NULL_HANDLE) vkDestroySurfaceKHR(instance, surface, nullptr);
         vkDestroyDevice(device, nullptr);
         vkDestroyInstance(instance, nullptr);
     }
@@ -811,9 +3050,222 @@ static void glfwError(int id, const char* description) {
   std::cout << "GLFW: (" << id << ") " << description << std::endl;
 }
 
-int main() {
+// makeTestScene(), but all one shape with --shape, with the SDF-only shapes in the mix with --sdf,
+// and with --translucent percent of it see-through.
+static std::vector<ShapeInstance> testScene(const Options &options, size_t count) {
+    auto shapes = makeTestScene(count, 1234, options.sdf);
+    if (options.onlyShape >= 0) {
+        for (auto &shape : shapes) shape.shape = (shape.shape & ~0xFFu) | uint32_t(options.onlyShape);
+    }
+    std::mt19937 rng(5678);
+    for (auto &shape : shapes) {
+        if (rng() % 100 >= options.translucentPercent) continue;
+        uint32_t alpha = 64 + rng() % 128;
+        shape.color = (shape.color & 0x00FFFFFF) | (alpha << 24);
+    }
+    return shapes;
+}
+
+// --bench-tessellate: triangles/sec out of the ear clipper with and without SSE, and what the mesh
+// cache saves when most polygons are repeats. All CPU, so no Vulkan at all.
+static void benchmarkTessellation(const Options &options) {
+    SECTION("=== Tessellation ===");
+    // Flattened up front, so the first part is just the ear clipping.
+    std::vector<Path> paths;
+    std::vector<Point> points;
+    std::vector<uint32_t> contourSizes;
+    for (uint32_t i = 0; i < options.polygonPaths; ++i) {
+        paths.push_back(makeTestPath(i));
+        paths.back().flatten(MeshCache::DEFAULT_TOLERANCE, points, contourSizes);
+    }
+    std::cout << paths.size() << " stars, " << points.size() << " points after flattening\n";
+
+    std::vector<uint32_t> indices;
+    double scalarRate = 0;
+    for (bool simd : {false, true}) {
+        setTessellatorSimd(simd);
+        if (tessellatorSimd() != simd) continue;
+
+        // Round and round for a second, so small --polygon-paths still get a decent sample.
+        uint64_t triangles = 0;
+        auto start = Clock::now();
+        double ms = 0;
+        do {
+            uint32_t first = 0;
+            for (auto size : contourSizes) {
+                indices.clear();
+                triangles += tessellatePolygon(&points[first], size, first, indices);
+                first += size;
+            }
+            ms = millisecondsSince(start);
+        } while (ms < 1000);
+
+        double rate = triangles / ms * 1000;
+        std::cout << (simd ? "SSE:    " : "scalar: ") << rate << " triangles/sec";
+        if (simd && scalarRate > 0) std::cout << " (" << rate / scalarRate << "x scalar)";
+        std::cout << '\n';
+        if (!simd) scalarRate = rate;
+    }
+    setTessellatorSimd(true);
+
+    // The same polygons --polygons would make, through the cache and without it.
+    size_t count = std::max<size_t>(options.polygons, 100000);
+    auto start = Clock::now();
+    MeshCache cache;
+    for (size_t i = 0; i < count; ++i) cache.get(makeTestPath(i % options.polygonPaths));
+    double cachedMs = millisecondsSince(start);
+
+    start = Clock::now();
+    std::vector<Point> vertices;
+    for (size_t i = 0; i < count; ++i) {
+        vertices.clear();
+        indices.clear();
+        tessellatePath(makeTestPath(i % options.polygonPaths), MeshCache::DEFAULT_TOLERANCE, vertices, indices);
+    }
+    double uncachedMs = millisecondsSince(start);
+
+    std::cout << count << " polygons from " << options.polygonPaths << " paths: " << cachedMs << " ms through the mesh cache, "
+              << uncachedMs << " ms tessellating every one (" << uncachedMs / cachedMs << "x)\n";
+    std::cout << "cache holds " << cache.size() << " meshes, " << cache.vertices().size() << " vertices, "
+              << cache.indices().size() / 3 << " triangles\n";
+}
+
+// --bench-scene-load: a big scene out of a .shapes file vs. out of the obvious text file, cold (off
+// the disk, as far as the kernel lets us drop its cache) and hot (from the page cache). Loading the
+// .shapes file goes as far as the memcpy that would fill staging memory, into already touched plain
+// memory here, since there's no GPU.
+static void benchmarkSceneLoading(const Options &options) {
+    SECTION("=== Scene loading ===");
+    const std::string binaryPath = "bench_scene.shapes";
+    const std::string textPath = "bench_scene.txt";
+    auto shapes = testScene(options, options.benchSceneLoad);
+    std::cout << "writing " << shapes.size() << " shapes to " << binaryPath << " and " << textPath << "...\n";
+    if (!writeSceneFile(binaryPath, shapes, false, 0, TRANSLUCENT_NONE, SHAPE_ANY) || !writeTextScene(textPath, shapes)) {
+        die(log << "couldn't write the benchmark scenes");
+    }
+
+    std::vector<ShapeInstance> loaded(shapes.size());
+    auto loadBinary = [&] {
+        SceneFile file;
+        if (!file.open(binaryPath)) die(log << "couldn't read " << binaryPath << " back");
+        memcpy(loaded.data(), file.shapes(), file.size() * sizeof(ShapeInstance));
+    };
+    auto loadText = [&] {
+        std::vector<ShapeInstance> parsed;
+        if (!readTextScene(textPath, parsed)) die(log << "couldn't read " << textPath << " back");
+        loaded = std::move(parsed);
+    };
+
+    std::cout << "format\tMiB\tcold ms\thot ms\thot MiB/s\n";
+    double binaryHotMs = 0;
+    for (bool binary : {true, false}) {
+        const std::string &path = binary ? binaryPath : textPath;
+        auto load = [&] { binary ? loadBinary() : loadText(); };
+
+        dropFromPageCache(path);
+        auto start = Clock::now();
+        load();
+        double coldMs = millisecondsSince(start);
+        start = Clock::now();
+        load();
+        double hotMs = millisecondsSince(start);
+
+        if (loaded.size() != shapes.size() || memcmp(loaded.data(), shapes.data(), shapes.size() * sizeof(ShapeInstance)) != 0) {
+            die(log << path << " didn't load back the scene that went into it");
+        }
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        double mib = double(file.tellg()) / (1 << 20);
+        std::cout << (binary ? ".shapes" : "text") << '\t' << mib << '\t' << coldMs << '\t' << hotMs << '\t'
+                  << mib / hotMs * 1000;
+        if (!binary) std::cout << " (.shapes is " << hotMs / binaryHotMs << "x faster)";
+        std::cout << '\n';
+        if (binary) binaryHotMs = hotMs;
+    }
+
+    std::remove(binaryPath.c_str());
+    std::remove(textPath.c_str());
+}
+
+// The scene to start with: --scene's file, or a random one.
+static void loadStartingScene(RenderState &renderer, const Options &options) {
+    if (!options.scenePath.empty()) renderer.loadSceneFile(options.scenePath);
+    else renderer.loadScene(testScene(options, options.instances));
+}
+
+int main(int argc, char **argv) {
     std::cout << ":)\n";
-    RenderState renderer;
+    Options options = parseOptions(argc, argv);
+    setProfilingEnabled(options.profile);
+    setProfileThreadName("main");
+    if (options.benchTessellate) {
+        benchmarkTessellation(options);
+        return 0;
+    }
+    if (options.benchSceneLoad > 0) {
+        benchmarkSceneLoading(options);
+        return 0;
+    }
+    RenderState renderer(options);
+    if (!options.saveScenePath.empty()) {
+        // Sorted for how this renderer draws, so loading it with the same --blend and --depth skips sorting.
+        if (!renderer.saveScene(testScene(options, options.instances), options.saveScenePath)) return 1;
+        std::cout << "wrote " << options.instances << " shapes to " << options.saveScenePath << '\n';
+        return 0;
+    }
+
+    // No display, no GLFW. Just render a fixed number of frames and see how fast it went.
+    if (options.headless) {
+        renderer.initVulkan(nullptr, {options.width, options.height});
+
+        if (!options.servePath.empty()) {
+            JobSpool spool;
+            spool.open(options.servePath);
+            renderer.runServer(spool);
+        }
+        else if (options.benchInstances) {
+            // How does it scale with the number of shapes?
+            std::vector<std::pair<size_t, RenderState::BenchmarkResult>> results;
+            for (size_t count : {1000, 10000, 100000, 1000000}) {
+                renderer.loadScene(testScene(options, count));
+                results.emplace_back(count, renderer.runBenchmark(options.frames));
+            }
+
+            SECTION("=== Instance scaling ===");
+            std::cout << "shapes\tframes/s\tCPU ms\tGPU ms\tshapes/s\n";
+            for (auto &[count, result] : results) {
+                std::cout << count << '\t' << result.framesPerSecond << '\t' << result.cpuMs << '\t'
+                          << result.gpuMs << '\t' << count * result.framesPerSecond << '\n';
+            }
+        }
+        else if (options.benchRecording) {
+            // How does recording scale with threads? 0 is the old inline path for reference.
+            renderer.loadScene(testScene(options, options.instances));
+            std::vector<uint32_t> threadCounts = {0};
+            uint32_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+            for (uint32_t threads = 1; threads < maxThreads; threads *= 2) threadCounts.push_back(threads);
+            threadCounts.push_back(maxThreads);
+
+            std::vector<double> results;
+            for (auto threads : threadCounts) results.push_back(renderer.benchmarkRecording(threads, options.frames));
+
+            SECTION("=== Recording scaling ===");
+            std::cout << options.instances << " shapes, " << options.drawBatch << " per batch, "
+                      << options.frames << " re-records each\n";
+            std::cout << "threads\trecord ms\tspeedup vs 1 thread\n";
+            for (size_t i = 0; i < threadCounts.size(); ++i) {
+                std::cout << (threadCounts[i] == 0 ? "inline" : std::to_string(threadCounts[i])) << '\t' << results[i]
+                          << '\t' << results[1] / results[i] << '\n';
+            }
+        }
+        else {
+            loadStartingScene(renderer, options);
+            if (options.polygons > 0) renderer.loadPolygons(options.polygons, options.polygonPaths);
+            renderer.runBenchmark(options.frames);
+        }
+
+        renderer.cleanup();
+        return 0;
+    }
 
     glfwSetErrorCallback(glfwError);
     if (!glfwInit()) {
@@ -823,10 +3275,8 @@ int main() {
         return 1;
     }
 
-    // TODO: probably want to support resizing eventually. I think that was like,
-    // we need to rebuild the swap chain or something.
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
     auto window = glfwCreateWindow(800, 600, "Shapes!??", nullptr, nullptr);
     if (!window) {
@@ -836,10 +3286,48 @@ int main() {
         return 2;
     }
     renderer.initVulkan(window);
+    loadStartingScene(renderer, options);
+    if (options.polygons > 0) renderer.loadPolygons(options.polygons, options.polygonPaths);
+
+    glfwSetWindowUserPointer(window, &renderer);
+    glfwSetWindowRefreshCallback(window, [](GLFWwindow *window) {
+        static_cast<RenderState *>(glfwGetWindowUserPointer(window))->requestRedraw();
+    });
+    glfwSetMouseButtonCallback(window, [](GLFWwindow *window, int, int action, int) {
+        if (action == GLFW_PRESS) static_cast<RenderState *>(glfwGetWindowUserPointer(window))->inputArrived();
+    });
+    glfwSetFramebufferSizeCallback(window, [](GLFWwindow *window, int, int) {
+        static_cast<RenderState *>(glfwGetWindowUserPointer(window))->windowResized();
+    });
+    // = and - add or drop a thousand shapes, for poking at the re-record-when-it-changes path.
+    glfwSetKeyCallback(window, [](GLFWwindow *window, int key, int, int action, int) {
+        if (action != GLFW_PRESS) return;
+        auto renderer = static_cast<RenderState *>(glfwGetWindowUserPointer(window));
+        renderer->inputArrived();
+        if (key != GLFW_KEY_EQUAL && key != GLFW_KEY_MINUS) return;
+
+        auto shapes = renderer->shapes();
+        if (key == GLFW_KEY_EQUAL) {
+            auto more = makeTestScene(1000, shapes.size(), renderer->analyticShapes());
+            shapes.insert(shapes.end(), more.begin(), more.end());
+        }
+        else {
+            shapes.resize(shapes.size() > 1000 ? shapes.size() - 1000 : 0);
+        }
+        renderer->setShapes(shapes);
+    });
 
+    uint64_t frame = 0;
     while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
+        // Nothing changed since the last frame? Then there's no point drawing it again, so sleep
+        // until GLFW has something for us.
+        if (options.idle && !renderer.dirty()) glfwWaitEvents();
+        else glfwPollEvents();
+
+        renderer.animate();
+        if (options.idle && !renderer.dirty()) continue;
         renderer.drawFrame();
+        if (options.statsInterval > 0 && ++frame % options.statsInterval == 0) renderer.reportTimings();
     }
 
     renderer.cleanup();
@@ -0,0 +1,273 @@
+#include "memory.h"
+#include "debug.h"
+
+#include <algorithm>
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+void DeviceAllocator::init(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize blockSize) {
+    Logger log("DeviceAllocator::init");
+    this->device = device;
+    this->blockSize = blockSize;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    nonCoherentAtomSize = std::max<VkDeviceSize>(properties.limits.nonCoherentAtomSize, 1);
+    maxAllocations = properties.limits.maxMemoryAllocationCount;
+
+    log << memoryProperties.memoryHeapCount << " heaps, " << memoryProperties.memoryTypeCount << " memory types, "
+        << (blockSize >> 20) << " MiB blocks, max " << maxAllocations << " allocations\n";
+}
+
+void DeviceAllocator::destroy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &block : blocks) {
+        if (block->allocationCount > 0) {
+            debug(log << "DeviceAllocator: leaked " << block->allocationCount << " allocations\n");
+        }
+        if (block->mapped) vkUnmapMemory(device, block->memory);
+        vkFreeMemory(device, block->memory, nullptr);
+    }
+    blocks.clear();
+}
+
+uint32_t DeviceAllocator::findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred) const {
+    uint32_t fallback = UINT32_MAX;
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i) {
+        if (!(typeBits & (1 << i))) continue;
+        auto flags = memoryProperties.memoryTypes[i].propertyFlags;
+        if ((flags & required) != required) continue;
+
+        if ((flags & preferred) == preferred) return i;
+        if (fallback == UINT32_MAX) fallback = i;
+    }
+    return fallback;
+}
+
+bool DeviceAllocator::isHostCoherent(uint32_t memoryType) const {
+    return memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+}
+
+bool DeviceAllocator::isLazilyAllocated(uint32_t memoryType) const {
+    return memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+}
+
+bool DeviceAllocator::hasMemoryType(VkMemoryPropertyFlags flags) const {
+    return findMemoryType(~0u, flags) != UINT32_MAX;
+}
+
+Block *DeviceAllocator::newBlock(VkDeviceSize size, uint32_t memoryType, bool linear, bool dedicated) {
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = memoryType;
+
+    VkDeviceMemory memory;
+    auto result = vkAllocateMemory(device, &allocInfo, nullptr, &memory);
+    if (result != VK_SUCCESS) return nullptr;
+
+    auto block = std::make_unique<Block>();
+    block->memory = memory;
+    block->size = size;
+    block->memoryType = memoryType;
+    block->linear = linear;
+    block->dedicated = dedicated;
+    block->freeRanges[0] = size;
+
+    if (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &block->mapped);
+    }
+
+    blocks.push_back(std::move(block));
+    return blocks.back().get();
+}
+
+// First fit. The free list is small (it's per block and we coalesce) so this is cheap enough.
+bool DeviceAllocator::carve(Block &block, const VkMemoryRequirements &requirements, Allocation &allocation) {
+    for (auto it = block.freeRanges.begin(); it != block.freeRanges.end(); ++it) {
+        VkDeviceSize rangeStart = it->first;
+        VkDeviceSize rangeEnd = it->first + it->second;
+        VkDeviceSize offset = alignUp(rangeStart, std::max<VkDeviceSize>(requirements.alignment, 1));
+        if (offset + requirements.size > rangeEnd) continue;
+
+        // Split the free range into whatever is left before and after us.
+        block.freeRanges.erase(it);
+        if (offset > rangeStart) block.freeRanges[rangeStart] = offset - rangeStart;
+        if (offset + requirements.size < rangeEnd) {
+            block.freeRanges[offset + requirements.size] = rangeEnd - (offset + requirements.size);
+        }
+
+        block.used += requirements.size;
+        block.allocationCount += 1;
+
+        allocation.memory = block.memory;
+        allocation.offset = offset;
+        allocation.size = requirements.size;
+        allocation.memoryType = block.memoryType;
+        allocation.mapped = block.mapped ? static_cast<char*>(block.mapped) + offset : nullptr;
+        allocation.block = &block;
+        return true;
+    }
+    return false;
+}
+
+Allocation DeviceAllocator::allocate(
+    const VkMemoryRequirements &requirements, bool linear,
+    VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred
+) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Allocation allocation;
+
+    uint32_t memoryType = findMemoryType(requirements.memoryTypeBits, required, preferred);
+    if (memoryType == UINT32_MAX) return allocation;
+
+    // Big stuff gets its own vkAllocateMemory, otherwise one fat image could eat a whole block.
+    if (requirements.size > blockSize / 2) {
+        Block *block = newBlock(requirements.size, memoryType, linear, true);
+        if (block) carve(*block, requirements, allocation);
+        return allocation;
+    }
+
+    for (auto &block : blocks) {
+        if (block->dedicated || block->memoryType != memoryType || block->linear != linear) continue;
+        if (block->size - block->used < requirements.size) continue;
+        if (carve(*block, requirements, allocation)) return allocation;
+    }
+
+    Block *block = newBlock(blockSize, memoryType, linear, false);
+    if (block) carve(*block, requirements, allocation);
+    return allocation;
+}
+
+void DeviceAllocator::free(Allocation &allocation) {
+    if (!allocation.block) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    Block &block = *allocation.block;
+
+    block.used -= allocation.size;
+    block.allocationCount -= 1;
+
+    // Put the range back and merge it with its neighbours.
+    auto it = block.freeRanges.emplace(allocation.offset, allocation.size).first;
+    auto next = std::next(it);
+    if (next != block.freeRanges.end() && it->first + it->second == next->first) {
+        it->second += next->second;
+        block.freeRanges.erase(next);
+    }
+    if (it != block.freeRanges.begin()) {
+        auto previous = std::prev(it);
+        if (previous->first + previous->second == it->first) {
+            previous->second += it->second;
+            block.freeRanges.erase(it);
+        }
+    }
+
+    // Dedicated blocks are useless once empty. Regular blocks stick around to be reused.
+    if (block.dedicated) {
+        if (block.mapped) vkUnmapMemory(device, block.memory);
+        vkFreeMemory(device, block.memory, nullptr);
+        blocks.erase(std::find_if(blocks.begin(), blocks.end(), [&](auto &b) { return b.get() == &block; }));
+    }
+
+    allocation = Allocation{};
+}
+
+Allocation DeviceAllocator::createBuffer(
+    VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer &buffer,
+    VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred
+) {
+    VkBufferCreateInfo bufferInfo{};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = size;
+    bufferInfo.usage = usage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    auto result = vkCreateBuffer(device, &bufferInfo, nullptr, &buffer);
+    if (result != VK_SUCCESS) die(log << "Failed to create a " << size << " byte buffer " << result);
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, buffer, &requirements);
+
+    Allocation allocation = allocate(requirements, true, required, preferred);
+    if (!allocation) die(log << "Out of memory for a " << size << " byte buffer (flags " << required << ')');
+    vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
+    return allocation;
+}
+
+Allocation DeviceAllocator::createImage(
+    const VkImageCreateInfo &imageInfo, VkImage &image,
+    VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred
+) {
+    auto result = vkCreateImage(device, &imageInfo, nullptr, &image);
+    if (result != VK_SUCCESS) die(log << "Failed to create image " << result);
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device, image, &requirements);
+
+    bool linear = imageInfo.tiling == VK_IMAGE_TILING_LINEAR;
+    Allocation allocation = allocate(requirements, linear, required, preferred);
+    if (!allocation) die(log << "Out of memory for a " << requirements.size << " byte image (flags " << required << ')');
+    vkBindImageMemory(device, image, allocation.memory, allocation.offset);
+    return allocation;
+}
+
+void DeviceAllocator::flush(const Allocation &allocation, VkDeviceSize offset, VkDeviceSize size) {
+    if (!allocation.mapped || isHostCoherent(allocation.memoryType)) return;
+    if (size == VK_WHOLE_SIZE) size = allocation.size - offset;
+
+    // Flushed ranges have to line up with nonCoherentAtomSize.
+    VkDeviceSize start = (allocation.offset + offset) / nonCoherentAtomSize * nonCoherentAtomSize;
+    VkDeviceSize end = alignUp(allocation.offset + offset + size, nonCoherentAtomSize);
+
+    VkMappedMemoryRange range{};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = allocation.memory;
+    range.offset = start;
+    range.size = std::min(end, allocation.block->size) - start;
+    vkFlushMappedMemoryRanges(device, 1, &range);
+}
+
+void DeviceAllocator::invalidate(const Allocation &allocation, VkDeviceSize offset, VkDeviceSize size) {
+    if (!allocation.mapped || isHostCoherent(allocation.memoryType)) return;
+    if (size == VK_WHOLE_SIZE) size = allocation.size - offset;
+
+    VkDeviceSize start = (allocation.offset + offset) / nonCoherentAtomSize * nonCoherentAtomSize;
+    VkDeviceSize end = alignUp(allocation.offset + offset + size, nonCoherentAtomSize);
+
+    VkMappedMemoryRange range{};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = allocation.memory;
+    range.offset = start;
+    range.size = std::min(end, allocation.block->size) - start;
+    vkInvalidateMappedMemoryRanges(device, 1, &range);
+}
+
+void DeviceAllocator::report(const char *label) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Report log(label);
+
+    struct HeapUsage { size_t blocks = 0, dedicated = 0, allocations = 0; VkDeviceSize reserved = 0, used = 0; };
+    std::vector<HeapUsage> heaps(memoryProperties.memoryHeapCount);
+    for (auto &block : blocks) {
+        auto &heap = heaps[memoryProperties.memoryTypes[block->memoryType].heapIndex];
+        heap.blocks += 1;
+        heap.dedicated += block->dedicated;
+        heap.allocations += block->allocationCount;
+        heap.reserved += block->size;
+        heap.used += block->used;
+    }
+
+    for (uint32_t i = 0; i < heaps.size(); ++i) {
+        auto &heap = heaps[i];
+        bool deviceLocal = memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+        log << "heap " << i << (deviceLocal ? " (device local)" : "") << ": "
+            << (heap.used >> 10) << " KiB used of " << (heap.reserved >> 10) << " KiB reserved, "
+            << (memoryProperties.memoryHeaps[i].size >> 20) << " MiB total; "
+            << heap.allocations << " allocations in " << heap.blocks << " blocks ("
+            << heap.dedicated << " dedicated)\n";
+    }
+    log << blocks.size() << '/' << maxAllocations << " vkAllocateMemory calls in use\n";
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A chunk of some bigger VkDeviceMemory block. Bind your buffer/image at (memory, offset).
+struct Allocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    // Already offset into the block. Null unless the memory is host visible.
+    void *mapped = nullptr;
+    uint32_t memoryType = 0;
+
+    struct Block *block = nullptr;
+
+    explicit operator bool() const { return memory != VK_NULL_HANDLE; }
+};
+
+// One vkAllocateMemory. Small allocations get carved out of these.
+struct Block {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    uint32_t memoryType = 0;
+    // Buffers and optimal-tiling images never share a block, so bufferImageGranularity is a non-issue.
+    bool linear = true;
+    // Holds exactly one allocation that was too big to share.
+    bool dedicated = false;
+    void *mapped = nullptr;
+    VkDeviceSize used = 0;
+    uint32_t allocationCount = 0;
+    // offset -> size, kept coalesced
+    std::map<VkDeviceSize, VkDeviceSize> freeRanges;
+};
+
+// Hands out suballocations of big memory blocks, so we don't run into maxMemoryAllocationCount
+// (which can be as low as 4096) or fragment the heaps with a thousand tiny allocations.
+//
+// Host visible blocks are mapped once when they're created and stay mapped.
+// Thread safe, but not exactly lock-free - don't allocate in hot loops.
+class DeviceAllocator {
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    VkDeviceSize blockSize = 0;
+    VkDeviceSize nonCoherentAtomSize = 1;
+    uint32_t maxAllocations = 0;
+    std::vector<std::unique_ptr<Block>> blocks;
+    std::mutex mutex;
+
+    Block *newBlock(VkDeviceSize size, uint32_t memoryType, bool linear, bool dedicated);
+    bool carve(Block &block, const VkMemoryRequirements &requirements, Allocation &allocation);
+
+public:
+    void init(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize blockSize = 64 << 20);
+    void destroy();
+
+    // Finds a memory type that has every `required` flag, preferring ones that also have the
+    // `preferred` ones. Returns UINT32_MAX if nothing fits.
+    uint32_t findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred = 0) const;
+    bool isHostCoherent(uint32_t memoryType) const;
+    bool isLazilyAllocated(uint32_t memoryType) const;
+    bool hasMemoryType(VkMemoryPropertyFlags flags) const;
+
+    // `linear` is true for buffers and linear images, false for optimal-tiling images.
+    Allocation allocate(
+        const VkMemoryRequirements &requirements, bool linear,
+        VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred = 0
+    );
+    void free(Allocation &allocation);
+
+    // Creates + allocates + binds. Dies if it can't.
+    Allocation createBuffer(
+        VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer &buffer,
+        VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred = 0
+    );
+    Allocation createImage(
+        const VkImageCreateInfo &imageInfo, VkImage &image,
+        VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred = 0
+    );
+
+    // Only does anything for host visible memory that isn't coherent.
+    void flush(const Allocation &allocation, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+    // The other direction: before reading what the GPU wrote.
+    void invalidate(const Allocation &allocation, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+
+    // Per-heap usage, through Logger.
+    void report(const char *label);
+};
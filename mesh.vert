@@ -0,0 +1,30 @@
+#version 450
+
+// triangle.vert for tessellated paths (see MeshCache): the same per-instance ShapeInstance places
+// the mesh, but the corners come from a vertex buffer instead of a table.
+layout(location = 0) in vec4 inRect;          // center x, y, width, height
+layout(location = 1) in vec2 inRotationDepth;
+layout(location = 2) in vec4 inColor;
+layout(location = 3) in uint inShape;
+// Per vertex, in the same -0.5..0.5 box as triangle.vert's corners.
+layout(location = 4) in vec2 inPosition;
+
+// Everything triangle.frag reads, even though only fragColor means anything without SDF.
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out vec2 fragLocal;
+layout(location = 2) flat out vec2 fragHalfSize;
+layout(location = 3) flat out uint fragShape;
+
+void main() {
+    vec2 corner = inPosition * inRect.zw;
+
+    float s = sin(inRotationDepth.x);
+    float c = cos(inRotationDepth.x);
+    vec2 rotated = vec2(corner.x * c - corner.y * s, corner.x * s + corner.y * c);
+
+    gl_Position = vec4(inRect.xy + rotated, inRotationDepth.y, 1.0);
+    fragColor = inColor;
+    fragLocal = vec2(0.0);
+    fragHalfSize = vec2(0.0);
+    fragShape = inShape;
+}
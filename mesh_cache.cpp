@@ -0,0 +1,72 @@
+#include "mesh_cache.h"
+#include "debug.h"
+
+#include <chrono>
+#include <cstring>
+
+// The murmur3 finalizer: every input bit ends up affecting every output bit.
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// 8 bytes at a time, which is plenty fast next to tessellating even a small path.
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+    auto bytes = static_cast<const unsigned char *>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = mix(hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    }
+    uint64_t tail = 0;
+    if (size > i) memcpy(&tail, bytes + i, size - i);
+    return mix(hash ^ tail ^ (uint64_t(size) << 56));
+}
+
+uint64_t hashPath(const Path &path) {
+    uint64_t hash = hashBytes(0, path.verbs.data(), path.verbs.size());
+    return hashBytes(hash, path.points.data(), path.points.size() * sizeof(Point));
+}
+
+uint32_t MeshCache::get(const Path &path) {
+    uint64_t hash = hashPath(path);
+    auto found = ids.find(hash);
+    if (found != ids.end()) {
+        hits += 1;
+        return found->second;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Mesh mesh{};
+    mesh.firstVertex = allVertices.size();
+    mesh.firstIndex = allIndices.size();
+    triangles += tessellatePath(path, tolerance, allVertices, allIndices);
+    mesh.vertexCount = allVertices.size() - mesh.firstVertex;
+    mesh.indexCount = allIndices.size() - mesh.firstIndex;
+    tessellateMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    misses += 1;
+    uint32_t id = meshes.size();
+    meshes.push_back(mesh);
+    ids.emplace(hash, id);
+    return id;
+}
+
+void MeshCache::markUploaded() {
+    uploadedVertices = allVertices.size();
+    uploadedIndices = allIndices.size();
+}
+
+void MeshCache::report(const char *label) {
+    Report log(label);
+    log << meshes.size() << " meshes, " << triangles << " triangles, " << allVertices.size() << " vertices ("
+        << ((allVertices.size() * sizeof(Point) + allIndices.size() * sizeof(uint32_t)) >> 10) << " KiB)\n";
+    log << hits << " hits, " << misses << " misses, " << tessellateMs << " ms tessellating";
+    if (tessellateMs > 0) log << " (" << triangles / tessellateMs * 1000 << " triangles/sec)";
+    log << '\n';
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "tessellator.h"
+
+// Where one tessellated path is in MeshCache's arrays. Indices point into the whole vertex array,
+// so a mesh draws with vkCmdDrawIndexed(indexCount, ..., firstIndex, 0, ...).
+struct Mesh {
+    uint32_t firstVertex;
+    uint32_t vertexCount;
+    uint32_t firstIndex;
+    uint32_t indexCount;
+};
+
+// Tessellated paths, keyed by a hash of what's in them. Asking for a path that's been asked for
+// before (by another instance, or last frame) costs a hash and a lookup: each distinct path only
+// ever gets tessellated once. Every mesh goes into the same two append-only arrays, so all of
+// them fit in one vertex and one index buffer, and an upload only has to copy what's been added
+// since the last one.
+class MeshCache {
+public:
+    // In path space, which is -0.5..0.5 for a whole shape. 1/1024 is under a pixel off until a
+    // shape is a thousand pixels across.
+    static constexpr float DEFAULT_TOLERANCE = 1.0f / 1024;
+
+    explicit MeshCache(float tolerance = DEFAULT_TOLERANCE) : tolerance(tolerance) {}
+
+    // The id of `path`'s mesh, tessellating it if it's new.
+    uint32_t get(const Path &path);
+    const Mesh &mesh(uint32_t id) const { return meshes[id]; }
+    size_t size() const { return meshes.size(); }
+
+    const std::vector<Point> &vertices() const { return allVertices; }
+    const std::vector<uint32_t> &indices() const { return allIndices; }
+
+    // How much of vertices() and indices() the GPU already has. Whoever uploads copies from
+    // here to the end, then calls markUploaded(). Set them back to 0 to upload everything again.
+    uint32_t uploadedVertices = 0;
+    uint32_t uploadedIndices = 0;
+    void markUploaded();
+
+    void report(const char *label);
+
+private:
+    float tolerance;
+    std::vector<Mesh> meshes;
+    // Content hash to mesh id. 64 bits, so it'd take billions of distinct paths before two of
+    // them collide, and we don't bother checking.
+    std::unordered_map<uint64_t, uint32_t> ids;
+    std::vector<Point> allVertices;
+    std::vector<uint32_t> allIndices;
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t triangles = 0;
+    double tessellateMs = 0;
+};
+
+// 64-bit hash of a path's verbs and points (and nothing else).
+uint64_t hashPath(const Path &path);
@@ -0,0 +1,259 @@
+#include "options.h"
+#include "debug.h"
+
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+static void usage(const char *program) {
+    std::cout << "usage: " << program << " [options]\n"
+              << "  --frames-in-flight N   let the CPU get up to N (1-" << MAX_FRAMES_IN_FLIGHT << ") frames ahead"
+              << " of the GPU (default 2)\n"
+              << "  --pipeline-cache PATH  load/save compiled pipelines at PATH (default shapes.pipelinecache)\n"
+              << "  --no-pipeline-cache    compile pipelines from scratch and don't save them\n"
+              << "  --stats N              print rolling CPU/GPU frame timings every N frames\n"
+              << "  --instances N          number of random shapes in the test scene (default 1000)\n"
+              << "  --headless             no window: render offscreen and print a throughput benchmark\n"
+              << "  --frames N             how many frames --headless renders (default 1000)\n"
+              << "  --size WxH             framebuffer size for --headless (default 800x600)\n"
+              << "  --bench-instances      with --headless, benchmark 1k/10k/100k/1M shapes\n"
+              << "  --staging-ring MIB     size of the ring buffer streamed shape changes go through (default 32)\n"
+              << "  --animate N            spin N shapes per frame, streaming the changes to the GPU\n"
+              << "  --record-threads N     record draws into secondary command buffers on N threads (default 0, inline)\n"
+              << "  --draw-batch N         shapes per secondary command buffer (default 4096)\n"
+              << "  --bench-recording      with --headless, time command buffer recording at 1..all threads\n"
+              << "  --gpu-cull             cull shapes in a compute shader and draw the rest indirectly\n"
+              << "  --cull-min-pixels N    with --gpu-cull, drop shapes under N pixels across (default 1)\n"
+              << "  --no-idle              keep drawing frames even when nothing on screen changed\n"
+              << "  --present MODE         balanced (default), low-latency, throughput or power-saver\n"
+              << "  --max-fps N            never draw more than N frames per second (power-saver defaults to 30)\n"
+              << "  --pipeline-threads N   compile pipeline variants on N background threads (default 2)\n"
+              << "  --no-precompile        only compile pipeline variants once a scene needs them\n"
+              << "  --blend MODE           opaque (default) or alpha\n"
+              << "  --no-depth             no depth buffer or sorting: draw shapes in scene order (to compare overdraw)\n"
+              << "  --translucent PERCENT  make PERCENT of the test scene see-through (shows with --blend alpha)\n"
+              << "  --shape TYPE           make the test scene all triangle, rectangle, diamond, circle, rounded-rect or ring\n"
+              << "  --sdf                  draw shapes with signed distance functions: antialiased, and circles etc. work\n"
+              << "  --polygons N           also draw N tessellated stars along with the shapes\n"
+              << "  --polygon-paths N      how many different stars --polygons picks from (default 64)\n"
+              << "  --bench-tessellate     time the polygon tessellator and mesh cache, then exit\n"
+              << "  --scene PATH           draw the scene in the .shapes file at PATH instead of a random one\n"
+              << "  --save-scene PATH      write the test scene to PATH as a .shapes file, then exit\n"
+              << "  --bench-scene-load N   time loading N shapes from a .shapes file vs. a text file, then exit\n"
+              << "  --device N|NAME        use device N from the startup list, or the first one whose name has NAME in it\n"
+              << "  --calibrate-devices    time a few frames on every usable device and take the fastest\n"
+              << "  --device-cache PATH    remember --calibrate-devices results at PATH (default shapes.devicecache)\n"
+              << "  --profile              time CPU zones and print their p50/p95/p99 with the other timings\n"
+              << "  --trace PATH           profile, and write a Chrome trace (chrome://tracing) to PATH on exit\n"
+              << "  --dump-graph           print the frame's render graph (passes, barriers, attachments) with per-pass GPU times\n"
+              << "  --capture DIR          write every frame to DIR as an image file, without slowing the frame loop down\n"
+              << "  --capture-format FMT   png (default) or raw (binary PPM)\n"
+              << "  --capture-buffers N    readback buffers for --capture (default frames in flight + threads + 1)\n"
+              << "  --capture-threads N    threads encoding --capture files (default 2)\n"
+              << "  --capture-drop         skip frames while the encoders are behind, instead of waiting for them\n"
+              << "  --serve DIR            render server: DIR/NAME.shapes in, DIR/NAME.png out, until DIR/stop turns up\n"
+              << "  --help                 this\n";
+}
+
+// Grabs the value that comes after a flag, or dies trying.
+static const char *nextArg(int argc, char **argv, int &i) {
+    if (i + 1 >= argc) die(log << argv[i] << " needs a value");
+    return argv[++i];
+}
+
+static uint32_t parseCount(const char *flag, const char *value) {
+    char *end;
+    unsigned long n = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0') die(log << flag << " wants a number, not \"" << value << '"');
+    return static_cast<uint32_t>(n);
+}
+
+Options parseOptions(int argc, char **argv) {
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+
+        if (strcmp(arg, "--frames-in-flight") == 0) {
+            options.framesInFlight = parseCount(arg, nextArg(argc, argv, i));
+            if (options.framesInFlight < 1 || options.framesInFlight > MAX_FRAMES_IN_FLIGHT) {
+                die(log << "--frames-in-flight has to be between 1 and " << MAX_FRAMES_IN_FLIGHT);
+            }
+        }
+        else if (strcmp(arg, "--pipeline-cache") == 0) {
+            options.pipelineCachePath = nextArg(argc, argv, i);
+        }
+        else if (strcmp(arg, "--no-pipeline-cache") == 0) {
+            options.pipelineCachePath.clear();
+        }
+        else if (strcmp(arg, "--stats") == 0) {
+            options.statsInterval = parseCount(arg, nextArg(argc, argv, i));
+        }
+        else if (strcmp(arg, "--instances") == 0) {
+            options.instances = parseCount(arg, nextArg(argc, argv, i));
+        }
+        else if (strcmp(arg, "--headless") == 0) {
+            options.headless = true;
+        }
+        else if (strcmp(arg, "--frames") == 0) {
+            options.frames = parseCount(arg, nextArg(argc, argv, i));
+        }
+        else if (strcmp(arg, "--size") == 0) {
+            const char *value = nextArg(argc, argv, i);
+            if (sscanf(value, "%ux%u", &options.width, &options.height) != 2 || options.width == 0 || options.height == 0) {
+                die(log << "--size wants WIDTHxHEIGHT, like 800x600. not \"" << value << '"');
+            }
+        }
+        else if (strcmp(arg, "--bench-instances") == 0) {
+            options.benchInstances = true;
+        }
+        else if (strcmp(arg, "--staging-ring") == 0) {
+            options.stagingRingMiB = parseCount(arg, nextArg(argc, argv, i));
+            if (options.stagingRingMiB == 0) die(log << "--staging-ring needs at least 1 MiB");
+        }
+        else if (strcmp(arg, "--animate") == 0) {
+            options.animate = parseCount(arg, nextArg(argc, argv, i));
+        }
+        else if (strcmp(arg, "--record-threads") == 0) {
+            options.recordThreads = parseCount(arg, nextArg(argc, argv, i));
+        }
+        else if (strcmp(arg, "--draw-batch") == 0) {
+            options.drawBatch = parseCount(arg, nextArg(argc, argv, i));
+            if (options.drawBatch == 0) die(log << "--draw-batch needs at least 1 shape");
+        }
+        else if (strcmp(arg, "--bench-recording") == 0) {
+            options.benchRecording = true;
+        }
+        else if (strcmp(arg, "--gpu-cull") == 0) {
+            options.gpuCull = true;
+        }
+        else if (strcmp(arg, "--cull-min-pixels") == 0) {
+            options.cullMinPixels = parseCount(arg, nextArg(argc, argv, i));
+        }
+        else if (strcmp(arg, "--no-idle") == 0) {
+            options.idle = false;
+        }
+        else if (strcmp(arg, "--present") == 0) {
+            const char *value = nextArg(argc, argv, i);
+            if (strcmp(value, "balanced") == 0) options.presentPacing = PACING_BALANCED;
+            else if (strcmp(value, "low-latency") == 0) options.presentPacing = PACING_LOW_LATENCY;
+            else if (strcmp(value, "throughput") == 0) options.presentPacing = PACING_THROUGHPUT;
+            else if (strcmp(value, "power-saver") == 0) options.presentPacing = PACING_POWER_SAVER;
+            else die(log << "--present wants balanced, low-latency, throughput or power-saver. not \"" << value << '"');
+        }
+        else if (strcmp(arg, "--max-fps") == 0) {
+            options.maxFps = parseCount(arg, nextArg(argc, argv, i));
+        }
+        else if (strcmp(arg, "--pipeline-threads") == 0) {
+            options.pipelineThreads = parseCount(arg, nextArg(argc, argv, i));
+        }
+        else if (strcmp(arg, "--no-precompile") == 0) {
+            options.precompilePipelines = false;
+        }
+        else if (strcmp(arg, "--blend") == 0) {
+            const char *value = nextArg(argc, argv, i);
+            if (strcmp(value, "opaque") == 0) options.alphaBlend = false;
+            else if (strcmp(value, "alpha") == 0) options.alphaBlend = true;
+            else die(log << "--blend wants opaque or alpha. not \"" << value << '"');
+        }
+        else if (strcmp(arg, "--no-depth") == 0) {
+            options.depth = false;
+        }
+        else if (strcmp(arg, "--translucent") == 0) {
+            options.translucentPercent = parseCount(arg, nextArg(argc, argv, i));
+            if (options.translucentPercent > 100) die(log << "--translucent is a percentage, 0 to 100");
+        }
+        else if (strcmp(arg, "--shape") == 0) {
+            const char *value = nextArg(argc, argv, i);
+            if (strcmp(value, "triangle") == 0) options.onlyShape = 0;
+            else if (strcmp(value, "rectangle") == 0) options.onlyShape = 1;
+            else if (strcmp(value, "diamond") == 0) options.onlyShape = 2;
+            else if (strcmp(value, "circle") == 0) options.onlyShape = 3;
+            else if (strcmp(value, "rounded-rect") == 0) options.onlyShape = 4;
+            else if (strcmp(value, "ring") == 0) options.onlyShape = 5;
+            else die(log << "--shape wants triangle, rectangle, diamond, circle, rounded-rect or ring. not \"" << value << '"');
+        }
+        else if (strcmp(arg, "--sdf") == 0) {
+            options.sdf = true;
+        }
+        else if (strcmp(arg, "--polygons") == 0) {
+            options.polygons = parseCount(arg, nextArg(argc, argv, i));
+        }
+        else if (strcmp(arg, "--polygon-paths") == 0) {
+            options.polygonPaths = parseCount(arg, nextArg(argc, argv, i));
+            if (options.polygonPaths == 0) die(log << "--polygon-paths needs at least 1 path");
+        }
+        else if (strcmp(arg, "--bench-tessellate") == 0) {
+            options.benchTessellate = true;
+        }
+        else if (strcmp(arg, "--scene") == 0) {
+            options.scenePath = nextArg(argc, argv, i);
+        }
+        else if (strcmp(arg, "--save-scene") == 0) {
+            options.saveScenePath = nextArg(argc, argv, i);
+        }
+        else if (strcmp(arg, "--bench-scene-load") == 0) {
+            options.benchSceneLoad = parseCount(arg, nextArg(argc, argv, i));
+            if (options.benchSceneLoad == 0) die(log << "--bench-scene-load needs at least 1 shape");
+        }
+        else if (strcmp(arg, "--device") == 0) {
+            options.device = nextArg(argc, argv, i);
+        }
+        else if (strcmp(arg, "--calibrate-devices") == 0) {
+            options.calibrateDevices = true;
+        }
+        else if (strcmp(arg, "--device-cache") == 0) {
+            options.deviceCachePath = nextArg(argc, argv, i);
+        }
+        else if (strcmp(arg, "--profile") == 0) {
+            options.profile = true;
+        }
+        else if (strcmp(arg, "--trace") == 0) {
+            options.tracePath = nextArg(argc, argv, i);
+            options.profile = true;
+        }
+        else if (strcmp(arg, "--dump-graph") == 0) {
+            options.dumpGraph = true;
+        }
+        else if (strcmp(arg, "--capture") == 0) {
+            options.capturePath = nextArg(argc, argv, i);
+        }
+        else if (strcmp(arg, "--capture-format") == 0) {
+            const char *value = nextArg(argc, argv, i);
+            if (strcmp(value, "png") == 0) options.captureRaw = false;
+            else if (strcmp(value, "raw") == 0) options.captureRaw = true;
+            else die(log << "--capture-format wants png or raw. not \"" << value << '"');
+        }
+        else if (strcmp(arg, "--capture-buffers") == 0) {
+            options.captureBuffers = parseCount(arg, nextArg(argc, argv, i));
+        }
+        else if (strcmp(arg, "--capture-threads") == 0) {
+            options.captureThreads = parseCount(arg, nextArg(argc, argv, i));
+            if (options.captureThreads == 0) die(log << "--capture-threads needs at least 1 thread");
+        }
+        else if (strcmp(arg, "--capture-drop") == 0) {
+            options.captureDrop = true;
+        }
+        else if (strcmp(arg, "--serve") == 0) {
+            options.servePath = nextArg(argc, argv, i);
+        }
+        else if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            usage(argv[0]);
+            exit(0);
+        }
+        else {
+            usage(argv[0]);
+            die(log << "what's " << arg << "?");
+        }
+    }
+
+    if (options.presentPacing == PACING_POWER_SAVER && options.maxFps == 0) options.maxFps = 30;
+    // The server's images come out of --capture, named after their jobs, and none can be dropped.
+    if (!options.servePath.empty()) {
+        options.headless = true;
+        options.capturePath = options.servePath;
+        options.captureDrop = false;
+    }
+    return options;
+}
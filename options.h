@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// How the swapchain trades latency against throughput and power. See SwapchainSupport in main.cpp.
+enum PresentPacing {
+    PACING_BALANCED,    // FIFO, min + 1 images. What we always did.
+    PACING_LOW_LATENCY, // MAILBOX (or IMMEDIATE), as few images as allowed
+    PACING_THROUGHPUT,  // FIFO with extra images, so the GPU never waits on the display
+    PACING_POWER_SAVER, // FIFO_RELAXED, and capped at --max-fps (30 unless told otherwise)
+};
+
+// Everything you can pass on the command line. See parseOptions() for the flags.
+struct Options {
+    // How many frames the CPU may queue up before drawFrame() has to wait on the GPU.
+    uint32_t framesInFlight = 2;
+    // Where the VkPipelineCache blob lives between launches. Empty means don't use one.
+    std::string pipelineCachePath = "shapes.pipelinecache";
+    // Print CPU/GPU timing stats every this many frames. 0 = never (headless prints at the end anyway).
+    uint32_t statsInterval = 0;
+    // How many random shapes to put in the test scene.
+    uint32_t instances = 1000;
+
+    // Render offscreen with no window or swapchain, for `frames` frames, then print stats.
+    bool headless = false;
+    uint32_t frames = 1000;
+    uint32_t width = 800;
+    uint32_t height = 600;
+    // Run the headless benchmark at 1k, 10k, 100k and 1M shapes instead of just once.
+    bool benchInstances = false;
+
+    // Size of the ring buffer that streamed shape changes go through, in MiB.
+    uint32_t stagingRingMiB = 32;
+    // Spin this many shapes every frame (streamed through the staging ring). 0 = static scene.
+    uint32_t animate = 0;
+
+    // Record draws into secondary command buffers on this many threads. 0 = inline, on the main thread.
+    uint32_t recordThreads = 0;
+    // How many shapes go in each secondary command buffer with --record-threads.
+    uint32_t drawBatch = 4096;
+    // With --headless, time command buffer recording at different thread counts instead of rendering.
+    bool benchRecording = false;
+
+    // Frustum/size cull on the GPU with cull.comp and draw whatever's left with vkCmdDrawIndirect.
+    bool gpuCull = false;
+    // With --gpu-cull, shapes smaller than this many pixels across get dropped.
+    uint32_t cullMinPixels = 1;
+
+    // Only draw when something changed, and sleep in glfwWaitEvents() otherwise.
+    bool idle = true;
+
+    PresentPacing presentPacing = PACING_BALANCED;
+    // Don't start frames more often than this. 0 = as fast as the present mode lets us.
+    uint32_t maxFps = 0;
+
+    // Background threads compiling specialized shape pipelines. 0 = compile on the main thread
+    // whenever one is needed, and wait for it.
+    uint32_t pipelineThreads = 2;
+    // Queue every variant at startup instead of waiting until a scene needs one.
+    bool precompilePipelines = true;
+    // Blend shapes by their alpha instead of drawing them opaque.
+    bool alphaBlend = false;
+    // Depth buffer, with the opaque shapes sorted front to back so the ones behind get rejected
+    // before shading. Off draws everything in scene order, which is handy for comparing overdraw.
+    bool depth = true;
+    // Give this many percent of the test scene's shapes an alpha somewhere under 1, so
+    // --blend alpha has something to draw in the translucent pass.
+    uint32_t translucentPercent = 0;
+    // Make the test scene all one ShapeType, so it gets a specialized pipeline. -1 = a mix.
+    int onlyShape = -1;
+    // Draw shapes as quads cut out by signed distance functions in the fragment shader, which
+    // gets antialiased edges and adds circles, rounded rectangles and rings. See ShapeRendering.
+    bool sdf = false;
+    // Also draw this many random stars, tessellated on the CPU (see MeshCache). They're picked
+    // from `polygonPaths` different ones, so most are repeats the cache already has.
+    uint32_t polygons = 0;
+    uint32_t polygonPaths = 64;
+    // Time the tessellator (with and without SSE) and the mesh cache, then exit. No GPU needed.
+    bool benchTessellate = false;
+
+    // Draw the scene in this .shapes file (see scene_file.h) instead of a random test scene.
+    std::string scenePath;
+    // Write the test scene (--instances, --shape, --translucent...) out as a .shapes file, then exit.
+    std::string saveScenePath;
+    // Time loading this many shapes from a .shapes file against parsing them out of a text file,
+    // then exit. 0 = don't. No GPU needed.
+    uint32_t benchSceneLoad = 0;
+
+    // Use this device instead of the best scoring one: its number in the "device N/M" list at
+    // startup, or a piece of its name. Empty = pick one ourselves.
+    std::string device;
+    // Time a few frames on every usable device and take the fastest, instead of going by the scores.
+    bool calibrateDevices = false;
+    // Where --calibrate-devices keeps its measurements, so each device only gets measured once
+    // (per driver version). Empty means measure every time.
+    std::string deviceCachePath = "shapes.devicecache";
+
+    // Time ProfileZones (see profiler.h) and print per-zone p50/p95/p99 with the other stats.
+    bool profile = false;
+    // Also write every zone out as a Chrome trace here when we exit. Empty = don't. Implies profile.
+    std::string tracePath;
+    // Print the compiled render graph (see render_graph.h) when it's built, and again with each
+    // pass's GPU time along with the other stats.
+    bool dumpGraph = false;
+
+    // Write every frame out as an image file in this directory (see FrameCapture). Empty = don't.
+    std::string capturePath;
+    // Binary PPMs instead of PNGs.
+    bool captureRaw = false;
+    // Readback buffers frames get copied into. 0 = enough for every frame in flight plus one
+    // per encoder and one spare.
+    uint32_t captureBuffers = 0;
+    uint32_t captureThreads = 2;
+    // When every readback buffer is busy, skip the frame instead of waiting for an encoder.
+    bool captureDrop = false;
+
+    // Run as a render server: draw every .shapes file that shows up in this directory into an
+    // image next to it (see JobSpool), until a stop file does. Implies --headless, with --capture
+    // into the same directory. Empty = don't.
+    std::string servePath;
+};
+
+const uint32_t MAX_FRAMES_IN_FLIGHT = 3;
+
+Options parseOptions(int argc, char **argv);
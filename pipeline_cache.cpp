@@ -0,0 +1,118 @@
+#include "pipeline_cache.h"
+#include "debug.h"
+
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+// The driver will happily reject a cache blob from a different GPU or driver version, but some
+// drivers have been known to crash on garbage instead. So we check the header ourselves first.
+// https://www.khronos.org/registry/vulkan/specs/1.1-extensions/html/vkspec.html#pipelines-cache-header
+static bool cacheHeaderMatches(const std::vector<char> &data, const VkPhysicalDeviceProperties &props, Logger &log) {
+    VkPipelineCacheHeaderVersionOne header;
+    if (data.size() < sizeof(header)) {
+        log << "cache file is too small to even have a header\n";
+        return false;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+
+    if (header.headerSize < sizeof(header) || header.headerSize > data.size()) {
+        log << "bogus header size " << header.headerSize << '\n';
+        return false;
+    }
+    if (header.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE) {
+        log << "unknown header version " << header.headerVersion << '\n';
+        return false;
+    }
+    if (header.vendorID != props.vendorID || header.deviceID != props.deviceID) {
+        log << "cache is for a different device (vendor " << header.vendorID << " device " << header.deviceID << ")\n";
+        return false;
+    }
+    if (memcmp(header.pipelineCacheUUID, props.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+        log << "cache UUID doesn't match (new driver?)\n";
+        return false;
+    }
+    return true;
+}
+
+void PipelineCache::load(VkDevice device, VkPhysicalDevice physicalDevice, const std::string &path) {
+    Logger log("PipelineCache::load");
+    this->device = device;
+    this->path = path;
+
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physicalDevice, &props);
+
+    std::vector<char> data;
+    std::ifstream file(path, std::ios::binary);
+    if (file) {
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        log << "read " << data.size() << " bytes from " << path << '\n';
+        warm = cacheHeaderMatches(data, props, log);
+        if (!warm) data.clear();
+    }
+    else {
+        log << "no cache at " << path << " yet\n";
+    }
+
+    VkPipelineCacheCreateInfo createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    createInfo.initialDataSize = data.size();
+    createInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+    auto result = vkCreatePipelineCache(device, &createInfo, nullptr, &handle);
+    if (result != VK_SUCCESS && warm) {
+        // The header looked fine but the driver still didn't like it. Start over empty.
+        log << "driver rejected the cache data (" << result << "), starting cold\n";
+        warm = false;
+        createInfo.initialDataSize = 0;
+        createInfo.pInitialData = nullptr;
+        result = vkCreatePipelineCache(device, &createInfo, nullptr, &handle);
+    }
+    if (result != VK_SUCCESS) die(log << "Couldn't even create an empty pipeline cache " << result);
+
+    log << "pipeline cache is " << (warm ? "warm" : "cold") << '\n';
+}
+
+void PipelineCache::save() {
+    Logger log("PipelineCache::save");
+    if (handle == VK_NULL_HANDLE) return;
+
+    size_t size = 0;
+    vkGetPipelineCacheData(device, handle, &size, nullptr);
+    std::vector<char> data(size);
+    auto result = vkGetPipelineCacheData(device, handle, &size, data.data());
+    if (result != VK_SUCCESS) {
+        log << "couldn't get pipeline cache data " << result << ", not saving\n";
+        return;
+    }
+
+    // Write to a temp file and rename it over the real one, so a crash mid-write
+    // can't leave a half-written cache behind for the next launch.
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            log << "couldn't open " << tempPath << " for writing\n";
+            return;
+        }
+        file.write(data.data(), size);
+        if (!file) {
+            log << "failed writing " << tempPath << '\n';
+            return;
+        }
+    }
+    if (std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        log << "couldn't move " << tempPath << " to " << path << '\n';
+        return;
+    }
+    log << "wrote " << size << " bytes to " << path << '\n';
+}
+
+void PipelineCache::destroy() {
+    if (handle == VK_NULL_HANDLE) return;
+    vkDestroyPipelineCache(device, handle, nullptr);
+    handle = VK_NULL_HANDLE;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <string>
+
+// A VkPipelineCache that lives on disk between launches, so the driver only has to compile
+// our shaders once. Call load() right after the logical device exists and save() before it dies.
+class PipelineCache {
+    VkDevice device = VK_NULL_HANDLE;
+    std::string path;
+
+public:
+    VkPipelineCache handle = VK_NULL_HANDLE;
+    // True if we actually got usable data off the disk.
+    bool warm = false;
+
+    void load(VkDevice device, VkPhysicalDevice physicalDevice, const std::string &path);
+    void save();
+    void destroy();
+
+    operator VkPipelineCache() { return handle; }
+};
@@ -0,0 +1,354 @@
+#include "pipelines.h"
+#include "debug.h"
+#include "profiler.h"
+#include "scene.h"
+#include "tessellator.h"
+
+#include <algorithm>
+#include <chrono>
+
+using Clock = std::chrono::steady_clock;
+
+static VkShaderModule createShaderModule(VkDevice device, const unsigned char *code, unsigned int length) {
+    VkShaderModuleCreateInfo createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    createInfo.codeSize = length;
+    createInfo.pCode = reinterpret_cast<const uint32_t*>(code);
+
+    VkShaderModule shaderModule;
+    auto result = vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule);
+    if (result != VK_SUCCESS) die(log << "Failed to send shader to GPU " << result);
+    return shaderModule;
+}
+
+void PipelineLibrary::init(
+    VkDevice device, VkPipelineCache cache, VkPipelineLayout layout, VkFormat depthFormat,
+    const unsigned char *vertCode, unsigned int vertLength,
+    const unsigned char *fragCode, unsigned int fragLength,
+    const unsigned char *meshCode, unsigned int meshLength,
+    uint32_t threadCount
+) {
+    this->device = device;
+    this->cache = cache;
+    this->layout = layout;
+    this->depthFormat = depthFormat;
+    vertModule = ShaderModule(device, createShaderModule(device, vertCode, vertLength));
+    fragModule = ShaderModule(device, createShaderModule(device, fragCode, fragLength));
+    meshModule = ShaderModule(device, createShaderModule(device, meshCode, meshLength));
+
+    stopping = false;
+    for (uint32_t i = 0; i < threadCount; ++i) threads.emplace_back(&PipelineLibrary::workerLoop, this);
+}
+
+void PipelineLibrary::destroy() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        queue.clear();
+    }
+    wake.notify_all();
+    for (auto &thread : threads) thread.join();
+    threads.clear();
+
+    for (auto &[variant, entry] : entries) {
+        if (entry.pipeline != VK_NULL_HANDLE) vkDestroyPipeline(device, entry.pipeline, nullptr);
+    }
+    entries.clear();
+    renderPasses.clear();
+    vertModule.reset();
+    fragModule.reset();
+    meshModule.reset();
+}
+
+void PipelineLibrary::request(const PipelineVariant &variant) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (entries.count(variant)) return;
+        entries[variant] = Entry{};
+        queue.push_back(variant);
+    }
+    wake.notify_one();
+}
+
+VkPipeline PipelineLibrary::get(const PipelineVariant &variant) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto entry = entries.find(variant);
+        if (entry != entries.end()) return entry->second.pipeline;
+    }
+    request(variant);
+    return VK_NULL_HANDLE;
+}
+
+VkPipeline PipelineLibrary::getBlocking(const PipelineVariant &variant) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto entry = entries.find(variant);
+    if (entry == entries.end()) {
+        entries[variant] = Entry{};
+        compile(lock, variant);
+    }
+    else if (entry->second.state == QUEUED) {
+        // Jump the line instead of waiting for a thread to get to it.
+        queue.erase(std::find(queue.begin(), queue.end(), variant));
+        compile(lock, variant);
+    }
+    compiled.wait(lock, [&] { return entries[variant].state == DONE; });
+    return entries[variant].pipeline;
+}
+
+size_t PipelineLibrary::pendingCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t pending = 0;
+    for (auto &[variant, entry] : entries) pending += entry.state != DONE;
+    return pending;
+}
+
+void PipelineLibrary::workerLoop() {
+    setProfileThreadName("pipeline compiler");
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wake.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (stopping) return;
+
+        auto variant = queue.front();
+        queue.pop_front();
+        compile(lock, variant);
+    }
+}
+
+void PipelineLibrary::compile(std::unique_lock<std::mutex> &lock, const PipelineVariant &variant) {
+    entries[variant].state = COMPILING;
+    VkRenderPass renderPass = compatibleRenderPass(variant.colorFormat);
+
+    lock.unlock();
+    auto start = Clock::now();
+    VkPipeline pipeline;
+    {
+        ProfileZone zone("compile pipeline variant");
+        pipeline = createPipeline(variant, renderPass);
+    }
+    double compileMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    lock.lock();
+
+    auto &entry = entries[variant];
+    entry.pipeline = pipeline;
+    entry.compileMs = compileMs;
+    entry.state = DONE;
+    ready += 1;
+    compiled.notify_all();
+    if (onReady) onReady();
+}
+
+VkRenderPass PipelineLibrary::compatibleRenderPass(VkFormat format) {
+    auto &renderPass = renderPasses[format];
+    if (renderPass) return renderPass;
+
+    VkAttachmentDescription colorAttachment{};
+    colorAttachment.format = format;
+    colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentDescription depthAttachment = colorAttachment;
+    depthAttachment.format = depthFormat;
+    depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    VkAttachmentDescription attachments[] = {colorAttachment, depthAttachment};
+
+    VkAttachmentReference colorAttachmentRef{};
+    colorAttachmentRef.attachment = 0;
+    colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    VkAttachmentReference depthAttachmentRef{};
+    depthAttachmentRef.attachment = 1;
+    depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    bool depth = depthFormat != VK_FORMAT_UNDEFINED;
+
+    VkSubpassDescription subpass{};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 1;
+    subpass.pColorAttachments = &colorAttachmentRef;
+    subpass.pDepthStencilAttachment = depth ? &depthAttachmentRef : nullptr;
+
+    VkRenderPassCreateInfo renderPassInfo{};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassInfo.attachmentCount = depth ? 2 : 1;
+    renderPassInfo.pAttachments = attachments;
+    renderPassInfo.subpassCount = 1;
+    renderPassInfo.pSubpasses = &subpass;
+
+    auto result = vkCreateRenderPass(device, &renderPassInfo, nullptr, renderPass.replace(device));
+    if (result != VK_SUCCESS) die(log << "Failed to create a render pass to compile pipelines against " << result);
+    return renderPass;
+}
+
+VkPipeline PipelineLibrary::createPipeline(const PipelineVariant &variant, VkRenderPass renderPass) {
+    // All the constant_ids from both shaders in one block. A stage just ignores the ones it
+    // doesn't declare.
+    bool meshes = variant.rendering == RENDER_MESHES;
+    uint32_t constants[] = {variant.shape, variant.blend, variant.rendering == RENDER_SDF};
+    VkSpecializationMapEntry constantEntries[] = {
+        {0, 0, sizeof(uint32_t)},                    // SHAPE_OVERRIDE
+        {1, sizeof(uint32_t), sizeof(uint32_t)},     // BLEND_MODE
+        {2, 2 * sizeof(uint32_t), sizeof(uint32_t)}, // SDF
+    };
+    VkSpecializationInfo specialization{};
+    specialization.mapEntryCount = 3;
+    specialization.pMapEntries = constantEntries;
+    specialization.dataSize = sizeof(constants);
+    specialization.pData = constants;
+
+    VkPipelineShaderStageCreateInfo shaderStages[2]{};
+    shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shaderStages[0].module = meshes ? meshModule : vertModule;
+    shaderStages[0].pName = "main";
+    shaderStages[0].pSpecializationInfo = &specialization;
+    shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shaderStages[1].module = fragModule;
+    shaderStages[1].pName = "main";
+    shaderStages[1].pSpecializationInfo = &specialization;
+
+    // Normally no per-vertex data at all. The shader makes up the corners from gl_VertexIndex,
+    // and everything else comes from the per-instance ShapeInstance in binding 0. Meshes have
+    // their corners in binding 1.
+    VkVertexInputBindingDescription bindings[2] = {ShapeInstance::bindingDescription(0)};
+    VkVertexInputAttributeDescription attributes[5];
+    auto instanceAttributes = ShapeInstance::attributeDescriptions(0);
+    std::copy(instanceAttributes.begin(), instanceAttributes.end(), attributes);
+
+    bindings[1].binding = 1;
+    bindings[1].stride = sizeof(Point);
+    bindings[1].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    attributes[4].binding = 1;
+    attributes[4].location = 4;
+    attributes[4].format = VK_FORMAT_R32G32_SFLOAT;
+    attributes[4].offset = 0;
+
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertexInputInfo.vertexBindingDescriptionCount = meshes ? 2 : 1;
+    vertexInputInfo.pVertexBindingDescriptions = bindings;
+    vertexInputInfo.vertexAttributeDescriptionCount = instanceAttributes.size() + (meshes ? 1 : 0);
+    vertexInputInfo.pVertexAttributeDescriptions = attributes;
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+    inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+    // Both dynamic (see setViewportAndScissor() in main.cpp), so the pipeline doesn't care about
+    // the window size and survives a resize.
+    VkPipelineViewportStateCreateInfo viewportState{};
+    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewportState.viewportCount = 1;
+    viewportState.scissorCount = 1;
+
+    VkDynamicState dynamicStates[] = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+    VkPipelineDynamicStateCreateInfo dynamicState{};
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.dynamicStateCount = 2;
+    dynamicState.pDynamicStates = dynamicStates;
+
+    VkPipelineRasterizationStateCreateInfo rasterizer{};
+    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer.depthClampEnable = VK_FALSE;
+    rasterizer.rasterizerDiscardEnable = VK_FALSE;
+    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizer.lineWidth = 1.0f;
+    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
+    rasterizer.depthBiasEnable = VK_FALSE;
+
+    // Still one sample. SDF shapes antialias themselves in the fragment shader.
+    VkPipelineMultisampleStateCreateInfo multisampling{};
+    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling.sampleShadingEnable = VK_FALSE;
+    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    multisampling.minSampleShading = 1.0f;
+
+    VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    if (variant.blend == BLEND_ALPHA || variant.rendering == RENDER_SDF) {
+        // Regular "over": new * a + old * (1 - a). SDF edges fade out through alpha, so even
+        // "opaque" SDF shapes need it.
+        colorBlendAttachment.blendEnable = VK_TRUE;
+        colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+        colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+        colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+        colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+    }
+    else {
+        colorBlendAttachment.blendEnable = VK_FALSE;
+    }
+
+    // Opaque shapes get drawn front to back and write depth, so anything behind them fails the
+    // test before its fragment shader runs. Translucent ones (and SDF ones, whose edges blend)
+    // only test: they still blend over whatever's behind them, but not over what's in front.
+    // LESS_OR_EQUAL so shapes at the same depth draw in order, like they did without one.
+    VkPipelineDepthStencilStateCreateInfo depthStencil{};
+    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil.depthTestEnable = VK_TRUE;
+    depthStencil.depthWriteEnable = variant.blend == BLEND_OPAQUE && variant.rendering != RENDER_SDF;
+    depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    depthStencil.depthBoundsTestEnable = VK_FALSE;
+    depthStencil.stencilTestEnable = VK_FALSE;
+
+    VkPipelineColorBlendStateCreateInfo colorBlending{};
+    colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorBlending.logicOpEnable = VK_FALSE;
+    colorBlending.attachmentCount = 1;
+    colorBlending.pAttachments = &colorBlendAttachment;
+
+    VkGraphicsPipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.pVertexInputState = &vertexInputInfo;
+    pipelineInfo.pInputAssemblyState = &inputAssembly;
+    pipelineInfo.pViewportState = &viewportState;
+    pipelineInfo.pRasterizationState = &rasterizer;
+    pipelineInfo.pMultisampleState = &multisampling;
+    pipelineInfo.pDepthStencilState = depthFormat != VK_FORMAT_UNDEFINED ? &depthStencil : nullptr;
+    pipelineInfo.pColorBlendState = &colorBlending;
+    pipelineInfo.pDynamicState = &dynamicState;
+    pipelineInfo.layout = layout;
+    pipelineInfo.renderPass = renderPass;
+    pipelineInfo.subpass = 0;
+    pipelineInfo.basePipelineIndex = -1;
+
+    VkPipeline pipeline;
+    auto result = vkCreateGraphicsPipelines(device, cache, 1, &pipelineInfo, nullptr, &pipeline);
+    if (result != VK_SUCCESS) die(log << "Failed to create graphics pipeline variant!! " << result);
+    return pipeline;
+}
+
+static const char *shapeName(uint32_t shape) {
+    switch (shape) {
+    case SHAPE_TRIANGLE: return "triangle";
+    case SHAPE_RECTANGLE: return "rectangle";
+    case SHAPE_DIAMOND: return "diamond";
+    case SHAPE_CIRCLE: return "circle";
+    case SHAPE_ROUNDED_RECTANGLE: return "rounded rectangle";
+    case SHAPE_RING: return "ring";
+    case SHAPE_ANY: return "any shape";
+    }
+    return "?";
+}
+
+void PipelineLibrary::report(const char *label) {
+    Report log(label);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &[variant, entry] : entries) {
+        log << shapeName(variant.shape) << ", " << (variant.blend == BLEND_ALPHA ? "alpha" : "opaque")
+            << (variant.rendering == RENDER_SDF ? ", sdf" : variant.rendering == RENDER_MESHES ? ", meshes" : "")
+            << ", format " << variant.colorFormat << ": ";
+        if (entry.state == DONE) log << entry.compileMs << " ms\n";
+        else log << (entry.state == QUEUED ? "queued\n" : "compiling\n");
+    }
+}
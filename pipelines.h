@@ -0,0 +1,120 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "handles.h"
+
+// Has to match BLEND_MODE in triangle.frag.
+enum BlendMode : uint32_t {
+    BLEND_OPAQUE = 0,
+    BLEND_ALPHA = 1,
+};
+
+// How shapes turn into pixels. The shaders' SDF constant is whether this is RENDER_SDF.
+enum ShapeRendering : uint32_t {
+    RENDER_TRIANGLES = 0, // the corner table in triangle.vert. Hard edges, and no round shapes
+    RENDER_SDF = 1,       // one quad per shape, cut down to size by a signed distance function
+    RENDER_MESHES = 2,    // mesh.vert: tessellated paths from a MeshCache, in vertex buffer binding 1
+};
+
+// Draw every instance as whatever its ShapeInstance::shape says. Has to match triangle.vert.
+const uint32_t SHAPE_ANY = 0xFFFFFFFF;
+
+// Everything that makes one shape pipeline different from another. The shape, blend mode and
+// rendering go in as specialization constants, so the driver compiles each variant down to just
+// what it needs.
+struct PipelineVariant {
+    uint32_t shape = SHAPE_ANY; // a ShapeType, or SHAPE_ANY
+    BlendMode blend = BLEND_OPAQUE;
+    VkFormat colorFormat = VK_FORMAT_UNDEFINED;
+    ShapeRendering rendering = RENDER_TRIANGLES;
+
+    bool operator<(const PipelineVariant &other) const {
+        return std::tie(shape, blend, colorFormat, rendering) < std::tie(other.shape, other.blend, other.colorFormat, other.rendering);
+    }
+    bool operator==(const PipelineVariant &other) const {
+        return shape == other.shape && blend == other.blend && colorFormat == other.colorFormat && rendering == other.rendering;
+    }
+    bool operator!=(const PipelineVariant &other) const { return !(*this == other); }
+};
+
+// All the shape pipeline variants we've asked for, compiled on background threads.
+//
+// get() never blocks: if the variant isn't done yet it returns VK_NULL_HANDLE (and queues it up
+// if nobody asked for it before), and the caller draws with a generic pipeline in the meantime.
+// Poll readyCount() to find out when it's worth asking again.
+class PipelineLibrary {
+public:
+    // The shader code and layout every variant shares (meshCode is the vertex shader for
+    // RENDER_MESHES). `cache` is shared between the threads, which is fine: pipeline caches are
+    // internally synchronized. VK_FORMAT_UNDEFINED for `depthFormat` means no depth buffer.
+    void init(
+        VkDevice device, VkPipelineCache cache, VkPipelineLayout layout, VkFormat depthFormat,
+        const unsigned char *vertCode, unsigned int vertLength,
+        const unsigned char *fragCode, unsigned int fragLength,
+        const unsigned char *meshCode, unsigned int meshLength,
+        uint32_t threadCount
+    );
+    // Called from a compile thread every time a variant finishes. Set it before init().
+    std::function<void()> onReady;
+    // Waits for whatever's compiling, then destroys every pipeline it made.
+    void destroy();
+
+    VkPipeline get(const PipelineVariant &variant);
+    // For when there's nothing to fall back on. Compiles on this thread if nobody has started it yet.
+    VkPipeline getBlocking(const PipelineVariant &variant);
+    // Queue it up without caring about the result yet.
+    void request(const PipelineVariant &variant);
+
+    // Goes up by one every time a variant finishes compiling.
+    uint64_t readyCount() const { return ready; }
+    size_t pendingCount();
+
+    void report(const char *label);
+
+private:
+    enum State { QUEUED, COMPILING, DONE };
+    struct Entry {
+        State state = QUEUED;
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        double compileMs = 0;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkPipelineCache cache = VK_NULL_HANDLE;
+    VkPipelineLayout layout = VK_NULL_HANDLE;
+    VkFormat depthFormat = VK_FORMAT_UNDEFINED;
+    ShaderModule vertModule;
+    ShaderModule fragModule;
+    ShaderModule meshModule;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable compiled;
+    bool stopping = false;
+    std::map<PipelineVariant, Entry> entries;
+    std::deque<PipelineVariant> queue;
+    // Pipelines only need a render pass that's compatible with the real one, which just means the
+    // same attachment formats. So we make our own, one per color format (all with depthFormat).
+    std::map<VkFormat, RenderPass> renderPasses;
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> ready{0};
+
+    void workerLoop();
+    // Called with `mutex` held. Unlocks it while the driver does its thing.
+    void compile(std::unique_lock<std::mutex> &lock, const PipelineVariant &variant);
+    VkRenderPass compatibleRenderPass(VkFormat format);
+    VkPipeline createPipeline(const PipelineVariant &variant, VkRenderPass renderPass);
+};
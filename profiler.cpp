@@ -0,0 +1,235 @@
+#include "profiler.h"
+#include "debug.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+std::atomic<bool> profilingEnabled{false};
+thread_local uint16_t profileDepth = 0;
+
+namespace {
+
+// Where one thread's zones pile up until the next Profiler::collect(). The mutex is only ever
+// contended for the moment collect() swaps the vector out, so recording a zone is an uncontended
+// lock and a push_back into memory that's already there after the first few frames.
+struct ThreadBuffer {
+    std::mutex mutex;
+    std::vector<ProfileSample> samples;
+    uint32_t id;
+    std::string name;
+};
+
+// Never shrinks, so whatever a thread recorded right before it exited still gets collected.
+std::mutex registryMutex;
+std::vector<std::unique_ptr<ThreadBuffer>> registry;
+thread_local ThreadBuffer *threadBuffer = nullptr;
+
+ThreadBuffer &thisThread() {
+    if (threadBuffer == nullptr) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        registry.push_back(std::make_unique<ThreadBuffer>());
+        threadBuffer = registry.back().get();
+        threadBuffer->id = registry.size() - 1;
+        threadBuffer->name = "thread " + std::to_string(threadBuffer->id);
+    }
+    return *threadBuffer;
+}
+
+// Zone names are string literals, but who knows what somebody passes in someday.
+void writeJsonString(FILE *file, const char *text) {
+    fputc('"', file);
+    for (const char *c = text; *c; ++c) {
+        if (*c == '"' || *c == '\\') fprintf(file, "\\%c", *c);
+        else if (static_cast<unsigned char>(*c) < 0x20) fprintf(file, "\\u%04x", *c);
+        else fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+}
+
+void setProfilingEnabled(bool enabled) {
+    profilingEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+void setProfileThreadName(const std::string &name) {
+    auto &buffer = thisThread();
+    std::lock_guard<std::mutex> lock(registryMutex);
+    buffer.name = name;
+}
+
+uint64_t profileNow() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+void profileRecord(const char *name, uint64_t start, uint64_t end, uint16_t depth) {
+    auto &buffer = thisThread();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    buffer.samples.push_back({name, start, end, depth});
+}
+
+void Profiler::init(size_t window, bool trace) {
+    this->window = window;
+    tracing = trace;
+    origin = profileNow();
+    frameMs = RollingStats(window);
+    zones.clear();
+    this->trace.clear();
+    clearStats();
+}
+
+void Profiler::newFrame() {
+    if (!profilingEnabled.load(std::memory_order_relaxed)) return;
+
+    uint64_t now = profileNow();
+    collect();
+
+    if (frameStart != 0) {
+        double ms = (now - frameStart) / 1e6;
+        frameMs.add(ms);
+        size_t bucket = 0;
+        for (double edge = HISTOGRAM_FIRST_MS; ms >= edge && bucket < HISTOGRAM_BUCKETS - 1; edge *= 2) bucket += 1;
+        histogram[bucket] += 1;
+    }
+    frameStart = now;
+
+    for (auto &zone : zones) {
+        if (zone.frameCalls == 0) continue;
+        zone.ms.add(zone.frameMs);
+        zone.calls += zone.frameCalls;
+        zone.frames += 1;
+        zone.frameMs = 0;
+        zone.frameCalls = 0;
+    }
+}
+
+void Profiler::clearStats() {
+    frameMs.clear();
+    std::fill(std::begin(histogram), std::end(histogram), 0);
+    for (auto &zone : zones) {
+        zone.ms.clear();
+        zone.calls = 0;
+        zone.frames = 0;
+    }
+}
+
+void Profiler::collect() {
+    std::lock_guard<std::mutex> registryLock(registryMutex);
+    for (auto &buffer : registry) {
+        {
+            std::lock_guard<std::mutex> lock(buffer->mutex);
+            scratch.swap(buffer->samples);
+        }
+        for (auto &sample : scratch) {
+            auto &entry = zone(sample.name, sample);
+            entry.frameMs += (sample.end - sample.start) / 1e6;
+            entry.frameCalls += 1;
+
+            if (!tracing) continue;
+            if (trace.size() < maxTraceEvents) trace.push_back({sample, buffer->id});
+            else droppedTraceEvents += 1;
+        }
+        scratch.clear();
+    }
+}
+
+Profiler::Zone &Profiler::zone(const char *name, const ProfileSample &sample) {
+    // Only ever a couple dozen of these, and the pointer compare nearly always hits.
+    for (auto &zone : zones) {
+        if (zone.key == name) return zone;
+    }
+    for (auto &zone : zones) {
+        if (zone.name == name) return zone;
+    }
+    zones.push_back({name, name, sample.depth, sample.start, RollingStats(window)});
+    return zones.back();
+}
+
+void Profiler::report(const char *label) {
+    Report log(label);
+    if (!profilingEnabled.load(std::memory_order_relaxed)) {
+        log << "(off, run with --profile)\n";
+        return;
+    }
+
+    log << "frame: p50 " << frameMs.percentile(50) << " ms, p95 " << frameMs.percentile(95)
+        << " ms, p99 " << frameMs.percentile(99) << " ms, max " << frameMs.max() << " ms ("
+        << frameMs.size() << " frames)\n";
+
+    // In the order they first started, so each zone comes right after whatever it's nested in.
+    std::vector<const Zone *> sorted;
+    for (auto &zone : zones) {
+        if (!zone.ms.empty()) sorted.push_back(&zone);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const Zone *a, const Zone *b) { return a->firstStart < b->firstStart; });
+    for (auto *zone : sorted) {
+        log << std::string(2 * zone->depth, ' ') << zone->name << ": p50 " << zone->ms.percentile(50)
+            << " ms, p95 " << zone->ms.percentile(95) << " ms, p99 " << zone->ms.percentile(99)
+            << " ms, max " << zone->ms.max() << " ms (" << zone->frames << " frames, "
+            << static_cast<double>(zone->calls) / zone->frames << " calls/frame)\n";
+    }
+
+    uint64_t tallest = *std::max_element(std::begin(histogram), std::end(histogram));
+    if (tallest == 0) return;
+    size_t first = 0, last = HISTOGRAM_BUCKETS - 1;
+    while (histogram[first] == 0) first += 1;
+    while (histogram[last] == 0) last -= 1;
+
+    log << "frame times:\n";
+    for (size_t bucket = first; bucket <= last; ++bucket) {
+        double edge = HISTOGRAM_FIRST_MS * (1 << bucket);
+        char line[32];
+        if (bucket == HISTOGRAM_BUCKETS - 1) snprintf(line, sizeof(line), "  >= %7g ms ", edge / 2);
+        else snprintf(line, sizeof(line), "   < %7g ms ", edge);
+        log << line << std::string(histogram[bucket] * 40 / tallest, '#') << ' ' << histogram[bucket] << '\n';
+    }
+}
+
+bool Profiler::writeTrace(const std::string &path) {
+    collect();
+
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        std::cout << "couldn't open " << path << " for writing\n";
+        return false;
+    }
+
+    // "X" events are complete zones with a start and a duration, in microseconds. The viewer
+    // works out the nesting from the times on its own.
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    const char *separator = "\n";
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (auto &buffer : registry) {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", separator, buffer->id);
+            writeJsonString(file, buffer->name.c_str());
+            fprintf(file, "}}");
+            separator = ",\n";
+        }
+    }
+    for (auto &event : trace) {
+        fprintf(file, "%s{\"name\":", separator);
+        writeJsonString(file, event.sample.name);
+        fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", event.thread,
+                static_cast<int64_t>(event.sample.start - origin) / 1e3, (event.sample.end - event.sample.start) / 1e3);
+        separator = ",\n";
+    }
+    fprintf(file, "\n]}\n");
+
+    bool ok = !ferror(file);
+    if (fclose(file) != 0) ok = false;
+    if (!ok) {
+        std::cout << "couldn't write " << path << '\n';
+        return false;
+    }
+
+    std::cout << trace.size() << " zones written to " << path;
+    if (droppedTraceEvents > 0) std::cout << " (dropped " << droppedTraceEvents << " more, past " << maxTraceEvents << ')';
+    std::cout << '\n';
+    return true;
+}
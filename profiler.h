@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "stats.h"
+
+// Whether ProfileZones record anything. Off unless --profile or --trace turned it on.
+extern std::atomic<bool> profilingEnabled;
+// Every thread's current ProfileZone nesting.
+extern thread_local uint16_t profileDepth;
+
+void setProfilingEnabled(bool enabled);
+// What this thread shows up as in the trace. Threads that never call it get "thread N".
+void setProfileThreadName(const std::string &name);
+
+// One finished zone. Times are profileNow() values.
+struct ProfileSample {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    uint16_t depth;
+};
+
+// Nanoseconds on the steady clock. (clock_gettime through the vDSO, so ~20ns and no syscall. rdtsc
+// would be a bit cheaper still, but then we'd have to calibrate it and trust it's invariant.)
+uint64_t profileNow();
+// Where ProfileZone puts a finished zone: this thread's buffer.
+void profileRecord(const char *name, uint64_t start, uint64_t end, uint16_t depth);
+
+// Like Logger, minus the printing: times everything until it goes out of scope, as one zone named
+// `name`, nested under whatever zones are already open on this thread.
+//
+//     ProfileZone zone("drawFrame");
+//
+// `name` has to outlive the profiler, so string literals only. When profiling is off this is one
+// relaxed load, so zones can just stay in.
+class ProfileZone {
+    const char *name;
+    uint64_t start = 0;
+
+public:
+    explicit ProfileZone(const char *name) : name(name) {
+        if (!profilingEnabled.load(std::memory_order_relaxed)) return;
+        start = profileNow();
+        profileDepth += 1;
+    }
+    ~ProfileZone() {
+        if (start == 0) return;
+        profileDepth -= 1;
+        profileRecord(name, start, profileNow(), profileDepth);
+    }
+    ProfileZone(const ProfileZone &) = delete;
+    ProfileZone &operator=(const ProfileZone &) = delete;
+};
+
+// Gathers up the zones from every thread once a frame, and keeps per-zone stats on how much time
+// each one took per frame. Can also keep every single zone around, for a Chrome trace
+// (chrome://tracing, or ui.perfetto.dev) of the whole run.
+class Profiler {
+public:
+    void init(size_t window, bool trace);
+
+    // Everything recorded since the last call counts as one frame. Call it at the start of each.
+    void newFrame();
+    void clearStats();
+    void report(const char *label);
+
+    // Writes every zone recorded so far as Chrome trace event JSON. Returns false if it couldn't.
+    bool writeTrace(const std::string &path);
+
+private:
+    struct Event {
+        ProfileSample sample;
+        uint32_t thread;
+    };
+
+    struct Zone {
+        std::string name;
+        const char *key;
+        uint16_t depth;
+        uint64_t firstStart;  // for putting them in order in report()
+        RollingStats ms;      // time spent in it per frame it showed up in
+        uint64_t calls = 0;
+        uint64_t frames = 0;
+        double frameMs = 0;   // this frame so far
+        uint32_t frameCalls = 0;
+    };
+
+    // Frame times from 1/16 ms up to 128 ms, doubling each time, plus everything over that.
+    static const size_t HISTOGRAM_BUCKETS = 13;
+    static constexpr double HISTOGRAM_FIRST_MS = 1.0 / 16;
+
+    size_t window = 1;
+    bool tracing = false;
+    uint64_t origin = 0;
+    size_t maxTraceEvents = 1 << 20;
+    uint64_t droppedTraceEvents = 0;
+
+    uint64_t frameStart = 0;
+    RollingStats frameMs{1};
+    uint64_t histogram[HISTOGRAM_BUCKETS] = {};
+
+    std::vector<Zone> zones;
+    std::vector<Event> trace;
+    std::vector<ProfileSample> scratch;
+
+    // Empties every thread's buffer into the frame's zone totals (and the trace).
+    void collect();
+    Zone &zone(const char *name, const ProfileSample &sample);
+};
@@ -0,0 +1,875 @@
+#include "render_graph.h"
+#include "debug.h"
+#include "gpu_timer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+// Any of these in an access mask makes it a write, the rest are reads.
+static const VkAccessFlags WRITE_ACCESS =
+    VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+    VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+// Stages that only ever touch the pixel they're working on, so a dependency between subpasses
+// that only involves these can be BY_REGION (and a tiler never has to leave the tile for it).
+static const VkPipelineStageFlags FRAMEBUFFER_STAGES =
+    VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+    VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+
+static const VkPipelineStageFlags DEPTH_STAGES =
+    VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+
+RenderGraph::Resource RenderGraph::importImage(
+    const char *name, VkFormat format, VkImageAspectFlags aspect,
+    const std::vector<VkImage> &images, const std::vector<VkImageView> &views,
+    VkImageLayout finalLayout, VkPipelineStageFlags readyStage
+) {
+    ResourceInfo resource{};
+    resource.name = name;
+    resource.kind = IMPORTED_IMAGE;
+    resource.format = format;
+    resource.aspect = aspect;
+    resource.images = images;
+    resource.views = views;
+    resource.finalLayout = finalLayout;
+    resource.readyStage = readyStage;
+    resources.push_back(std::move(resource));
+    return resources.size() - 1;
+}
+
+RenderGraph::Resource RenderGraph::importBuffer(const char *name) {
+    ResourceInfo resource{};
+    resource.name = name;
+    resource.kind = IMPORTED_BUFFER;
+    resources.push_back(std::move(resource));
+    return resources.size() - 1;
+}
+
+RenderGraph::Resource RenderGraph::createImage(const char *name, VkFormat format, VkImageAspectFlags aspect) {
+    ResourceInfo resource{};
+    resource.name = name;
+    resource.kind = TRANSIENT_IMAGE;
+    resource.format = format;
+    resource.aspect = aspect;
+    resources.push_back(std::move(resource));
+    return resources.size() - 1;
+}
+
+RenderGraph::Pass RenderGraph::addPass(const char *name, PassType type, RecordFunction record) {
+    PassInfo pass{};
+    pass.name = name;
+    pass.type = type;
+    pass.record = std::move(record);
+    passes.push_back(std::move(pass));
+    return passes.size() - 1;
+}
+
+void RenderGraph::colorAttachment(Pass pass, Resource image, VkAttachmentLoadOp load, VkClearColorValue clear) {
+    if (passes[pass].type != PASS_GRAPHICS) die(log << "RenderGraph: " << passes[pass].name << " isn't a graphics pass");
+    Use use{};
+    use.resource = image;
+    use.kind = USE_COLOR;
+    use.stages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    // Blending reads what's there.
+    use.access = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    use.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    use.load = load;
+    use.clear.color = clear;
+    passes[pass].uses.push_back(use);
+}
+
+void RenderGraph::depthAttachment(Pass pass, Resource image, VkAttachmentLoadOp load, bool write, float clear) {
+    if (passes[pass].type != PASS_GRAPHICS) die(log << "RenderGraph: " << passes[pass].name << " isn't a graphics pass");
+    Use use{};
+    use.resource = image;
+    use.kind = USE_DEPTH;
+    use.stages = DEPTH_STAGES;
+    use.access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | (write ? VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT : 0);
+    use.layout = write ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    use.load = load;
+    use.clear.depthStencil = {clear, 0};
+    passes[pass].uses.push_back(use);
+}
+
+void RenderGraph::use(Pass pass, Resource resource, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout) {
+    auto kind = resources[resource].kind;
+    if (kind == TRANSIENT_IMAGE) die(log << "RenderGraph: " << resources[resource].name << " can only be an attachment");
+    if (kind == IMPORTED_IMAGE && passes[pass].type == PASS_GRAPHICS) {
+        // It'd have to change layout before the render pass starts. Not worth it until something needs it.
+        die(log << "RenderGraph: graphics passes can only use images as attachments (" << passes[pass].name << ')');
+    }
+    if (kind == IMPORTED_IMAGE && layout == VK_IMAGE_LAYOUT_UNDEFINED) {
+        die(log << "RenderGraph: " << passes[pass].name << " has to say what layout it wants " << resources[resource].name << " in");
+    }
+    Use use{};
+    use.resource = resource;
+    use.kind = USE_OTHER;
+    use.stages = stages;
+    use.access = access;
+    use.layout = kind == IMPORTED_IMAGE ? layout : VK_IMAGE_LAYOUT_UNDEFINED;
+    use.load = access & ~WRITE_ACCESS ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    passes[pass].uses.push_back(use);
+}
+
+void RenderGraph::output(Resource resource, VkPipelineStageFlags stages, VkAccessFlags access) {
+    resources[resource].output = true;
+    resources[resource].outputStages |= stages;
+    resources[resource].outputAccess |= access;
+}
+
+void RenderGraph::setContents(Pass pass, VkSubpassContents contents) {
+    passes[pass].contents = contents;
+}
+
+// Whether a use needs what was in the resource before it, and whether it changes it.
+static bool reads(VkAttachmentLoadOp load) { return load == VK_ATTACHMENT_LOAD_OP_LOAD; }
+static bool writes(VkAccessFlags access, VkAttachmentLoadOp load) {
+    // Clearing is a write, even for a depth attachment that's read-only after that.
+    return (access & WRITE_ACCESS) || load == VK_ATTACHMENT_LOAD_OP_CLEAR;
+}
+
+void RenderGraph::compile(VkDevice device, DeviceAllocator &allocator, VkExtent2D extent, uint32_t imageCount) {
+    Logger log("RenderGraph::compile");
+    this->device = device;
+    this->allocator = &allocator;
+    this->extent = extent;
+    this->imageCount = imageCount;
+
+    cull();
+    group();
+    allocateTransients(allocator);
+    placeBarriers();
+    createRenderPasses();
+
+    size_t culledCount = std::count_if(passes.begin(), passes.end(), [](const PassInfo &pass) { return pass.step == NONE; });
+    log << passes.size() << " passes (" << culledCount << " culled) in " << steps.size() << " steps, "
+        << slots.size() << " transient memory slots\n";
+}
+
+// Walks the passes backwards from the outputs. A pass is only worth running if it writes
+// something a later pass (or the outside) is going to read, and a pass that overwrites a
+// resource completely means nobody cares what earlier passes wrote to it.
+void RenderGraph::cull() {
+    std::vector<bool> needed(resources.size());
+    for (Resource i = 0; i < resources.size(); ++i) needed[i] = resources[i].output;
+
+    for (size_t p = passes.size(); p-- > 0;) {
+        auto &pass = passes[p];
+        pass.step = NONE;
+        bool live = false;
+        for (auto &use : pass.uses) {
+            if (writes(use.access, use.load) && needed[use.resource]) live = true;
+        }
+        if (!live) continue;
+        pass.step = 0;
+        for (auto &use : pass.uses) {
+            if (writes(use.access, use.load) && !reads(use.load)) needed[use.resource] = false;
+        }
+        for (auto &use : pass.uses) {
+            if (reads(use.load)) needed[use.resource] = true;
+        }
+    }
+}
+
+// Graphics passes in a row share a render pass. Everything else gets a step to itself.
+void RenderGraph::group() {
+    steps.clear();
+    for (Pass p = 0; p < passes.size(); ++p) {
+        auto &pass = passes[p];
+        if (pass.step == NONE) continue;
+        bool graphics = pass.type == PASS_GRAPHICS;
+        if (!graphics || steps.empty() || !steps.back().graphics) {
+            steps.emplace_back();
+            steps.back().graphics = graphics;
+        }
+        pass.step = steps.size() - 1;
+        pass.subpass = steps.back().passes.size();
+        steps.back().passes.push_back(p);
+    }
+}
+
+// Transient images whose first and last steps don't overlap take turns in the same memory. Greedy,
+// in order of first use, which is as good as it gets for intervals.
+void RenderGraph::allocateTransients(DeviceAllocator &allocator) {
+    Logger log("RenderGraph::allocateTransients");
+    struct Lifetime {
+        Resource resource;
+        uint32_t first = NONE;
+        uint32_t last = 0;
+        VkImageUsageFlags usage = 0;
+    };
+    std::vector<Lifetime> lifetimes;
+    for (Resource r = 0; r < resources.size(); ++r) {
+        if (resources[r].kind == TRANSIENT_IMAGE) lifetimes.push_back({r});
+    }
+    for (auto &lifetime : lifetimes) {
+        for (auto &pass : passes) {
+            if (pass.step == NONE) continue;
+            for (auto &use : pass.uses) {
+                if (use.resource != lifetime.resource) continue;
+                lifetime.first = std::min(lifetime.first, pass.step);
+                lifetime.last = std::max(lifetime.last, pass.step);
+                lifetime.usage |= use.kind == USE_COLOR ? VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT : VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+            }
+        }
+    }
+    lifetimes.erase(
+        std::remove_if(lifetimes.begin(), lifetimes.end(), [](const Lifetime &lifetime) { return lifetime.first == NONE; }),
+        lifetimes.end()
+    );
+    std::stable_sort(lifetimes.begin(), lifetimes.end(), [](const Lifetime &a, const Lifetime &b) { return a.first < b.first; });
+
+    slots.clear();
+    for (auto &lifetime : lifetimes) {
+        auto &resource = resources[lifetime.resource];
+        // Living in one render pass means it never gets loaded or stored, so it never has to
+        // exist outside the tile on a tiler.
+        resource.usage = lifetime.usage;
+        if (lifetime.first == lifetime.last) resource.usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+
+        VkImageCreateInfo imageInfo{};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageInfo.format = resource.format;
+        imageInfo.extent = { extent.width, extent.height, 1 };
+        imageInfo.mipLevels = 1;
+        imageInfo.arrayLayers = 1;
+        imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageInfo.usage = resource.usage;
+        imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        auto result = vkCreateImage(device, &imageInfo, nullptr, &resource.image);
+        if (result != VK_SUCCESS) die(log << "Failed to create transient image " << resource.name << ' ' << result);
+
+        uint32_t slot = NONE;
+        for (uint32_t i = 0; i < slots.size() && slot == NONE; ++i) {
+            if (slots[i].lastStep < lifetime.first) slot = i;
+        }
+        if (slot == NONE) {
+            slot = slots.size();
+            slots.emplace_back();
+        }
+        slots[slot].images.push_back(lifetime.resource);
+        slots[slot].lastStep = lifetime.last;
+        resource.slot = slot;
+    }
+
+    // One allocation per slot, big enough (and aligned enough) for everything in it.
+    for (auto &slot : slots) {
+        VkMemoryRequirements requirements{};
+        requirements.memoryTypeBits = ~0u;
+        requirements.alignment = 1;
+        bool transient = true;
+        for (auto r : slot.images) {
+            VkMemoryRequirements imageRequirements;
+            vkGetImageMemoryRequirements(device, resources[r].image, &imageRequirements);
+            requirements.size = std::max(requirements.size, imageRequirements.size);
+            requirements.alignment = std::max(requirements.alignment, imageRequirements.alignment);
+            requirements.memoryTypeBits &= imageRequirements.memoryTypeBits;
+            transient = transient && (resources[r].usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT);
+        }
+        if (requirements.memoryTypeBits == 0) die(log << "RenderGraph: no memory type fits every image in a slot");
+        slot.memory = allocator.allocate(
+            requirements, false, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, transient ? VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT : 0
+        );
+
+        for (auto r : slot.images) {
+            auto &resource = resources[r];
+            auto result = vkBindImageMemory(device, resource.image, slot.memory.memory, slot.memory.offset);
+            if (result != VK_SUCCESS) die(log << "Failed to bind transient image " << resource.name << ' ' << result);
+
+            VkImageViewCreateInfo viewInfo{};
+            viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+            viewInfo.image = resource.image;
+            viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+            viewInfo.format = resource.format;
+            viewInfo.subresourceRange.aspectMask = resource.aspect;
+            viewInfo.subresourceRange.levelCount = 1;
+            viewInfo.subresourceRange.layerCount = 1;
+            result = vkCreateImageView(device, &viewInfo, nullptr, resource.view.replace(device));
+            if (result != VK_SUCCESS) die(log << "Failed to create view for transient image " << resource.name << ' ' << result);
+
+            log << resource.name << ": " << extent.width << 'x' << extent.height << ", format " << resource.format
+                << ", slot " << resource.slot << (allocator.isLazilyAllocated(slot.memory.memoryType) ? ", lazily allocated" : "") << '\n';
+        }
+    }
+}
+
+VkSubpassDependency &RenderGraph::dependency(Step &step, uint32_t srcSubpass, uint32_t dstSubpass) {
+    for (auto &dependency : step.dependencies) {
+        if (dependency.srcSubpass == srcSubpass && dependency.dstSubpass == dstSubpass) return dependency;
+    }
+    VkSubpassDependency dependency{};
+    dependency.srcSubpass = srcSubpass;
+    dependency.dstSubpass = dstSubpass;
+    // Until something that isn't per pixel shows up in it.
+    bool internal = srcSubpass != VK_SUBPASS_EXTERNAL && dstSubpass != VK_SUBPASS_EXTERNAL;
+    dependency.dependencyFlags = internal ? VK_DEPENDENCY_BY_REGION_BIT : 0;
+    step.dependencies.push_back(dependency);
+    return step.dependencies.back();
+}
+
+// Makes `srcPass`'s access happen before `dstPass`'s. NONE for srcPass is the previous frame (or
+// whoever had the resource before the frame), and NONE for dstPass whoever has it after.
+//
+// Inside a render pass that's a subpass dependency, and so is anything going into or out of one
+// (subpass dependencies are the only thing that orders the render pass's own layout transitions).
+// Between two passes that aren't in one, it's a pipeline barrier right before the second.
+void RenderGraph::depend(
+    uint32_t srcPass, VkPipelineStageFlags srcStages, VkAccessFlags srcAccess,
+    uint32_t dstPass, VkPipelineStageFlags dstStages, VkAccessFlags dstAccess
+) {
+    if (srcStages == 0 && srcPass == NONE) return;
+    if (srcPass != NONE && srcPass == dstPass) return;
+    // Only writes have anything to make available.
+    srcAccess &= WRITE_ACCESS;
+
+    Step *srcStep = srcPass != NONE && steps[passes[srcPass].step].graphics ? &steps[passes[srcPass].step] : nullptr;
+    Step *dstStep = dstPass != NONE && steps[passes[dstPass].step].graphics ? &steps[passes[dstPass].step] : nullptr;
+
+    // Between two render passes both of them get one: the first's makes its writes available,
+    // the second's orders its load ops and layout transitions after them.
+    VkSubpassDependency *subpassDependencies[2] = {};
+    if (srcStep && srcStep == dstStep) {
+        subpassDependencies[0] = &dependency(*srcStep, passes[srcPass].subpass, passes[dstPass].subpass);
+    }
+    else {
+        if (srcStep) subpassDependencies[0] = &dependency(*srcStep, passes[srcPass].subpass, VK_SUBPASS_EXTERNAL);
+        if (dstStep) subpassDependencies[1] = &dependency(*dstStep, VK_SUBPASS_EXTERNAL, passes[dstPass].subpass);
+    }
+
+    if (subpassDependencies[0] || subpassDependencies[1]) {
+        for (auto subpassDependency : subpassDependencies) {
+            if (!subpassDependency) continue;
+            subpassDependency->srcStageMask |= srcStages;
+            subpassDependency->dstStageMask |= dstStages;
+            subpassDependency->srcAccessMask |= srcAccess;
+            subpassDependency->dstAccessMask |= dstAccess;
+            if ((srcStages | dstStages) & ~FRAMEBUFFER_STAGES) subpassDependency->dependencyFlags &= ~VK_DEPENDENCY_BY_REGION_BIT;
+        }
+        return;
+    }
+    auto &barrier = dstPass != NONE ? passes[dstPass].before : after;
+    barrier.srcStages |= srcStages;
+    barrier.dstStages |= dstStages;
+    barrier.srcAccess |= srcAccess;
+    barrier.dstAccess |= dstAccess;
+}
+
+// Goes through the surviving passes in order, keeping track of who last wrote each resource and
+// who has read it since, and puts a dependency in front of every use that needs one: after the
+// last write for anything (read after write, write after write), and after the reads since then
+// for writes (write after read, which only needs the execution order). Fills in the render
+// passes' attachments along the way, since their layouts and load/store ops fall out of the same walk.
+void RenderGraph::placeBarriers() {
+    struct Track {
+        uint32_t writer = NONE;
+        VkPipelineStageFlags writeStages = 0;
+        VkAccessFlags writeAccess = 0;
+        std::vector<std::pair<uint32_t, VkPipelineStageFlags>> readers;
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        bool touched = false;
+        // The last step that used it, and which of its attachments it was there.
+        uint32_t step = NONE;
+        uint32_t attachment = NONE;
+    };
+    std::vector<Track> tracks(resources.size());
+
+    // How a resource was left at the end of the frame, which for a transient image is what the
+    // next frame's first use of its memory has to wait for.
+    auto endOfFrame = [&](Resource r) {
+        Track track;
+        VkPipelineStageFlags readStages = 0;
+        for (auto &pass : passes) {
+            if (pass.step == NONE) continue;
+            for (auto &use : pass.uses) {
+                if (use.resource != r) continue;
+                if (writes(use.access, use.load)) {
+                    track.writeStages = use.stages;
+                    track.writeAccess = use.access & WRITE_ACCESS;
+                    readStages = 0;
+                }
+                else {
+                    readStages |= use.stages;
+                }
+            }
+        }
+        if (readStages) track.readers.push_back({NONE, readStages});
+        return track;
+    };
+
+    for (auto &pass : passes) pass.before = Barrier{};
+    after = Barrier{};
+
+    for (Pass p = 0; p < passes.size(); ++p) {
+        auto &pass = passes[p];
+        if (pass.step == NONE) continue;
+        auto &step = steps[pass.step];
+
+        for (auto &use : pass.uses) {
+            auto &resource = resources[use.resource];
+            auto &track = tracks[use.resource];
+            bool image = resource.kind != IMPORTED_BUFFER;
+
+            if (!track.touched) {
+                track.touched = true;
+                if (resource.kind == IMPORTED_IMAGE) {
+                    track.writeStages = resource.readyStage;
+                }
+                else if (resource.kind == TRANSIENT_IMAGE) {
+                    // Whoever had the memory before: an earlier image in this frame, or the
+                    // last one in the previous frame.
+                    auto &occupants = slots[resource.slot].images;
+                    auto at = std::find(occupants.begin(), occupants.end(), use.resource);
+                    if (at != occupants.begin()) {
+                        auto &previous = tracks[*(at - 1)];
+                        track.writer = previous.writer;
+                        track.writeStages = previous.writeStages;
+                        track.writeAccess = previous.writeAccess;
+                        track.readers = previous.readers;
+                    }
+                    else {
+                        auto last = endOfFrame(occupants.back());
+                        track.writeStages = last.writeStages;
+                        track.writeAccess = last.writeAccess;
+                        track.readers = last.readers;
+                    }
+                }
+                if (image && reads(use.load)) {
+                    die(log << "RenderGraph: " << pass.name << " reads " << resource.name << " before anything wrote it");
+                }
+            }
+
+            // An attachment only changes layout between render passes: the previous render pass
+            // leaves it in whatever layout this one wants (see below).
+            bool attachment = use.kind != USE_OTHER;
+            bool newStep = track.step != pass.step;
+            bool transition = image && track.layout != use.layout && (!attachment || newStep);
+            bool write = writes(use.access, use.load) || transition;
+
+            if (track.writeStages) depend(track.writer, track.writeStages, track.writeAccess, p, use.stages, use.access);
+            if (write) {
+                for (auto &[reader, stages] : track.readers) depend(reader, stages, 0, p, use.stages, 0);
+            }
+
+            // The render pass (if it was one) that used it last stores it, and leaves it in the
+            // layout we need, so there's nothing to transition.
+            if (image && track.step != NONE && newStep && steps[track.step].graphics) {
+                auto &description = steps[track.step].descriptions[track.attachment];
+                description.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+                description.finalLayout = use.layout;
+                track.layout = use.layout;
+                transition = false;
+            }
+
+            if (attachment && newStep) {
+                // Its first subpass in this render pass.
+                VkAttachmentDescription description{};
+                description.format = resource.format;
+                description.samples = VK_SAMPLE_COUNT_1_BIT;
+                description.loadOp = use.load;
+                description.storeOp = resource.output ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+                description.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+                description.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+                description.initialLayout = track.layout;
+                description.finalLayout = use.layout;
+                track.attachment = step.attachments.size();
+                step.attachments.push_back(use.resource);
+                step.descriptions.push_back(description);
+                step.clearValues.push_back(use.clear);
+            }
+            else if (attachment) {
+                // Already in this render pass. Only its first subpass gets to load or clear it.
+                if (use.load == VK_ATTACHMENT_LOAD_OP_CLEAR) {
+                    die(log << "RenderGraph: " << pass.name << " clears " << resource.name << ", but an earlier subpass already has it");
+                }
+                step.descriptions[track.attachment].finalLayout = use.layout;
+            }
+            else if (transition) {
+                pass.before.transitions.push_back({use.resource, track.layout, use.layout});
+            }
+
+            if (write) {
+                track.writer = p;
+                track.writeStages = use.stages;
+                track.writeAccess = use.access & WRITE_ACCESS;
+                track.readers.clear();
+            }
+            else {
+                track.readers.push_back({p, use.stages});
+            }
+            track.layout = use.layout;
+            track.step = pass.step;
+            if (!attachment) track.attachment = NONE;
+        }
+    }
+
+    // And whoever gets the outputs after the frame.
+    for (Resource r = 0; r < resources.size(); ++r) {
+        auto &resource = resources[r];
+        auto &track = tracks[r];
+        if (!track.touched || resource.kind != IMPORTED_IMAGE) {
+            if (resource.output && resource.outputStages && track.writeStages) {
+                depend(track.writer, track.writeStages, track.writeAccess, NONE, resource.outputStages, resource.outputAccess);
+            }
+            continue;
+        }
+        bool inRenderPass = track.step != NONE && steps[track.step].graphics;
+        if (inRenderPass) {
+            steps[track.step].descriptions[track.attachment].finalLayout = resource.finalLayout;
+        }
+        else if (track.layout != resource.finalLayout) {
+            after.transitions.push_back({r, track.layout, resource.finalLayout});
+            for (auto &[reader, stages] : track.readers) depend(reader, stages, 0, NONE, resource.outputStages, 0);
+        }
+        bool needsBarrier = resource.outputStages || (!inRenderPass && track.layout != resource.finalLayout);
+        if (needsBarrier) depend(track.writer, track.writeStages, track.writeAccess, NONE, resource.outputStages, resource.outputAccess);
+    }
+}
+
+void RenderGraph::createRenderPasses() {
+    Logger log("RenderGraph::createRenderPasses");
+    for (auto &step : steps) {
+        if (!step.graphics) continue;
+
+        // Per subpass: its attachment references, and the ones it has to keep intact for a later
+        // subpass even though it doesn't touch them.
+        size_t subpassCount = step.passes.size();
+        std::vector<std::vector<VkAttachmentReference>> colorRefs(subpassCount);
+        std::vector<VkAttachmentReference> depthRefs(subpassCount, VkAttachmentReference{VK_ATTACHMENT_UNUSED, VK_IMAGE_LAYOUT_UNDEFINED});
+        std::vector<std::vector<uint32_t>> preserved(subpassCount);
+        std::vector<uint32_t> firstUse(step.attachments.size(), NONE), lastUse(step.attachments.size(), 0);
+        std::vector<std::vector<bool>> usedIn(subpassCount, std::vector<bool>(step.attachments.size()));
+
+        for (uint32_t s = 0; s < subpassCount; ++s) {
+            for (auto &use : passes[step.passes[s]].uses) {
+                if (use.kind == USE_OTHER) continue;
+                uint32_t a = std::find(step.attachments.begin(), step.attachments.end(), use.resource) - step.attachments.begin();
+                if (use.kind == USE_COLOR) colorRefs[s].push_back({a, use.layout});
+                else depthRefs[s] = {a, use.layout};
+                firstUse[a] = std::min(firstUse[a], s);
+                lastUse[a] = std::max(lastUse[a], s);
+                usedIn[s][a] = true;
+            }
+        }
+        std::vector<VkSubpassDescription> subpasses(subpassCount);
+        for (uint32_t s = 0; s < subpassCount; ++s) {
+            for (uint32_t a = 0; a < step.attachments.size(); ++a) {
+                if (!usedIn[s][a] && firstUse[a] < s && s < lastUse[a]) preserved[s].push_back(a);
+            }
+            auto &subpass = subpasses[s];
+            subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+            subpass.colorAttachmentCount = colorRefs[s].size();
+            subpass.pColorAttachments = colorRefs[s].data();
+            subpass.pDepthStencilAttachment = depthRefs[s].attachment != VK_ATTACHMENT_UNUSED ? &depthRefs[s] : nullptr;
+            subpass.preserveAttachmentCount = preserved[s].size();
+            subpass.pPreserveAttachments = preserved[s].data();
+        }
+
+        // A dependency with nothing on one side still needs some stage there.
+        for (auto &dependency : step.dependencies) {
+            if (dependency.srcStageMask == 0) dependency.srcStageMask = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+            if (dependency.dstStageMask == 0) dependency.dstStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+        }
+
+        VkRenderPassCreateInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+        renderPassInfo.attachmentCount = step.descriptions.size();
+        renderPassInfo.pAttachments = step.descriptions.data();
+        renderPassInfo.subpassCount = subpasses.size();
+        renderPassInfo.pSubpasses = subpasses.data();
+        renderPassInfo.dependencyCount = step.dependencies.size();
+        renderPassInfo.pDependencies = step.dependencies.data();
+        auto result = vkCreateRenderPass(device, &renderPassInfo, nullptr, step.renderPass.replace(device));
+        if (result != VK_SUCCESS) die(log << "Failed to create render pass for " << passes[step.passes[0]].name << ' ' << result);
+
+        step.framebuffers.resize(imageCount);
+        for (uint32_t i = 0; i < imageCount; ++i) {
+            std::vector<VkImageView> views;
+            for (auto r : step.attachments) {
+                views.push_back(resources[r].kind == TRANSIENT_IMAGE ? resources[r].view.get() : resources[r].views[i]);
+            }
+            VkFramebufferCreateInfo framebufferInfo{};
+            framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+            framebufferInfo.renderPass = step.renderPass;
+            framebufferInfo.attachmentCount = views.size();
+            framebufferInfo.pAttachments = views.data();
+            framebufferInfo.width = extent.width;
+            framebufferInfo.height = extent.height;
+            framebufferInfo.layers = 1;
+            result = vkCreateFramebuffer(device, &framebufferInfo, nullptr, step.framebuffers[i].replace(device));
+            if (result != VK_SUCCESS) die(log << "Failed to create framebuffer " << i << " for " << passes[step.passes[0]].name << ' ' << result);
+        }
+        log << "render pass: " << subpassCount << " subpasses, " << step.attachments.size() << " attachments, "
+            << step.dependencies.size() << " dependencies\n";
+    }
+}
+
+void RenderGraph::recordBarrier(VkCommandBuffer commandBuffer, uint32_t image, const Barrier &barrier) const {
+    if (barrier.empty()) return;
+
+    VkMemoryBarrier memoryBarrier{};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = barrier.srcAccess;
+    memoryBarrier.dstAccessMask = barrier.dstAccess;
+    bool memory = barrier.srcAccess || barrier.dstAccess;
+
+    std::vector<VkImageMemoryBarrier> imageBarriers;
+    for (auto &transition : barrier.transitions) {
+        auto &resource = resources[transition.resource];
+        VkImageMemoryBarrier imageBarrier{};
+        imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        imageBarrier.srcAccessMask = barrier.srcAccess;
+        imageBarrier.dstAccessMask = barrier.dstAccess;
+        imageBarrier.oldLayout = transition.from;
+        imageBarrier.newLayout = transition.to;
+        imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        imageBarrier.image = resource.images[image];
+        imageBarrier.subresourceRange.aspectMask = resource.aspect;
+        imageBarrier.subresourceRange.levelCount = 1;
+        imageBarrier.subresourceRange.layerCount = 1;
+        imageBarriers.push_back(imageBarrier);
+    }
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        barrier.srcStages ? barrier.srcStages : VkPipelineStageFlags(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT),
+        barrier.dstStages ? barrier.dstStages : VkPipelineStageFlags(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT),
+        0, memory ? 1 : 0, &memoryBarrier, 0, nullptr, imageBarriers.size(), imageBarriers.data()
+    );
+}
+
+void RenderGraph::execute(VkCommandBuffer commandBuffer, uint32_t image, GpuTimer &timer) const {
+    for (auto &step : steps) {
+        if (!step.graphics) {
+            auto &pass = passes[step.passes[0]];
+            recordBarrier(commandBuffer, image, pass.before);
+            auto zone = timer.begin(commandBuffer, image, pass.name);
+            pass.record(commandBuffer, image);
+            timer.end(commandBuffer, image, zone);
+            continue;
+        }
+
+        // Timestamps can't go in a subpass that executes secondaries, so a render pass on its
+        // own gets timed from the outside, and merged ones per inline subpass.
+        bool merged = step.passes.size() > 1;
+        uint32_t stepZone = merged ? 0 : timer.begin(commandBuffer, image, passes[step.passes[0]].name);
+
+        VkRenderPassBeginInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = step.renderPass;
+        renderPassInfo.framebuffer = step.framebuffers[image];
+        renderPassInfo.renderArea.offset = {0, 0};
+        renderPassInfo.renderArea.extent = extent;
+        renderPassInfo.clearValueCount = step.clearValues.size();
+        renderPassInfo.pClearValues = step.clearValues.data();
+
+        for (size_t s = 0; s < step.passes.size(); ++s) {
+            auto &pass = passes[step.passes[s]];
+            if (s == 0) vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, pass.contents);
+            else vkCmdNextSubpass(commandBuffer, pass.contents);
+
+            bool timed = merged && pass.contents == VK_SUBPASS_CONTENTS_INLINE;
+            uint32_t zone = timed ? timer.begin(commandBuffer, image, pass.name) : 0;
+            pass.record(commandBuffer, image);
+            if (timed) timer.end(commandBuffer, image, zone);
+        }
+        vkCmdEndRenderPass(commandBuffer);
+        if (!merged) timer.end(commandBuffer, image, stepZone);
+    }
+    recordBarrier(commandBuffer, image, after);
+}
+
+VkRenderPass RenderGraph::renderPass(Pass pass) const {
+    if (culled(pass) || !steps[passes[pass].step].graphics) return VK_NULL_HANDLE;
+    return steps[passes[pass].step].renderPass;
+}
+
+VkFramebuffer RenderGraph::framebuffer(Pass pass, uint32_t image) const {
+    if (culled(pass) || !steps[passes[pass].step].graphics) return VK_NULL_HANDLE;
+    return steps[passes[pass].step].framebuffers[image];
+}
+
+void RenderGraph::clear(DeletionQueue &deletions) {
+    for (auto &step : steps) {
+        deletions.defer(std::move(step.renderPass));
+        for (auto &framebuffer : step.framebuffers) deletions.defer(std::move(framebuffer));
+    }
+    for (auto &resource : resources) {
+        if (resource.kind != TRANSIENT_IMAGE) continue;
+        deletions.defer(std::move(resource.view));
+        deletions.defer<vkDestroyImage>(device, resource.image);
+    }
+    for (auto &slot : slots) deletions.defer(slot.memory);
+    steps.clear();
+    slots.clear();
+    resources.clear();
+    passes.clear();
+    after = Barrier{};
+}
+
+void RenderGraph::destroy() {
+    steps.clear();
+    for (auto &resource : resources) {
+        if (resource.kind != TRANSIENT_IMAGE) continue;
+        resource.view.reset();
+        if (resource.image != VK_NULL_HANDLE) vkDestroyImage(device, resource.image, nullptr);
+    }
+    for (auto &slot : slots) allocator->free(slot.memory);
+    slots.clear();
+    resources.clear();
+    passes.clear();
+    after = Barrier{};
+}
+
+// For dump(): the names of whichever bits are set.
+struct FlagName {
+    uint32_t bit;
+    const char *name;
+};
+
+static std::string flagNames(uint32_t flags, const FlagName *names, size_t count) {
+    if (flags == 0) return "none";
+    std::string result;
+    for (size_t i = 0; i < count; ++i) {
+        if (!(flags & names[i].bit)) continue;
+        if (!result.empty()) result += '|';
+        result += names[i].name;
+        flags &= ~names[i].bit;
+    }
+    if (flags) {
+        char hex[16];
+        snprintf(hex, sizeof(hex), "0x%x", flags);
+        if (!result.empty()) result += '|';
+        result += hex;
+    }
+    return result;
+}
+
+static std::string stageNames(VkPipelineStageFlags stages) {
+    static const FlagName names[] = {
+        {VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, "top"},
+        {VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, "draw indirect"},
+        {VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, "vertex input"},
+        {VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, "vertex shader"},
+        {VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, "fragment shader"},
+        {VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, "early tests"},
+        {VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, "late tests"},
+        {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, "color output"},
+        {VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, "compute"},
+        {VK_PIPELINE_STAGE_TRANSFER_BIT, "transfer"},
+        {VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, "bottom"},
+        {VK_PIPELINE_STAGE_HOST_BIT, "host"},
+    };
+    return flagNames(stages, names, sizeof(names) / sizeof(names[0]));
+}
+
+static std::string accessNames(VkAccessFlags access) {
+    static const FlagName names[] = {
+        {VK_ACCESS_INDIRECT_COMMAND_READ_BIT, "indirect read"},
+        {VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, "vertex read"},
+        {VK_ACCESS_SHADER_READ_BIT, "shader read"},
+        {VK_ACCESS_SHADER_WRITE_BIT, "shader write"},
+        {VK_ACCESS_COLOR_ATTACHMENT_READ_BIT, "color read"},
+        {VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, "color write"},
+        {VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT, "depth read"},
+        {VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, "depth write"},
+        {VK_ACCESS_TRANSFER_READ_BIT, "transfer read"},
+        {VK_ACCESS_TRANSFER_WRITE_BIT, "transfer write"},
+        {VK_ACCESS_HOST_READ_BIT, "host read"},
+        {VK_ACCESS_HOST_WRITE_BIT, "host write"},
+    };
+    return flagNames(access, names, sizeof(names) / sizeof(names[0]));
+}
+
+static const char *layoutName(VkImageLayout layout) {
+    switch (layout) {
+        case VK_IMAGE_LAYOUT_UNDEFINED: return "undefined";
+        case VK_IMAGE_LAYOUT_GENERAL: return "general";
+        case VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL: return "color attachment";
+        case VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL: return "depth attachment";
+        case VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL: return "depth read-only";
+        case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL: return "shader read-only";
+        case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL: return "transfer src";
+        case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL: return "transfer dst";
+        case VK_IMAGE_LAYOUT_PRESENT_SRC_KHR: return "present";
+        default: return "other";
+    }
+}
+
+static const char *loadName(VkAttachmentLoadOp load) {
+    switch (load) {
+        case VK_ATTACHMENT_LOAD_OP_LOAD: return "load";
+        case VK_ATTACHMENT_LOAD_OP_CLEAR: return "clear";
+        default: return "don't care";
+    }
+}
+
+void RenderGraph::dump(const char *label, const GpuTimer *timer) const {
+    Report log(label);
+    static const char *typeNames[] = {"graphics", "compute", "transfer"};
+
+    auto dumpBarrier = [&](const char *what, const Barrier &barrier) {
+        if (barrier.empty()) return;
+        log << what << ": " << stageNames(barrier.srcStages) << " -> " << stageNames(barrier.dstStages)
+            << ", " << accessNames(barrier.srcAccess) << " -> " << accessNames(barrier.dstAccess) << '\n';
+        for (auto &transition : barrier.transitions) {
+            log << "    " << resources[transition.resource].name << ": " << layoutName(transition.from)
+                << " -> " << layoutName(transition.to) << '\n';
+        }
+    };
+
+    VkDeviceSize transientBytes = 0;
+    for (auto &slot : slots) transientBytes += slot.memory.size;
+    size_t renderPasses = std::count_if(steps.begin(), steps.end(), [](const Step &step) { return step.graphics; });
+    log << passes.size() << " passes, " << renderPasses << " render passes, " << slots.size()
+        << " transient memory slots (" << (transientBytes >> 10) << " KiB)\n";
+
+    for (size_t i = 0; i < steps.size(); ++i) {
+        auto &step = steps[i];
+        if (step.graphics) {
+            log << "render pass " << i << ", " << extent.width << 'x' << extent.height << ":\n";
+            for (size_t a = 0; a < step.attachments.size(); ++a) {
+                auto &resource = resources[step.attachments[a]];
+                auto &description = step.descriptions[a];
+                log << "  attachment " << a << ' ' << resource.name << ": " << loadName(description.loadOp) << ", "
+                    << (description.storeOp == VK_ATTACHMENT_STORE_OP_STORE ? "store" : "don't store") << ", "
+                    << layoutName(description.initialLayout) << " -> " << layoutName(description.finalLayout);
+                if (resource.kind == TRANSIENT_IMAGE) {
+                    log << ", transient in slot " << resource.slot
+                        << (resource.usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT ? " (never leaves the tile)" : "");
+                }
+                log << '\n';
+            }
+            for (auto &dependency : step.dependencies) {
+                auto subpassName = [](uint32_t subpass) {
+                    return subpass == VK_SUBPASS_EXTERNAL ? std::string("external") : std::to_string(subpass);
+                };
+                log << "  dependency " << subpassName(dependency.srcSubpass) << " -> " << subpassName(dependency.dstSubpass)
+                    << ": " << stageNames(dependency.srcStageMask) << " -> " << stageNames(dependency.dstStageMask)
+                    << ", " << accessNames(dependency.srcAccessMask) << " -> " << accessNames(dependency.dstAccessMask)
+                    << (dependency.dependencyFlags & VK_DEPENDENCY_BY_REGION_BIT ? " (by region)" : "") << '\n';
+            }
+        }
+        for (auto p : step.passes) {
+            auto &pass = passes[p];
+            log << (step.graphics ? "  subpass " + std::to_string(pass.subpass) + ' ' : std::string()) << pass.name
+                << " (" << typeNames[pass.type] << ')';
+            auto stats = timer ? timer->stats(pass.name) : nullptr;
+            if (stats && !stats->empty()) log << ": " << stats->avg() << " ms avg, " << stats->percentile(99) << " ms p99";
+            log << '\n';
+            dumpBarrier("    barrier first", pass.before);
+            for (auto &use : pass.uses) {
+                bool write = writes(use.access, use.load);
+                log << "    " << (reads(use.load) ? (write ? "reads + writes " : "reads ") : "writes ") << resources[use.resource].name
+                    << " (" << stageNames(use.stages) << ", " << accessNames(use.access) << ")\n";
+            }
+        }
+    }
+    dumpBarrier("after the last pass", after);
+    for (auto &pass : passes) {
+        if (pass.step == NONE) log << "culled: " << pass.name << " (nothing uses what it writes)\n";
+    }
+}
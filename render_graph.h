@@ -0,0 +1,210 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "handles.h"
+#include "memory.h"
+
+class GpuTimer;
+
+// One frame, written down as passes that say which resources they read and write, instead of
+// render passes and barriers written out by hand. compile() works out the rest:
+//
+//  - passes none of the outputs depend on get dropped,
+//  - back to back graphics passes become subpasses of one render pass,
+//  - every hazard between two passes turns into the smallest barrier or subpass dependency that
+//    covers it, and image layout transitions go in render pass attachments wherever they can,
+//  - images the graph makes itself only live inside the frame, so the ones whose passes never
+//    overlap share memory (and they're lazily allocated wherever that works).
+//
+// Build it (and compile it) when what the frame looks like changes: a new swapchain, a pass
+// coming or going. execute() then records it into as many command buffers as you like.
+//
+// A pipeline can only draw in a merged pass if it was created against renderPass(pass) and
+// subpass(pass). The shape pipelines are made against a one-subpass render pass of their own,
+// so they're only good in a graphics pass with no other graphics pass right next to it.
+class RenderGraph {
+public:
+    using Resource = uint32_t;
+    using Pass = uint32_t;
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    enum PassType { PASS_GRAPHICS, PASS_COMPUTE, PASS_TRANSFER };
+
+    // Records one pass for swapchain image `image`. Graphics passes are already inside their
+    // (sub)pass when this gets called.
+    using RecordFunction = std::function<void(VkCommandBuffer commandBuffer, uint32_t image)>;
+
+    // An image from outside, one per swapchain image (images[i] and views[i] go with
+    // execute(..., i)). Its contents are thrown out at the start of every frame, and whatever
+    // is waiting on it (the acquire semaphore, say) has to be done by `readyStage`. It's left in
+    // `finalLayout` at the end.
+    Resource importImage(
+        const char *name, VkFormat format, VkImageAspectFlags aspect,
+        const std::vector<VkImage> &images, const std::vector<VkImageView> &views,
+        VkImageLayout finalLayout, VkPipelineStageFlags readyStage
+    );
+    // A buffer from outside (or one per swapchain image, it makes no difference: buffer barriers
+    // are all plain VkMemoryBarriers). Only here so passes can say they use it.
+    Resource importBuffer(const char *name);
+    // A swapchain sized attachment the graph makes itself, and shares between every image.
+    // Nothing outside the frame can see what's in it.
+    Resource createImage(const char *name, VkFormat format, VkImageAspectFlags aspect);
+
+    // Names have to outlive the graph (and the GpuTimer zones they become), so string literals only.
+    Pass addPass(const char *name, PassType type, RecordFunction record);
+
+    // Attachments of a graphics pass. LOAD only works for something an earlier pass in this
+    // frame drew into.
+    void colorAttachment(Pass pass, Resource image, VkAttachmentLoadOp load, VkClearColorValue clear = {});
+    void depthAttachment(Pass pass, Resource image, VkAttachmentLoadOp load, bool write = true, float clear = 1.0f);
+    // Anything else a pass does to a resource. Whether it's a read or a write (or both) comes
+    // from `access`. Images used like this need a `layout`, and have to be imported.
+    void use(
+        Pass pass, Resource resource, VkPipelineStageFlags stages, VkAccessFlags access,
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED
+    );
+    // What the frame is for. Passes that don't lead to any output get culled. `stages` and
+    // `access` are whoever looks at it after the frame (the host, say), if it needs a barrier.
+    void output(Resource resource, VkPipelineStageFlags stages = 0, VkAccessFlags access = 0);
+
+    // Whether a graphics pass records its draws inline or executes secondaries. Can change
+    // between execute()s without compiling again.
+    void setContents(Pass pass, VkSubpassContents contents);
+    VkSubpassContents contents(Pass pass) const { return passes[pass].contents; }
+
+    void compile(VkDevice device, DeviceAllocator &allocator, VkExtent2D extent, uint32_t imageCount);
+    // Records every pass that survived compile(), with a GpuTimer zone per pass (named after it).
+    // Passes merged into a subpass only get a zone when they record inline.
+    void execute(VkCommandBuffer commandBuffer, uint32_t image, GpuTimer &timer) const;
+
+    // Forgets every pass and resource, and hands what it made over to `deletions`, since frames
+    // in flight can still be using it. Ready to build again after.
+    void clear(DeletionQueue &deletions);
+    // Only once the device is idle.
+    void destroy();
+
+    bool culled(Pass pass) const { return passes[pass].step == NONE; }
+    // For secondaries (and pipelines) that go inside a graphics pass.
+    VkRenderPass renderPass(Pass pass) const;
+    uint32_t subpass(Pass pass) const { return passes[pass].subpass; }
+    VkFramebuffer framebuffer(Pass pass, uint32_t image) const;
+
+    // Through Logger: every pass with what it uses and the barriers in front of it, and its
+    // average GPU time from `timer` (if it has one).
+    void dump(const char *label, const GpuTimer *timer = nullptr) const;
+
+private:
+    enum ResourceKind { IMPORTED_IMAGE, IMPORTED_BUFFER, TRANSIENT_IMAGE };
+    enum UseKind { USE_COLOR, USE_DEPTH, USE_OTHER };
+
+    struct Use {
+        Resource resource;
+        UseKind kind;
+        VkPipelineStageFlags stages;
+        VkAccessFlags access;
+        VkImageLayout layout;
+        VkAttachmentLoadOp load;
+        VkClearValue clear;
+    };
+
+    struct ResourceInfo {
+        const char *name;
+        ResourceKind kind;
+        VkFormat format = VK_FORMAT_UNDEFINED;
+        VkImageAspectFlags aspect = 0;
+        std::vector<VkImage> images;
+        std::vector<VkImageView> views;
+        VkImageLayout finalLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        VkPipelineStageFlags readyStage = 0;
+        bool output = false;
+        VkPipelineStageFlags outputStages = 0;
+        VkAccessFlags outputAccess = 0;
+
+        // Transient images, once compiled: which memory slot, and what's in it.
+        uint32_t slot = NONE;
+        VkImage image = VK_NULL_HANDLE;
+        ImageView view;
+        VkImageUsageFlags usage = 0;
+    };
+
+    // Everything pass A has to be done with before pass B starts, in one place.
+    struct Barrier {
+        VkPipelineStageFlags srcStages = 0;
+        VkPipelineStageFlags dstStages = 0;
+        VkAccessFlags srcAccess = 0;
+        VkAccessFlags dstAccess = 0;
+        // Imported images that change layout outside a render pass.
+        struct Transition {
+            Resource resource;
+            VkImageLayout from;
+            VkImageLayout to;
+        };
+        std::vector<Transition> transitions;
+
+        bool empty() const { return srcStages == 0 && dstStages == 0 && transitions.empty(); }
+    };
+
+    struct PassInfo {
+        const char *name;
+        PassType type;
+        RecordFunction record;
+        std::vector<Use> uses;
+        VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE;
+
+        // Once compiled: which step it's in (NONE if culled) and which subpass of it.
+        uint32_t step = NONE;
+        uint32_t subpass = 0;
+        Barrier before;
+    };
+
+    // What execute() walks through: either one compute/transfer pass, or a render pass with
+    // one or more graphics passes in it.
+    struct Step {
+        std::vector<Pass> passes;
+        bool graphics = false;
+        RenderPass renderPass;
+        std::vector<Framebuffer> framebuffers;
+        // Which resource each attachment is, and what it gets cleared to.
+        std::vector<Resource> attachments;
+        std::vector<VkClearValue> clearValues;
+        std::vector<VkAttachmentDescription> descriptions;
+        std::vector<VkSubpassDependency> dependencies;
+    };
+
+    // Memory that transient images take turns in.
+    struct Slot {
+        Allocation memory;
+        std::vector<Resource> images;
+        uint32_t lastStep = 0;
+    };
+
+    std::vector<ResourceInfo> resources;
+    std::vector<PassInfo> passes;
+    std::vector<Step> steps;
+    std::vector<Slot> slots;
+    // After the last pass: for outputs read by someone outside the frame.
+    Barrier after;
+
+    VkDevice device = VK_NULL_HANDLE;
+    DeviceAllocator *allocator = nullptr;
+    VkExtent2D extent{};
+    uint32_t imageCount = 0;
+
+    void cull();
+    void group();
+    void allocateTransients(DeviceAllocator &allocator);
+    void placeBarriers();
+    void createRenderPasses();
+    void depend(
+        uint32_t srcPass, VkPipelineStageFlags srcStages, VkAccessFlags srcAccess,
+        uint32_t dstPass, VkPipelineStageFlags dstStages, VkAccessFlags dstAccess
+    );
+    VkSubpassDependency &dependency(Step &step, uint32_t srcSubpass, uint32_t dstSubpass);
+    void recordBarrier(VkCommandBuffer commandBuffer, uint32_t image, const Barrier &barrier) const;
+};
@@ -0,0 +1,155 @@
+#include "scene.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <random>
+
+VkVertexInputBindingDescription ShapeInstance::bindingDescription(uint32_t binding) {
+    VkVertexInputBindingDescription description{};
+    description.binding = binding;
+    description.stride = sizeof(ShapeInstance);
+    description.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+    return description;
+}
+
+std::array<VkVertexInputAttributeDescription, 4> ShapeInstance::attributeDescriptions(uint32_t binding) {
+    std::array<VkVertexInputAttributeDescription, 4> attributes{};
+
+    // location 0: vec4 (x, y, width, height)
+    attributes[0].binding = binding;
+    attributes[0].location = 0;
+    attributes[0].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    attributes[0].offset = offsetof(ShapeInstance, x);
+
+    // location 1: vec2 (rotation, depth)
+    attributes[1].binding = binding;
+    attributes[1].location = 1;
+    attributes[1].format = VK_FORMAT_R32G32_SFLOAT;
+    attributes[1].offset = offsetof(ShapeInstance, rotation);
+
+    // location 2: vec4 color, unpacked from the uint by the vertex fetch for free
+    attributes[2].binding = binding;
+    attributes[2].location = 2;
+    attributes[2].format = VK_FORMAT_R8G8B8A8_UNORM;
+    attributes[2].offset = offsetof(ShapeInstance, color);
+
+    // location 3: uint shape
+    attributes[3].binding = binding;
+    attributes[3].location = 3;
+    attributes[3].format = VK_FORMAT_R32_UINT;
+    attributes[3].offset = offsetof(ShapeInstance, shape);
+
+    return attributes;
+}
+
+uint32_t packColor(float r, float g, float b, float a) {
+    auto channel = [](float c) { return static_cast<uint32_t>(std::clamp(c, 0.0f, 1.0f) * 255.0f + 0.5f); };
+    return channel(r) | (channel(g) << 8) | (channel(b) << 16) | (channel(a) << 24);
+}
+
+uint32_t packShape(ShapeType type, float parameter) {
+    auto byte = static_cast<uint32_t>(std::clamp(parameter, 0.0f, 1.0f) * 255.0f + 0.5f);
+    return uint32_t(type) | (byte << 8);
+}
+
+std::vector<ShapeInstance> makeTestScene(size_t count, uint32_t seed, bool analytic) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+
+    // Shapes get smaller as there are more of them, so the screen stays about equally covered.
+    float baseSize = 2.0f / std::sqrt(static_cast<float>(std::max<size_t>(count, 1)));
+
+    std::vector<ShapeInstance> shapes(count);
+    for (size_t i = 0; i < count; ++i) {
+        auto &shape = shapes[i];
+        shape.x = position(rng);
+        shape.y = position(rng);
+        shape.width = baseSize * (0.5f + unit(rng));
+        shape.height = baseSize * (0.5f + unit(rng));
+        shape.rotation = unit(rng) * 6.2831853f;
+        shape.depth = unit(rng);
+        shape.color = packColor(unit(rng), unit(rng), unit(rng));
+        auto type = static_cast<ShapeType>(rng() % (analytic ? SHAPE_TYPE_COUNT : SHAPE_CIRCLE));
+        shape.shape = packShape(type, analytic ? unit(rng) : 0.0f);
+    }
+    return shapes;
+}
+
+// The depth as bits that sort the same way as the depth does, which is how positive floats work.
+// Anything outside 0..1 (or NaN) would be clipped anyway, so it just goes to one end.
+static uint32_t depthBits(float depth) {
+    float clamped = depth > 0.0f ? std::min(depth, 1.0f) : 0.0f;
+    uint32_t bits;
+    memcpy(&bits, &clamped, sizeof(bits));
+    return bits;
+}
+
+size_t sortForDrawing(std::vector<ShapeInstance> &shapes, Translucency translucency) {
+    // Key in the top half, index in the bottom. The top bit of the key says translucent, so those
+    // end up after the opaque ones, and their depth is flipped so they go back to front.
+    static const uint32_t ONE = 0x3F800000; // 1.0f
+    std::vector<uint64_t> keys(shapes.size());
+    size_t opaque = 0;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        bool translucent = translucency == TRANSLUCENT_ALL ||
+                           (translucency == TRANSLUCENT_BY_ALPHA && (shapes[i].color >> 24) < 255);
+        uint32_t bits = depthBits(shapes[i].depth);
+        uint32_t key = translucent ? (1u << 31) | (ONE - bits) : bits;
+        keys[i] = (uint64_t(key) << 32) | i;
+        opaque += !translucent;
+    }
+
+    // LSD radix sort on the key, a byte at a time. Stable, so the index breaks ties by itself.
+    // Only the 8 byte keys move around until the very end, which makes it about 2.5x faster than
+    // std::stable_sort on the shapes themselves (a million of them).
+    std::vector<uint64_t> scratch(keys.size());
+    for (uint32_t shift = 32; shift < 64; shift += 8) {
+        size_t counts[257] = {};
+        for (auto key : keys) counts[((key >> shift) & 0xFF) + 1] += 1;
+        // Everything's in the same bucket, so this byte wouldn't move anything.
+        if (std::find(counts + 1, counts + 257, keys.size()) != counts + 257) continue;
+        for (size_t b = 1; b < 257; ++b) counts[b] += counts[b - 1];
+        for (auto key : keys) scratch[counts[(key >> shift) & 0xFF]++] = key;
+        keys.swap(scratch);
+    }
+
+    std::vector<ShapeInstance> sorted(shapes.size());
+    for (size_t i = 0; i < keys.size(); ++i) sorted[i] = shapes[uint32_t(keys[i])];
+    shapes.swap(sorted);
+    return opaque;
+}
+
+Path makeTestPath(uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    uint32_t tips = 3 + rng() % 30;
+    float inner = 0.1f + 0.35f * unit(rng);
+    // Where the curve's control point sits between the valley and the tip. Each side stays inside
+    // its own wedge of the star, so curved or not it never crosses another one.
+    float bulge = unit(rng);
+    bool curved = rng() % 2 == 0;
+
+    auto corner = [&](float step, float radius) {
+        float angle = 3.14159265f * step / tips;
+        return Point{radius * std::sin(angle), -radius * std::cos(angle)};
+    };
+
+    Path path;
+    path.moveTo(0.0f, -0.5f);
+    for (uint32_t i = 1; i <= 2 * tips; ++i) {
+        // Even steps are tips, odd ones the valleys between them. The last one lands back on the first tip.
+        Point to = i == 2 * tips ? Point{0.0f, -0.5f} : corner(i, i % 2 == 0 ? 0.5f : inner);
+        if (curved) {
+            Point control = corner(i - 0.5f, inner + (0.5f - inner) * bulge);
+            path.quadTo(control.x, control.y, to.x, to.y);
+        }
+        else {
+            path.lineTo(to.x, to.y);
+        }
+    }
+    path.close();
+    return path;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "tessellator.h"
+
+// Has to match the table in triangle.vert and shapeDistance() in triangle.frag.
+enum ShapeType : uint32_t {
+    SHAPE_TRIANGLE = 0,
+    SHAPE_RECTANGLE = 1,
+    SHAPE_DIAMOND = 2,
+    // These only really exist with RENDER_SDF. Drawn as triangles, they're just a rectangle.
+    SHAPE_CIRCLE = 3,
+    SHAPE_ROUNDED_RECTANGLE = 4,
+    SHAPE_RING = 5,
+    SHAPE_TYPE_COUNT
+};
+
+// One of these per shape on screen. This is exactly what goes into the instance buffer, and
+// triangle.vert reads it as per-instance vertex attributes, so keep the two in sync.
+struct ShapeInstance {
+    // Center and size, in normalized device coordinates (-1..1 covers the screen)
+    float x, y;
+    float width, height;
+    // Radians, clockwise
+    float rotation;
+    // 0 is in front, 1 is all the way in the back
+    float depth;
+    // RGBA8, red in the lowest byte
+    uint32_t color;
+    // ShapeType in the low 8 bits. The next 8 are a 0-1 parameter (see packShape()), and the rest
+    // is reserved.
+    uint32_t shape;
+
+    static VkVertexInputBindingDescription bindingDescription(uint32_t binding);
+    static std::array<VkVertexInputAttributeDescription, 4> attributeDescriptions(uint32_t binding);
+};
+static_assert(sizeof(ShapeInstance) == 32, "ShapeInstance layout is shared with the shaders");
+
+// Every shape is drawn as this many vertices, some of them degenerate. See triangle.vert.
+const uint32_t VERTICES_PER_SHAPE = 6;
+
+uint32_t packColor(float r, float g, float b, float a = 1.0f);
+// ShapeInstance::shape. `parameter` is the corner radius of a rounded rectangle, or the thickness of
+// a ring, as a fraction of half the shape's shorter side. Other shapes ignore it.
+uint32_t packShape(ShapeType type, float parameter = 0.0f);
+
+// A bunch of random shapes scattered over the screen, sized so `count` of them roughly fill it.
+// Only triangles, rectangles and diamonds, unless `analytic` (for RENDER_SDF) says to throw in
+// circles, rounded rectangles and rings too.
+std::vector<ShapeInstance> makeTestScene(size_t count, uint32_t seed = 1234, bool analytic = false);
+
+// Which shapes sortForDrawing() counts as translucent, which depends on how they get blended.
+enum Translucency {
+    TRANSLUCENT_NONE,     // alpha is ignored, so nothing is
+    TRANSLUCENT_BY_ALPHA, // anything with alpha under 255
+    TRANSLUCENT_ALL,      // everything, like SDF shapes with their faded edges
+};
+
+// Puts the opaque shapes first, front to back, then the translucent ones back to front. Drawn in
+// that order with a depth buffer, the opaque ones hide what's behind them before its fragment
+// shader runs, and the translucent ones still blend over everything behind them. Shapes at the
+// same depth keep their order. Returns how many are opaque.
+size_t sortForDrawing(std::vector<ShapeInstance> &shapes, Translucency translucency);
+
+// A random star with 3 to 32 points, some with curved sides, filling the -0.5..0.5 box that paths
+// for MeshCache live in. Same seed, same path (down to the bit, so they hash the same).
+Path makeTestPath(uint32_t seed);
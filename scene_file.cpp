@@ -0,0 +1,189 @@
+#include "scene_file.h"
+#include "debug.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char MAGIC[8] = {'S', 'H', 'A', 'P', 'E', 'S', '\r', '\n'};
+// Records start on a cache line, so copying them out never straddles one more than it has to.
+static const uint64_t RECORDS_ALIGNMENT = 64;
+
+SceneFile &SceneFile::operator=(SceneFile &&other) noexcept {
+    if (this == &other) return *this;
+    close();
+    mapping = other.mapping;
+    mappingSize = other.mappingSize;
+    other.mapping = nullptr;
+    other.mappingSize = 0;
+    return *this;
+}
+
+bool SceneFile::open(const std::string &path) {
+    Logger log("SceneFile::open");
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cout << "couldn't open " << path << ": " << strerror(errno) << '\n';
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(SceneFileHeader)) {
+        std::cout << path << " is too small to be a scene file\n";
+        ::close(fd);
+        return false;
+    }
+    mappingSize = info.st_size;
+    void *mapped = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file around on its own.
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cout << "couldn't map " << path << ": " << strerror(errno) << '\n';
+        mappingSize = 0;
+        return false;
+    }
+    mapping = mapped;
+
+    // Every check is against the header and the file size, never the records, so a bad file
+    // fails before a single page of shapes gets read.
+    auto &h = header();
+    std::string problem;
+    if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0) problem = "isn't a scene file";
+    else if (h.version != SCENE_FILE_VERSION) {
+        problem = "is version " + std::to_string(h.version) + ", and this only reads " + std::to_string(SCENE_FILE_VERSION);
+    }
+    else if (h.headerSize != sizeof(SceneFileHeader)) problem = "has the wrong header size for its version";
+    else if (h.recordSize != sizeof(ShapeInstance)) problem = "has records that aren't ShapeInstances";
+    else if (h.recordsOffset < h.headerSize || h.recordsOffset % RECORDS_ALIGNMENT != 0) problem = "has its records in a weird place";
+    else if (h.recordsOffset > mappingSize || h.shapeCount > (mappingSize - h.recordsOffset) / h.recordSize) problem = "is cut short";
+    else if (h.reserved[0] != 0 || h.reserved[1] != 0 || h.reserved[2] != 0) problem = "uses header fields this version doesn't know about";
+    else if (h.flags & SCENE_SORTED) {
+        // These end up in draw counts (and cull.comp's shape count), so they'd better add up.
+        if (h.opaqueCount > h.shapeCount) problem = "says more of its shapes are opaque than it has";
+        else if (h.translucency > TRANSLUCENT_ALL) problem = "is sorted for a blend mode that doesn't exist";
+    }
+    if (!problem.empty()) {
+        std::cout << path << ' ' << problem << '\n';
+        close();
+        return false;
+    }
+
+    // It all gets read front to back exactly once, to be copied into staging memory, so have the
+    // kernel start reading now and read ahead as far as it likes. (Advice isn't flags, so it's
+    // one call each.)
+    madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+    madvise(mapping, mappingSize, MADV_WILLNEED);
+    log << path << ": " << h.shapeCount << " shapes, " << (mappingSize >> 20) << " MiB"
+        << (h.flags & SCENE_SORTED ? ", sorted" : "") << '\n';
+    return true;
+}
+
+void SceneFile::close() {
+    if (!mapping) return;
+    munmap(mapping, mappingSize);
+    mapping = nullptr;
+    mappingSize = 0;
+}
+
+const ShapeInstance *SceneFile::shapes() const {
+    return reinterpret_cast<const ShapeInstance *>(static_cast<const char *>(mapping) + header().recordsOffset);
+}
+
+bool SceneFile::sortedFor(Translucency translucency) const {
+    return (header().flags & SCENE_SORTED) && header().translucency == uint32_t(translucency);
+}
+
+bool writeSceneFile(
+    const std::string &path, const std::vector<ShapeInstance> &shapes,
+    bool sorted, uint32_t opaqueCount, Translucency translucency, uint32_t uniformShape
+) {
+    SceneFileHeader header{};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = SCENE_FILE_VERSION;
+    header.headerSize = sizeof(SceneFileHeader);
+    header.recordSize = sizeof(ShapeInstance);
+    header.flags = sorted ? uint32_t(SCENE_SORTED) : 0;
+    header.shapeCount = shapes.size();
+    header.recordsOffset = (sizeof(SceneFileHeader) + RECORDS_ALIGNMENT - 1) / RECORDS_ALIGNMENT * RECORDS_ALIGNMENT;
+    header.opaqueCount = sorted ? opaqueCount : 0;
+    header.translucency = sorted ? uint32_t(translucency) : 0;
+    header.uniformShape = uniformShape;
+
+    std::string tempPath = path + ".tmp";
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if (!file) {
+        std::cout << "couldn't open " << tempPath << " for writing\n";
+        return false;
+    }
+    std::vector<char> padding(header.recordsOffset - sizeof(header));
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   (padding.empty() || fwrite(padding.data(), 1, padding.size(), file) == padding.size()) &&
+                   (shapes.empty() || fwrite(shapes.data(), sizeof(ShapeInstance), shapes.size(), file) == shapes.size());
+    written = fclose(file) == 0 && written;
+    if (!written || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::cout << "failed writing " << path << '\n';
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Floats with %.9g come back bit for bit, so both loaders end up with the same scene.
+bool writeTextScene(const std::string &path, const std::vector<ShapeInstance> &shapes) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        std::cout << "couldn't open " << path << " for writing\n";
+        return false;
+    }
+    fprintf(file, "# x y width height rotation depth color shape\n");
+    for (auto &shape : shapes) {
+        fprintf(
+            file, "%.9g %.9g %.9g %.9g %.9g %.9g %" PRIu32 " %" PRIu32 "\n",
+            shape.x, shape.y, shape.width, shape.height, shape.rotation, shape.depth, shape.color, shape.shape
+        );
+    }
+    return fclose(file) == 0;
+}
+
+// What you'd write first: a line at a time, sscanf each one, push_back.
+bool readTextScene(const std::string &path, std::vector<ShapeInstance> &shapes) {
+    FILE *file = fopen(path.c_str(), "r");
+    if (!file) {
+        std::cout << "couldn't open " << path << '\n';
+        return false;
+    }
+    shapes.clear();
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#') continue;
+        ShapeInstance shape;
+        int fields = sscanf(
+            line, "%f %f %f %f %f %f %" SCNu32 " %" SCNu32,
+            &shape.x, &shape.y, &shape.width, &shape.height, &shape.rotation, &shape.depth, &shape.color, &shape.shape
+        );
+        if (fields != 8) {
+            std::cout << path << ": bad line \"" << line << "\"\n";
+            fclose(file);
+            return false;
+        }
+        shapes.push_back(shape);
+    }
+    fclose(file);
+    return true;
+}
+
+void dropFromPageCache(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    // Dirty pages can't be dropped, and the file was probably only just written.
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
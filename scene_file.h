@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "scene.h"
+
+// .shapes files: a scene on disk, laid out so loading it is mapping it and copying the records
+// straight into staging memory. There's nothing to parse: the records are ShapeInstances, byte for
+// byte what goes into the instance buffer (little endian, like every GPU we run on).
+//
+// The header says which version wrote it and how big its parts are, so a newer version can grow
+// the header or the records and an older reader can tell it can't read the file, instead of
+// drawing garbage. It also carries what loading would otherwise have to go through every shape
+// for: whether they're already in sortForDrawing() order (and for which Translucency), and
+// whether they're all one ShapeType.
+const uint32_t SCENE_FILE_VERSION = 1;
+
+enum SceneFileFlags : uint32_t {
+    // In sortForDrawing() order for `translucency`, with `opaqueCount` opaque shapes first.
+    SCENE_SORTED = 1,
+};
+
+struct SceneFileHeader {
+    char magic[8];          // "SHAPES\r\n", which also catches files mangled by a text-mode transfer
+    uint32_t version;       // SCENE_FILE_VERSION
+    uint32_t headerSize;    // sizeof(SceneFileHeader)
+    uint32_t recordSize;    // sizeof(ShapeInstance)
+    uint32_t flags;         // SceneFileFlags
+    uint64_t shapeCount;
+    uint64_t recordsOffset; // from the start of the file. A multiple of 64
+    uint32_t opaqueCount;   // only means anything with SCENE_SORTED
+    uint32_t translucency;  // a Translucency, ditto
+    uint32_t uniformShape;  // the ShapeType every shape is, or SHAPE_ANY
+    uint32_t reserved[3];   // zero
+};
+static_assert(sizeof(SceneFileHeader) == 64, "SceneFileHeader is written to disk as is");
+
+// A .shapes file, mapped read-only for as long as this is open.
+class SceneFile {
+public:
+    SceneFile() = default;
+    ~SceneFile() { close(); }
+    SceneFile(const SceneFile &) = delete;
+    SceneFile &operator=(const SceneFile &) = delete;
+    SceneFile(SceneFile &&other) noexcept { *this = std::move(other); }
+    SceneFile &operator=(SceneFile &&other) noexcept;
+
+    // Maps `path` and checks the header against the file. Returns false (and says why on stdout)
+    // if it's not a scene file this version can read. Doesn't touch the records: the first read
+    // of each page faults it in from the page cache (or the disk).
+    bool open(const std::string &path);
+    void close();
+    explicit operator bool() const { return mapping != nullptr; }
+
+    const SceneFileHeader &header() const { return *static_cast<const SceneFileHeader *>(mapping); }
+    const ShapeInstance *shapes() const;
+    size_t size() const { return header().shapeCount; }
+    bool sortedFor(Translucency translucency) const;
+
+private:
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+};
+
+// Writes a .shapes file. Pass `sorted` if `shapes` came out of sortForDrawing(shapes, translucency),
+// which returned `opaqueCount`. `uniformShape` is the ShapeType they all are, or SHAPE_ANY.
+// Writes to a temporary file and renames it, so a reader never sees half a scene.
+bool writeSceneFile(
+    const std::string &path, const std::vector<ShapeInstance> &shapes,
+    bool sorted, uint32_t opaqueCount, Translucency translucency, uint32_t uniformShape
+);
+
+// The naive way, for --bench-scene-load to compare against: one shape per line, as text.
+bool writeTextScene(const std::string &path, const std::vector<ShapeInstance> &shapes);
+bool readTextScene(const std::string &path, std::vector<ShapeInstance> &shapes);
+// Asks the kernel to forget what it has cached of `path`, so the next read comes off the disk.
+// For --bench-scene-load's cold runs. It's only advice, and pages still mapped somewhere stay.
+void dropFromPageCache(const std::string &path);
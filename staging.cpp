@@ -0,0 +1,91 @@
+#include "staging.h"
+#include "debug.h"
+
+#include <algorithm>
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+void StagingRing::init(DeviceAllocator &allocator, VkDevice device, VkDeviceSize size) {
+    Logger log("StagingRing::init");
+    this->allocator = &allocator;
+    this->device = device;
+    this->size = size;
+    allocation = allocator.createBuffer(
+        size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, buffer,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+    );
+    head = 0;
+    finishedFrame = 0;
+    log << "mapped " << (size >> 20) << " MiB staging ring\n";
+}
+
+void StagingRing::destroy() {
+    if (buffer == VK_NULL_HANDLE) return;
+    vkDestroyBuffer(device, buffer, nullptr);
+    allocator->free(allocation);
+    buffer = VK_NULL_HANDLE;
+    regions.clear();
+}
+
+void StagingRing::collect(uint64_t frame) {
+    finishedFrame = std::max(finishedFrame, frame);
+    retire();
+}
+
+void StagingRing::retire() {
+    while (!regions.empty()) {
+        auto &oldest = regions.front();
+        if (oldest.users > 0) break;
+        if (oldest.frame > finishedFrame) break;
+        regions.pop_front();
+    }
+    if (regions.empty()) head = 0;
+}
+
+StagingRing::Region *StagingRing::allocate(VkDeviceSize size, VkDeviceSize alignment, uint32_t users) {
+    retire();
+    if (size == 0 || size > capacity()) return nullptr;
+    alignment = alignment > 0 ? alignment : 1;
+
+    VkDeviceSize offset;
+    if (regions.empty()) {
+        offset = 0;
+    }
+    else {
+        VkDeviceSize tail = regions.front().offset;
+        if (head > tail) {
+            // Not wrapped: free space is [head, end) and then [0, tail)
+            offset = alignUp(head, alignment);
+            if (offset + size > capacity()) {
+                if (size > tail) return nullptr;
+                offset = 0;
+            }
+        }
+        else {
+            // Wrapped: the only free space is [head, tail)
+            offset = alignUp(head, alignment);
+            if (offset + size > tail) return nullptr;
+        }
+    }
+
+    Region region;
+    region.offset = offset;
+    region.size = size;
+    region.mapped = static_cast<char*>(allocation.mapped) + offset;
+    region.users = users;
+    regions.push_back(region);
+    head = offset + size;
+    return &regions.back();
+}
+
+void StagingRing::flush(const Region &region) {
+    allocator->flush(allocation, region.offset, region.size);
+}
+
+VkDeviceSize StagingRing::inUse() const {
+    if (regions.empty()) return 0;
+    VkDeviceSize tail = regions.front().offset;
+    return head > tail ? head - tail : capacity() - tail + head;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <deque>
+
+#include "memory.h"
+
+// A persistently mapped ring of host visible memory for streaming data up to the GPU.
+//
+// allocate() hands out a contiguous Region at the head of the ring. Each Region says how many
+// consumers still have to copy out of it (`users`) and which frame the most recent copy went in
+// with, numbered like DeletionQueue::submitted(). Once users hits 0 and collect() has been told
+// that frame is done, retire() lets the tail move past it. Regions retire in the order they
+// were allocated.
+class StagingRing {
+public:
+    struct Region {
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+        void *mapped = nullptr;
+        uint32_t users = 0;
+        // 0 if nothing has copied out of it yet.
+        uint64_t frame = 0;
+    };
+
+private:
+    DeviceAllocator *allocator = nullptr;
+    VkDevice device = VK_NULL_HANDLE;
+    Allocation allocation;
+    // The buffer's size. The allocation behind it can be a bit bigger.
+    VkDeviceSize size = 0;
+    VkDeviceSize head = 0;
+    // The newest frame collect() has heard about.
+    uint64_t finishedFrame = 0;
+    // Pointers to these stay valid until they retire (std::deque never moves its elements
+    // on push_back/pop_front).
+    std::deque<Region> regions;
+
+public:
+    VkBuffer buffer = VK_NULL_HANDLE;
+
+    void init(DeviceAllocator &allocator, VkDevice device, VkDeviceSize size);
+    void destroy();
+
+    // Call once frame `frame` is done (its fence has signaled), same as DeletionQueue::collect().
+    void collect(uint64_t frame);
+    // Frees up whatever regions the GPU is done with. Never waits.
+    void retire();
+    // Returns null if there isn't room even after retiring. Data written through Region::mapped
+    // has to be flush()ed before it's submitted.
+    Region *allocate(VkDeviceSize size, VkDeviceSize alignment, uint32_t users);
+    void flush(const Region &region);
+
+    VkDeviceSize capacity() const { return size; }
+    VkDeviceSize inUse() const;
+};
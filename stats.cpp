@@ -0,0 +1,43 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+
+RollingStats::RollingStats(size_t window) : samples(window > 0 ? window : 1) { }
+
+void RollingStats::add(double sample) {
+    samples[next] = sample;
+    next = (next + 1) % samples.size();
+    if (count < samples.size()) count += 1;
+}
+
+void RollingStats::clear() {
+    next = 0;
+    count = 0;
+}
+
+double RollingStats::min() const {
+    if (count == 0) return 0;
+    return *std::min_element(samples.begin(), samples.begin() + count);
+}
+
+double RollingStats::max() const {
+    if (count == 0) return 0;
+    return *std::max_element(samples.begin(), samples.begin() + count);
+}
+
+double RollingStats::avg() const {
+    if (count == 0) return 0;
+    double sum = 0;
+    for (size_t i = 0; i < count; ++i) sum += samples[i];
+    return sum / count;
+}
+
+double RollingStats::percentile(double p) const {
+    if (count == 0) return 0;
+    std::vector<double> sorted(samples.begin(), samples.begin() + count);
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * count));
+    rank = std::clamp<size_t>(rank, 1, count) - 1;
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Keeps the last `window` samples around so we can ask for min/avg/p99 without
+// the numbers being dominated by whatever happened during startup.
+class RollingStats {
+    std::vector<double> samples;
+    size_t next = 0;
+    size_t count = 0;
+
+public:
+    explicit RollingStats(size_t window = 512);
+
+    void add(double sample);
+    void clear();
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    double min() const;
+    double max() const;
+    double avg() const;
+    // p is 0-100. Copies and partially sorts, so don't call it in a hot loop.
+    double percentile(double p) const;
+};
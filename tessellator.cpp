@@ -0,0 +1,490 @@
+#include "tessellator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+static bool useSimd = true;
+#else
+static bool useSimd = false;
+#endif
+
+void setTessellatorSimd(bool enabled) {
+#ifdef __SSE2__
+    useSimd = enabled;
+#endif
+}
+
+bool tessellatorSimd() { return useSimd; }
+
+void Path::moveTo(float x, float y) {
+    verbs.push_back(MOVE);
+    points.push_back({x, y});
+}
+
+void Path::lineTo(float x, float y) {
+    verbs.push_back(LINE);
+    points.push_back({x, y});
+}
+
+void Path::quadTo(float cx, float cy, float x, float y) {
+    verbs.push_back(QUAD);
+    points.insert(points.end(), {{cx, cy}, {x, y}});
+}
+
+void Path::cubicTo(float c1x, float c1y, float c2x, float c2y, float x, float y) {
+    verbs.push_back(CUBIC);
+    points.insert(points.end(), {{c1x, c1y}, {c2x, c2y}, {x, y}});
+}
+
+void Path::close() {
+    verbs.push_back(CLOSE);
+}
+
+// How many lines a curve needs so none of them is more than `tolerance` off. A line across a
+// parametric step of 1/n is off by at most |B''| / 8n², so that's n = sqrt(|B''| / 8 tolerance).
+static uint32_t curveSegments(float maxSecondDerivative, float tolerance) {
+    float n = std::ceil(std::sqrt(maxSecondDerivative / (8.0f * tolerance)));
+    return static_cast<uint32_t>(std::clamp(n, 1.0f, 256.0f));
+}
+
+void Path::flatten(float tolerance, std::vector<Point> &out, std::vector<uint32_t> &contourSizes) const {
+    size_t contourStart = out.size();
+    Point first{0, 0};
+    Point current{0, 0};
+
+    auto endContour = [&] {
+        size_t size = out.size() - contourStart;
+        // Ending right back at the start is what closing does anyway.
+        if (size > 1 && out.back().x == out[contourStart].x && out.back().y == out[contourStart].y) {
+            out.pop_back();
+            size -= 1;
+        }
+        if (size >= 3) contourSizes.push_back(size);
+        else out.resize(contourStart);
+        contourStart = out.size();
+    };
+    // Drawing on after a close() without a moveTo() picks up where the last contour started.
+    auto startContour = [&] {
+        if (out.size() == contourStart) out.push_back(current);
+    };
+
+    const Point *p = points.data();
+    for (auto verb : verbs) {
+        switch (verb) {
+        case MOVE:
+            endContour();
+            first = current = *p++;
+            out.push_back(current);
+            break;
+        case LINE:
+            startContour();
+            current = *p++;
+            out.push_back(current);
+            break;
+        case QUAD: {
+            startContour();
+            Point c = p[0], end = p[1];
+            p += 2;
+            // B'' = 2(p0 - 2c + p1) the whole way along.
+            float ddx = current.x - 2 * c.x + end.x, ddy = current.y - 2 * c.y + end.y;
+            uint32_t n = curveSegments(2 * std::hypot(ddx, ddy), tolerance);
+            for (uint32_t i = 1; i <= n; ++i) {
+                float t = float(i) / n, u = 1 - t;
+                out.push_back({u * u * current.x + 2 * u * t * c.x + t * t * end.x,
+                               u * u * current.y + 2 * u * t * c.y + t * t * end.y});
+            }
+            current = end;
+            break;
+        }
+        case CUBIC: {
+            startContour();
+            Point c1 = p[0], c2 = p[1], end = p[2];
+            p += 3;
+            // B'' = 6((1 - t)(p0 - 2c1 + c2) + t(c1 - 2c2 + p1)), so it's biggest at one of the ends.
+            float dd0 = std::hypot(current.x - 2 * c1.x + c2.x, current.y - 2 * c1.y + c2.y);
+            float dd1 = std::hypot(c1.x - 2 * c2.x + end.x, c1.y - 2 * c2.y + end.y);
+            uint32_t n = curveSegments(6 * std::max(dd0, dd1), tolerance);
+            for (uint32_t i = 1; i <= n; ++i) {
+                float t = float(i) / n, u = 1 - t;
+                float w0 = u * u * u, w1 = 3 * u * u * t, w2 = 3 * u * t * t, w3 = t * t * t;
+                out.push_back({w0 * current.x + w1 * c1.x + w2 * c2.x + w3 * end.x,
+                               w0 * current.y + w1 * c1.y + w2 * c2.y + w3 * end.y});
+            }
+            current = end;
+            break;
+        }
+        case CLOSE:
+            endContour();
+            current = first;
+            break;
+        }
+    }
+    endContour();
+}
+
+namespace {
+
+// Twice the area of abc, positive if it goes the same way as the corners in triangle.vert.
+// For a polygon corner b between a and c, positive means convex.
+inline float turn(Point a, Point b, Point c) {
+    return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+}
+
+inline bool same(Point a, Point b) {
+    return a.x == b.x && a.y == b.y;
+}
+
+inline bool onCorner(Point p, Point a, Point b, Point c) {
+    return same(p, a) || same(p, b) || same(p, c);
+}
+
+// What tessellatePolygon() works with. The polygon is a circular linked list of the corners
+// that haven't been clipped off yet, always going the positive way round.
+struct EarClipper {
+    const Point *points;
+    std::vector<uint32_t> prev, next;
+    // The reflex (or flat) corners still left: the only ones that can be inside an ear. Struct of
+    // arrays so SSE can load 4 at a time, and padded to a multiple of 4 with NaN, which fails
+    // every comparison and so is never inside anything.
+    std::vector<float> reflexX, reflexY;
+    std::vector<int32_t> reflexCorner;
+    // Per corner, where it is in the arrays above. -1 if it's convex.
+    std::vector<int32_t> reflexSlot;
+    uint32_t reflexCount = 0;
+
+    void reset(const Point *points, uint32_t count, bool backwards) {
+        this->points = points;
+        prev.resize(count);
+        next.resize(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t after = i + 1 == count ? 0 : i + 1;
+            uint32_t before = i == 0 ? count - 1 : i - 1;
+            next[i] = backwards ? before : after;
+            prev[i] = backwards ? after : before;
+        }
+
+        size_t padded = (count + 3) & ~size_t(3);
+        reflexX.assign(padded, std::numeric_limits<float>::quiet_NaN());
+        reflexY.assign(padded, std::numeric_limits<float>::quiet_NaN());
+        reflexCorner.assign(padded, -1);
+        reflexSlot.assign(count, -1);
+        reflexCount = 0;
+        for (uint32_t v = 0; v < count; ++v) {
+            if (turn(points[prev[v]], points[v], points[next[v]]) > 0) continue;
+            reflexX[reflexCount] = points[v].x;
+            reflexY[reflexCount] = points[v].y;
+            reflexCorner[reflexCount] = v;
+            reflexSlot[v] = reflexCount++;
+        }
+    }
+
+    void removeReflex(uint32_t v) {
+        int32_t slot = reflexSlot[v];
+        if (slot < 0) return;
+        // The last one moves into the gap, and the padding grows by one.
+        uint32_t last = --reflexCount;
+        reflexX[slot] = reflexX[last];
+        reflexY[slot] = reflexY[last];
+        reflexCorner[slot] = reflexCorner[last];
+        reflexSlot[reflexCorner[slot]] = slot;
+        reflexX[last] = reflexY[last] = std::numeric_limits<float>::quiet_NaN();
+        reflexCorner[last] = -1;
+        reflexSlot[v] = -1;
+    }
+
+    void remove(uint32_t v) {
+        removeReflex(v);
+        uint32_t a = prev[v], c = next[v];
+        next[a] = c;
+        prev[c] = a;
+        // Cutting off an ear can only make the corners on either side of it more convex.
+        for (uint32_t corner : {a, c}) {
+            if (reflexSlot[corner] >= 0 && turn(points[prev[corner]], points[corner], points[next[corner]]) > 0) {
+                removeReflex(corner);
+            }
+        }
+    }
+
+    // Is any reflex corner inside or on the edge of abc? Not counting ones right on a, b or c:
+    // that's a and c themselves, or the other end of a hole's bridge (see bridgeHoles()), which
+    // comes through twice. If not, b is an ear. This is where nearly all the time goes.
+    bool anyReflexInside(uint32_t a, uint32_t b, uint32_t c) const {
+        Point pa = points[a], pb = points[b], pc = points[c];
+#ifdef __SSE2__
+        if (useSimd) {
+            // turn(pa, pb, p) for 4 p's at once, and the same for the other two edges.
+            __m128 ax = _mm_set1_ps(pa.x), ay = _mm_set1_ps(pa.y);
+            __m128 bx = _mm_set1_ps(pb.x), by = _mm_set1_ps(pb.y);
+            __m128 cx = _mm_set1_ps(pc.x), cy = _mm_set1_ps(pc.y);
+            __m128 abx = _mm_sub_ps(bx, ax), aby = _mm_sub_ps(by, ay);
+            __m128 bcx = _mm_sub_ps(cx, bx), bcy = _mm_sub_ps(cy, by);
+            __m128 cax = _mm_sub_ps(ax, cx), cay = _mm_sub_ps(ay, cy);
+            __m128 zero = _mm_setzero_ps();
+            __m128i skipA = _mm_set1_epi32(a), skipC = _mm_set1_epi32(c);
+
+            for (uint32_t i = 0; i < reflexCount; i += 4) {
+                __m128 px = _mm_loadu_ps(&reflexX[i]), py = _mm_loadu_ps(&reflexY[i]);
+                __m128 t0 = _mm_sub_ps(_mm_mul_ps(abx, _mm_sub_ps(py, ay)), _mm_mul_ps(aby, _mm_sub_ps(px, ax)));
+                __m128 t1 = _mm_sub_ps(_mm_mul_ps(bcx, _mm_sub_ps(py, by)), _mm_mul_ps(bcy, _mm_sub_ps(px, bx)));
+                __m128 t2 = _mm_sub_ps(_mm_mul_ps(cax, _mm_sub_ps(py, cy)), _mm_mul_ps(cay, _mm_sub_ps(px, cx)));
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(t0, zero), _mm_cmpge_ps(t1, zero)), _mm_cmpge_ps(t2, zero));
+
+                __m128i corner = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&reflexCorner[i]));
+                __m128i isAOrC = _mm_or_si128(_mm_cmpeq_epi32(corner, skipA), _mm_cmpeq_epi32(corner, skipC));
+                inside = _mm_andnot_ps(_mm_castsi128_ps(isAOrC), inside);
+                int hits = _mm_movemask_ps(inside);
+                if (hits == 0) continue;
+                // Nearly always a real one, but it can be a bridge's other end. Rare enough to
+                // check one at a time.
+                for (uint32_t lane = 0; lane < 4; ++lane) {
+                    if ((hits & (1 << lane)) && !onCorner(Point{reflexX[i + lane], reflexY[i + lane]}, pa, pb, pc)) return true;
+                }
+            }
+            return false;
+        }
+#endif
+        for (uint32_t i = 0; i < reflexCount; ++i) {
+            uint32_t corner = reflexCorner[i];
+            if (corner == a || corner == c) continue;
+            Point p{reflexX[i], reflexY[i]};
+            if (turn(pa, pb, p) >= 0 && turn(pb, pc, p) >= 0 && turn(pc, pa, p) >= 0 && !onCorner(p, pa, pb, pc)) return true;
+        }
+        return false;
+    }
+};
+
+}
+
+// tessellatePolygon(), except that with `vertexIndices`, corner i comes out as vertexIndices[i]
+// plus base instead of i plus base.
+static uint32_t clipEars(
+    const Point *points, uint32_t count, const uint32_t *vertexIndices, uint32_t base, std::vector<uint32_t> &indices
+) {
+    if (count < 3) return 0;
+
+    // Twice the signed area, to find out which way round it goes.
+    double area = 0;
+    for (uint32_t i = 0, j = count - 1; i < count; j = i++) {
+        area += double(points[j].x) * points[i].y - double(points[i].x) * points[j].y;
+    }
+
+    // One per thread and kept around, so lots of little polygons don't mean lots of little allocations.
+    static thread_local EarClipper clipper;
+    clipper.reset(points, count, area < 0);
+
+    uint32_t triangles = 0;
+    auto emit = [&](uint32_t a, uint32_t b, uint32_t c) {
+        if (vertexIndices) {
+            a = vertexIndices[a];
+            b = vertexIndices[b];
+            c = vertexIndices[c];
+        }
+        indices.insert(indices.end(), {base + a, base + b, base + c});
+        triangles += 1;
+    };
+
+    uint32_t remaining = count;
+    uint32_t v = 0;
+    // Corners in a row that weren't ears. Once that's every corner left, the polygon isn't simple
+    // (or rounding makes it look that way), and we clip whatever's next just to get somewhere.
+    uint32_t misses = 0;
+    while (remaining > 3) {
+        uint32_t a = clipper.prev[v], c = clipper.next[v];
+        float corner = turn(points[a], points[v], points[c]);
+        bool ear = corner > 0 && !clipper.anyReflexInside(a, v, c);
+        // Flat corners always go, but without a triangle: it'd have no area.
+        if (!ear && corner != 0 && misses < remaining) {
+            v = c;
+            misses += 1;
+            continue;
+        }
+        if (corner > 0) emit(a, v, c);
+        clipper.remove(v);
+        remaining -= 1;
+        misses = 0;
+        v = c;
+    }
+    uint32_t a = clipper.prev[v], c = clipper.next[v];
+    if (turn(points[a], points[v], points[c]) > 0) emit(a, v, c);
+    return triangles;
+}
+
+uint32_t tessellatePolygon(const Point *points, uint32_t count, uint32_t base, std::vector<uint32_t> &indices) {
+    return clipEars(points, count, nullptr, base, indices);
+}
+
+namespace {
+
+// Where a contour is in the flattened path.
+struct Contour {
+    uint32_t start, size;
+};
+
+// Twice the signed area, positive if it goes the same way as the corners in triangle.vert.
+double contourArea(const std::vector<Point> &vertices, Contour contour) {
+    double area = 0;
+    for (uint32_t i = 0, j = contour.size - 1; i < contour.size; j = i++) {
+        Point a = vertices[contour.start + j], b = vertices[contour.start + i];
+        area += double(a.x) * b.y - double(b.x) * a.y;
+    }
+    return area;
+}
+
+// Even-odd: is `point` inside `contour`?
+bool contourContains(const std::vector<Point> &vertices, Contour contour, Point point) {
+    bool inside = false;
+    for (uint32_t i = 0, j = contour.size - 1; i < contour.size; j = i++) {
+        Point a = vertices[contour.start + j], b = vertices[contour.start + i];
+        if ((a.y > point.y) != (b.y > point.y) && point.x < a.x + (point.y - a.y) * (b.x - a.x) / (b.y - a.y)) {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+// Corner `at` of `ring` is a corner of the filled area, going round the positive way. Does the
+// direction from it to `point` start off inside the fill?
+bool locallyInside(const std::vector<Point> &vertices, const std::vector<uint32_t> &ring, size_t at, Point point) {
+    size_t n = ring.size();
+    Point a = vertices[ring[(at + n - 1) % n]], b = vertices[ring[at]], c = vertices[ring[(at + 1) % n]];
+    if (turn(a, b, c) > 0) return turn(a, b, point) > 0 && turn(b, c, point) > 0;
+    return turn(a, b, point) > 0 || turn(b, c, point) > 0;
+}
+
+// Turns `outer` and the `holes` in it into one polygon that can be ear clipped like any other:
+// each hole gets joined on by a bridge, an edge there and the same edge back, from its
+// rightmost point to a corner of what's been joined so far that it can see. That's David
+// Eberly's "Triangulation by Ear Clipping". `ring` ends up as indices into `vertices`, going
+// round the positive way, with the holes going round the other way.
+void bridgeHoles(
+    const std::vector<Point> &vertices, Contour outer, std::vector<Contour> &holes, std::vector<uint32_t> &ring
+) {
+    bool outerBackwards = contourArea(vertices, outer) < 0;
+    ring.clear();
+    for (uint32_t i = 0; i < outer.size; ++i) ring.push_back(outer.start + (outerBackwards ? outer.size - 1 - i : i));
+
+    auto rightmost = [&](Contour hole) {
+        uint32_t best = hole.start;
+        for (uint32_t i = hole.start + 1; i < hole.start + hole.size; ++i) {
+            if (vertices[i].x > vertices[best].x) best = i;
+        }
+        return best;
+    };
+    // Rightmost first, so nothing a hole's bridge goes right past is still to come.
+    std::sort(holes.begin(), holes.end(), [&](Contour a, Contour b) {
+        return vertices[rightmost(a)].x > vertices[rightmost(b)].x;
+    });
+
+    std::vector<uint32_t> hole;
+    for (auto contour : holes) {
+        // Starting and ending at its rightmost point, the other way round from the outside.
+        uint32_t from = rightmost(contour) - contour.start;
+        bool backwards = contourArea(vertices, contour) > 0;
+        hole.clear();
+        for (uint32_t i = 0; i <= contour.size; ++i) {
+            uint32_t step = backwards ? contour.size - i % contour.size : i;
+            hole.push_back(contour.start + (from + step) % contour.size);
+        }
+        Point m = vertices[hole[0]];
+
+        // The nearest edge a ray going right from m hits...
+        size_t n = ring.size();
+        float hitX = std::numeric_limits<float>::infinity();
+        size_t target = SIZE_MAX;
+        for (size_t i = 0; i < n; ++i) {
+            Point a = vertices[ring[i]], b = vertices[ring[(i + 1) % n]];
+            if ((a.y > m.y) == (b.y > m.y)) continue;
+            float x = a.y == m.y ? a.x : b.y == m.y ? b.x : a.x + (m.y - a.y) * (b.x - a.x) / (b.y - a.y);
+            if (x < m.x || x >= hitX) continue;
+            hitX = x;
+            if (a.y == m.y) target = i;
+            else if (b.y == m.y) target = (i + 1) % n;
+            else target = a.x > b.x ? i : (i + 1) % n;
+        }
+        // Not inside anything after all. Leave it out.
+        if (target == SIZE_MAX) continue;
+
+        // ...and the end of it that's furthest right can see m, unless some corner is in the way.
+        // Then the one that's the smallest angle off the ray can.
+        Point hit{hitX, m.y}, p = vertices[ring[target]];
+        if (!same(p, hit)) {
+            float bestSlope = std::numeric_limits<float>::infinity(), bestDistance = 0;
+            for (size_t i = 0; i < n; ++i) {
+                Point q = vertices[ring[i]];
+                if (q.x <= m.x || same(q, p)) continue;
+                float t0 = turn(m, hit, q), t1 = turn(hit, p, q), t2 = turn(p, m, q);
+                bool inside = (t0 >= 0 && t1 >= 0 && t2 >= 0) || (t0 <= 0 && t1 <= 0 && t2 <= 0);
+                if (!inside) continue;
+                float distance = q.x - m.x, slope = std::abs(q.y - m.y) / distance;
+                if (slope < bestSlope || (slope == bestSlope && distance < bestDistance)) {
+                    bestSlope = slope;
+                    bestDistance = distance;
+                    target = i;
+                }
+            }
+        }
+        // A corner can be in the ring more than once, if it's got a bridge already. Only one of
+        // them faces the right way.
+        for (size_t i = 0; i < n; ++i) {
+            if (same(vertices[ring[i]], vertices[ring[target]]) && locallyInside(vertices, ring, i, m)) {
+                target = i;
+                break;
+            }
+        }
+
+        // Over the bridge, all the way round the hole, and back.
+        hole.push_back(ring[target]);
+        ring.insert(ring.begin() + target + 1, hole.begin(), hole.end());
+    }
+}
+
+}
+
+uint32_t tessellatePath(const Path &path, float tolerance, std::vector<Point> &vertices, std::vector<uint32_t> &indices) {
+    static thread_local std::vector<uint32_t> contourSizes;
+    contourSizes.clear();
+    uint32_t start = vertices.size();
+    path.flatten(tolerance, vertices, contourSizes);
+
+    if (contourSizes.size() == 1) return tessellatePolygon(&vertices[start], contourSizes[0], start, indices);
+
+    std::vector<Contour> contours;
+    for (auto size : contourSizes) {
+        contours.push_back({start, size});
+        start += size;
+    }
+    // How many others each contour is inside. Even is filled, odd is a hole in the innermost
+    // one around it.
+    std::vector<uint32_t> depths(contours.size(), 0);
+    for (size_t i = 0; i < contours.size(); ++i) {
+        for (size_t j = 0; j < contours.size(); ++j) {
+            if (i != j && contourContains(vertices, contours[j], vertices[contours[i].start])) depths[i] += 1;
+        }
+    }
+
+    uint32_t triangles = 0;
+    std::vector<Contour> holes;
+    std::vector<uint32_t> ring;
+    std::vector<Point> corners;
+    for (size_t i = 0; i < contours.size(); ++i) {
+        if (depths[i] % 2 != 0) continue;
+        holes.clear();
+        for (size_t j = 0; j < contours.size(); ++j) {
+            if (depths[j] == depths[i] + 1 && contourContains(vertices, contours[i], vertices[contours[j].start])) {
+                holes.push_back(contours[j]);
+            }
+        }
+        if (holes.empty()) {
+            triangles += tessellatePolygon(&vertices[contours[i].start], contours[i].size, contours[i].start, indices);
+            continue;
+        }
+        bridgeHoles(vertices, contours[i], holes, ring);
+        corners.clear();
+        for (auto vertex : ring) corners.push_back(vertices[vertex]);
+        triangles += clipEars(corners.data(), corners.size(), ring.data(), 0, indices);
+    }
+    return triangles;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// A point in a path's own space. Paths that go through MeshCache live in the same -0.5..0.5 box
+// as the corner table in triangle.vert, so a ShapeInstance places them like any other shape.
+struct Point {
+    float x, y;
+};
+
+// Outlines made of lines and curves, like the paths of any 2D API: any number of contours, each
+// started by moveTo() and implicitly closed at the end.
+struct Path {
+    enum Verb : uint8_t { MOVE, LINE, QUAD, CUBIC, CLOSE };
+
+    // What each verb does, and its points in order (MOVE and LINE 1, QUAD 2, CUBIC 3, CLOSE 0).
+    // Together they're the path's content, which is what MeshCache hashes.
+    std::vector<uint8_t> verbs;
+    std::vector<Point> points;
+
+    void moveTo(float x, float y);
+    void lineTo(float x, float y);
+    void quadTo(float cx, float cy, float x, float y);
+    void cubicTo(float c1x, float c1y, float c2x, float c2y, float x, float y);
+    void close();
+
+    // Turns the curves into lines no further than `tolerance` from the real thing, and appends
+    // each contour to `out` as a polygon (without repeating its first point at the end). Its
+    // point count goes in `contourSizes`. Contours with less than 3 points are left out.
+    void flatten(float tolerance, std::vector<Point> &out, std::vector<uint32_t> &contourSizes) const;
+};
+
+// Ear clipping. Appends triangles for the simple polygon points[0..count) to `indices`, as
+// indices into `points` plus `base`, and returns how many. The polygon can go around either
+// way. The triangles always come out the way the corner table in triangle.vert goes, so back
+// face culling keeps them. Self-intersecting polygons still come out as *something*, just not
+// necessarily the right thing.
+uint32_t tessellatePolygon(const Point *points, uint32_t count, uint32_t base, std::vector<uint32_t> &indices);
+
+// Flattens `path` and tessellates it, appending the vertices to `vertices` and the triangles to
+// `indices` (which point into `vertices` from its start). Returns the triangle count. Contours
+// nest even-odd, whichever way round they go: one inside another is a hole in it, one inside
+// that is filled again, and so on. Each hole gets bridged into the contour around it, and the
+// two go through tessellatePolygon() together. Contours that cross each other still come out
+// as *something*.
+uint32_t tessellatePath(const Path &path, float tolerance, std::vector<Point> &vertices, std::vector<uint32_t> &indices);
+
+// Whether tessellatePolygon() tests 4 points against an ear at once with SSE, or one at a time.
+// On wherever we have SSE2. Only switchable so the benchmark can compare the two.
+void setTessellatorSimd(bool enabled);
+bool tessellatorSimd();
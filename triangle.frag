@@ -1,8 +1,84 @@
 #version 450
 
-layout(location = 0) in vec3 fragColor;
+layout(location = 0) in vec4 fragColor;
+layout(location = 1) in vec2 fragLocal;
+layout(location = 2) flat in vec2 fragHalfSize;
+layout(location = 3) flat in uint fragShape;
 layout(location = 0) out vec4 outColor;
 
+// Specialization constants: the shape override from triangle.vert (so the switch below folds
+// away too), BlendMode and ShapeRendering from pipelines.h. Opaque throws the alpha away.
+layout(constant_id = 0) const uint SHAPE_OVERRIDE = 0xFFFFFFFFu;
+layout(constant_id = 1) const uint BLEND_MODE = 0u;
+layout(constant_id = 2) const uint SDF = 0u;
+
+// Signed distance functions, in pixels: negative inside, positive outside. Mostly from
+// https://iquilezles.org/articles/distfunctions2d/
+
+float sdBox(vec2 p, vec2 halfSize) {
+    vec2 d = abs(p) - halfSize;
+    return length(max(d, 0.0)) + min(max(d.x, d.y), 0.0);
+}
+
+// Only exact for circles. Off by a bit for squashed ellipses, which is fine for a one-pixel fade.
+float sdEllipse(vec2 p, vec2 radii) {
+    float k0 = length(p / radii);
+    float k1 = length(p / (radii * radii));
+    return k0 * (k0 - 1.0) / max(k1, 1e-6);
+}
+
+float sdTriangle(vec2 p, vec2 p0, vec2 p1, vec2 p2) {
+    vec2 e0 = p1 - p0, e1 = p2 - p1, e2 = p0 - p2;
+    vec2 v0 = p - p0, v1 = p - p1, v2 = p - p2;
+    vec2 pq0 = v0 - e0 * clamp(dot(v0, e0) / dot(e0, e0), 0.0, 1.0);
+    vec2 pq1 = v1 - e1 * clamp(dot(v1, e1) / dot(e1, e1), 0.0, 1.0);
+    vec2 pq2 = v2 - e2 * clamp(dot(v2, e2) / dot(e2, e2), 0.0, 1.0);
+    float s = sign(e0.x * e2.y - e0.y * e2.x);
+    vec2 d = min(min(vec2(dot(pq0, pq0), s * (v0.x * e0.y - v0.y * e0.x)),
+                     vec2(dot(pq1, pq1), s * (v1.x * e1.y - v1.y * e1.x))),
+                     vec2(dot(pq2, pq2), s * (v2.x * e2.y - v2.y * e2.x)));
+    return -sqrt(d.x) * sign(d.y);
+}
+
+float sdRhombus(vec2 p, vec2 halfSize) {
+    p = abs(p);
+    vec2 b = halfSize;
+    float h = clamp((b.x * (b.x - 2.0 * p.x) - b.y * (b.y - 2.0 * p.y)) / dot(b, b), -1.0, 1.0);
+    float d = length(p - 0.5 * b * vec2(1.0 - h, 1.0 + h));
+    return d * sign(p.x * b.y + p.y * b.x - b.x * b.y);
+}
+
+// Same ShapeTypes as scene.h. The byte above the type is a 0-1 parameter: the corner radius of a
+// rounded rectangle, or the thickness of a ring, as a fraction of half the smaller side.
+float shapeDistance(uint shape, vec2 p, vec2 halfSize) {
+    float parameter = float((shape >> 8) & 0xFFu) / 255.0;
+    float shortSide = min(halfSize.x, halfSize.y);
+    switch (shape & 0xFFu) {
+    case 0u: return sdTriangle(p, vec2(0.0, -halfSize.y), halfSize, vec2(-halfSize.x, halfSize.y));
+    case 2u: return sdRhombus(p, halfSize);
+    case 3u: return sdEllipse(p, halfSize);
+    case 4u: {
+        float radius = parameter * shortSide;
+        return sdBox(p, halfSize - radius) - radius;
+    }
+    case 5u: {
+        // No parameter means a quarter of the way in.
+        float thickness = (parameter > 0.0 ? parameter : 0.25) * shortSide;
+        return abs(sdEllipse(p, halfSize - 0.5 * thickness)) - 0.5 * thickness;
+    }
+    }
+    // 1u, the rectangle, and anything we don't know about.
+    return sdBox(p, halfSize);
+}
+
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    float coverage = 1.0;
+    if (SDF != 0u) {
+        uint shape = SHAPE_OVERRIDE != 0xFFFFFFFFu ? (fragShape & ~0xFFu) | SHAPE_OVERRIDE : fragShape;
+        float d = shapeDistance(shape, fragLocal, fragHalfSize);
+        // Fade out over one pixel, however the shape got rotated or stretched on the way here.
+        coverage = clamp(0.5 - d / max(fwidth(d), 1e-4), 0.0, 1.0);
+        if (coverage <= 0.0) discard;
+    }
+    outColor = BLEND_MODE == 0u ? vec4(fragColor.rgb, coverage) : vec4(fragColor.rgb, fragColor.a * coverage);
 }
@@ -1,14 +1,67 @@
 #version 450
 
-vec2 positions[3] = vec2[](
-    vec2(0.0, -0.5),
-    vec2(0.5, 0.5),
-    vec2(-0.5, 0.5)
-);
+// Per-instance attributes. Has to match ShapeInstance in scene.h.
+layout(location = 0) in vec4 inRect;          // center x, y, width, height
+layout(location = 1) in vec2 inRotationDepth;
+layout(location = 2) in vec4 inColor;
+layout(location = 3) in uint inShape;
+
+layout(location = 0) out vec4 fragColor;
+// Only used with SDF. Where this fragment is relative to the shape's center, and half the shape's
+// size, both in pixels and before rotation. Plus the whole inShape (type and parameter).
+layout(location = 1) out vec2 fragLocal;
+layout(location = 2) flat out vec2 fragHalfSize;
+layout(location = 3) flat out uint fragShape;
+
+// Specialization constant, see PipelineVariant in pipelines.h. If it's a ShapeType, every instance
+// is drawn as that shape and inShape is ignored (so the table lookup folds away). ~0 = read inShape.
+layout(constant_id = 0) const uint SHAPE_OVERRIDE = 0xFFFFFFFFu;
+// ShapeRendering from pipelines.h. 1 = every shape is one quad and triangle.frag works out the
+// actual shape with a signed distance function.
+layout(constant_id = 2) const uint SDF = 0u;
+
+// Framebuffer size / 2, so NDC sizes can be turned into pixels.
+layout(push_constant) uniform Frame {
+    vec2 halfExtent;
+};
 
-layout(location = 0) out vec3 fragColor;
+// Every shape is 6 vertices (2 triangles) so one vkCmdDraw can cover all of them.
+// Shapes that only need one triangle repeat a vertex so the second one is degenerate.
+const vec2 corners[18] = vec2[](
+    // 0: triangle
+    vec2(0.0, -0.5), vec2(0.5, 0.5), vec2(-0.5, 0.5),
+    vec2(-0.5, 0.5), vec2(-0.5, 0.5), vec2(-0.5, 0.5),
+    // 1: rectangle (and, without SDF, everything that isn't in this table)
+    vec2(-0.5, -0.5), vec2(0.5, -0.5), vec2(0.5, 0.5),
+    vec2(-0.5, -0.5), vec2(0.5, 0.5), vec2(-0.5, 0.5),
+    // 2: diamond
+    vec2(0.0, -0.5), vec2(0.5, 0.0), vec2(0.0, 0.5),
+    vec2(0.0, -0.5), vec2(0.0, 0.5), vec2(-0.5, 0.0)
+);
 
 void main() {
-    gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-    fragColor = vec3(1.0, 1.0, 0.0);
+    uint shapeType = SHAPE_OVERRIDE != 0xFFFFFFFFu ? SHAPE_OVERRIDE : inShape & 0xFFu;
+
+    vec2 local;
+    if (SDF != 0u) {
+        // The bounding quad, grown by a pixel on each side so the antialiased edge has room.
+        vec2 sizePixels = max(inRect.zw * halfExtent, vec2(1.0));
+        local = corners[6u + uint(gl_VertexIndex)] * (1.0 + 2.0 / sizePixels);
+        fragLocal = local * sizePixels;
+        fragHalfSize = 0.5 * sizePixels;
+    }
+    else {
+        local = corners[(shapeType <= 2u ? shapeType : 1u) * 6u + uint(gl_VertexIndex)];
+        fragLocal = vec2(0.0);
+        fragHalfSize = vec2(0.0);
+    }
+    vec2 corner = local * inRect.zw;
+
+    float s = sin(inRotationDepth.x);
+    float c = cos(inRotationDepth.x);
+    vec2 rotated = vec2(corner.x * c - corner.y * s, corner.x * s + corner.y * c);
+
+    gl_Position = vec4(inRect.xy + rotated, inRotationDepth.y, 1.0);
+    fragColor = inColor;
+    fragShape = (inShape & ~0xFFu) | shapeType;
 }
@@ -0,0 +1,105 @@
+#include "workers.h"
+#include "profiler.h"
+
+#include <string>
+
+void WorkerPool::start(uint32_t threadCount) {
+    stop();
+    if (threadCount == 0) threadCount = 1;
+
+    stopping = false;
+    stealCount = 0;
+    for (uint32_t i = 0; i < threadCount; ++i) queues.push_back(std::make_unique<Queue>());
+    // Worker 0 is whoever calls run().
+    for (uint32_t i = 1; i < threadCount; ++i) threads.emplace_back(&WorkerPool::workerLoop, this, i);
+}
+
+void WorkerPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &thread : threads) thread.join();
+    threads.clear();
+    queues.clear();
+}
+
+void WorkerPool::run(size_t count, const Job &job) {
+    if (count == 0) return;
+    if (queues.empty()) start(1);
+
+    // Set up everything before any worker can see the new jobs.
+    this->job = &job;
+    remaining = count;
+
+    size_t workers = queues.size();
+    for (size_t w = 0; w < workers; ++w) {
+        std::lock_guard<std::mutex> lock(queues[w]->mutex);
+        for (size_t i = count * w / workers; i < count * (w + 1) / workers; ++i) queues[w]->jobs.push_back(i);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        generation += 1;
+    }
+    wake.notify_all();
+
+    drain(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return remaining == 0; });
+}
+
+void WorkerPool::workerLoop(uint32_t worker) {
+    setProfileThreadName("worker " + std::to_string(worker));
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+        drain(worker);
+    }
+}
+
+void WorkerPool::drain(uint32_t worker) {
+    size_t index;
+    while (pop(worker, index) || steal(worker, index)) {
+        (*job)(index, worker);
+
+        if (remaining.fetch_sub(1) == 1) {
+            // Last one out. Take the lock so run() can't miss the notify between its check and wait.
+            std::lock_guard<std::mutex> lock(mutex);
+            done.notify_all();
+        }
+    }
+}
+
+bool WorkerPool::pop(uint32_t worker, size_t &index) {
+    auto &queue = *queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.jobs.empty()) return false;
+
+    index = queue.jobs.back();
+    queue.jobs.pop_back();
+    return true;
+}
+
+bool WorkerPool::steal(uint32_t worker, size_t &index) {
+    size_t workers = queues.size();
+    for (size_t i = 1; i < workers; ++i) {
+        auto &victim = *queues[(worker + i) % workers];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.jobs.empty()) continue;
+
+        // Steal from the opposite end from where the owner works, so we fight over the lock less.
+        index = victim.jobs.front();
+        victim.jobs.pop_front();
+        stealCount += 1;
+        return true;
+    }
+    return false;
+}
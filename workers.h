@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads that chew through a batch of numbered jobs together.
+//
+// Each worker gets its own queue, seeded with a contiguous chunk of the jobs. Workers take from
+// the back of their own queue, and once that's empty they steal from the front of everyone
+// else's. So uneven jobs (say, one draw batch that's way bigger than the rest) don't leave the
+// other threads sitting around.
+//
+// The thread that calls run() pitches in as worker 0, so a pool of size 1 has no extra threads
+// at all and just runs everything inline.
+class WorkerPool {
+public:
+    using Job = std::function<void(size_t index, uint32_t worker)>;
+
+    ~WorkerPool() { stop(); }
+
+    void start(uint32_t threadCount);
+    void stop();
+    uint32_t size() const { return queues.size(); }
+
+    // Calls job(index, worker) for every index in [0, count) and returns once all of them are
+    // done. `worker` is in [0, size()), so it can index per-thread stuff (command pools, etc).
+    void run(size_t count, const Job &job);
+
+    // How many jobs got picked up by a worker other than the one they were handed to.
+    size_t steals() const { return stealCount; }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    const Job *job = nullptr;
+    std::atomic<size_t> remaining{0};
+    std::atomic<size_t> stealCount{0};
+
+    void workerLoop(uint32_t worker);
+    void drain(uint32_t worker);
+    bool pop(uint32_t worker, size_t &index);
+    bool steal(uint32_t worker, size_t &index);
+};